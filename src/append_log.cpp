@@ -0,0 +1,786 @@
+#include "append_log.h"
+#include "snapshot.h"
+#include "replication.h"
+#include "logger.h"
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * @brief the monotonic time in ms
+ *
+ */
+static std::int64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (std::int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief sync the directory of a file, so that its creation, rename
+ * or deletion survives a crash
+ *
+ */
+static void sync_directory(const std::string& path)
+{
+    size_t slash = path.rfind('/');
+    std::string directory = std::string::npos == slash ? "." : path.substr(0, slash + 1);
+    int dir_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+std::string get_log_segment_path(const std::string& path, std::uint64_t segment)
+{
+    return path + "." + std::to_string(segment);
+}
+
+bool list_log_segments(const std::string& path, std::vector<std::uint64_t>& segments)
+{
+    segments.clear();
+
+    size_t slash = path.rfind('/');
+    std::string directory = std::string::npos == slash ? "." : path.substr(0, slash + 1);
+    std::string prefix = (std::string::npos == slash ? path : path.substr(slash + 1)) + ".";
+
+    DIR* dir = opendir(directory.c_str());
+    if (!dir)
+    {
+        LOG_ERROR("Cannot open directory " << directory << ", errno = " << errno);
+        return false;
+    }
+
+    bool is_ok = true;
+    while (struct dirent* entry = readdir(dir))
+    {
+        const char* name = entry->d_name;
+        if (strncmp(name, prefix.c_str(), prefix.size()))
+            continue;
+
+        // Only PATH.N, not the other files that share the prefix
+        const char* digits = name + prefix.size();
+        if (!*digits || strspn(digits, "0123456789") != strlen(digits))
+            continue;
+
+        try
+        {
+            segments.push_back(strtoull(digits, nullptr, 10));
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            is_ok = false;
+            break;
+        }
+    }
+    closedir(dir);
+
+    std::sort(segments.begin(), segments.end());
+    return is_ok;
+}
+
+AppendLog::AppendLog(
+    const std::string& path,
+    size_t num_shards,
+    appendfsync_t fsync,
+    ReplicationBacklog* backlog):
+    m_shards(nullptr),
+    m_num_shards(num_shards),
+    m_path(path),
+    m_fsync(path.empty() ? APPENDFSYNC_NO : fsync),
+    m_backlog(backlog),
+    m_last_ticket(0),
+    m_synced_ticket(0),
+    m_fd(-1),
+    m_segment(0),
+    m_size(0),
+    m_synced_size(0),
+    m_last_sync(0),
+    m_mutex(PTHREAD_MUTEX_INITIALIZER),
+    m_is_requested(false),
+    m_is_stopping(false),
+    m_is_running(false),
+    m_thread_id(),
+    m_bytes_written(0),
+    m_num_syncs(0),
+    m_num_errors(0),
+    m_is_failed(false)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_cond_init(&m_synced_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+AppendLog::~AppendLog()
+{
+    stop();
+    if (m_fd >= 0)
+        close(m_fd);
+    delete[] m_shards;
+    pthread_cond_destroy(&m_cond);
+    pthread_cond_destroy(&m_synced_cond);
+}
+
+bool AppendLog::open_segment(std::uint64_t segment)
+{
+    std::string segment_path = get_log_segment_path(m_path, segment);
+    int fd = open(segment_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        LOG_ERROR("Cannot create " << segment_path << ", errno = " << errno);
+        return false;
+    }
+
+    if (APPEND_LOG_MAGIC_SIZE != ::write(fd, APPEND_LOG_MAGIC, APPEND_LOG_MAGIC_SIZE) || fsync(fd))
+    {
+        LOG_ERROR("Cannot write " << segment_path << ", errno = " << errno);
+        close(fd);
+        unlink(segment_path.c_str());
+        return false;
+    }
+    sync_directory(m_path);
+
+    if (m_fd >= 0)
+        close(m_fd);
+    m_fd = fd;
+    m_segment = segment;
+    m_size = APPEND_LOG_MAGIC_SIZE;
+    m_synced_size = m_size;
+    return true;
+}
+
+bool AppendLog::start()
+{
+    int retval;
+
+    if (m_is_running)
+        return true;
+
+    std::vector<std::uint64_t> segments;
+    if (is_persistent() && !list_log_segments(m_path, segments))
+        return false;
+
+    if (!m_shards)
+    {
+        m_shards = new (std::nothrow) Shard[m_num_shards];
+        if (!m_shards)
+        {
+            LOG_ERROR("Out of memory");
+            return false;
+        }
+
+        try
+        {
+            m_pending.resize(m_num_shards);
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            return false;
+        }
+    }
+
+    {
+        std::unique_lock lock(m_file_mutex);
+        if (is_persistent() && m_fd < 0 && \
+            !open_segment(segments.empty() ? 1 : segments.back() + 1))
+            return false;
+    }
+    m_last_sync = monotonic_ms();
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        AppendLog::thread_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void AppendLog::stop()
+{
+    if (m_is_running)
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_is_stopping = true;
+        pthread_cond_broadcast(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(m_thread_id, nullptr);
+        m_is_running = false;
+    }
+
+    // What the threads appended last must not wait for the next start
+    if (m_shards)
+        flush();
+
+    pthread_mutex_lock(&m_mutex);
+    pthread_cond_broadcast(&m_synced_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+std::uint64_t AppendLog::append(
+    size_t shard,
+    std::uint8_t op,
+    std::string_view key,
+    const std::string_view* value,
+    std::int64_t expire_at)
+{
+    std::string& buffer = m_shards[shard].m_buffer;
+    size_t size = buffer.size();
+    std::uint8_t bytes[10];
+
+    try
+    {
+        buffer.push_back(op);
+        buffer.append((const char*)bytes, encode_varint(key.size(), bytes));
+        if (value)
+            buffer.append((const char*)bytes, encode_varint(value->size(), bytes));
+        if (APPEND_LOG_OP_DEL != op)
+            buffer.append((const char*)&expire_at, sizeof(expire_at));
+        buffer.append(key);
+        if (value)
+            buffer.append(*value);
+    }
+    catch (...)
+    {
+        // A record cut in the middle would corrupt the ones after it
+        buffer.resize(size);
+        LOG_ERROR("Out of memory, a write is not logged");
+        m_num_errors++;
+    }
+
+    return ++m_last_ticket;
+}
+
+bool AppendLog::write_pending()
+{
+    struct iovec iov[IOV_MAX];
+    size_t first = 0;
+
+    while (first < m_pending.size())
+    {
+        int n_iov = 0;
+        size_t length = 0;
+        size_t last = first;
+        for (; last < m_pending.size() && n_iov < IOV_MAX; last++)
+        {
+            if (m_pending[last].empty())
+                continue;
+            iov[n_iov].iov_base = m_pending[last].data();
+            iov[n_iov].iov_len = m_pending[last].size();
+            length += m_pending[last].size();
+            n_iov++;
+        }
+
+        // writev() may stop short, what it did not take is written
+        // with the next call
+        size_t done = 0;
+        int index = 0;
+        while (done < length)
+        {
+            ssize_t n = writev(m_fd, iov + index, n_iov - index);
+            if (n < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+
+                LOG_ERROR("Append log write failed, errno = " << errno);
+                if (ftruncate(m_fd, m_size))
+                    LOG_ERROR("Cannot cut back the append log, errno = " << errno);
+                return false;
+            }
+
+            done += n;
+            while (index < n_iov && (size_t)n >= iov[index].iov_len)
+            {
+                n -= iov[index].iov_len;
+                index++;
+            }
+            if (index < n_iov)
+            {
+                iov[index].iov_base = (char*)iov[index].iov_base + n;
+                iov[index].iov_len -= n;
+            }
+        }
+
+        for (size_t i = first; i < last; i++)
+            m_pending[i].clear();
+        m_size += length;
+        m_bytes_written += length;
+        first = last;
+    }
+    return true;
+}
+
+bool AppendLog::flush_unsafe(bool is_sync)
+{
+    std::uint64_t ticket = m_last_ticket;
+
+    // A record with a ticket up to this one is in a buffer by now, it
+    // was appended with the mutex of its shard held
+    for (size_t i = 0; i < m_num_shards; i++)
+    {
+        std::unique_lock lock(m_shards[i].m_mutex);
+        if (m_backlog && !m_shards[i].m_buffer.empty())
+            m_backlog->append(m_shards[i].m_buffer);
+
+        if (m_fd < 0)
+            m_shards[i].m_buffer.clear();
+        else if (m_pending[i].empty())
+            m_pending[i].swap(m_shards[i].m_buffer);
+        else
+        {
+            try
+            {
+                m_pending[i].append(m_shards[i].m_buffer);
+                m_shards[i].m_buffer.clear();
+            }
+            catch (...)
+            {
+                // Left in the shard, for the next flush
+                ticket = 0;
+            }
+        }
+    }
+
+    // Nothing to sync when the flusher wakes up to an idle log
+    bool is_ok = m_fd < 0 || write_pending();
+    if (is_ok && is_sync && m_size != m_synced_size)
+    {
+        if (fdatasync(m_fd))
+        {
+            LOG_ERROR("Append log fdatasync failed, errno = " << errno);
+            is_ok = false;
+        }
+        else
+        {
+            m_synced_size = m_size;
+            m_num_syncs++;
+        }
+        m_last_sync = monotonic_ms();
+    }
+
+    if (!is_ok)
+        m_num_errors++;
+    m_is_failed = !is_ok;
+
+    // With APPENDFSYNC_ALWAYS a write is only acknowledged once it is
+    // synced. The threads that wait for it are still woken up by a
+    // failure, and give up rather than wait for the disk to recover.
+    bool is_acknowledged = is_ok || APPENDFSYNC_ALWAYS != m_fsync;
+    if ((ticket && is_acknowledged) || !is_ok)
+    {
+        pthread_mutex_lock(&m_mutex);
+        if (is_acknowledged && ticket > m_synced_ticket)
+            m_synced_ticket = ticket;
+        pthread_cond_broadcast(&m_synced_cond);
+        pthread_mutex_unlock(&m_mutex);
+    }
+    return is_ok;
+}
+
+bool AppendLog::flush()
+{
+    std::unique_lock lock(m_file_mutex);
+    return flush_unsafe(APPENDFSYNC_NO != m_fsync);
+}
+
+void AppendLog::loop()
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&m_mutex);
+    while (!m_is_stopping)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += APPEND_LOG_FLUSH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!m_is_stopping && !m_is_requested)
+        {
+            if (ETIMEDOUT == pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+                break;
+        }
+
+        if (m_is_stopping)
+            break;
+
+        m_is_requested = false;
+        pthread_mutex_unlock(&m_mutex);
+
+        {
+            std::unique_lock lock(m_file_mutex);
+            bool is_sync = APPENDFSYNC_ALWAYS == m_fsync || \
+                (APPENDFSYNC_EVERYSEC == m_fsync && \
+                    monotonic_ms() - m_last_sync >= APPEND_LOG_SYNC_INTERVAL_MS);
+            flush_unsafe(is_sync);
+        }
+
+        pthread_mutex_lock(&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void* AppendLog::thread_start_routine(void* arg)
+{
+    static_cast<AppendLog*>(arg)->loop();
+    return nullptr;
+}
+
+bool AppendLog::wait_for_sync(std::uint64_t ticket)
+{
+    if (APPENDFSYNC_ALWAYS != m_fsync || m_synced_ticket >= ticket)
+        return true;
+
+    if (!m_is_running)
+        return flush() && m_synced_ticket >= ticket;
+
+    // The flusher runs now rather than at its next interval, and the
+    // writes of the other threads go with this one. A failed flush
+    // after this point ends the wait, the record may never be synced.
+    pthread_mutex_lock(&m_mutex);
+    std::uint64_t num_errors = m_num_errors;
+    m_is_requested = true;
+    pthread_cond_broadcast(&m_cond);
+    while (m_synced_ticket < ticket && !m_is_stopping && num_errors == m_num_errors)
+        pthread_cond_wait(&m_synced_cond, &m_mutex);
+    bool is_synced = m_synced_ticket >= ticket;
+    pthread_mutex_unlock(&m_mutex);
+    return is_synced;
+}
+
+bool AppendLog::start_segment(std::uint64_t& segment)
+{
+    std::unique_lock lock(m_file_mutex);
+    if (m_fd < 0)
+        return false;
+
+    // The current segment ends with everything appended so far
+    flush_unsafe(true);
+    if (!open_segment(m_segment + 1))
+        return false;
+
+    segment = m_segment;
+    LOG_INFO("Started append log segment " << get_log_segment_path(m_path, m_segment));
+    return true;
+}
+
+void AppendLog::remove_segments_before(std::uint64_t segment)
+{
+    std::vector<std::uint64_t> segments;
+    if (!list_log_segments(m_path, segments))
+        return;
+
+    for (auto old_segment: segments)
+    {
+        if (old_segment >= segment)
+            break;
+
+        std::string segment_path = get_log_segment_path(m_path, old_segment);
+        if (unlink(segment_path.c_str()))
+            LOG_ERROR("Cannot delete " << segment_path << ", errno = " << errno);
+    }
+    sync_directory(m_path);
+}
+
+/**
+ * @brief the records of a data store, replayed by its own thread
+ *
+ */
+struct LogReplayJob
+{
+    DataStoreInterface*         m_datastore;
+    /**
+     * @brief the start and the end of every record
+     *
+     */
+    std::vector<std::pair<const char*, const char*>> m_records;
+    std::int64_t                m_now;
+
+    size_t                      m_num_replayed;
+
+    /**
+     * @brief keys the data store refused, because of its memory limit
+     *
+     */
+    size_t                      m_num_dropped;
+};
+
+int decode_log_record(const char*& p, const char* end, LogRecord& record)
+{
+    record.m_op = *p++;
+    if (APPEND_LOG_OP_SET != record.m_op && \
+        APPEND_LOG_OP_DEL != record.m_op && \
+        APPEND_LOG_OP_EXPIRE != record.m_op)
+        return -1;
+
+    std::uint64_t key_length;
+    std::uint64_t value_length = 0;
+    if (!decode_varint(p, end, key_length))
+        return 0;
+    if (APPEND_LOG_OP_SET == record.m_op && !decode_varint(p, end, value_length))
+        return 0;
+
+    record.m_expire_at = EXPIRE_NEVER;
+    if (APPEND_LOG_OP_DEL != record.m_op)
+    {
+        if (end - p < (ptrdiff_t)sizeof(record.m_expire_at))
+            return 0;
+        memcpy(&record.m_expire_at, p, sizeof(record.m_expire_at));
+        p += sizeof(record.m_expire_at);
+    }
+
+    if ((std::uint64_t)(end - p) < key_length || \
+        (std::uint64_t)(end - p) - key_length < value_length)
+        return 0;
+
+    record.m_key = std::string_view(p, key_length);
+    record.m_value = std::string_view(p + key_length, value_length);
+    p += key_length + value_length;
+    return 1;
+}
+
+bool apply_log_record(
+    DataStoreInterface* datastore,
+    const HashedKey& key,
+    const LogRecord& record,
+    std::int64_t now)
+{
+    bool is_expired = EXPIRE_NEVER != record.m_expire_at && record.m_expire_at <= now;
+    if (APPEND_LOG_OP_DEL == record.m_op || is_expired)
+        datastore->del(key);
+    else if (APPEND_LOG_OP_SET == record.m_op)
+        return datastore->set(key, record.m_value, record.m_expire_at);
+    else
+    {
+        std::int64_t previous;
+        datastore->set_expiry(key, record.m_expire_at, previous);
+    }
+    return true;
+}
+
+static void* replay_records(void* arg)
+{
+    LogReplayJob& job = *static_cast<LogReplayJob*>(arg);
+    DataStoreInterface* datastore = job.m_datastore;
+
+    for (auto [p, end]: job.m_records)
+    {
+        // Every record was decoded once already, by the split
+        LogRecord record;
+        decode_log_record(p, end, record);
+        if (!apply_log_record(datastore, HashedKey(record.m_key), record, job.m_now))
+            job.m_num_dropped++;
+        job.m_num_replayed++;
+    }
+    return nullptr;
+}
+
+/**
+ * @brief a mapped segment
+ *
+ */
+struct MappedSegment
+{
+    void*                       m_map;
+    size_t                      m_size;
+};
+
+/**
+ * @brief map a segment, and hand its records to the jobs of their
+ * data stores
+ *
+ * @param segment_path the segment
+ * @param jobs one job per data store
+ * @param maps the mapping is added here, to be unmapped after the
+ * replay
+ * @return true on success
+ * @return false if it cannot be read, or is corrupt
+ */
+static bool split_segment(
+    const std::string& segment_path,
+    std::vector<LogReplayJob>& jobs,
+    std::vector<MappedSegment>& maps)
+{
+    int fd = open(segment_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        LOG_ERROR("Cannot open " << segment_path << ", errno = " << errno);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        LOG_ERROR("Cannot stat " << segment_path << ", errno = " << errno);
+        close(fd);
+        return false;
+    }
+
+    // A crash right after the segment was created
+    size_t size = st.st_size;
+    if (size <= APPEND_LOG_MAGIC_SIZE)
+    {
+        close(fd);
+        return true;
+    }
+
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map)
+    {
+        LOG_ERROR("Cannot map " << segment_path << ", errno = " << errno);
+        return false;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    madvise(map, size, MADV_WILLNEED);
+
+    try
+    {
+        maps.push_back({map, size});
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        munmap(map, size);
+        return false;
+    }
+
+    const char* p = static_cast<const char*>(map);
+    const char* end = p + size;
+    if (memcmp(p, APPEND_LOG_MAGIC, APPEND_LOG_MAGIC_SIZE))
+    {
+        LOG_ERROR("Append log " << segment_path << " is corrupt");
+        return false;
+    }
+    p += APPEND_LOG_MAGIC_SIZE;
+
+    while (p < end)
+    {
+        const char* begin = p;
+        LogRecord record;
+        int rc = decode_log_record(p, end, record);
+        if (rc < 0)
+        {
+            LOG_ERROR("Append log " << segment_path << " is corrupt at offset " \
+                << begin - static_cast<const char*>(map));
+            return false;
+        }
+        if (!rc)
+        {
+            LOG_WARN("Append log " << segment_path << " ends with an incomplete record, " \
+                << end - begin << " bytes are ignored");
+            break;
+        }
+
+        HashedKey key(record.m_key);
+        try
+        {
+            jobs[get_partition(key, jobs.size())].m_records.emplace_back(begin, p);
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool replay_append_log(
+    const std::string& path,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_replayed)
+{
+    num_replayed = 0;
+
+    std::vector<std::uint64_t> segments;
+    if (!list_log_segments(path, segments))
+        return false;
+    if (segments.empty())
+    {
+        LOG_INFO("No append log at " << path);
+        return true;
+    }
+
+    std::int64_t start = unix_time_ms();
+    std::vector<LogReplayJob> jobs;
+    std::vector<MappedSegment> maps;
+    std::vector<pthread_t> threads;
+    bool is_ok = true;
+    try
+    {
+        jobs.resize(num_datastores);
+        threads.resize(num_datastores);
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    // The segments are split in order, so every data store gets the
+    // records of its keys in the order they were logged
+    for (size_t i = 0; is_ok && i < segments.size(); i++)
+        is_ok = split_segment(get_log_segment_path(path, segments[i]), jobs, maps);
+
+    if (is_ok)
+    {
+        for (size_t i = 0; i < num_datastores; i++)
+        {
+            jobs[i].m_datastore = datastores[i];
+            jobs[i].m_now = start;
+            jobs[i].m_num_replayed = 0;
+            jobs[i].m_num_dropped = 0;
+        }
+
+        std::vector<bool> is_started(num_datastores, false);
+        for (size_t i = 0; i < num_datastores; i++)
+            is_started[i] = 0 == pthread_create(&threads[i], NULL, replay_records, &jobs[i]);
+
+        size_t num_dropped = 0;
+        for (size_t i = 0; i < num_datastores; i++)
+        {
+            if (is_started[i])
+                pthread_join(threads[i], nullptr);
+            else
+                replay_records(&jobs[i]);
+
+            num_replayed += jobs[i].m_num_replayed;
+            num_dropped += jobs[i].m_num_dropped;
+        }
+
+        if (num_dropped)
+            LOG_WARN("Dropped " << num_dropped << " keys of the append log, over the memory limit");
+        LOG_INFO("Replayed " << num_replayed << " records of " << segments.size() \
+            << " append log segments in " << unix_time_ms() - start << "ms");
+    }
+
+    for (auto& map: maps)
+        munmap(map.m_map, map.m_size);
+    return is_ok;
+}
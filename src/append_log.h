@@ -0,0 +1,459 @@
+#ifndef APPEND_LOG_H_
+#define APPEND_LOG_H_
+
+#include "common_include.h"
+#include "data_store.h"
+#include <pthread.h>
+#include <ctime>
+
+class ReplicationBacklog;
+
+/**
+ * @brief identifies a segment of the append log, at its start
+ *
+ */
+#define APPEND_LOG_MAGIC "KVLOG001"
+#define APPEND_LOG_MAGIC_SIZE 8
+
+/**
+ * @brief time between two writes of the buffered records, in
+ * milliseconds
+ *
+ */
+#define APPEND_LOG_FLUSH_INTERVAL_MS 10
+
+/**
+ * @brief time between two syncs with APPENDFSYNC_EVERYSEC, in
+ * milliseconds
+ *
+ */
+#define APPEND_LOG_SYNC_INTERVAL_MS 1000
+
+/**
+ * @brief operations of the append log records
+ *
+ */
+#define APPEND_LOG_OP_SET 1
+#define APPEND_LOG_OP_DEL 2
+#define APPEND_LOG_OP_EXPIRE 3
+
+/**
+ * @brief When the append log is synced to the disk
+ *
+ */
+typedef enum
+{
+    /**
+     * @brief before the writes are acknowledged. Writes that arrive
+     * together share a sync.
+     *
+     */
+    APPENDFSYNC_ALWAYS,
+    /**
+     * @brief once a second, a crash loses at most about a second of
+     * writes
+     *
+     */
+    APPENDFSYNC_EVERYSEC,
+    /**
+     * @brief never, the kernel writes the pages back when it wants
+     *
+     */
+    APPENDFSYNC_NO
+} appendfsync_t;
+
+/**
+ * @brief Logs the writes to the data stores, so that they survive a
+ * restart between two snapshots
+ *
+ * Every data store has its own buffer and mutex. A write is applied
+ * to its data store and appended to the buffer with the mutex held,
+ * so the log has the writes of a key in the order they were applied,
+ * and the threads that write to different data stores do not contend.
+ * A flusher thread takes the buffers every APPEND_LOG_FLUSH_INTERVAL_MS,
+ * writes them with a single writev, and syncs the file as the
+ * appendfsync policy says. The threads that write never call write()
+ * or fdatasync() themselves; with APPENDFSYNC_ALWAYS they wait for the
+ * flusher before replying, and all the writes buffered in the meantime
+ * are committed by the same sync.
+ *
+ * The log is a sequence of segments, PATH.1, PATH.2, ..., replayed in
+ * order. A snapshot starts a new segment before it walks the data
+ * stores, and once it is complete the older segments are deleted,
+ * since the snapshot has all their writes.
+ *
+ * A segment is APPEND_LOG_MAGIC followed by records. A record is an
+ * operation byte, the length of the key as a LEB128 varint, and then:
+ *  - APPEND_LOG_OP_SET: the length of the value as a varint, the
+ *    expiry time as a 64 bit integer, the key and the value
+ *  - APPEND_LOG_OP_DEL: the key
+ *  - APPEND_LOG_OP_EXPIRE: the expiry time, EXPIRE_NEVER to persist
+ *    the key, and the key
+ *
+ * Without a path, nothing is written to disk, and the log only feeds
+ * the replication backlog: the flusher hands every batch to it, so
+ * that replicas get the writes in the same order as the log.
+ *
+ * Expiry times are absolute, so that a replay does not extend them.
+ * Keys deleted by expiry and by eviction are not logged, expired keys
+ * are dropped by the replay, and the memory limit applies to it.
+ *
+ */
+class AppendLog
+{
+private:
+    /**
+     * @brief the records of a data store not taken by the flusher yet
+     *
+     */
+    struct alignas(CACHE_LINE_SIZE) Shard
+    {
+        std::mutex                          m_mutex;
+        std::string                         m_buffer;
+    };
+
+    Shard*                                  m_shards;
+    size_t                                  m_num_shards;
+    std::string                             m_path;
+    appendfsync_t                           m_fsync;
+
+    /**
+     * @brief gets every batch of records, nullptr if there are no
+     * replicas
+     *
+     */
+    ReplicationBacklog*                     m_backlog;
+
+    /**
+     * @brief tickets of the last record appended, and of the last
+     * record on the disk as the policy wants it
+     *
+     */
+    std::atomic<std::uint64_t>              m_last_ticket;
+    std::atomic<std::uint64_t>              m_synced_ticket;
+
+    /**
+     * @brief serializes the writes to the file and the switches to a
+     * new segment
+     *
+     */
+    std::mutex                              m_file_mutex;
+    int                                     m_fd;
+    std::atomic<std::uint64_t>              m_segment;
+
+    /**
+     * @brief size of the segment, up to the last complete write
+     *
+     */
+    off_t                                   m_size;
+
+    /**
+     * @brief size of the segment at its last sync
+     *
+     */
+    off_t                                   m_synced_size;
+
+    /**
+     * @brief the buffers taken from the shards, kept until they are
+     * written
+     *
+     */
+    std::vector<std::string>                m_pending;
+
+    /**
+     * @brief monotonic time in ms of the last sync
+     *
+     */
+    std::int64_t                            m_last_sync;
+
+    /**
+     * @brief used with m_cond, on the monotonic clock, to wait for the
+     * next flush, and to be woken up by wait_for_sync() and stop().
+     * Also used with m_synced_cond, which wait_for_sync() waits on.
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+    pthread_cond_t                          m_synced_cond;
+    bool                                    m_is_requested;
+    bool                                    m_is_stopping;
+
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief create a segment, and make it the one written to
+     *
+     * @param segment its number
+     * @return true on success
+     */
+    bool open_segment(std::uint64_t segment);
+
+    /**
+     * @brief write the pending buffers, with m_file_mutex held
+     *
+     * @return true on success
+     * @return false on a write error, the file is then cut back to
+     * its last complete write, and the buffers are kept
+     */
+    bool write_pending();
+
+    /**
+     * @brief write the buffers and sync, with m_file_mutex held
+     *
+     * @param is_sync whether to sync the file
+     * @return true on success
+     */
+    bool flush_unsafe(bool is_sync);
+
+    /**
+     * @brief the loop of the flusher thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg);
+
+    /**
+     * @brief append a record to the buffer of a shard, with its mutex
+     * held
+     *
+     * @return std::uint64_t the ticket of the record
+     */
+    std::uint64_t append(
+        size_t shard,
+        std::uint8_t op,
+        std::string_view key,
+        const std::string_view* value,
+        std::int64_t expire_at);
+
+public:
+    /**
+     * @brief bytes written to the log, and syncs
+     *
+     */
+    std::atomic<std::uint64_t>              m_bytes_written;
+    std::atomic<std::uint64_t>              m_num_syncs;
+
+    /**
+     * @brief write and sync errors, and whether the last write or
+     * sync failed
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_errors;
+    std::atomic<bool>                       m_is_failed;
+
+    /**
+     * @brief create a log, start() opens it
+     *
+     * @param path the prefix of the segments, empty to keep the
+     * records off the disk
+     * @param num_shards the number of data stores
+     * @param fsync when the log is synced
+     * @param backlog gets every batch of records, must outlive the
+     * log or stop(), nullptr if there are no replicas
+     */
+    AppendLog(
+        const std::string& path,
+        size_t num_shards,
+        appendfsync_t fsync,
+        ReplicationBacklog* backlog = nullptr);
+
+    ~AppendLog();
+
+    /**
+     * @brief open a new segment after the existing ones, and start
+     * the flusher thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop the flusher thread, and wait for it, then write and
+     * sync what is left
+     *
+     */
+    void stop();
+
+    /**
+     * @brief the mutex that the writes to a data store and their
+     * records are done with
+     *
+     * @param shard the index of the data store
+     */
+    std::mutex& get_mutex(size_t shard)
+    {
+        return m_shards[shard].m_mutex;
+    }
+
+    /**
+     * @brief log a SET, with get_mutex() of the shard held
+     *
+     * @param shard the index of the data store of the key
+     * @param key the key
+     * @param value the value
+     * @param expire_at the unix time in ms at which the key expires,
+     * or EXPIRE_NEVER
+     * @return std::uint64_t the ticket to pass to wait_for_sync()
+     */
+    std::uint64_t append_set(
+        size_t shard,
+        std::string_view key,
+        std::string_view value,
+        std::int64_t expire_at)
+    {
+        return append(shard, APPEND_LOG_OP_SET, key, &value, expire_at);
+    }
+
+    /**
+     * @brief log a DEL, with get_mutex() of the shard held
+     *
+     */
+    std::uint64_t append_del(size_t shard, std::string_view key)
+    {
+        return append(shard, APPEND_LOG_OP_DEL, key, nullptr, EXPIRE_NEVER);
+    }
+
+    /**
+     * @brief log a change of the expiry time of a key, with
+     * get_mutex() of the shard held
+     *
+     */
+    std::uint64_t append_expire(size_t shard, std::string_view key, std::int64_t expire_at)
+    {
+        return append(shard, APPEND_LOG_OP_EXPIRE, key, nullptr, expire_at);
+    }
+
+    /**
+     * @brief with APPENDFSYNC_ALWAYS, wait until a record is synced,
+     * return right away otherwise
+     *
+     * @param ticket the ticket of the record
+     * @return true if the record is synced, or the policy does not
+     * wait for it
+     * @return false if a write or a sync failed in the meantime, or
+     * the log stopped, the record must not be acknowledged
+     */
+    bool wait_for_sync(std::uint64_t ticket);
+
+    /**
+     * @brief write and sync the buffered records now, in the calling
+     * thread
+     *
+     * @return true on success
+     */
+    bool flush();
+
+    /**
+     * @brief end the current segment, and start a new one
+     *
+     * @param segment set to the number of the new segment
+     * @return true on success
+     * @return false if the new segment cannot be created, the current
+     * one is then kept
+     */
+    bool start_segment(std::uint64_t& segment);
+
+    /**
+     * @brief delete the segments before a segment
+     *
+     * @param segment the first segment to keep
+     */
+    void remove_segments_before(std::uint64_t segment);
+
+    /**
+     * @brief the number of the segment being written
+     *
+     */
+    std::uint64_t get_segment() const { return m_segment; }
+
+    appendfsync_t get_fsync() const { return m_fsync; }
+
+    /**
+     * @brief whether the records are written to disk
+     *
+     */
+    bool is_persistent() const { return !m_path.empty(); }
+};
+
+/**
+ * @brief A record of the append log, pointing into the log
+ *
+ */
+struct LogRecord
+{
+    std::uint8_t                m_op;
+    std::string_view            m_key;
+    std::string_view            m_value;
+    std::int64_t                m_expire_at;
+};
+
+/**
+ * @brief decode a record
+ *
+ * @param p the record, moved past it
+ * @param end the end of the data
+ * @param record set to the record
+ * @return int 1 on success, 0 if the data ends in the middle of the
+ * record, -1 if it is not a record
+ */
+int decode_log_record(const char*& p, const char* end, LogRecord& record);
+
+/**
+ * @brief apply a record to the data store of its key
+ *
+ * @param datastore the data store
+ * @param key the key of the record
+ * @param record the record
+ * @param now the current unix time in ms, records that set a time
+ * before it delete the key
+ * @return true on success
+ * @return false if the data store refused the value, because of its
+ * memory limit
+ */
+bool apply_log_record(
+    DataStoreInterface* datastore,
+    const HashedKey& key,
+    const LogRecord& record,
+    std::int64_t now);
+
+/**
+ * @brief the segments of an append log
+ *
+ * @param path the prefix of the segments
+ * @param segments set to the numbers of the segments, in order
+ * @return true on success
+ * @return false if the directory cannot be read
+ */
+bool list_log_segments(const std::string& path, std::vector<std::uint64_t>& segments);
+
+/**
+ * @brief the file of a segment
+ *
+ */
+std::string get_log_segment_path(const std::string& path, std::uint64_t segment);
+
+/**
+ * @brief replay an append log into the data stores
+ *
+ * The segments are mapped and split by data store, with
+ * get_partition(), then every data store replays its records in order,
+ * in its own thread. The records of a key keep their order, since they
+ * all go to the same data store. A record cut short at the end of a
+ * segment, by a crash in the middle of a write, ends the segment.
+ *
+ * @param path the prefix of the segments
+ * @param datastores the data stores, with the snapshot loaded
+ * @param num_datastores the number of data stores, a power of two
+ * @param num_replayed set to the number of records replayed
+ * @return true if the log was replayed, or there is none
+ * @return false if it cannot be read, or is corrupt
+ */
+bool replay_append_log(
+    const std::string& path,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_replayed);
+
+#endif /* #ifndef APPEND_LOG_H_ */
@@ -0,0 +1,750 @@
+#include "cluster.h"
+#include "append_log.h"
+#include "replication.h"
+#include "snapshot.h"
+#include "logger.h"
+#include <bitset>
+#include <charconv>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * @brief parse a number in a range
+ *
+ * @return true if s is a number in [min, max]
+ */
+static bool parse_number(std::string_view s, int min, int max, int& value)
+{
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    return std::errc() == ec && end == s.data() + s.size() && value >= min && value <= max;
+}
+
+bool parse_cluster_address(std::string_view address, std::string& host, int& port)
+{
+    size_t colon = address.rfind(':');
+    if (std::string_view::npos == colon || 0 == colon || \
+        !parse_number(address.substr(colon + 1), 1, 65535, port))
+        return false;
+
+    host.assign(address.substr(0, colon));
+    return true;
+}
+
+bool parse_cluster_nodes(std::string_view spec, std::vector<ClusterSlotRange>& ranges)
+{
+    while (!spec.empty())
+    {
+        size_t comma = spec.find(',');
+        std::string_view entry = spec.substr(0, comma);
+        spec = std::string_view::npos == comma ? std::string_view() : spec.substr(comma + 1);
+
+        size_t at = entry.rfind('@');
+        if (std::string_view::npos == at)
+            return false;
+
+        ClusterSlotRange range;
+        if (!parse_cluster_address(entry.substr(0, at), range.m_host, range.m_port))
+            return false;
+
+        std::string_view slots = entry.substr(at + 1);
+        size_t dash = slots.find('-');
+        int first, last;
+        if (!parse_number(slots.substr(0, dash), 0, CLUSTER_SLOTS - 1, first))
+            return false;
+        last = first;
+        if (std::string_view::npos != dash && \
+            !parse_number(slots.substr(dash + 1), first, CLUSTER_SLOTS - 1, last))
+            return false;
+
+        range.m_first = first;
+        range.m_last = last;
+        ranges.push_back(range);
+    }
+    return true;
+}
+
+/**
+ * @brief the id of a node, 40 hexadecimal digits like the ids of
+ * Redis Cluster
+ *
+ * The id is a function of the address only, with FNV-1a and the
+ * finalizer of MurmurHash3, so that all the nodes agree on it without
+ * talking to each other.
+ *
+ */
+static std::string get_node_id(const std::string& address)
+{
+    char id[CLUSTER_NODE_ID_SIZE + 1];
+    for (int i = 0; i < CLUSTER_NODE_ID_SIZE / 8; i++)
+    {
+        std::uint32_t hash = 2166136261u + i * 0x9e3779b9u;
+        for (unsigned char c: address)
+        {
+            hash ^= c;
+            hash *= 16777619u;
+        }
+
+        // Addresses differ in their last bytes, that FNV-1a hardly mixes
+        hash ^= hash >> 16;
+        hash *= 0x85ebca6bu;
+        hash ^= hash >> 13;
+        hash *= 0xc2b2ae35u;
+        hash ^= hash >> 16;
+        snprintf(id + 8 * i, 9, "%08x", hash);
+    }
+    return std::string(id, CLUSTER_NODE_ID_SIZE);
+}
+
+/**
+ * @brief append a command, as a RESP array of bulk strings
+ *
+ */
+static void append_command(std::string& commands, std::initializer_list<std::string_view> args)
+{
+    commands += '*';
+    commands += std::to_string(args.size());
+    commands += "\r\n";
+    for (auto arg: args)
+    {
+        commands += '$';
+        commands += std::to_string(arg.size());
+        commands += "\r\n";
+        commands.append(arg);
+        commands += "\r\n";
+    }
+}
+
+/**
+ * @brief send commands to a node, and wait for their replies
+ *
+ * The commands sent by the migration have replies of a single line.
+ *
+ * @param fd the socket
+ * @param commands the commands
+ * @param count the number of commands
+ * @return true if they all succeeded
+ */
+static bool send_commands(int fd, const std::string& commands, size_t count)
+{
+    if (!write_full(fd, commands.data(), commands.size()))
+        return false;
+
+    bool is_ok = true;
+    std::string line;
+    char buffer[4096];
+    while (count)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return false;
+
+        for (ssize_t i = 0; i < n && count; i++)
+        {
+            if ('\n' != buffer[i])
+            {
+                if (line.size() < 256)
+                    line += buffer[i];
+                continue;
+            }
+
+            if (is_ok && !line.empty() && '-' == line[0])
+            {
+                LOG_WARN("The target of a migration refused a command: " << line);
+                is_ok = false;
+            }
+            line.clear();
+            count--;
+        }
+    }
+    return is_ok;
+}
+
+Cluster::Cluster(DataStoreInterface** datastores, size_t num_datastores, AppendLog* append_log):
+    m_datastores(datastores),
+    m_num_datastores(num_datastores),
+    m_append_log(append_log),
+    m_nodes(nullptr),
+    m_num_nodes(0),
+    m_self(-1),
+    m_fd(-1),
+    m_mutex(PTHREAD_MUTEX_INITIALIZER),
+    m_is_stopping(false),
+    m_is_running(false),
+    m_thread_id(),
+    m_num_migrated_keys(0),
+    m_num_migrated_slots(0)
+{
+    for (size_t i = 0; i < CLUSTER_SLOTS; i++)
+        set_slot_unsafe(i, -1, -1, -1);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+Cluster::~Cluster()
+{
+    stop();
+    pthread_cond_destroy(&m_cond);
+    delete[] m_nodes;
+}
+
+int Cluster::add_node_unsafe(const std::string& host, int port)
+{
+    std::string address = host + ":" + std::to_string(port);
+    int num_nodes = m_num_nodes.load(std::memory_order_relaxed);
+    for (int i = 0; i < num_nodes; i++)
+    {
+        if (m_nodes[i].m_address == address)
+            return i;
+    }
+
+    if (CLUSTER_MAX_NODES == num_nodes)
+    {
+        LOG_ERROR("A cluster has at most " << CLUSTER_MAX_NODES << " nodes");
+        return -1;
+    }
+
+    ClusterNode& node = m_nodes[num_nodes];
+    node.m_host = host;
+    node.m_port = port;
+    node.m_id = get_node_id(address);
+    node.m_address = std::move(address);
+    m_num_nodes.store(num_nodes + 1, std::memory_order_release);
+    return num_nodes;
+}
+
+bool Cluster::init(const std::vector<ClusterSlotRange>& ranges, const std::string& host, int port)
+{
+    m_nodes = new (std::nothrow) ClusterNode[CLUSTER_MAX_NODES];
+    if (!m_nodes)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_nodes_mutex);
+    m_self = add_node_unsafe(host, port);
+    for (auto& range: ranges)
+    {
+        int node = add_node_unsafe(range.m_host, range.m_port);
+        if (node < 0)
+            return false;
+        for (int slot = range.m_first; slot <= range.m_last; slot++)
+            m_owners[slot].store(node, std::memory_order_relaxed);
+    }
+    return true;
+}
+
+int Cluster::get_or_add_node(std::string_view name)
+{
+    std::lock_guard<std::mutex> lock(m_nodes_mutex);
+    int num_nodes = m_num_nodes.load(std::memory_order_relaxed);
+    for (int i = 0; i < num_nodes; i++)
+    {
+        if (m_nodes[i].m_id == name)
+            return i;
+    }
+
+    std::string host;
+    int port;
+    if (!parse_cluster_address(name, host, port))
+        return -1;
+    return add_node_unsafe(host, port);
+}
+
+void Cluster::set_slot_node(std::uint16_t slot, int node)
+{
+    std::unique_lock<std::shared_mutex> lock(get_slot_mutex(slot));
+    set_slot_unsafe(slot, node, -1, -1);
+}
+
+bool Cluster::set_slot_migrating(std::uint16_t slot, int node)
+{
+    {
+        std::unique_lock<std::shared_mutex> lock(get_slot_mutex(slot));
+        if (get_owner(slot) != m_self || node == m_self)
+            return false;
+
+        // Already queued, the migration thread looks up the target
+        // when it gets to the slot
+        bool is_queued = get_migrating(slot) >= 0;
+        m_migrating[slot].store(node, std::memory_order_relaxed);
+        if (is_queued)
+            return true;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    try
+    {
+        m_migrations.push_back(slot);
+    }
+    catch (...)
+    {
+        pthread_mutex_unlock(&m_mutex);
+        set_slot_stable(slot);
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+    return true;
+}
+
+bool Cluster::set_slot_importing(std::uint16_t slot, int node)
+{
+    std::unique_lock<std::shared_mutex> lock(get_slot_mutex(slot));
+    if (get_owner(slot) == m_self || node == m_self)
+        return false;
+
+    m_importing[slot].store(node, std::memory_order_relaxed);
+    return true;
+}
+
+void Cluster::set_slot_stable(std::uint16_t slot)
+{
+    std::unique_lock<std::shared_mutex> lock(get_slot_mutex(slot));
+    m_migrating[slot].store(-1, std::memory_order_relaxed);
+    m_importing[slot].store(-1, std::memory_order_relaxed);
+}
+
+/**
+ * @brief what the walks of a slot collect
+ *
+ */
+struct SlotKeys
+{
+    std::uint16_t               m_slot;
+    size_t                      m_count;
+    size_t                      m_max_count;
+    std::vector<std::string>*   m_keys;
+};
+
+/**
+ * @brief the entry_visitor_t that counts, and collects, the keys of a
+ * slot
+ *
+ */
+static void visit_slot_key(std::string_view key, std::string_view value, std::int64_t expire_at, void* context)
+{
+    SlotKeys* slot_keys = static_cast<SlotKeys*>(context);
+    if (get_key_slot(key) != slot_keys->m_slot || slot_keys->m_count >= slot_keys->m_max_count)
+        return;
+
+    if (slot_keys->m_keys)
+    {
+        try
+        {
+            slot_keys->m_keys->emplace_back(key);
+        }
+        catch (...)
+        {
+            return;
+        }
+    }
+    slot_keys->m_count++;
+}
+
+size_t Cluster::count_keys_in_slot(std::uint16_t slot)
+{
+    SlotKeys slot_keys = {slot, 0, SIZE_MAX, nullptr};
+    DataStoreInterface* datastore = m_datastores[get_slot_partition(slot, m_num_datastores)];
+
+    size_t cursor = 0;
+    do
+    {
+        cursor = datastore->scan(cursor, SNAPSHOT_SCAN_BUCKETS, visit_slot_key, &slot_keys);
+    } while (cursor);
+    return slot_keys.m_count;
+}
+
+void Cluster::get_keys_in_slot(std::uint16_t slot, size_t count, std::vector<std::string>& keys)
+{
+    SlotKeys slot_keys = {slot, 0, count, &keys};
+    DataStoreInterface* datastore = m_datastores[get_slot_partition(slot, m_num_datastores)];
+
+    size_t cursor = 0;
+    do
+    {
+        cursor = datastore->scan(cursor, SNAPSHOT_SCAN_BUCKETS, visit_slot_key, &slot_keys);
+    } while (cursor && slot_keys.m_count < count);
+}
+
+/**
+ * @brief what a walk of the migration collects
+ *
+ */
+struct MigrationWalk
+{
+    const Cluster*                      m_cluster;
+    int                                 m_target;
+    const std::bitset<CLUSTER_SLOTS>*   m_slots;
+    std::vector<std::string>            m_keys;
+};
+
+/**
+ * @brief the entry_visitor_t that collects the keys of the slots
+ * migrating to a target
+ *
+ */
+static void collect_migrating_key(std::string_view key, std::string_view value, std::int64_t expire_at, void* context)
+{
+    MigrationWalk* walk = static_cast<MigrationWalk*>(context);
+    std::uint16_t slot = get_key_slot(key);
+    if (!walk->m_slots->test(slot) || walk->m_cluster->get_migrating(slot) != walk->m_target)
+        return;
+
+    try
+    {
+        walk->m_keys.emplace_back(key);
+    }
+    catch (...)
+    {
+    }
+}
+
+/**
+ * @brief take the exclusive locks of the slots of some keys
+ *
+ */
+static void lock_key_slots(Cluster* cluster, const std::vector<std::string>& keys, \
+    std::unique_lock<std::shared_mutex> (&locks)[CLUSTER_SLOT_LOCKS])
+{
+    std::bitset<CLUSTER_SLOT_LOCKS> is_locked;
+    for (auto& key: keys)
+        is_locked.set(get_key_slot(key) & (CLUSTER_SLOT_LOCKS - 1));
+
+    // In order, even though the commands only take one lock each
+    for (size_t i = 0; i < CLUSTER_SLOT_LOCKS; i++)
+    {
+        if (is_locked.test(i))
+            locks[i] = std::unique_lock<std::shared_mutex>(cluster->get_slot_mutex(i));
+    }
+}
+
+/**
+ * @brief append the commands that give the target a key, or delete it
+ * there if it was not found
+ *
+ */
+static void append_migrate_commands(std::string& commands, std::string_view key, bool found, \
+    std::string_view value, std::int64_t expire_at)
+{
+    // The expiry time is absolute, it does not move with the key
+    append_command(commands, {"ASKING"});
+    if (!found)
+        append_command(commands, {"DEL", key});
+    else if (EXPIRE_NEVER == expire_at)
+        append_command(commands, {"SET", key, value});
+    else
+        append_command(commands, {"SET", key, value, "PXAT", std::to_string(expire_at)});
+}
+
+bool Cluster::migrate_batch(int fd, int target, std::vector<std::string>& keys, size_t& num_moved)
+{
+    std::string commands;
+    size_t num_commands = 0;
+    std::vector<size_t> moved;
+    std::vector<std::string> values;
+    std::vector<std::int64_t> expiries;
+    {
+        std::unique_lock<std::shared_mutex> locks[CLUSTER_SLOT_LOCKS];
+        lock_key_slots(this, keys, locks);
+        for (size_t i = 0; i < keys.size(); i++)
+        {
+            HashedKey key(keys[i]);
+            if (get_migrating(key.m_slot) != target)
+                continue;
+
+            DataStoreInterface* datastore = m_datastores[get_partition(key, m_num_datastores)];
+            std::int64_t expire_at;
+            if (!datastore->get_expiry(key, expire_at))
+                continue;
+            auto [found, value] = datastore->get(key);
+            if (!found)
+                continue;
+
+            append_migrate_commands(commands, key.m_key, true, value, expire_at);
+            num_commands += 2;
+            moved.push_back(i);
+            values.push_back(std::move(value));
+            expiries.push_back(expire_at);
+        }
+    }
+
+    // Without the locks, the commands for the slots go on while the
+    // target stores the keys
+    if (num_commands && !send_commands(fd, commands, num_commands))
+        return false;
+
+    std::unique_lock<std::shared_mutex> locks[CLUSTER_SLOT_LOCKS];
+    lock_key_slots(this, keys, locks);
+
+    // A key changed meanwhile is sent again, and one that is gone is
+    // deleted on the target, with the locks held this time, so that
+    // the target never keeps a stale copy
+    commands.clear();
+    num_commands = 0;
+    for (size_t j = 0; j < moved.size(); j++)
+    {
+        HashedKey key(keys[moved[j]]);
+        if (get_migrating(key.m_slot) != target)
+            continue;
+
+        DataStoreInterface* datastore = m_datastores[get_partition(key, m_num_datastores)];
+        std::int64_t expire_at = EXPIRE_NEVER;
+        bool found = datastore->get_expiry(key, expire_at);
+        auto [is_found, value] = datastore->get(key);
+        found = found && is_found;
+        if (found && expire_at == expiries[j] && value == values[j])
+            continue;
+
+        append_migrate_commands(commands, key.m_key, found, value, expire_at);
+        num_commands += 2;
+    }
+    if (num_commands && !send_commands(fd, commands, num_commands))
+        return false;
+
+    // The target has the keys, clients now find them there after -ASK
+    size_t num_deleted = 0;
+    for (size_t i: moved)
+    {
+        HashedKey key(keys[i]);
+        if (get_migrating(key.m_slot) != target)
+            continue;
+
+        size_t partition = get_partition(key, m_num_datastores);
+        std::unique_lock<std::mutex> log_lock;
+        if (m_append_log)
+            log_lock = std::unique_lock<std::mutex>(m_append_log->get_mutex(partition));
+        if (m_datastores[partition]->del(key))
+        {
+            num_deleted++;
+            if (m_append_log)
+                m_append_log->append_del(partition, key.m_key);
+        }
+    }
+
+    num_moved += num_deleted;
+    m_num_migrated_keys += num_deleted;
+    keys.clear();
+    return true;
+}
+
+bool Cluster::migrate_slots(int target, const std::vector<std::uint16_t>& slots)
+{
+    const ClusterNode& node = m_nodes[target];
+    int fd = connect_to_host(node.m_host, node.m_port, CLUSTER_MIGRATION_RETRY_MS);
+    if (fd < 0)
+    {
+        LOG_WARN("Cannot connect to " << node.m_address << " to move slots to it");
+        return false;
+    }
+
+    // A target that stops answering fails the batch, rather than
+    // holding up the commands for its slots
+    struct timeval timeout = {CLUSTER_MIGRATION_TIMEOUT_MS / 1000, (CLUSTER_MIGRATION_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    pthread_mutex_lock(&m_mutex);
+    m_fd = fd;
+    pthread_mutex_unlock(&m_mutex);
+
+    bool is_ok = !m_is_stopping;
+    size_t num_moved = 0;
+    size_t num_slots = 0;
+    try
+    {
+        // The target only takes the keys of the slots it imports
+        std::bitset<CLUSTER_SLOTS> is_moving;
+        std::bitset<CLUSTER_SLOTS> is_partition_moving;
+        std::string commands;
+        for (auto slot: slots)
+        {
+            append_command(commands, {"CLUSTER", "SETSLOT", std::to_string(slot),
+                "IMPORTING", m_nodes[m_self].m_address});
+            is_moving.set(slot);
+            is_partition_moving.set(get_slot_partition(slot, m_num_datastores));
+        }
+        is_ok = is_ok && send_commands(fd, commands, slots.size());
+
+        MigrationWalk walk = {this, target, &is_moving, {}};
+        size_t walk_moved;
+        do
+        {
+            walk_moved = 0;
+            for (size_t i = 0; is_ok && i < m_num_datastores; i++)
+            {
+                if (!is_partition_moving.test(i))
+                    continue;
+
+                size_t cursor = 0;
+                do
+                {
+                    cursor = m_datastores[i]->scan(
+                                cursor, SNAPSHOT_SCAN_BUCKETS, collect_migrating_key, &walk);
+                    if (walk.m_keys.size() >= CLUSTER_MIGRATION_BATCH || \
+                            (!cursor && !walk.m_keys.empty()))
+                        is_ok = migrate_batch(fd, target, walk.m_keys, walk_moved) && !m_is_stopping;
+                } while (is_ok && cursor);
+            }
+            num_moved += walk_moved;
+        } while (is_ok && walk_moved);
+
+        // The target is told first, so that it serves the slot as soon
+        // as this node sends the clients to it
+        for (size_t i = 0; is_ok && i < slots.size(); i++)
+        {
+            std::unique_lock<std::shared_mutex> lock(get_slot_mutex(slots[i]));
+            if (get_migrating(slots[i]) != target)
+                continue;
+
+            commands.clear();
+            append_command(commands, {"CLUSTER", "SETSLOT", std::to_string(slots[i]),
+                "NODE", node.m_address});
+            is_ok = send_commands(fd, commands, 1);
+            if (is_ok)
+            {
+                set_slot_unsafe(slots[i], target, -1, -1);
+                num_slots++;
+            }
+        }
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        is_ok = false;
+    }
+
+    pthread_mutex_lock(&m_mutex);
+    m_fd = -1;
+    pthread_mutex_unlock(&m_mutex);
+    close(fd);
+
+    m_num_migrated_slots += num_slots;
+    if (is_ok)
+        LOG_INFO("Moved " << num_slots << " slots and " << num_moved << " keys to " << node.m_address);
+    else if (!m_is_stopping)
+        LOG_WARN("Failed to move slots to " << node.m_address << " after " << num_moved \
+            << " keys, will try again");
+    return is_ok;
+}
+
+void Cluster::loop()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (!m_is_stopping)
+    {
+        if (m_migrations.empty())
+        {
+            pthread_cond_wait(&m_cond, &m_mutex);
+            continue;
+        }
+
+        // The slots that go to the same node are moved together, the
+        // others wait for their turn, and the cancelled ones are dropped
+        int target = -1;
+        std::vector<std::uint16_t> slots;
+        std::deque<std::uint16_t> others;
+        try
+        {
+            for (auto slot: m_migrations)
+            {
+                int migrating = get_migrating(slot);
+                if (target < 0)
+                    target = migrating;
+                if (migrating < 0)
+                    continue;
+                if (migrating == target)
+                    slots.push_back(slot);
+                else
+                    others.push_back(slot);
+            }
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            pthread_mutex_unlock(&m_mutex);
+            return;
+        }
+        m_migrations.swap(others);
+        if (slots.empty())
+            continue;
+
+        pthread_mutex_unlock(&m_mutex);
+        bool is_done = migrate_slots(target, slots);
+        pthread_mutex_lock(&m_mutex);
+
+        // The slots that failed are tried again, and the ones that got
+        // another target in the meantime are moved to it
+        for (auto slot: slots)
+        {
+            int migrating = get_migrating(slot);
+            if (migrating >= 0 && (!is_done || migrating != target))
+                m_migrations.push_back(slot);
+        }
+        if (is_done || m_is_stopping)
+            continue;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += (long)CLUSTER_MIGRATION_RETRY_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!m_is_stopping && \
+                ETIMEDOUT != pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+            ;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void* Cluster::thread_start_routine(void* arg)
+{
+    static_cast<Cluster*>(arg)->loop();
+    return nullptr;
+}
+
+bool Cluster::start()
+{
+    int retval;
+
+    if (m_is_running)
+        return true;
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        Cluster::thread_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void Cluster::stop()
+{
+    if (!m_is_running)
+        return;
+
+    pthread_mutex_lock(&m_mutex);
+    m_is_stopping = true;
+    int fd = m_fd;
+    if (fd >= 0)
+        shutdown(fd, SHUT_RDWR);
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread_id, nullptr);
+    m_is_running = false;
+}
@@ -0,0 +1,394 @@
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+#include "common_include.h"
+#include "data_store.h"
+#include <pthread.h>
+#include <ctime>
+
+class AppendLog;
+
+/**
+ * @brief the most nodes a cluster knows of
+ *
+ */
+#define CLUSTER_MAX_NODES 1024
+
+/**
+ * @brief number of locks the slots are spread over
+ *
+ */
+#define CLUSTER_SLOT_LOCKS 64
+
+/**
+ * @brief the most keys moved to another node at once
+ *
+ */
+#define CLUSTER_MIGRATION_BATCH 128
+
+/**
+ * @brief time between two attempts to move a slot, and the longest a
+ * batch may wait for the target, in milliseconds
+ *
+ */
+#define CLUSTER_MIGRATION_RETRY_MS 1000
+#define CLUSTER_MIGRATION_TIMEOUT_MS 5000
+
+/**
+ * @brief size of the id of a node, in hexadecimal digits
+ *
+ */
+#define CLUSTER_NODE_ID_SIZE 40
+
+/**
+ * @brief a range of slots, and the node that serves it, as given on
+ * the command line
+ *
+ */
+struct ClusterSlotRange
+{
+    std::string                 m_host;
+    int                         m_port;
+    std::uint16_t               m_first;
+    std::uint16_t               m_last;
+};
+
+/**
+ * @brief parse the address of a node
+ *
+ * @param address HOST:PORT
+ * @param host set to the host
+ * @param port set to the port
+ * @return true if the address is valid
+ */
+bool parse_cluster_address(std::string_view address, std::string& host, int& port);
+
+/**
+ * @brief parse the slots of the nodes of a cluster
+ *
+ * @param spec comma separated HOST:PORT@FIRST-LAST, or HOST:PORT@SLOT,
+ * a node may be given several times
+ * @param ranges the ranges are appended here
+ * @return true if the spec is valid
+ */
+bool parse_cluster_nodes(std::string_view spec, std::vector<ClusterSlotRange>& ranges);
+
+/**
+ * @brief A node of the cluster, where clients are sent for the slots
+ * it serves
+ *
+ */
+struct ClusterNode
+{
+    std::string                 m_host;
+    int                         m_port;
+
+    /**
+     * @brief HOST:PORT
+     *
+     */
+    std::string                 m_address;
+
+    /**
+     * @brief derived from the address, so that every node gives the
+     * same id to a node
+     *
+     */
+    std::string                 m_id;
+};
+
+/**
+ * @brief The hash slots of a cluster, the nodes that serve them, and
+ * the slots this node moves to another node
+ *
+ * The keys are mapped to CLUSTER_SLOTS slots with get_key_slot(), as
+ * in Redis Cluster, and every slot is served by one node. A command
+ * for a slot of another node is answered with -MOVED and the address
+ * of that node. There is no gossip: every node is started with the
+ * map of all the slots, and a node only learns about a change of owner
+ * from CLUSTER SETSLOT, sent by the operator or by the node that moved
+ * the slot.
+ *
+ * A slot is moved while it is being served. The node that has it
+ * marks it MIGRATING, tells the target to mark it IMPORTING, and a
+ * migration thread then sends the keys of the slot to the target in
+ * batches of CLUSTER_MIGRATION_BATCH, as ASKING and SET commands on
+ * its client port, and deletes every batch once the target has
+ * acknowledged it. The slots that go to the same target are moved
+ * together, with one walk of every data store. Meanwhile the keys that are still here are served
+ * here, and clients are sent to the target with -ASK for the others.
+ * The target only serves the keys of a slot it imports to commands
+ * that follow an ASKING. Once the slot is empty, both nodes make the
+ * target its owner.
+ *
+ * Commands run with the shared lock of the slot held, see
+ * get_slot_mutex(), and a change of the state of a slot, or the
+ * deletes of a batch, with its exclusive lock, so that a command sees
+ * a key either here or on the target. The lock is not held while the
+ * target stores a batch, only the commands for the slots that share a
+ * lock with the batch wait for the reads and deletes around it.
+ *
+ */
+class Cluster
+{
+private:
+    /**
+     * @brief a lock of the slots, on its own cache line
+     *
+     */
+    struct alignas(CACHE_LINE_SIZE) SlotLock
+    {
+        std::shared_mutex                   m_mutex;
+    };
+
+    DataStoreInterface**                    m_datastores;
+    size_t                                  m_num_datastores;
+
+    /**
+     * @brief logs the deletes of the keys moved away, nullptr if
+     * there is no append log
+     *
+     */
+    AppendLog*                              m_append_log;
+
+    /**
+     * @brief the known nodes, only ever appended, m_num_nodes is
+     * published after the node is filled in
+     *
+     */
+    ClusterNode*                            m_nodes;
+    std::atomic<int>                        m_num_nodes;
+    std::mutex                              m_nodes_mutex;
+
+    /**
+     * @brief this node
+     *
+     */
+    int                                     m_self;
+
+    /**
+     * @brief for every slot, the node that serves it, the node it is
+     * moved to and the node it is moved from, -1 if there is none.
+     * Changed with the lock of the slot held.
+     *
+     */
+    std::atomic<std::int16_t>               m_owners[CLUSTER_SLOTS];
+    std::atomic<std::int16_t>               m_migrating[CLUSTER_SLOTS];
+    std::atomic<std::int16_t>               m_importing[CLUSTER_SLOTS];
+
+    SlotLock                                m_slot_locks[CLUSTER_SLOT_LOCKS];
+
+    /**
+     * @brief the slots to move, guarded by m_mutex
+     *
+     */
+    std::deque<std::uint16_t>               m_migrations;
+
+    /**
+     * @brief the socket to the target, shut down by stop() to end a
+     * blocking read
+     *
+     */
+    std::atomic<int>                        m_fd;
+
+    /**
+     * @brief used with m_cond, on the monotonic clock, to wait for a
+     * slot to move, and to be woken up by set_slot_migrating() and
+     * stop()
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+    std::atomic<bool>                       m_is_stopping;
+
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief move the keys of some slots to the node they migrate to,
+     * and make that node their owner
+     *
+     * The data stores of the slots are walked until a walk finds none
+     * of their keys, so that a walk that misses keys, when a data store
+     * rehashes behind its cursor, is made up by the next one.
+     *
+     * @param target the node the slots migrate to
+     * @param slots the slots
+     * @return true if the slots were moved, or are not migrating anymore
+     * @return false if the target failed, to try again later
+     */
+    bool migrate_slots(int target, const std::vector<std::uint16_t>& slots);
+
+    /**
+     * @brief move a batch of keys
+     *
+     * The values are copied with the exclusive locks of the slots held,
+     * a key that was deleted, or whose slot is not migrating to the
+     * target anymore, is skipped. They are sent without the locks, and
+     * the keys are deleted once the locks are taken again. A key that
+     * changed meanwhile is sent again, or deleted on the target if it
+     * is gone, before that.
+     *
+     * @param fd the socket to the target
+     * @param target the node the keys are moved to
+     * @param keys the keys, cleared once they are moved
+     * @param num_moved incremented by the number of keys moved
+     * @return true on success
+     */
+    bool migrate_batch(int fd, int target, std::vector<std::string>& keys, size_t& num_moved);
+
+    /**
+     * @brief set the state of a slot, with its exclusive lock held
+     *
+     */
+    void set_slot_unsafe(std::uint16_t slot, int owner, int migrating, int importing)
+    {
+        m_owners[slot].store(owner, std::memory_order_relaxed);
+        m_migrating[slot].store(migrating, std::memory_order_relaxed);
+        m_importing[slot].store(importing, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief the loop of the migration thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg);
+
+    /**
+     * @brief add a node, with m_nodes_mutex held
+     *
+     * @return int the index of the node, -1 if there are too many
+     */
+    int add_node_unsafe(const std::string& host, int port);
+
+public:
+    /**
+     * @brief keys and slots moved to other nodes
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_migrated_keys;
+    std::atomic<std::uint64_t>              m_num_migrated_slots;
+
+    /**
+     * @brief create a cluster, init() sets it up
+     *
+     * @param datastores the data stores, must outlive the cluster or
+     * stop()
+     * @param num_datastores the number of data stores, a power of two
+     * @param append_log logs the deletes of the keys moved away, may
+     * be nullptr
+     */
+    Cluster(DataStoreInterface** datastores, size_t num_datastores, AppendLog* append_log);
+
+    ~Cluster();
+
+    /**
+     * @brief set the nodes and their slots
+     *
+     * @param ranges the slots of every node
+     * @param host the host of this node, as the others know it
+     * @param port the port of this node
+     * @return true on success
+     * @return false if out of memory, or there are too many nodes
+     */
+    bool init(const std::vector<ClusterSlotRange>& ranges, const std::string& host, int port);
+
+    /**
+     * @brief start the migration thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop the migration thread, and wait for it. A slot being
+     * moved stays MIGRATING.
+     *
+     */
+    void stop();
+
+    /**
+     * @brief the lock a command for a slot runs with
+     *
+     */
+    std::shared_mutex& get_slot_mutex(std::uint16_t slot)
+    {
+        return m_slot_locks[slot & (CLUSTER_SLOT_LOCKS - 1)].m_mutex;
+    }
+
+    /**
+     * @brief the node the slot belongs to, it is moved to, and it is
+     * moved from, -1 if there is none
+     *
+     */
+    int get_owner(std::uint16_t slot) const { return m_owners[slot].load(std::memory_order_relaxed); }
+    int get_migrating(std::uint16_t slot) const { return m_migrating[slot].load(std::memory_order_relaxed); }
+    int get_importing(std::uint16_t slot) const { return m_importing[slot].load(std::memory_order_relaxed); }
+
+    int get_self() const { return m_self; }
+
+    int get_num_nodes() const { return m_num_nodes.load(std::memory_order_acquire); }
+
+    const ClusterNode& get_node(int node) const { return m_nodes[node]; }
+
+    /**
+     * @brief find a node by id or by address, adding it if an address
+     * is not known yet
+     *
+     * @param name the id, or HOST:PORT
+     * @return int the index of the node, -1 if the name is not valid
+     * or there are too many nodes
+     */
+    int get_or_add_node(std::string_view name);
+
+    /**
+     * @brief make a node the owner of a slot, and stop moving it
+     *
+     */
+    void set_slot_node(std::uint16_t slot, int node);
+
+    /**
+     * @brief start moving a slot of this node to another node
+     *
+     * @return true on success
+     * @return false if the slot is not served by this node, or the
+     * node is this one
+     */
+    bool set_slot_migrating(std::uint16_t slot, int node);
+
+    /**
+     * @brief accept the keys of a slot of another node, after ASKING
+     *
+     * @return true on success
+     * @return false if the slot is already served by this node
+     */
+    bool set_slot_importing(std::uint16_t slot, int node);
+
+    /**
+     * @brief stop moving a slot, and stop importing it
+     *
+     */
+    void set_slot_stable(std::uint16_t slot);
+
+    /**
+     * @brief the number of keys of a slot
+     *
+     * The data store of the slot is walked, so this takes time in the
+     * number of its keys.
+     *
+     */
+    size_t count_keys_in_slot(std::uint16_t slot);
+
+    /**
+     * @brief some keys of a slot
+     *
+     * @param slot the slot
+     * @param count the most keys
+     * @param keys the keys are appended here
+     */
+    void get_keys_in_slot(std::uint16_t slot, size_t count, std::vector<std::string>& keys);
+};
+
+#endif /* #ifndef CLUSTER_H_ */
@@ -0,0 +1,325 @@
+#ifndef COMMAND_TABLE_H_
+#define COMMAND_TABLE_H_
+
+#include "common_include.h"
+#include "resp_parser.h"
+#include "io_buffer.h"
+
+class Orchestrator;
+
+/**
+ * @brief enum defines the different types of commands
+ *
+ * Commands can be get, set, del, mget, mset, the expiry commands,
+ * info, the persistence commands or the cluster commands
+ *
+ */
+typedef enum
+{
+    /**
+     * @brief invalid command
+     *
+     */
+    COMMAND_INVALID,
+    /**
+     * @brief get command
+     *
+     */
+    COMMAND_GET,
+    /**
+     * @brief del command
+     *
+     */
+    COMMAND_DEL,
+    /**
+     * @brief set command
+     *
+     */
+    COMMAND_SET,
+    /**
+     * @brief mget command, get several keys at once
+     *
+     */
+    COMMAND_MGET,
+    /**
+     * @brief mset command, set several keys at once
+     *
+     */
+    COMMAND_MSET,
+    /**
+     * @brief expire command, set the time to live of a key in seconds
+     *
+     */
+    COMMAND_EXPIRE,
+    /**
+     * @brief pexpire command, set the time to live of a key in
+     * milliseconds
+     *
+     */
+    COMMAND_PEXPIRE,
+    /**
+     * @brief ttl command, get the time to live of a key in seconds
+     *
+     */
+    COMMAND_TTL,
+    /**
+     * @brief pttl command, get the time to live of a key in
+     * milliseconds
+     *
+     */
+    COMMAND_PTTL,
+    /**
+     * @brief persist command, remove the time to live of a key
+     *
+     */
+    COMMAND_PERSIST,
+    /**
+     * @brief info command, also known as stats
+     *
+     */
+    COMMAND_INFO,
+    /**
+     * @brief save command, write a snapshot before replying
+     *
+     */
+    COMMAND_SAVE,
+    /**
+     * @brief bgsave command, write a snapshot in the background
+     *
+     */
+    COMMAND_BGSAVE,
+    /**
+     * @brief cluster command, the slots and the nodes of the cluster
+     *
+     */
+    COMMAND_CLUSTER,
+    /**
+     * @brief asking command, the next command may use a slot this node
+     * imports
+     *
+     */
+    COMMAND_ASKING
+} command_type_t;
+
+/**
+ * @brief what a command does with the data stores, a command with
+ * neither flag does not touch them
+ *
+ */
+typedef enum
+{
+    COMMAND_FLAG_READ   = 1 << 0,
+    COMMAND_FLAG_WRITE  = 1 << 1
+} command_flag_t;
+
+/**
+ * @brief runs a command
+ *
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ */
+typedef bool (*command_handler_t)(
+    Orchestrator* porch,
+    const CommandView& command,
+    IoBuffer& response);
+
+/**
+ * @brief A command the server runs, an entry of a CommandTable
+ *
+ */
+struct CommandSpec
+{
+    /**
+     * @brief the name, lowercase
+     *
+     */
+    std::string_view            m_name;
+    command_type_t              m_type;
+    command_handler_t           m_handler;
+
+    /**
+     * @brief the numbers of arguments it takes, the name included:
+     * from m_min_argc to m_max_argc, -1 if there is no limit, in steps
+     * of m_argc_step
+     *
+     */
+    int                         m_min_argc;
+    int                         m_max_argc;
+    int                         m_argc_step;
+
+    /**
+     * @brief COMMAND_FLAG_READ and COMMAND_FLAG_WRITE
+     *
+     */
+    unsigned                    m_flags;
+
+    /**
+     * @brief where the keys are, as in Redis: the first key, 0 if
+     * there is none, the last one, -1 for the last argument, and the
+     * distance between two keys
+     *
+     */
+    int                         m_first_key;
+    int                         m_last_key;
+    int                         m_key_step;
+
+    constexpr bool accepts_argc(int argc) const
+    {
+        return argc >= m_min_argc &&
+            (m_max_argc < 0 || argc <= m_max_argc) &&
+            0 == (argc - m_min_argc) % m_argc_step;
+    }
+
+    constexpr bool is_write() const { return m_flags & COMMAND_FLAG_WRITE; }
+
+    /**
+     * @brief the argument of the last key of a command, 0 if it has
+     * no keys
+     *
+     */
+    constexpr int get_last_key(int argc) const
+    {
+        if (!m_first_key)
+            return 0;
+        return m_last_key < 0 ? argc - 1 : m_last_key;
+    }
+};
+
+/**
+ * @brief compare a command name with a lowercase name, ignoring
+ * the case of the command, as clients may send either
+ *
+ * @param name the name received from the client
+ * @param lowercase_name the lowercase name to compare with
+ * @return true if they are the same, ignoring case
+ */
+constexpr bool command_name_equals(std::string_view name, std::string_view lowercase_name)
+{
+    if (name.size() != lowercase_name.size())
+        return false;
+
+    for (size_t i = 0; i < name.size(); i++)
+    {
+        if ((name[i] | 0x20) != lowercase_name[i])
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief a hash of a command name that ignores its case, FNV-1a from
+ * a seed
+ *
+ */
+constexpr std::uint32_t command_name_hash(std::string_view name, std::uint32_t seed)
+{
+    std::uint32_t hash = 2166136261U ^ seed;
+    for (char c: name)
+    {
+        hash ^= (unsigned char)(c | 0x20);
+        hash *= 16777619U;
+    }
+    return hash ^ (hash >> 16);
+}
+
+/**
+ * @brief number of slots of a CommandTable, a power of two, at least
+ * twice the number of commands
+ *
+ */
+#define COMMAND_TABLE_SIZE 64
+
+/**
+ * @brief most seeds tried for a perfect hash of the commands
+ *
+ */
+#define COMMAND_TABLE_MAX_SEEDS 4096
+
+/**
+ * @brief The commands a server runs, found with a perfect hash of
+ * their names
+ *
+ * The table is built at compile time: the constructor tries seeds of
+ * command_name_hash() until every command gets a slot of its own. A
+ * name received from a client is then found with one hash and one
+ * comparison, whatever its case, without copying it. Adding a command
+ * is adding its CommandSpec to the array the table is built from.
+ *
+ * @tparam N the number of commands
+ */
+template <size_t N>
+class CommandTable
+{
+private:
+    const CommandSpec*          m_specs;
+
+    /**
+     * @brief the seed of the perfect hash, 0 if none was found
+     *
+     */
+    std::uint32_t               m_seed;
+
+    /**
+     * @brief for every slot, one more than the index of its command,
+     * 0 if it is free
+     *
+     */
+    std::uint8_t                m_slots[COMMAND_TABLE_SIZE];
+
+    constexpr bool try_seed(std::uint32_t seed)
+    {
+        for (auto& slot: m_slots)
+            slot = 0;
+
+        for (size_t i = 0; i < N; i++)
+        {
+            auto& slot = m_slots[command_name_hash(m_specs[i].m_name, seed) & (COMMAND_TABLE_SIZE - 1)];
+            if (slot)
+                return false;
+            slot = (std::uint8_t)(i + 1);
+        }
+        return true;
+    }
+
+public:
+    constexpr explicit CommandTable(const CommandSpec (&specs)[N]):
+        m_specs(specs),
+        m_seed(0),
+        m_slots()
+    {
+        static_assert(2 * N <= COMMAND_TABLE_SIZE, "COMMAND_TABLE_SIZE is too small");
+
+        for (std::uint32_t seed = 1; seed <= COMMAND_TABLE_MAX_SEEDS; seed++)
+        {
+            if (try_seed(seed))
+            {
+                m_seed = seed;
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief whether every command has a slot of its own, to be
+     * checked with a static_assert
+     *
+     */
+    constexpr bool is_perfect() const { return 0 != m_seed; }
+
+    /**
+     * @brief find a command
+     *
+     * @param name the name received from the client, in any case
+     * @return const CommandSpec* the command, nullptr if there is none
+     * of that name
+     */
+    constexpr const CommandSpec* find(std::string_view name) const
+    {
+        unsigned slot = m_slots[command_name_hash(name, m_seed) & (COMMAND_TABLE_SIZE - 1)];
+        if (!slot || !command_name_equals(name, m_specs[slot - 1].m_name))
+            return nullptr;
+        return &m_specs[slot - 1];
+    }
+};
+
+#endif /* #ifndef COMMAND_TABLE_H_ */
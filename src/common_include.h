@@ -18,5 +18,13 @@
 #include <shared_mutex>
 #include <mutex>
 #include <thread>
+#include <string_view>
+
+/**
+ * @brief size of a cache line, used to keep data that is written by
+ * different threads from sharing one
+ * 
+ */
+#define CACHE_LINE_SIZE 64
 
 #endif /* #ifndef COMMON_INCLUDE_ */
@@ -0,0 +1,132 @@
+#ifndef CONNECTION_TABLE_H_
+#define CONNECTION_TABLE_H_
+
+#include "common_include.h"
+#include "state.h"
+
+/**
+ * @brief number of slots of a chunk of a ConnectionTable, a power of
+ * two
+ *
+ */
+#define CONNECTION_TABLE_CHUNK_SIZE 4096
+
+/**
+ * @brief The states of the connections, indexed by their fd
+ *
+ * The kernel hands out the lowest free fd, so the fds of the
+ * connections are dense, and a flat array finds a connection without
+ * hashing, and without an allocation per connection. The slots are
+ * allocated in chunks of CONNECTION_TABLE_CHUNK_SIZE when a fd first
+ * needs one, so the table is sized by the most connections there have
+ * been, at 16 bytes a connection.
+ *
+ * A lookup holds the shared lock just long enough to copy the slot,
+ * inserting or erasing holds the exclusive lock.
+ *
+ */
+class ConnectionTable
+{
+private:
+    typedef std::shared_ptr<State> Slot;
+
+    std::vector<Slot*>              m_chunks;
+    mutable std::shared_mutex       m_mutex;
+
+    Slot* get_slot_unsafe(int fd) const
+    {
+        size_t chunk = (size_t)fd / CONNECTION_TABLE_CHUNK_SIZE;
+        if (fd < 0 || chunk >= m_chunks.size() || !m_chunks[chunk])
+            return nullptr;
+
+        return &m_chunks[chunk][fd & (CONNECTION_TABLE_CHUNK_SIZE - 1)];
+    }
+
+public:
+    ConnectionTable() = default;
+
+    ~ConnectionTable()
+    {
+        for (auto chunk: m_chunks)
+            delete[] chunk;
+    }
+
+    ConnectionTable(const ConnectionTable&) = delete;
+    ConnectionTable& operator=(const ConnectionTable&) = delete;
+
+    /**
+     * @brief add the state of a connection
+     *
+     * @param fd the socket of the connection
+     * @param state the state
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool insert(int fd, const std::shared_ptr<State>& state)
+    {
+        if (fd < 0)
+            return false;
+
+        std::unique_lock lock(m_mutex);
+        size_t chunk = (size_t)fd / CONNECTION_TABLE_CHUNK_SIZE;
+        try
+        {
+            if (chunk >= m_chunks.size())
+                m_chunks.resize(chunk + 1, nullptr);
+        }
+        catch (...)
+        {
+            return false;
+        }
+
+        if (!m_chunks[chunk])
+        {
+            m_chunks[chunk] = new (std::nothrow) Slot[CONNECTION_TABLE_CHUNK_SIZE];
+            if (!m_chunks[chunk])
+                return false;
+        }
+
+        *get_slot_unsafe(fd) = state;
+        return true;
+    }
+
+    /**
+     * @brief find the state of a connection, and lock it
+     *
+     * @param fd the socket of the connection
+     * @return std::shared_ptr<State> the state, locked, or nullptr if
+     * the connection is not in the table
+     */
+    std::shared_ptr<State> lock(int fd) const
+    {
+        std::shared_lock lock(m_mutex);
+        Slot* slot = get_slot_unsafe(fd);
+        if (!slot || !*slot)
+            return std::shared_ptr<State>(nullptr);
+
+        std::shared_ptr<State> state = *slot;
+        state->m_mutex.lock();
+        return state;
+    }
+
+    /**
+     * @brief remove the state of a connection, once nobody holds its
+     * lock
+     *
+     * @param fd the socket of the connection
+     */
+    void erase(int fd)
+    {
+        std::unique_lock lock(m_mutex);
+        Slot* slot = get_slot_unsafe(fd);
+        if (!slot || !*slot)
+            return;
+
+        std::shared_ptr<State> state;
+        state.swap(*slot);
+        state->m_mutex.lock();
+        state->m_mutex.unlock();
+    }
+};
+
+#endif /* #ifndef CONNECTION_TABLE_H_ */
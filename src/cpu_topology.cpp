@@ -0,0 +1,197 @@
+#include "cpu_topology.h"
+#include "logger.h"
+#include <charconv>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && __has_include(<linux/mempolicy.h>)
+#include <linux/mempolicy.h>
+#define HAVE_MEMPOLICY
+#endif
+
+/**
+ * @brief set once a failure to bind memory has been logged, it is
+ * then the same for every shard
+ *
+ */
+static std::atomic<bool> g_is_bind_failure_logged(false);
+
+/**
+ * @brief parse a CPU number
+ *
+ * @return true if s is a number below CPU_SETSIZE
+ */
+static bool parse_cpu(std::string_view s, int& cpu)
+{
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), cpu);
+    return std::errc() == ec && end == s.data() + s.size() && cpu >= 0 && cpu < CPU_SETSIZE;
+}
+
+bool parse_cpu_list(std::string_view list, cpu_set_t& cpus)
+{
+    CPU_ZERO(&cpus);
+
+    // The files in /sys end with a new line
+    while (!list.empty() && isspace((unsigned char)list.back()))
+        list.remove_suffix(1);
+    if (list.empty())
+        return false;
+
+    while (true)
+    {
+        size_t comma = list.find(',');
+        std::string_view entry = list.substr(0, comma);
+        size_t dash = entry.find('-');
+
+        int first;
+        int last;
+        if (!parse_cpu(entry.substr(0, dash), first))
+            return false;
+        last = first;
+        if (std::string_view::npos != dash && !parse_cpu(entry.substr(dash + 1), last))
+            return false;
+        if (last < first)
+            return false;
+
+        for (int cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &cpus);
+
+        if (std::string_view::npos == comma)
+            return true;
+        list = list.substr(comma + 1);
+    }
+}
+
+std::string format_cpu_list(const cpu_set_t& cpus)
+{
+    std::string list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &cpus))
+            continue;
+
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &cpus))
+            last++;
+
+        if (!list.empty())
+            list += ',';
+        list += std::to_string(cpu);
+        if (last > cpu)
+            list += '-' + std::to_string(last);
+        cpu = last;
+    }
+    return list;
+}
+
+CpuTopology::CpuTopology(const char* node_dir)
+{
+    if (0 != sched_getaffinity(0, sizeof(m_allowed_cpus), &m_allowed_cpus))
+    {
+        CPU_ZERO(&m_allowed_cpus);
+        long num_cpus = std::min(sysconf(_SC_NPROCESSORS_ONLN), (long)CPU_SETSIZE);
+        for (long cpu = 0; cpu < std::max(num_cpus, 1L); cpu++)
+            CPU_SET(cpu, &m_allowed_cpus);
+    }
+
+    std::vector<std::pair<int, cpu_set_t> > nodes;
+    DIR* dir = opendir(node_dir);
+    if (dir)
+    {
+        struct dirent* entry;
+        while ((entry = readdir(dir)))
+        {
+            std::string_view name(entry->d_name);
+            int node;
+            if (!name.starts_with("node") || \
+                !parse_cpu(name.substr(4), node))
+                continue;
+
+            std::ifstream in(std::string(node_dir) + "/" + entry->d_name + "/cpulist");
+            std::string line;
+            cpu_set_t cpus;
+            if (!std::getline(in, line) || !parse_cpu_list(line, cpus))
+                continue;
+
+            CPU_AND(&cpus, &cpus, &m_allowed_cpus);
+            if (!is_cpu_set_empty(cpus))
+                nodes.emplace_back(node, cpus);
+        }
+        closedir(dir);
+    }
+
+    if (nodes.empty())
+        nodes.emplace_back(0, m_allowed_cpus);
+
+    std::sort(nodes.begin(), nodes.end(),
+        [](const auto& a, const auto& b) { return a.first < b.first; });
+    for (auto& [node, cpus]: nodes)
+    {
+        m_nodes.push_back(node);
+        m_node_cpus.push_back(cpus);
+    }
+}
+
+const CpuTopology& CpuTopology::get()
+{
+    static const CpuTopology topology(CPU_TOPOLOGY_NODE_DIR);
+    return topology;
+}
+
+int CpuTopology::get_node_of_cpu(int cpu) const
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return -1;
+
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        if (CPU_ISSET(cpu, &m_node_cpus[i]))
+            return m_nodes[i];
+    }
+    return -1;
+}
+
+void CpuTopology::get_nodes_of(const cpu_set_t& cpus, std::vector<int>& nodes) const
+{
+    for (size_t i = 0; i < m_nodes.size(); i++)
+    {
+        cpu_set_t common;
+        CPU_AND(&common, &cpus, &m_node_cpus[i]);
+        if (!is_cpu_set_empty(common))
+            nodes.push_back(m_nodes[i]);
+    }
+}
+
+bool bind_memory_to_node(void* addr, size_t size, int node)
+{
+    if (node < 0)
+        return true;
+
+#ifdef HAVE_MEMPOLICY
+    if (node >= CPU_TOPOLOGY_MAX_NODES)
+        return false;
+
+    static const std::uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    std::uintptr_t start = ((std::uintptr_t)addr + page_size - 1) & ~(page_size - 1);
+    std::uintptr_t end = ((std::uintptr_t)addr + size) & ~(page_size - 1);
+    if (end <= start)
+        return true;
+
+    const size_t bits = 8 * sizeof(unsigned long);
+    unsigned long mask[CPU_TOPOLOGY_MAX_NODES / bits] = {};
+    mask[node / bits] |= 1UL << (node % bits);
+
+    // The kernel reads one bit less than it is told
+    if (0 == syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask,
+                     CPU_TOPOLOGY_MAX_NODES + 1, MPOL_MF_MOVE))
+        return true;
+
+    if (!g_is_bind_failure_logged.exchange(true))
+        LOG_WARN("Could not bind memory to NUMA node " << node << ", errno = " << errno);
+#endif
+    return false;
+}
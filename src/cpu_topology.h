@@ -0,0 +1,178 @@
+#ifndef CPU_TOPOLOGY_H_
+#define CPU_TOPOLOGY_H_
+
+#include "common_include.h"
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * @brief where the NUMA nodes and their CPUs are described
+ *
+ */
+#define CPU_TOPOLOGY_NODE_DIR "/sys/devices/system/node"
+
+/**
+ * @brief the most NUMA nodes memory can be bound to
+ *
+ */
+#define CPU_TOPOLOGY_MAX_NODES 1024
+
+/**
+ * @brief parse a list of CPUs, as given to taskset -c and found in
+ * /sys
+ *
+ * @param list comma separated CPUs and ranges of CPUs, e.g. 0-3,8
+ * @param cpus set to the CPUs
+ * @return true if the list is valid and not empty
+ */
+bool parse_cpu_list(std::string_view list, cpu_set_t& cpus);
+
+/**
+ * @brief the list of the CPUs of a set, as parse_cpu_list() takes it
+ *
+ * @param cpus the CPUs
+ * @return std::string the list, with ranges, empty for an empty set
+ */
+std::string format_cpu_list(const cpu_set_t& cpus);
+
+/**
+ * @brief whether a set of CPUs is empty, which is how a thread that
+ * may run anywhere is described
+ *
+ */
+inline bool is_cpu_set_empty(const cpu_set_t& cpus)
+{
+    return 0 == CPU_COUNT(&cpus);
+}
+
+/**
+ * @brief create a thread that runs on a set of CPUs
+ *
+ * The affinity is set before the thread starts, so that its stack and
+ * everything it first touches come from the memory of those CPUs.
+ *
+ * @param tid set to the thread
+ * @param cpus the CPUs, an empty set to let the thread run anywhere
+ * @param start_routine the function the thread runs
+ * @param arg passed to start_routine
+ * @return int 0 on success, an error number as pthread_create()
+ */
+inline int create_pinned_thread(
+    pthread_t* tid,
+    const cpu_set_t& cpus,
+    void* (*start_routine)(void*),
+    void* arg)
+{
+    if (is_cpu_set_empty(cpus))
+        return pthread_create(tid, NULL, start_routine, arg);
+
+    pthread_attr_t attr;
+    int retval = pthread_attr_init(&attr);
+    if (0 != retval)
+        return retval;
+
+    retval = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    if (0 == retval)
+        retval = pthread_create(tid, &attr, start_routine, arg);
+    pthread_attr_destroy(&attr);
+    return retval;
+}
+
+/**
+ * @brief The NUMA nodes of the machine, and the CPUs of each one
+ *
+ * The nodes are read once from CPU_TOPOLOGY_NODE_DIR, and only the
+ * CPUs the process is allowed to run on are kept, so that a cpuset or
+ * a taskset is honoured. Nodes without any such CPU, as nodes with
+ * memory only, are left out. Where there is no NUMA information, all
+ * the CPUs are one node, node 0.
+ *
+ */
+class CpuTopology
+{
+private:
+    /**
+     * @brief the ids of the nodes, in increasing order, and their CPUs
+     *
+     */
+    std::vector<int>                m_nodes;
+    std::vector<cpu_set_t>          m_node_cpus;
+
+    /**
+     * @brief the CPUs the process is allowed to run on
+     *
+     */
+    cpu_set_t                       m_allowed_cpus;
+
+public:
+    /**
+     * @brief read the topology
+     *
+     * @param node_dir the directory with a nodeN directory per node,
+     * each with a cpulist file
+     */
+    explicit CpuTopology(const char* node_dir);
+
+    /**
+     * @brief the topology of this machine, read from
+     * CPU_TOPOLOGY_NODE_DIR the first time
+     *
+     */
+    static const CpuTopology& get();
+
+    /**
+     * @brief number of nodes with CPUs the process may run on, at
+     * least 1
+     *
+     */
+    int get_num_nodes() const { return (int)m_nodes.size(); }
+
+    /**
+     * @brief the id of the i-th node, as the kernel numbers it
+     *
+     */
+    int get_node_id(int index) const { return m_nodes[index]; }
+
+    /**
+     * @brief the CPUs of the i-th node
+     *
+     */
+    const cpu_set_t& get_node_cpus(int index) const { return m_node_cpus[index]; }
+
+    const cpu_set_t& get_allowed_cpus() const { return m_allowed_cpus; }
+
+    /**
+     * @brief the id of the node of a CPU
+     *
+     * @param cpu the CPU
+     * @return int the node id, -1 if the CPU is not one the process
+     * may run on
+     */
+    int get_node_of_cpu(int cpu) const;
+
+    /**
+     * @brief the nodes that a set of CPUs spans
+     *
+     * @param cpus the CPUs
+     * @param nodes the ids of the nodes are appended here, in
+     * increasing order
+     */
+    void get_nodes_of(const cpu_set_t& cpus, std::vector<int>& nodes) const;
+};
+
+/**
+ * @brief ask for the pages of a range of memory to come from a node
+ *
+ * The policy is preferred, not strict: once the node is out of memory,
+ * pages come from the other nodes. Only the whole pages within the
+ * range are bound, and those already touched are moved there.
+ *
+ * @param addr the memory
+ * @param size its size
+ * @param node the node id, nothing is done if it is negative
+ * @return true on success
+ * @return false if the kernel does not support it
+ */
+bool bind_memory_to_node(void* addr, size_t size, int node);
+
+#endif /* #ifndef CPU_TOPOLOGY_H_ */
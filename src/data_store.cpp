@@ -1,49 +1,784 @@
 #include "data_store.h"
+#include "cpu_topology.h"
+#include <charconv>
+#include <cstring>
+#include <ctime>
 
-bool DataStore::set(const std::string& key, const std::string& value)
+/**
+ * @brief the LFU counter of a new key, so that it is not evicted
+ * before it had a chance to be read again
+ *
+ */
+#define LFU_INIT_VAL 5
+
+/**
+ * @brief how much harder it gets to bump the LFU counter as it grows
+ *
+ */
+#define LFU_LOG_FACTOR 10
+
+/**
+ * @brief the LFU counter goes down by one every that many minutes
+ * without an access
+ *
+ */
+#define LFU_DECAY_MINUTES 1
+
+/**
+ * @brief the initial capacity of the index
+ *
+ */
+#define COMPACT_MIN_SLOTS 16
+
+/**
+ * @brief a cheap random number, for eviction sampling and the LFU
+ * counter, one generator per thread since readers use it too
+ *
+ */
+static std::uint64_t next_random()
 {
-    std::unique_lock lock(m_mutex);
-    try
+    static thread_local std::uint64_t t_state = 0x9E3779B97F4A7C15ULL;
+    t_state ^= t_state << 13;
+    t_state ^= t_state >> 7;
+    t_state ^= t_state << 17;
+    return t_state;
+}
+
+/**
+ * @brief milliseconds on a clock that is cheap to read, good to a few
+ * milliseconds
+ *
+ */
+static std::uint64_t coarse_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (std::uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief the LRU clock, in units of 16ms
+ *
+ */
+static std::uint32_t lru_clock()
+{
+    return (std::uint32_t)(coarse_time_ms() >> 4);
+}
+
+/**
+ * @brief the LFU clock, in minutes, on 24 bits
+ *
+ */
+static std::uint32_t lfu_minutes()
+{
+    return (std::uint32_t)(coarse_time_ms() / 60000) & 0xffffff;
+}
+
+/**
+ * @brief the LFU counter of an access record, after its decay
+ *
+ * @param access the access record, minutes in the top 24 bits and
+ * the counter in the low 8 bits
+ * @param now lfu_minutes()
+ * @return std::uint32_t the counter
+ */
+static std::uint32_t lfu_decayed_counter(std::uint32_t access, std::uint32_t now)
+{
+    std::uint32_t counter = access & 0xff;
+    std::uint32_t elapsed = (now - (access >> 8)) & 0xffffff;
+    std::uint32_t periods = elapsed / LFU_DECAY_MINUTES;
+    return periods > counter ? 0 : counter - periods;
+}
+
+/**
+ * @brief whether a value is an integer in its canonical form, the one
+ * it would be printed back in
+ *
+ * @param value the value
+ * @param n the integer
+ * @return size_t the bytes to store it in, 0 if it is not an integer
+ */
+static size_t encode_integer(std::string_view value, std::int64_t& n)
+{
+    if (value.empty() || value.size() > 20)
+        return 0;
+
+    auto [end, ec] = std::from_chars(value.data(), value.data() + value.size(), n);
+    if (ec != std::errc() || end != value.data() + value.size())
+        return 0;
+
+    // No leading zeros, plus signs or negative zero
+    size_t digits = value[0] == '-' ? 1 : 0;
+    if (value.size() > digits + 1 && value[digits] == '0')
+        return 0;
+    if (digits && n == 0)
+        return 0;
+
+    if (n >= INT8_MIN && n <= INT8_MAX)
+        return 1;
+    if (n >= INT16_MIN && n <= INT16_MAX)
+        return 2;
+    if (n >= INT32_MIN && n <= INT32_MAX)
+        return 4;
+    return 8;
+}
+
+std::string_view CompactEntry::get_value(char* buffer)
+{
+    if (!(m_flags & COMPACT_ENTRY_INTEGER))
+        return get_stored_value();
+
+    const char* data = get_key_data() + m_key_length;
+    std::int64_t n;
+    switch (m_value_length)
     {
-        m_map[key] = value;
+    case 1: { std::int8_t v; memcpy(&v, data, 1); n = v; break; }
+    case 2: { std::int16_t v; memcpy(&v, data, 2); n = v; break; }
+    case 4: { std::int32_t v; memcpy(&v, data, 4); n = v; break; }
+    default: memcpy(&n, data, 8); break;
     }
-    catch(...)
+
+    char* end = std::to_chars(buffer, buffer + 24, n).ptr;
+    return std::string_view(buffer, end - buffer);
+}
+
+DataStore::DataStore():
+    m_slots(nullptr),
+    m_mask(0),
+    m_num_entries(0),
+    m_max_memory(0),
+    m_policy(EVICTION_NOEVICTION),
+    m_is_tracking_access(false),
+    m_num_evicted(0),
+    m_numa_node(-1)
+{
+}
+
+DataStore::~DataStore()
+{
+    if (!m_slots)
+        return;
+
+    // Large entries do not live in slabs, and have to go one by one
+    for (size_t i = 0; i <= m_mask; i++)
     {
+        if (m_slots[i].m_entry)
+            free_entry_unsafe(m_slots[i].m_entry);
+    }
+    delete[] m_slots;
+}
+
+size_t DataStore::find_unsafe(const HashedKey& key) const
+{
+    if (!m_slots)
+        return SIZE_MAX;
+
+    for (size_t i = key.m_hash & m_mask;; i = (i + 1) & m_mask)
+    {
+        const CompactSlot& slot = m_slots[i];
+        if (!slot.m_entry)
+            return SIZE_MAX;
+        if (slot.m_hash == key.m_hash && slot.m_entry->key() == key.m_key)
+            return i;
+    }
+}
+
+bool DataStore::grow_unsafe()
+{
+    size_t capacity = m_slots ? (m_mask + 1) * 2 : COMPACT_MIN_SLOTS;
+    CompactSlot* slots = new (std::nothrow) CompactSlot[capacity];
+    if (!slots)
         return false;
+
+    // Bound before it is cleared, which is when its pages are touched
+    bind_memory_to_node(slots, capacity * sizeof(CompactSlot), m_numa_node);
+    std::fill(slots, slots + capacity, CompactSlot());
+
+    size_t mask = capacity - 1;
+    if (m_slots)
+    {
+        for (size_t i = 0; i <= m_mask; i++)
+        {
+            if (!m_slots[i].m_entry)
+                continue;
+
+            size_t j = m_slots[i].m_hash & mask;
+            while (slots[j].m_entry)
+                j = (j + 1) & mask;
+            slots[j] = m_slots[i];
+        }
+        delete[] m_slots;
     }
 
+    m_slots = slots;
+    m_mask = mask;
     return true;
 }
 
-bool DataStore::del(const std::string& key)
+bool DataStore::insert_unsafe(size_t hash, CompactEntry* entry)
 {
-    std::unique_lock lock(m_mutex);
-    try
+    // Keep the load under 70%, so that probes stay short
+    if (!m_slots || (m_num_entries + 1) * 10 > (m_mask + 1) * 7)
     {
-        auto it = m_map.find(key);
-        if (it == m_map.end())
+        if (!grow_unsafe())
             return false;
-        m_map.erase(it);
+    }
+
+    size_t i = hash & m_mask;
+    while (m_slots[i].m_entry)
+        i = (i + 1) & m_mask;
+
+    m_slots[i].m_hash = hash;
+    m_slots[i].m_entry = entry;
+    m_num_entries++;
+    return true;
+}
+
+void DataStore::remove_unsafe(size_t index)
+{
+    free_entry_unsafe(m_slots[index].m_entry);
+
+    // Move back the entries after the hole whose probe sequence goes
+    // through it, so that lookups do not stop early
+    size_t hole = index;
+    for (size_t i = (index + 1) & m_mask; m_slots[i].m_entry; i = (i + 1) & m_mask)
+    {
+        size_t home = m_slots[i].m_hash & m_mask;
+        bool is_between = hole <= i ?
+                            (hole < home && home <= i) :
+                            (hole < home || home <= i);
+        if (!is_between)
+        {
+            m_slots[hole] = m_slots[i];
+            hole = i;
+        }
+    }
+
+    m_slots[hole].m_entry = nullptr;
+    m_num_entries--;
+}
+
+CompactEntry* DataStore::create_entry_unsafe(
+    std::string_view key,
+    std::string_view value,
+    std::int64_t expire_at,
+    CompactEntry* previous)
+{
+    if (key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+        return nullptr;
+
+    std::int64_t n = 0;
+    size_t integer_length = encode_integer(value, n);
+    size_t value_length = integer_length ? integer_length : value.size();
+    bool expires = EXPIRE_NEVER != expire_at;
+
+    void* memory = m_allocator.allocate(CompactEntry::get_size(key.size(), value_length, expires));
+    if (!memory)
+        return nullptr;
+
+    CompactEntry* entry = static_cast<CompactEntry*>(memory);
+    new (&entry->m_access) std::atomic<std::uint32_t>(0);
+    entry->m_key_length = (std::uint32_t)key.size();
+    entry->m_value_length = (std::uint32_t)value_length;
+    entry->m_flags = (integer_length ? COMPACT_ENTRY_INTEGER : 0) | \
+                     (expires ? COMPACT_ENTRY_EXPIRES : 0);
+
+    if (expires)
+    {
+        entry->get_expiry_fields()[0] = expire_at;
+        entry->get_expiry_fields()[1] = previous ? previous->get_timer_at() : EXPIRE_NEVER;
+    }
+
+    char* data = entry->get_key_data();
+    memcpy(data, key.data(), key.size());
+    data += key.size();
+    switch (integer_length)
+    {
+    case 0: memcpy(data, value.data(), value.size()); break;
+    case 1: { std::int8_t v = (std::int8_t)n; memcpy(data, &v, 1); break; }
+    case 2: { std::int16_t v = (std::int16_t)n; memcpy(data, &v, 2); break; }
+    case 4: { std::int32_t v = (std::int32_t)n; memcpy(data, &v, 4); break; }
+    default: memcpy(data, &n, 8); break;
+    }
+
+    if (previous)
+        entry->m_access.store(previous->m_access.load(std::memory_order_relaxed), std::memory_order_relaxed);
+    else if (m_is_tracking_access)
+        entry->m_access.store(
+            EVICTION_LFU == m_policy ? (lfu_minutes() << 8) | LFU_INIT_VAL : lru_clock(),
+            std::memory_order_relaxed);
+
+    return entry;
+}
+
+void DataStore::free_entry_unsafe(CompactEntry* entry)
+{
+    m_allocator.free(entry, entry->get_size());
+}
+
+void DataStore::touch(CompactEntry* entry) const
+{
+    if (!m_is_tracking_access)
+        return;
+
+    std::uint32_t access = entry->m_access.load(std::memory_order_relaxed);
+    std::uint32_t updated;
+    if (EVICTION_LFU == m_policy)
+    {
+        std::uint32_t now = lfu_minutes();
+        std::uint32_t counter = lfu_decayed_counter(access, now);
+        if (counter < 255)
+        {
+            double base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+            double r = (double)(next_random() >> 11) / (double)(1ULL << 53);
+            if (r < 1.0 / (base * LFU_LOG_FACTOR + 1))
+                counter++;
+        }
+        updated = (now << 8) | counter;
+    }
+    else
+        updated = lru_clock();
+
+    // Most reads do not change the record, and then the cache line
+    // is left alone
+    if (updated != access)
+        entry->m_access.store(updated, std::memory_order_relaxed);
+}
+
+void DataStore::evict_unsafe()
+{
+    std::int64_t now = unix_time_ms();
+    std::uint32_t lru_now = lru_clock();
+    std::uint32_t lfu_now = lfu_minutes();
+
+    size_t best = SIZE_MAX;
+    std::uint64_t best_score = 0;
+    size_t num_sampled = 0;
+    size_t i = next_random() & m_mask;
+    for (size_t n = 0; n <= m_mask && num_sampled < EVICTION_SAMPLES; n++, i = (i + 1) & m_mask)
+    {
+        CompactEntry* entry = m_slots[i].m_entry;
+        if (!entry)
+            continue;
+        num_sampled++;
+
+        std::int64_t expire_at = entry->get_expire_at();
+        if (EXPIRE_NEVER != expire_at && expire_at <= now)
+        {
+            // An expired key is gone already as far as clients know
+            remove_unsafe(i);
+            return;
+        }
+
+        // The higher the score, the better the candidate
+        std::uint32_t access = entry->m_access.load(std::memory_order_relaxed);
+        std::uint64_t score = EVICTION_LFU == m_policy ?
+                                255 - lfu_decayed_counter(access, lfu_now) :
+                                (std::uint32_t)(lru_now - access);
+        if (SIZE_MAX == best || score > best_score)
+        {
+            best = i;
+            best_score = score;
+        }
+    }
+
+    if (SIZE_MAX == best)
+        return;
+
+    remove_unsafe(best);
+    m_num_evicted++;
+}
+
+bool DataStore::make_room_unsafe(size_t needed)
+{
+    if (!m_max_memory)
         return true;
+
+    while (get_used_memory_unsafe() + needed > m_max_memory)
+    {
+        if (EVICTION_NOEVICTION == m_policy || !m_num_entries)
+            return false;
+        evict_unsafe();
     }
-    catch (...)
+    return true;
+}
+
+void DataStore::schedule_unsafe(CompactEntry* entry)
+{
+    std::int64_t expire_at = entry->get_expire_at();
+    if (EXPIRE_NEVER == expire_at)
+        return;
+
+    // A timer that fires earlier reschedules itself when it finds the
+    // key expires later
+    std::int64_t timer_at = entry->get_timer_at();
+    if (EXPIRE_NEVER != timer_at && timer_at <= expire_at)
+        return;
+
+    if (m_timers.add(entry->key(), expire_at, unix_time_ms()))
+        entry->get_expiry_fields()[1] = expire_at;
+}
+
+bool DataStore::set_unsafe(const HashedKey& key, std::string_view value, std::int64_t expire_at)
+{
+    // Evicting moves entries around in the index, so it is done
+    // before looking the key up. The size may be a little more than
+    // what the entry takes, if the value is an integer.
+    if (m_max_memory && !make_room_unsafe(SlabAllocator::get_chunk_size(
+            CompactEntry::get_size(key.m_key.size(), value.size(), EXPIRE_NEVER != expire_at))))
+        return false;
+
+    size_t index = find_unsafe(key);
+    CompactEntry* previous = SIZE_MAX != index ? m_slots[index].m_entry : nullptr;
+    CompactEntry* entry = create_entry_unsafe(key.m_key, value, expire_at, previous);
+    if (!entry)
+        return false;
+
+    if (previous)
+    {
+        m_slots[index].m_entry = entry;
+        free_entry_unsafe(previous);
+    }
+    else if (!insert_unsafe(key.m_hash, entry))
     {
+        free_entry_unsafe(entry);
         return false;
     }
+
+    schedule_unsafe(entry);
+    return true;
+}
+
+bool DataStore::set(const HashedKey& key, std::string_view value, std::int64_t expire_at)
+{
+    std::unique_lock lock(m_mutex);
+    return set_unsafe(key, value, expire_at);
+}
+
+bool DataStore::del(const HashedKey& key)
+{
+    std::unique_lock lock(m_mutex);
+    size_t index = find_unsafe(key);
+    if (SIZE_MAX == index)
+        return false;
+
+    bool was_live = !is_expired(m_slots[index].m_entry->get_expire_at());
+    remove_unsafe(index);
+    return was_live;
 }
 
-std::tuple<bool, std::string> DataStore::get(const std::string& key)
+std::tuple<bool, std::string> DataStore::get(const HashedKey& key)
 {
     std::shared_lock lock(m_mutex);
     try
     {
-        auto it = m_map.find(key);
-        if (it == m_map.end())
+        size_t index = find_unsafe(key);
+        if (SIZE_MAX == index)
+            return std::make_tuple(false, std::string(""));
+
+        CompactEntry* entry = m_slots[index].m_entry;
+        if (is_expired(entry->get_expire_at()))
             return std::make_tuple(false, std::string(""));
-        return std::make_tuple(true, m_map[key]);
+
+        touch(entry);
+        char buffer[24];
+        return std::make_tuple(true, std::string(entry->get_value(buffer)));
     }
     catch (...)
     {
         return std::make_tuple(false, std::string(""));
     }
-}
\ No newline at end of file
+}
+
+bool DataStore::visit_value(
+    const HashedKey& key,
+    value_visitor_t visitor,
+    void* context)
+{
+    std::shared_lock lock(m_mutex);
+    try
+    {
+        size_t index = find_unsafe(key);
+        if (SIZE_MAX == index)
+            return false;
+
+        CompactEntry* entry = m_slots[index].m_entry;
+        if (is_expired(entry->get_expire_at()))
+            return false;
+
+        touch(entry);
+        char buffer[24];
+        visitor(entry->get_value(buffer), context);
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+bool DataStore::set_expiry(
+    const HashedKey& key,
+    std::int64_t expire_at,
+    std::int64_t& previous)
+{
+    std::unique_lock lock(m_mutex);
+    size_t index = find_unsafe(key);
+    if (SIZE_MAX == index)
+        return false;
+
+    CompactEntry* entry = m_slots[index].m_entry;
+    if (is_expired(entry->get_expire_at()))
+    {
+        remove_unsafe(index);
+        return false;
+    }
+
+    previous = entry->get_expire_at();
+    if (entry->expires())
+        entry->get_expiry_fields()[0] = expire_at;
+    else if (EXPIRE_NEVER != expire_at)
+    {
+        // The entry has no room for an expiry time, it is copied into
+        // one that does
+        char buffer[24];
+        CompactEntry* copy = create_entry_unsafe(
+                                entry->key(), entry->get_value(buffer), expire_at, entry);
+        if (!copy)
+            return false;
+        m_slots[index].m_entry = copy;
+        free_entry_unsafe(entry);
+        entry = copy;
+    }
+
+    schedule_unsafe(entry);
+    return true;
+}
+
+bool DataStore::get_expiry(const HashedKey& key, std::int64_t& expire_at)
+{
+    std::shared_lock lock(m_mutex);
+    size_t index = find_unsafe(key);
+    if (SIZE_MAX == index)
+        return false;
+
+    std::int64_t entry_expire_at = m_slots[index].m_entry->get_expire_at();
+    if (is_expired(entry_expire_at))
+        return false;
+
+    expire_at = entry_expire_at;
+    return true;
+}
+
+size_t DataStore::reclaim_expired(
+    std::int64_t now,
+    size_t budget,
+    size_t& num_expired)
+{
+    std::unique_lock lock(m_mutex);
+    return m_timers.expire(now, budget,
+        [this, now, &num_expired](const std::string& name, std::int64_t time)
+        {
+            size_t index = find_unsafe(HashedKey(name));
+            if (SIZE_MAX == index)
+                return;
+
+            CompactEntry* entry = m_slots[index].m_entry;
+            if (entry->get_timer_at() != time)
+                return;
+
+            entry->get_expiry_fields()[1] = EXPIRE_NEVER;
+            std::int64_t expire_at = entry->get_expire_at();
+            if (EXPIRE_NEVER == expire_at)
+                return;
+
+            if (expire_at <= now)
+            {
+                remove_unsafe(index);
+                num_expired++;
+            }
+            else
+                schedule_unsafe(entry);
+        });
+}
+
+size_t DataStore::scan(
+    size_t cursor,
+    size_t count,
+    entry_visitor_t visitor,
+    void* context)
+{
+    std::shared_lock lock(m_mutex);
+    if (!m_slots)
+        return 0;
+
+    std::int64_t now = unix_time_ms();
+    char buffer[24];
+    for (size_t n = 0; n < count; n++)
+    {
+        // The keys of a bucket are in the cluster that starts there
+        size_t bucket = cursor & m_mask;
+        for (size_t i = bucket; m_slots[i].m_entry; i = (i + 1) & m_mask)
+        {
+            if ((m_slots[i].m_hash & m_mask) != bucket)
+                continue;
+
+            CompactEntry* entry = m_slots[i].m_entry;
+            std::int64_t expire_at = entry->get_expire_at();
+            if (EXPIRE_NEVER != expire_at && expire_at <= now)
+                continue;
+            visitor(entry->key(), entry->get_value(buffer), expire_at, context);
+        }
+
+        cursor = scan_next_cursor(cursor, m_mask);
+        if (!cursor)
+            break;
+    }
+    return cursor;
+}
+
+size_t DataStore::visit_values(
+    const HashedKey* keys,
+    const std::uint32_t* indexes,
+    size_t count,
+    indexed_value_visitor_t visitor,
+    void* context)
+{
+    size_t found = 0;
+    char buffer[24];
+    std::shared_lock lock(m_mutex);
+    for (size_t i = 0; i < count; i++)
+    {
+        try
+        {
+            size_t index = find_unsafe(keys[indexes[i]]);
+            if (SIZE_MAX == index)
+                continue;
+
+            CompactEntry* entry = m_slots[index].m_entry;
+            if (is_expired(entry->get_expire_at()))
+                continue;
+
+            touch(entry);
+            visitor(indexes[i], entry->get_value(buffer), context);
+            found++;
+        }
+        catch (...)
+        {
+        }
+    }
+    return found;
+}
+
+size_t DataStore::set_values(
+    const HashedKey* keys,
+    const std::string_view* values,
+    const std::uint32_t* indexes,
+    size_t count,
+    std::uint32_t* set_indexes)
+{
+    std::unique_lock lock(m_mutex);
+    return set_values_unsafe(keys, values, indexes, count, set_indexes);
+}
+
+void DataStore::lock_writes()
+{
+    m_mutex.lock();
+}
+
+void DataStore::unlock_writes()
+{
+    m_mutex.unlock();
+}
+
+bool DataStore::make_room_for_values_unsafe(
+    const HashedKey* keys,
+    const std::string_view* values,
+    const std::uint32_t* indexes,
+    size_t count)
+{
+    if (!m_max_memory)
+        return true;
+
+    size_t needed = 0;
+    for (size_t i = 0; i < count; i++)
+        needed += SlabAllocator::get_chunk_size(CompactEntry::get_size(
+            keys[indexes[i]].m_key.size(), values[indexes[i]].size(), false));
+
+    // The index doubles as in insert_unsafe(), and the old one is
+    // freed right after
+    size_t capacity = m_slots ? m_mask + 1 : 0;
+    size_t new_capacity = capacity;
+    while (!new_capacity || (m_num_entries + count) * 10 > new_capacity * 7)
+        new_capacity = new_capacity ? new_capacity * 2 : COMPACT_MIN_SLOTS;
+    if (new_capacity > capacity)
+        needed += (new_capacity - capacity) * sizeof(CompactSlot);
+
+    // A batch that cannot fit anyway does not evict everything first
+    if (needed > m_max_memory)
+        return false;
+    return make_room_unsafe(needed);
+}
+
+size_t DataStore::set_values_unsafe(
+    const HashedKey* keys,
+    const std::string_view* values,
+    const std::uint32_t* indexes,
+    size_t count,
+    std::uint32_t* set_indexes)
+{
+    size_t num_set = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (set_unsafe(keys[indexes[i]], values[indexes[i]], EXPIRE_NEVER))
+            set_indexes[num_set++] = indexes[i];
+    }
+    return num_set;
+}
+
+size_t DataStore::del_keys(
+    const HashedKey* keys,
+    const std::uint32_t* indexes,
+    size_t count,
+    std::uint32_t* deleted_indexes)
+{
+    size_t deleted = 0;
+    std::unique_lock lock(m_mutex);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t index = find_unsafe(keys[indexes[i]]);
+        if (SIZE_MAX == index)
+            continue;
+        if (!is_expired(m_slots[index].m_entry->get_expire_at()))
+            deleted_indexes[deleted++] = indexes[i];
+        remove_unsafe(index);
+    }
+    return deleted;
+}
+
+void DataStore::set_memory_limit(size_t max_memory, eviction_policy_t policy)
+{
+    std::unique_lock lock(m_mutex);
+    m_max_memory = max_memory;
+    m_policy = policy;
+    m_is_tracking_access = max_memory && EVICTION_NOEVICTION != policy;
+}
+
+void DataStore::set_numa_node(int node)
+{
+    std::unique_lock lock(m_mutex);
+    m_numa_node = node;
+    m_allocator.set_numa_node(node);
+}
+
+size_t DataStore::get_used_memory()
+{
+    std::shared_lock lock(m_mutex);
+    return get_used_memory_unsafe();
+}
+
+std::uint64_t DataStore::get_num_evicted()
+{
+    std::shared_lock lock(m_mutex);
+    return m_num_evicted;
+}
@@ -2,34 +2,626 @@
 #define DATA_STORE_H_
 
 #include "common_include.h"
+#include "timer_wheel.h"
+#include "slab_allocator.h"
+#include <array>
 
 /**
- * @brief This class implements a data store. In essence
- * this is a hash table, with synchronization added
- * for thread safety.
+ * @brief the expiry time of a key that does not expire
  * 
- * The orchestrator maintains an array of several of these
- * for even greater parallelism.
+ */
+#define EXPIRE_NEVER 0
+
+/**
+ * @brief whether a key with a given expiry time has expired
+ * 
+ * The clock is only read for keys that do expire.
  * 
+ * @param expire_at unix time in ms, or EXPIRE_NEVER
+ * @return true if the key has expired
+ * @return false otherwise
  */
-class DataStore
+inline bool is_expired(std::int64_t expire_at)
+{
+    return EXPIRE_NEVER != expire_at && expire_at <= unix_time_ms();
+}
+
+/**
+ * @brief hash a key
+ * 
+ * This is the hash used both to pick the DataStore a key lives in,
+ * and by the index inside the DataStore
+ * 
+ * @param key the key
+ * @return size_t the hash value
+ */
+inline size_t hash_key(std::string_view key)
+{
+    return std::hash<std::string_view>()(key);
+}
+
+/**
+ * @brief number of hash slots, as in Redis Cluster
+ * 
+ */
+#define CLUSTER_SLOTS 16384
+
+/**
+ * @brief the table of the CRC16-CCITT (XMODEM) of every byte
+ * 
+ */
+inline constexpr auto CRC16_TABLE = []()
+{
+    std::array<std::uint16_t, 256> table = {};
+    for (int i = 0; i < 256; i++)
+    {
+        std::uint16_t crc = (std::uint16_t)(i << 8);
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 0x8000) ? (std::uint16_t)((crc << 1) ^ 0x1021) : (std::uint16_t)(crc << 1);
+        table[i] = crc;
+    }
+    return table;
+}();
+
+/**
+ * @brief the CRC16 Redis Cluster hashes the keys with
+ * 
+ */
+inline std::uint16_t crc16(std::string_view data)
+{
+    std::uint16_t crc = 0;
+    for (unsigned char c: data)
+        crc = (std::uint16_t)(crc << 8) ^ CRC16_TABLE[((crc >> 8) ^ c) & 0xff];
+    return crc;
+}
+
+/**
+ * @brief the hash slot of a key, the same as in Redis Cluster
+ * 
+ * If the key has a non empty hash tag, the part between the first
+ * '{' and the next '}', only the tag is hashed, so that related keys
+ * can be put in the same slot.
+ * 
+ * @param key the key
+ * @return std::uint16_t the slot, below CLUSTER_SLOTS
+ */
+inline std::uint16_t get_key_slot(std::string_view key)
+{
+    size_t open = key.find('{');
+    if (std::string_view::npos != open)
+    {
+        size_t close = key.find('}', open + 1);
+        if (std::string_view::npos != close && close != open + 1)
+            key = key.substr(open + 1, close - open - 1);
+    }
+    return crc16(key) & (CLUSTER_SLOTS - 1);
+}
+
+/**
+ * @brief A key together with its hash and its slot
+ * 
+ * The hash and the slot are computed once when the key is received,
+ * and are then reused for routing the key in a cluster, for picking
+ * the DataStore and for the lookup in its map. The key is not copied,
+ * so the underlying string must outlive this object.
+ * 
+ */
+struct HashedKey
 {
-private:
     /**
-     * @brief The hash map for key-value pairs
-     * keys are strings, and values are serialized
-     * RESP objects
+     * @brief the key
      * 
      */
-    std::unordered_map<std::string, std::string>    m_map;
+    std::string_view        m_key;
 
     /**
-     * @brief the mutex to serialize the hash table
+     * @brief hash_key() of the key
      * 
      */
-    mutable std::shared_mutex                       m_mutex;
+    size_t                  m_hash;
+
+    /**
+     * @brief get_key_slot() of the key
+     * 
+     */
+    std::uint16_t           m_slot;
+
+    explicit HashedKey(std::string_view key):
+        m_key(key),
+        m_hash(hash_key(key)),
+        m_slot(get_key_slot(key))
+    {
+    }
+};
+
+/**
+ * @brief the data store the keys of a slot live in
+ * 
+ * All the keys of a slot are in the same data store, so that a slot
+ * can be walked, and moved to another node, one data store at a time.
+ * The slot is independent from the hash that selects the bucket
+ * inside the data store.
+ * 
+ * @param slot the slot
+ * @param num_datastores the number of data stores, a power of two no
+ * larger than CLUSTER_SLOTS
+ * @return size_t the index of the data store
+ */
+inline size_t get_slot_partition(std::uint16_t slot, size_t num_datastores)
+{
+    return slot & (num_datastores - 1);
+}
+
+/**
+ * @brief the data store a key lives in, from the slot of the key
+ * 
+ * @param key the key
+ * @param num_datastores the number of data stores, a power of two no
+ * larger than CLUSTER_SLOTS
+ * @return size_t the index of the data store
+ */
+inline size_t get_partition(const HashedKey& key, size_t num_datastores)
+{
+    return get_slot_partition(key.m_slot, num_datastores);
+}
+
+/**
+ * @brief reverse the bits of a 64 bit value
+ * 
+ */
+inline std::uint64_t reverse_bits(std::uint64_t v)
+{
+    v = __builtin_bswap64(v);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0fULL) | ((v & 0x0f0f0f0f0f0f0f0fULL) << 4);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    return v;
+}
+
+/**
+ * @brief the cursor of scan() after the bucket at a cursor
+ * 
+ * Buckets are visited in the order of the reversed bits of their
+ * index. When a table doubles, bucket b splits into b and b + size,
+ * which both come after the cursor of b if b had not been visited,
+ * and both before it otherwise, so that a scan across growing tables
+ * still sees every key at least once.
+ * 
+ * @param cursor the current cursor
+ * @param mask the number of buckets minus one
+ * @return size_t the next cursor, 0 once all buckets were visited
+ */
+inline size_t scan_next_cursor(size_t cursor, size_t mask)
+{
+    cursor |= ~mask;
+    cursor = reverse_bits(cursor);
+    cursor++;
+    return reverse_bits(cursor);
+}
+
+/**
+ * @brief called with a value while the data store keeps it alive
+ * 
+ * The view is only valid for the duration of the call, the callback
+ * must copy whatever it needs, and must not call back into the
+ * data store.
+ * 
+ * @param value the value
+ * @param context the context given along with the callback
+ */
+typedef void (*value_visitor_t)(std::string_view value, void* context);
+
+/**
+ * @brief called with a value of a batch lookup, along with the
+ * index of its key
+ * 
+ * The same rules as for value_visitor_t apply.
+ * 
+ * @param index the index of the key in the batch
+ * @param value the value
+ * @param context the context given along with the callback
+ */
+typedef void (*indexed_value_visitor_t)(
+    std::uint32_t index,
+    std::string_view value,
+    void* context);
 
+/**
+ * @brief called with every key of a scan()
+ * 
+ * The same rules as for value_visitor_t apply.
+ * 
+ * @param key the key
+ * @param value the value
+ * @param expire_at unix time in ms at which the key expires, or
+ * EXPIRE_NEVER
+ * @param context the context given along with the callback
+ */
+typedef void (*entry_visitor_t)(
+    std::string_view key,
+    std::string_view value,
+    std::int64_t expire_at,
+    void* context);
+
+/**
+ * @brief What a data store does once its memory limit is reached
+ * 
+ */
+typedef enum
+{
+    /**
+     * @brief writes that need more memory fail
+     * 
+     */
+    EVICTION_NOEVICTION,
+    /**
+     * @brief evict the least recently used of a few sampled keys
+     * 
+     */
+    EVICTION_LRU,
+    /**
+     * @brief evict the least frequently used of a few sampled keys
+     * 
+     */
+    EVICTION_LFU
+} eviction_policy_t;
+
+/**
+ * @brief number of keys sampled to pick one to evict
+ * 
+ */
+#define EVICTION_SAMPLES 5
+
+/**
+ * @brief All data store variants derive from this class, so that
+ * the orchestrator can use any of them interchangeably
+ * 
+ * Keys and values are byte strings, the contents of the bulk strings
+ * of the commands, without their RESP framing. A data store may
+ * encode a value in a more compact form, visitors always get the
+ * bytes back.
+ * 
+ */
+class DataStoreInterface
+{
 public:
+    /**
+     * @brief set a key-value
+     * 
+     * @param key
+     * @param value 
+     * @param expire_at unix time in ms at which the key expires, or
+     * EXPIRE_NEVER
+     * @return true success
+     * @return false failure
+     */
+    virtual bool set(
+        const HashedKey& key,
+        std::string_view value,
+        std::int64_t expire_at) = 0;
+
+    /**
+     * @brief delete a key
+     * 
+     * @param key 
+     * @return true success
+     * @return false failure
+     */
+    virtual bool del(const HashedKey& key) = 0;
+
+    /**
+     * @brief fetch a value for a key
+     * 
+     * @param key 
+     * @return std::tuple<bool, std::string> 
+     * A tuple containing
+     * 1. whether the key was found or not
+     * 2. The value
+     */
+    virtual std::tuple<bool, std::string> get(const HashedKey& key) = 0;
+
+    /**
+     * @brief look up a key once, and hand its value to a callback
+     * without copying it
+     * 
+     * The value stays pinned, by a lock or by an epoch, while the
+     * callback runs.
+     * 
+     * @param key 
+     * @param visitor called with the value, if found
+     * @param context passed to the visitor as it is
+     * @return true if the key was found
+     * @return false otherwise
+     */
+    virtual bool visit_value(
+        const HashedKey& key,
+        value_visitor_t visitor,
+        void* context) = 0;
+
+    /**
+     * @brief change the expiry time of a key
+     * 
+     * @param key 
+     * @param expire_at unix time in ms at which the key expires, or
+     * EXPIRE_NEVER to keep it for good
+     * @param previous set to the expiry time the key had
+     * @return true if the key was found
+     * @return false otherwise
+     */
+    virtual bool set_expiry(
+        const HashedKey& key,
+        std::int64_t expire_at,
+        std::int64_t& previous) = 0;
+
+    /**
+     * @brief fetch the expiry time of a key
+     * 
+     * @param key 
+     * @param expire_at set to the unix time in ms at which the key
+     * expires, or EXPIRE_NEVER
+     * @return true if the key was found
+     * @return false otherwise
+     */
+    virtual bool get_expiry(const HashedKey& key, std::int64_t& expire_at) = 0;
+
+    /**
+     * @brief delete keys whose expiry time has passed
+     * 
+     * Keys that expired are never seen again, but only deleted by a
+     * write to them, or by this. The work done, and so the time the
+     * data store is locked for, is bounded by the budget.
+     * 
+     * @param now the current unix time in ms
+     * @param budget the most work to do
+     * @param num_expired incremented for every key deleted
+     * @return size_t the work done, budget if there may be more
+     */
+    virtual size_t reclaim_expired(
+        std::int64_t now,
+        size_t budget,
+        size_t& num_expired) = 0;
+
+    /**
+     * @brief visit a few buckets of the data store
+     * 
+     * The data store is only locked for the buckets visited by one
+     * call, so that a walk over all the keys does not hold up the
+     * requests. A key that is present during the whole walk is
+     * visited at least once, and may be visited twice if the table
+     * grows in between. Keys written during the walk may or may not
+     * be visited. Expired keys are skipped.
+     * 
+     * @param cursor 0 for the first call, then the cursor returned by
+     * the previous one
+     * @param count the number of buckets to visit
+     * @param visitor called with every key
+     * @param context passed to the visitor
+     * @return size_t the cursor for the next call, 0 once the walk
+     * is done
+     */
+    virtual size_t scan(
+        size_t cursor,
+        size_t count,
+        entry_visitor_t visitor,
+        void* context) = 0;
+
+    /**
+     * @brief look up several keys, and hand each value found to a
+     * callback
+     * 
+     * The keys used are keys[indexes[0]] ... keys[indexes[count - 1]],
+     * in that order. Data stores override this to pin their values
+     * and take their locks once for the whole batch.
+     * 
+     * @param keys the keys of the batch
+     * @param indexes the indexes in keys of the keys to look up
+     * @param count the number of indexes
+     * @param visitor called with the index and the value of every key
+     * that is found
+     * @param context passed to the visitor as it is
+     * @return size_t the number of keys found
+     */
+    virtual size_t visit_values(
+        const HashedKey* keys,
+        const std::uint32_t* indexes,
+        size_t count,
+        indexed_value_visitor_t visitor,
+        void* context)
+    {
+        struct IndexedVisit
+        {
+            std::uint32_t               m_index;
+            indexed_value_visitor_t     m_visitor;
+            void*                       m_context;
+        };
+
+        size_t found = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            IndexedVisit visit = {indexes[i], visitor, context};
+            if (visit_value(
+                    keys[indexes[i]],
+                    [](std::string_view value, void* context)
+                    {
+                        auto visit = static_cast<IndexedVisit*>(context);
+                        visit->m_visitor(visit->m_index, value, visit->m_context);
+                    },
+                    &visit))
+                found++;
+        }
+        return found;
+    }
+
+    /**
+     * @brief set several key-values that do not expire, in the order
+     * of indexes, so that the last value of a key repeated in the
+     * batch wins
+     * 
+     * @param keys the keys of the batch
+     * @param values the values, values[i] goes with keys[i]
+     * @param indexes the indexes in keys of the pairs to set
+     * @param count the number of indexes
+     * @param set_indexes the indexes of the pairs that were set are
+     * stored here, in the order of indexes, room for count of them
+     * @return size_t the number of pairs that were set
+     */
+    virtual size_t set_values(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* set_indexes)
+    {
+        size_t num_set = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (set(keys[indexes[i]], values[indexes[i]]))
+                set_indexes[num_set++] = indexes[i];
+        }
+        return num_set;
+    }
+
+    /**
+     * @brief keep the other threads from writing to the data store, so
+     * that a batch can be checked against several data stores before
+     * it is set in any of them
+     * 
+     * A thread that holds the writes of several data stores takes
+     * them in increasing order of their partitions.
+     * 
+     */
+    virtual void lock_writes() = 0;
+
+    virtual void unlock_writes() = 0;
+
+    /**
+     * @brief make room for several key-values that do not expire,
+     * evicting keys if the policy allows it, with lock_writes() held
+     * 
+     * Every pair is counted as a new key, and the growth of the index
+     * as well, so that set_values_unsafe() cannot run out of room.
+     * 
+     * @param keys the keys of the batch
+     * @param values the values, values[i] goes with keys[i]
+     * @param indexes the indexes in keys of the pairs to set
+     * @param count the number of indexes
+     * @return true if the pairs fit within the memory limit
+     * @return false otherwise, nothing is evicted then with
+     * EVICTION_NOEVICTION
+     */
+    virtual bool make_room_for_values_unsafe(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count) = 0;
+
+    /**
+     * @brief set_values(), with lock_writes() held
+     * 
+     */
+    virtual size_t set_values_unsafe(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* set_indexes) = 0;
+
+    /**
+     * @brief delete several keys
+     * 
+     * @param keys the keys of the batch
+     * @param indexes the indexes in keys of the keys to delete
+     * @param count the number of indexes
+     * @param deleted_indexes the indexes of the keys that were deleted
+     * are stored here, in the order of indexes, room for count of them
+     * @return size_t the number of keys that were present, and deleted
+     */
+    virtual size_t del_keys(
+        const HashedKey* keys,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* deleted_indexes)
+    {
+        size_t deleted = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (del(keys[indexes[i]]))
+                deleted_indexes[deleted++] = indexes[i];
+        }
+        return deleted;
+    }
+
+    /**
+     * @brief cap the memory used by the data store
+     * 
+     * Must be called before the data store is shared with other
+     * threads.
+     * 
+     * @param max_memory the most bytes used by keys, values and the
+     * index, 0 for no limit
+     * @param policy what to do once the limit is reached
+     */
+    virtual void set_memory_limit(size_t max_memory, eviction_policy_t policy) = 0;
+
+    /**
+     * @brief take the memory of the data store from a NUMA node, as
+     * far as the node has some
+     * 
+     * Must be called before the first key is set.
+     * 
+     * @param node the node id, -1 for any
+     */
+    virtual void set_numa_node(int node) = 0;
+
+    /**
+     * @brief bytes used by keys, values and the index
+     * 
+     */
+    virtual size_t get_used_memory() = 0;
+
+    /**
+     * @brief number of keys evicted to stay within the memory limit
+     * 
+     */
+    virtual std::uint64_t get_num_evicted() = 0;
+
+    virtual ~DataStoreInterface() {}
+
+    /**
+     * @brief fetch the value for a key, and append it to a buffer
+     * 
+     * This avoids copying the value into a temporary, the bytes
+     * go straight from the hash table to the output.
+     * 
+     * @param key 
+     * @param output the value is appended here, if found
+     * @return true if the key was found
+     * @return false otherwise
+     */
+    bool append_value(const HashedKey& key, std::string& output)
+    {
+        return visit_value(
+            key,
+            [](std::string_view value, void* context)
+            {
+                static_cast<std::string*>(context)->append(value);
+            },
+            &output);
+    }
+
+    /**
+     * @brief set a key-value that does not expire
+     * 
+     * @param key
+     * @param value 
+     * @return true success
+     * @return false failure
+     */
+    bool set(const HashedKey& key, std::string_view value)
+    {
+        return set(key, value, EXPIRE_NEVER);
+    }
+
     /**
      * @brief set a key-value
      * 
@@ -38,7 +630,10 @@ public:
      * @return true success
      * @return false failure
      */
-    bool set(const std::string& key, const std::string& value);
+    bool set(std::string_view key, std::string_view value)
+    {
+        return set(HashedKey(key), value);
+    }
 
     /**
      * @brief delete a key
@@ -47,7 +642,10 @@ public:
      * @return true success
      * @return false failure
      */
-    bool del(const std::string& key);
+    bool del(std::string_view key)
+    {
+        return del(HashedKey(key));
+    }
 
     /**
      * @brief fetch a value for a key
@@ -58,7 +656,23 @@ public:
      * 1. whether the key was found or not
      * 2. The value
      */
-    std::tuple<bool, std::string> get(const std::string& key);
+    std::tuple<bool, std::string> get(std::string_view key)
+    {
+        return get(HashedKey(key));
+    }
+
+    /**
+     * @brief fetch the value for a key, and append it to a buffer
+     * 
+     * @param key 
+     * @param output the value is appended here, if found
+     * @return true if the key was found
+     * @return false otherwise
+     */
+    bool append_value(std::string_view key, std::string& output)
+    {
+        return append_value(HashedKey(key), output);
+    }
 
     /**
      * @brief Set a key value pair
@@ -70,7 +684,7 @@ public:
      */
     bool set(const char* key, const char* value)
     {
-        return set(std::string(key), std::string(value));
+        return set(std::string_view(key), std::string_view(value));
     }
 
     /**
@@ -82,7 +696,7 @@ public:
      */
     bool del(const char* key)
     {
-        return del(std::string(key));
+        return del(std::string_view(key));
     }
 
     /**
@@ -96,8 +710,425 @@ public:
      */
     std::tuple<bool, std::string> get(const char* key)
     {
-        return get(std::string(key));
+        return get(std::string_view(key));
+    }
+};
+
+/**
+ * @brief flags of a CompactEntry
+ * 
+ */
+#define COMPACT_ENTRY_INTEGER   0x1
+#define COMPACT_ENTRY_EXPIRES   0x2
+
+/**
+ * @brief A key-value pair in a DataStore
+ * 
+ * The key and the value are stored right after this header, in a
+ * single chunk of the slab allocator of the DataStore. Values that
+ * are integers in their canonical form are stored as 1, 2, 4 or 8
+ * byte integers, and turned back into digits when they are read.
+ * 
+ * Only keys with an expiry time have room for it: two 64 bit fields,
+ * the expiry time and the time of the timer that will look at the
+ * key, sit between the header and the key.
+ * 
+ */
+struct CompactEntry
+{
+    /**
+     * @brief when the key was last used, or how often, for eviction.
+     * Updated by readers, whatever they race with is close enough.
+     * 
+     */
+    std::atomic<std::uint32_t>  m_access;
+
+    std::uint32_t               m_key_length;
+
+    /**
+     * @brief length of the stored value, the width of an integer
+     * 
+     */
+    std::uint32_t               m_value_length;
+
+    /**
+     * @brief COMPACT_ENTRY_* flags
+     * 
+     */
+    std::uint8_t                m_flags;
+
+    bool expires() const { return m_flags & COMPACT_ENTRY_EXPIRES; }
+
+    std::int64_t* get_expiry_fields()
+    {
+        return reinterpret_cast<std::int64_t*>(this + 1);
+    }
+
+    /**
+     * @brief unix time in ms at which the key expires, or EXPIRE_NEVER
+     * 
+     */
+    std::int64_t get_expire_at()
+    {
+        return expires() ? get_expiry_fields()[0] : EXPIRE_NEVER;
+    }
+
+    /**
+     * @brief the time of the timer that will look at the key next, or
+     * EXPIRE_NEVER
+     * 
+     */
+    std::int64_t get_timer_at()
+    {
+        return expires() ? get_expiry_fields()[1] : EXPIRE_NEVER;
     }
+
+    char* get_key_data()
+    {
+        return reinterpret_cast<char*>(this + 1) + \
+            (expires() ? 2 * sizeof(std::int64_t) : 0);
+    }
+
+    std::string_view key()
+    {
+        return std::string_view(get_key_data(), m_key_length);
+    }
+
+    /**
+     * @brief the stored bytes of the value, in their encoding
+     * 
+     */
+    std::string_view get_stored_value()
+    {
+        return std::string_view(get_key_data() + m_key_length, m_value_length);
+    }
+
+    /**
+     * @brief the value
+     * 
+     * @param buffer room for the digits of an integer, at least 24
+     * bytes, the value may point into it
+     * @return std::string_view the value
+     */
+    std::string_view get_value(char* buffer);
+
+    /**
+     * @brief the size of the entry
+     * 
+     */
+    size_t get_size() const
+    {
+        return get_size(m_key_length, m_value_length, m_flags & COMPACT_ENTRY_EXPIRES);
+    }
+
+    static size_t get_size(size_t key_length, size_t value_length, bool expires)
+    {
+        return sizeof(CompactEntry) + (expires ? 2 * sizeof(std::int64_t) : 0) + \
+            key_length + value_length;
+    }
+};
+
+/**
+ * @brief A slot of the index of a DataStore
+ * 
+ */
+struct CompactSlot
+{
+    /**
+     * @brief hash_key() of the key
+     * 
+     */
+    size_t                      m_hash;
+
+    /**
+     * @brief the entry, nullptr if the slot is empty
+     * 
+     */
+    CompactEntry*               m_entry;
+};
+
+/**
+ * @brief This class implements a data store. In essence
+ * this is a hash table, with synchronization added
+ * for thread safety.
+ * 
+ * The index is an open addressing table with linear probing, whose
+ * slots hold the hash and a pointer to an entry. Deleting shifts the
+ * following entries back, so there are no tombstones. Entries are
+ * CompactEntry's, carved from slabs, so a key-value pair costs its
+ * bytes, a small header and a slot, rather than a map node and two
+ * strings.
+ * 
+ * With a memory limit, writes that would go over it first evict keys:
+ * a few consecutive slots, from a random place, make up the sample,
+ * and the key that was used the least recently, or the least often,
+ * goes. Expired keys always go first.
+ * 
+ * The orchestrator maintains an array of several of these
+ * for even greater parallelism. Each one is aligned to a cache
+ * line, so that the locks of neighbouring data stores do not
+ * share a cache line.
+ * 
+ */
+class alignas(CACHE_LINE_SIZE) DataStore: public DataStoreInterface
+{
+private:
+    /**
+     * @brief the index, nullptr until the first key is set
+     * 
+     */
+    CompactSlot*                                    m_slots;
+
+    /**
+     * @brief capacity of m_slots minus one, the capacity is a power
+     * of two
+     * 
+     */
+    size_t                                          m_mask;
+
+    /**
+     * @brief number of keys, whether they expired or not
+     * 
+     */
+    size_t                                          m_num_entries;
+
+    /**
+     * @brief where the entries come from
+     * 
+     */
+    SlabAllocator                                   m_allocator;
+
+    /**
+     * @brief the timers of the keys that expire
+     * 
+     */
+    TimerWheel                                      m_timers;
+
+    /**
+     * @brief the memory limit, 0 if there is none
+     * 
+     */
+    size_t                                          m_max_memory;
+
+    eviction_policy_t                               m_policy;
+
+    /**
+     * @brief whether readers record their accesses, for eviction
+     * 
+     */
+    bool                                            m_is_tracking_access;
+
+    std::uint64_t                                   m_num_evicted;
+
+    /**
+     * @brief the node the index and the slabs come from, -1 for any
+     * 
+     */
+    int                                             m_numa_node;
+
+    /**
+     * @brief the mutex to serialize the hash table and the timers
+     * 
+     */
+    mutable std::shared_mutex                       m_mutex;
+
+    /**
+     * @brief find the slot of a key
+     * Read or write lock must be held by the caller.
+     * 
+     * @param key the key
+     * @return size_t the index of the slot, SIZE_MAX if the key is
+     * not present
+     */
+    size_t find_unsafe(const HashedKey& key) const;
+
+    /**
+     * @brief publish the entry of a key that is not present
+     * Write lock must be held by the caller.
+     * 
+     * @param hash the hash of the key
+     * @param entry the entry
+     * @return true on success
+     * @return false if out of memory, the entry is then not owned by
+     * the table
+     */
+    bool insert_unsafe(size_t hash, CompactEntry* entry);
+
+    /**
+     * @brief delete the entry of a slot, and shift back the entries
+     * that follow it
+     * Write lock must be held by the caller.
+     * 
+     * @param index the slot
+     */
+    void remove_unsafe(size_t index);
+
+    /**
+     * @brief double the capacity of the index
+     * Write lock must be held by the caller.
+     * 
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool grow_unsafe();
+
+    /**
+     * @brief allocate an entry
+     * Write lock must be held by the caller.
+     * 
+     * @param key the key
+     * @param value the value, stored as an integer if it is one
+     * @param expire_at unix time in ms at which the key expires, or
+     * EXPIRE_NEVER
+     * @param previous the entry it replaces, whose access record and
+     * timer carry over, or nullptr
+     * @return CompactEntry* the entry, nullptr if out of memory
+     */
+    CompactEntry* create_entry_unsafe(
+        std::string_view key,
+        std::string_view value,
+        std::int64_t expire_at,
+        CompactEntry* previous);
+
+    /**
+     * @brief free an entry
+     * Write lock must be held by the caller.
+     * 
+     * @param entry the entry
+     */
+    void free_entry_unsafe(CompactEntry* entry);
+
+    /**
+     * @brief set a key-value
+     * Write lock must be held by the caller.
+     * 
+     * @return true on success
+     * @return false if out of memory, or over the memory limit
+     */
+    bool set_unsafe(const HashedKey& key, std::string_view value, std::int64_t expire_at);
+
+    /**
+     * @brief make sure a timer looks at a key by its expiry time
+     * Write lock must be held by the caller.
+     * 
+     * @param entry the entry of the key
+     */
+    void schedule_unsafe(CompactEntry* entry);
+
+    /**
+     * @brief evict keys until there is room for more bytes
+     * Write lock must be held by the caller.
+     * 
+     * @param needed the bytes about to be allocated
+     * @return true if they fit within the memory limit
+     * @return false otherwise
+     */
+    bool make_room_unsafe(size_t needed);
+
+    /**
+     * @brief evict the best candidate of a sample of keys
+     * Write lock must be held by the caller.
+     * 
+     */
+    void evict_unsafe();
+
+    /**
+     * @brief record a read of an entry, for eviction
+     * 
+     * @param entry the entry
+     */
+    void touch(CompactEntry* entry) const;
+
+    size_t get_used_memory_unsafe() const
+    {
+        return m_allocator.get_used() + (m_slots ? (m_mask + 1) * sizeof(CompactSlot) : 0);
+    }
+
+public:
+    using DataStoreInterface::set;
+    using DataStoreInterface::del;
+    using DataStoreInterface::get;
+
+    DataStore();
+
+    ~DataStore();
+
+    DataStore(const DataStore&) = delete;
+    DataStore& operator=(const DataStore&) = delete;
+
+    bool set(const HashedKey& key, std::string_view value, std::int64_t expire_at);
+
+    bool del(const HashedKey& key);
+
+    std::tuple<bool, std::string> get(const HashedKey& key);
+
+    bool visit_value(
+        const HashedKey& key,
+        value_visitor_t visitor,
+        void* context);
+
+    bool set_expiry(
+        const HashedKey& key,
+        std::int64_t expire_at,
+        std::int64_t& previous);
+
+    bool get_expiry(const HashedKey& key, std::int64_t& expire_at);
+
+    size_t reclaim_expired(
+        std::int64_t now,
+        size_t budget,
+        size_t& num_expired);
+
+    size_t scan(
+        size_t cursor,
+        size_t count,
+        entry_visitor_t visitor,
+        void* context);
+
+    size_t visit_values(
+        const HashedKey* keys,
+        const std::uint32_t* indexes,
+        size_t count,
+        indexed_value_visitor_t visitor,
+        void* context);
+
+    size_t set_values(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* set_indexes);
+
+    void lock_writes();
+
+    void unlock_writes();
+
+    bool make_room_for_values_unsafe(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count);
+
+    size_t set_values_unsafe(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* set_indexes);
+
+    size_t del_keys(
+        const HashedKey* keys,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* deleted_indexes);
+
+    void set_memory_limit(size_t max_memory, eviction_policy_t policy);
+
+    void set_numa_node(int node);
+
+    size_t get_used_memory();
+
+    std::uint64_t get_num_evicted();
 };
 
-#endif /* #ifndef DATA_STORE_H_ */
\ No newline at end of file
+#endif /* #ifndef DATA_STORE_H_ */
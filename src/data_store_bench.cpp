@@ -0,0 +1,86 @@
+#include <chrono>
+#include <cstdlib>
+#include "data_store.h"
+#include "read_optimized_store.h"
+#include "key_generator.h"
+
+/**
+ * @brief distinct keys in every measurement
+ *
+ */
+#define BENCH_KEYS 100000
+
+/**
+ * @brief operations run by each thread in a measurement
+ *
+ */
+#define BENCH_OPS_PER_THREAD 500000
+
+/**
+ * @brief keeps the compiler from optimizing the measured work away
+ *
+ */
+static volatile size_t g_sink;
+
+template <typename Store>
+void bench_store(
+    const char* name,
+    int num_threads,
+    int get_percent,
+    key_distribution_t distribution)
+{
+    Store store;
+    std::vector<std::string> keys;
+    for (int i = 0; i < BENCH_KEYS; i++)
+        keys.push_back("key:" + std::to_string(i));
+
+    // Values are stored without their RESP framing, as the server does
+    std::string value(16, 'x');
+    for (auto& key: keys)
+        store.set(HashedKey(key), value);
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++)
+        threads.emplace_back([&, t]() {
+            KeyGenerator generator(distribution, BENCH_KEYS, 0.99, 0x9876 + t);
+            FastRandom& random = generator.get_random();
+            size_t found = 0;
+            size_t bytes = 0;
+            for (int i = 0; i < BENCH_OPS_PER_THREAD; i++)
+            {
+                HashedKey key(keys[generator.next()]);
+                if ((int)(random.next() % 100) < get_percent)
+                    found += store.visit_value(key,
+                        [](std::string_view v, void* context) {
+                            *static_cast<size_t*>(context) += v.size();
+                        }, &bytes);
+                else
+                    store.set(key, value);
+            }
+            g_sink = found + bytes;
+        });
+    for (auto& thread: threads)
+        thread.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << name << ", " << num_threads << " threads, " << get_percent \
+        << "% gets, " << (KEY_DISTRIBUTION_ZIPFIAN == distribution ? "zipfian" : "uniform") \
+        << ": " << num_threads * BENCH_OPS_PER_THREAD / elapsed.count() / 1e6 \
+        << " Mops/s" << std::endl;
+}
+
+template <typename Store>
+void bench_store_variants(const char* name)
+{
+    for (int threads: {1, 4})
+        for (int get_percent: {100, 90, 50})
+            for (auto distribution: {KEY_DISTRIBUTION_UNIFORM, KEY_DISTRIBUTION_ZIPFIAN})
+                bench_store<Store>(name, threads, get_percent, distribution);
+}
+
+int main(int argc, char** argv)
+{
+    bench_store_variants<DataStore>("locked");
+    bench_store_variants<ReadOptimizedDataStore>("read optimized");
+}
@@ -1,7 +1,22 @@
 #include <cstdlib>
+#include <cstring>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
 #include "data_store.h"
+#include "read_optimized_store.h"
+#include "expiry_reclaimer.h"
+#include "slab_allocator.h"
+#include "snapshot.h"
+#include "append_log.h"
+#include "replication.h"
+#include "cluster.h"
+#include <set>
+#include <map>
 
 #define TEST(x, y) {\
     if (!(x))\
@@ -30,6 +45,14 @@ void basic_tests()
             TEST(readValue == std::string("bar"), "Should read the correct set value");
         }
         
+        {
+            std::string output("prefix:");
+            TEST(m.append_value("foo", output), "appending existing value should succeed");
+            TEST(output == std::string("prefix:bar"), "value should be appended to the output");
+            TEST(!m.append_value("missing", output), "appending non-existing value should fail");
+            TEST(output == std::string("prefix:bar"), "output should be untouched for missing keys");
+        }
+
         auto e = m.del("foo");
         TEST(e, "Should be able to delete existing value");
         e = m.del("foo");
@@ -43,9 +66,1009 @@ void basic_tests()
     }
 }
 
+void hashed_key_tests()
+{
+    std::cout << std::endl << "Running hashed key tests " << std::endl;
+
+    {
+        DataStore m;
+        std::string key("user:1000");
+        HashedKey hkey(key);
+        TEST(hkey.m_hash == hash_key(std::string("user:1000")), "hash should only depend on the key");
+
+        TEST(m.set(hkey, "bar"), "Should be able to set value with a hashed key");
+        auto [succ, readValue] = m.get("user:1000");
+        TEST(succ && readValue == std::string("bar"), "hashed and plain keys should find the same value");
+        TEST(m.set("user:1000", "baz"), "Should be able to overwrite with a plain key");
+        auto [succ2, readValue2] = m.get(hkey);
+        TEST(succ2 && readValue2 == std::string("baz"), "overwritten value should be found with the hashed key");
+        TEST(m.del(hkey), "Should be able to delete with a hashed key");
+        TEST(!m.del("user:1000"), "deleted key should be gone");
+    }
+}
+
+/**
+ * @brief records what a visitor was called with
+ * 
+ */
+static void record_visit(std::string_view value, void* context)
+{
+    auto visits = static_cast<std::vector<std::string>*>(context);
+    visits->push_back(std::string(value));
+}
+
+void visit_value_tests(DataStoreInterface& m, const char* name)
+{
+    std::cout << std::endl << "Running visit value tests on " << name << std::endl;
+
+    std::string buffer("xxuser:7xx");
+    std::string_view key(buffer.data() + 2, 6);
+    std::vector<std::string> visits;
+
+    TEST(m.set(key, "seven"), "Should be able to set value with a string_view key");
+    TEST(m.visit_value(HashedKey("user:7"), record_visit, &visits), "visiting existing value should succeed");
+    TEST(visits.size() == 1 && visits[0] == "seven", "visitor should be called once with the value");
+    TEST(!m.visit_value(HashedKey("user:8"), record_visit, &visits), "visiting non-existing value should fail");
+    TEST(visits.size() == 1, "visitor should not be called for missing keys");
+    TEST(m.del(key), "Should be able to delete with a string_view key");
+}
+
+/**
+ * @brief records the index and value a batch visitor was called with
+ * 
+ */
+static void record_indexed_visit(std::uint32_t index, std::string_view value, void* context)
+{
+    auto visits = static_cast<std::vector<std::string>*>(context);
+    visits->push_back(std::to_string(index) + "=" + std::string(value));
+}
+
+void batch_tests(DataStoreInterface& m, const char* name)
+{
+    std::cout << std::endl << "Running batch tests on " << name << std::endl;
+
+    std::vector<HashedKey> keys = {HashedKey("a"), HashedKey("b"), HashedKey("a"), HashedKey("c")};
+    std::vector<std::string_view> values = {"1", "2", "3", "4"};
+    std::vector<std::uint32_t> indexes = {0, 1, 2};
+
+    std::vector<std::uint32_t> set_indexes(3);
+    TEST(3 == m.set_values(keys.data(), values.data(), indexes.data(), 3, set_indexes.data()), "all pairs of the batch should be set");
+    TEST(indexes == set_indexes, "the pairs set should be reported in order");
+    auto [succ, readValue] = m.get("a");
+    TEST(succ && readValue == "3", "the last value of a repeated key should win");
+
+    std::vector<std::string> visits;
+    std::vector<std::uint32_t> lookups = {3, 1, 0};
+    TEST(2 == m.visit_values(keys.data(), lookups.data(), 3, record_indexed_visit, &visits), "only present keys should be found");
+    TEST(visits.size() == 2 && visits[0] == "1=2" && visits[1] == "0=3", "visitor should get the index of every key found");
+
+    std::vector<std::uint32_t> deleted_indexes(3);
+    TEST(2 == m.del_keys(keys.data(), lookups.data(), 3, deleted_indexes.data()), "only present keys should be counted as deleted");
+    TEST(1 == deleted_indexes[0] && 0 == deleted_indexes[1], "the keys deleted should be reported in order");
+    TEST(0 == m.del_keys(keys.data(), indexes.data(), 3, deleted_indexes.data()), "deleted keys should be gone");
+}
+
+void timer_wheel_tests()
+{
+    std::cout << std::endl << "Running timer wheel tests " << std::endl;
+
+    TimerWheel wheel;
+    std::int64_t start = 1000000;
+    std::vector<std::int64_t> times = {start, start + 1, start + 63, start + 64, start + 5000,
+        start + 300000, start + 20000000, start - 10};
+    for (auto time: times)
+        TEST(wheel.add(std::to_string(time), time, start), "Should be able to add a timer");
+    TEST(wheel.size() == times.size(), "wheel should count its timers");
+
+    std::vector<std::int64_t> fired;
+    bool on_time = true;
+    std::int64_t now = start;
+    auto record = [&](const std::string& key, std::int64_t time)
+    {
+        on_time = on_time && key == std::to_string(time) && time <= now && \
+            (fired.empty() || fired.back() <= time);
+        fired.push_back(time);
+    };
+
+    // Small steps, and a budget that often runs out mid-way
+    while (now <= start + 20000000)
+    {
+        wheel.expire(now, 3, record);
+        wheel.expire(now, 3, record);
+        now += std::max((std::int64_t)1, (now - start) / 64);
+    }
+    while (wheel.expire(now, 3, record) == 3)
+        ;
+    TEST(fired.size() == times.size(), "every timer should fire once");
+    TEST(on_time, "timers should fire in order, and never early");
+    TEST(0 == wheel.size(), "wheel should be empty once all timers fired");
+}
+
+void expiry_tests(DataStoreInterface& m, const char* name)
+{
+    std::cout << std::endl << "Running expiry tests on " << name << std::endl;
+
+    std::int64_t now = unix_time_ms();
+    std::int64_t expire_at;
+    std::int64_t previous;
+
+    TEST(m.set(HashedKey("gone"), "v", now - 1), "Should be able to set an expired key");
+    TEST(!std::get<0>(m.get("gone")), "expired key should not be found");
+    TEST(!m.set_expiry(HashedKey("gone"), EXPIRE_NEVER, previous), "expired key should not get a new expiry");
+
+    TEST(m.set(HashedKey("session"), "v", now + 60000), "Should be able to set a key with an expiry");
+    TEST(m.get_expiry(HashedKey("session"), expire_at) && expire_at == now + 60000, "expiry should be kept with the key");
+    TEST(m.set_expiry(HashedKey("session"), EXPIRE_NEVER, previous) && previous == now + 60000, "expiry should be removable");
+    TEST(m.get_expiry(HashedKey("session"), expire_at) && EXPIRE_NEVER == expire_at, "key should not expire any more");
+    TEST(m.set_expiry(HashedKey("session"), now + 50, previous), "expiry should be settable again");
+    TEST(m.set("plain", "v"), "Should be able to set a key without expiry");
+
+    size_t num_expired = 0;
+    m.reclaim_expired(now + 10, 1000, num_expired);
+    TEST(0 == num_expired && std::get<0>(m.get("session")), "keys should not be reclaimed early");
+
+    while (m.reclaim_expired(now + 100, 1, num_expired))
+        ;
+    TEST(1 == num_expired, "the expired key should be reclaimed once, with a small budget");
+    TEST(std::get<0>(m.get("plain")), "keys without expiry should stay");
+
+    TEST(m.set(HashedKey("refreshed"), "v", now + 50), "Should be able to set a key with an expiry");
+    TEST(m.set(HashedKey("refreshed"), "v", now + 500), "Should be able to extend the expiry");
+    m.reclaim_expired(now + 100, 1000, num_expired);
+    TEST(1 == num_expired, "a key whose expiry was extended should not be reclaimed");
+
+    DataStoreInterface* stores[] = {&m};
+    ExpiryReclaimer reclaimer(stores, 1);
+    reclaimer.pass(now + 1000);
+    TEST(1 == reclaimer.m_num_expired, "reclaimer should count the expired keys");
+    TEST(!m.del("refreshed") && m.del("plain"), "reclaimed keys should be gone");
+}
+
+void read_optimized_tests()
+{
+    std::cout << std::endl << "Running read optimized store tests " << std::endl;
+
+    {
+        ReadOptimizedDataStore m;
+        TEST(m.set("foo", "bar"), "Should be able to set value");
+        auto [succ, readValue] = m.get("foo");
+        TEST(succ && readValue == std::string("bar"), "Should read the correct set value");
+        TEST(m.set("foo", "baz"), "Should be able to overwrite value");
+        auto [succ2, readValue2] = m.get("foo");
+        TEST(succ2 && readValue2 == std::string("baz"), "Should read the overwritten value");
+
+        std::string output("prefix:");
+        TEST(m.append_value("foo", output), "appending existing value should succeed");
+        TEST(output == std::string("prefix:baz"), "value should be appended to the output");
+        TEST(!m.append_value("missing", output), "appending non-existing value should fail");
+
+        TEST(m.del("foo"), "Should be able to delete existing value");
+        TEST(!m.del("foo"), "deleting non-existent value should fail");
+        auto [succ3, readValue3] = m.get("foo");
+        TEST(!succ3, "reading deleted value should fail");
+        TEST(m.set("foo", "again"), "Should be able to set a deleted key again");
+        auto [succ4, readValue4] = m.get("foo");
+        TEST(succ4 && readValue4 == std::string("again"), "Should read the value set after the delete");
+
+        std::string binary("a\0b", 3);
+        TEST(m.set(std::string("bin\0key", 7), binary), "Should be able to set binary data");
+        auto [succ5, readValue5] = m.get(std::string("bin\0key", 7));
+        TEST(succ5 && readValue5 == binary, "binary keys and values should round trip");
+    }
+
+    {
+        ReadOptimizedDataStore m;
+        bool all_set = true;
+        for (int i = 0; i < 10000; i++)
+            all_set = m.set("key" + std::to_string(i), std::to_string(i)) && all_set;
+        TEST(all_set, "Should be able to set many keys, growing the table");
+
+        bool all_found = true;
+        for (int i = 0; i < 10000; i++)
+        {
+            auto [succ, readValue] = m.get("key" + std::to_string(i));
+            all_found = all_found && succ && readValue == std::to_string(i);
+        }
+        TEST(all_found, "all keys should be found after growing");
+
+        bool all_deleted = true;
+        for (int i = 0; i < 10000; i += 2)
+            all_deleted = m.del("key" + std::to_string(i)) && all_deleted;
+        for (int i = 0; i < 10000; i += 2)
+            all_set = m.set("other" + std::to_string(i), "x") && all_set;
+        TEST(all_deleted && all_set, "Should be able to reuse deleted slots");
+
+        bool consistent = true;
+        for (int i = 0; i < 10000; i++)
+        {
+            auto [succ, readValue] = m.get("key" + std::to_string(i));
+            consistent = consistent && (succ == (i % 2 == 1));
+        }
+        TEST(consistent, "deleted keys should be gone, others should stay");
+    }
+}
+
+void slab_allocator_tests()
+{
+    std::cout << std::endl << "Running slab allocator tests " << std::endl;
+
+    SlabAllocator allocator;
+    std::vector<std::pair<char*, size_t>> chunks;
+    bool all_allocated = true;
+    for (size_t size = 1; size <= 3 * SLAB_MAX_CHUNK_SIZE; size += 13)
+    {
+        char* p = static_cast<char*>(allocator.allocate(size));
+        all_allocated = all_allocated && p && 0 == ((uintptr_t)p & 7);
+        if (p)
+        {
+            memset(p, (int)(size & 0xff), size);
+            chunks.push_back({p, size});
+        }
+    }
+    TEST(all_allocated, "allocations of every size should succeed, aligned to 8 bytes");
+    TEST(SlabAllocator::get_chunk_size(100) >= 100 && SlabAllocator::get_chunk_size(100) <= 125, \
+        "chunks should waste at most a fifth of their size");
+
+    bool intact = true;
+    for (auto [p, size]: chunks)
+        intact = intact && p[0] == (char)(size & 0xff) && p[size - 1] == (char)(size & 0xff);
+    TEST(intact, "chunks should not overlap");
+
+    for (auto [p, size]: chunks)
+        allocator.free(p, size);
+    TEST(0 == allocator.get_used(), "freed chunks should not be counted as used");
+
+    size_t reserved = allocator.get_reserved();
+    for (auto [p, size]: chunks)
+        allocator.allocate(size);
+    TEST(reserved == allocator.get_reserved(), "freed chunks should be reused");
+}
+
+void compact_encoding_tests()
+{
+    std::cout << std::endl << "Running compact encoding tests " << std::endl;
+
+    DataStore m;
+    const char* values[] = {
+        "0", "-1", "127", "128", "-32769", "2147483648",
+        "9223372036854775807", "-9223372036854775808", "9223372036854775808",
+        "007", "-0", "+5", "12a", "", " 1"
+    };
+    bool round_trip = true;
+    for (const char* value: values)
+    {
+        m.set("k", value);
+        auto [succ, readValue] = m.get("k");
+        round_trip = round_trip && succ && readValue == value;
+    }
+    TEST(round_trip, "integers and look-alikes should read back as they were set");
+
+    std::string large(3 * SLAB_MAX_CHUNK_SIZE, 'x');
+    TEST(m.set("large", large) && std::get<1>(m.get("large")) == large, "large values should round trip");
+
+    size_t used = m.get_used_memory();
+    m.set("counter", "123456789012345");
+    size_t integer_size = m.get_used_memory() - used;
+    m.set("textual", "abcdefghijklmno");
+    TEST(integer_size < m.get_used_memory() - used - integer_size, "integers should take less room than their digits");
+
+    bool all_set = true;
+    for (int i = 0; i < 10000; i++)
+        all_set = m.set("key" + std::to_string(i), std::to_string(i)) && all_set;
+    bool all_deleted = true;
+    for (int i = 0; i < 10000; i += 2)
+        all_deleted = m.del("key" + std::to_string(i)) && all_deleted;
+    bool consistent = true;
+    for (int i = 0; i < 10000; i++)
+    {
+        auto [succ, readValue] = m.get("key" + std::to_string(i));
+        consistent = consistent && succ == (i % 2 == 1) && (!succ || readValue == std::to_string(i));
+    }
+    TEST(all_set && all_deleted && consistent, "deletes should keep the other keys reachable");
+}
+
+void eviction_tests(DataStoreInterface& m, const char* name, eviction_policy_t policy)
+{
+    std::cout << std::endl << "Running eviction tests for " << name \
+        << " with policy " << policy << std::endl;
+
+    const size_t max_memory = 256 * 1024;
+    std::string value(100, 'v');
+    m.set_memory_limit(max_memory, policy);
+
+    size_t num_set = 0;
+    for (int i = 0; i < 20000; i++)
+    {
+        if (m.set("key" + std::to_string(i), value))
+            num_set++;
+    }
+    TEST(m.get_used_memory() <= max_memory, "used memory should stay within the limit");
+
+    if (EVICTION_NOEVICTION == policy)
+    {
+        TEST(num_set < 20000 && 0 == m.get_num_evicted(), "writes should fail rather than evict");
+        TEST(m.del("key0") && m.set("key0", value), "deleting should make room again");
+
+        // Room for about one more pair, the batch is only partly set
+        m.del("key1");
+        std::vector<std::string> names;
+        std::vector<HashedKey> keys;
+        std::vector<std::string_view> values;
+        std::vector<std::uint32_t> indexes;
+        for (std::uint32_t i = 0; i < 10; i++)
+            names.push_back("batch" + std::to_string(i));
+        for (std::uint32_t i = 0; i < 10; i++)
+        {
+            keys.emplace_back(names[i]);
+            values.push_back(value);
+            indexes.push_back(i);
+        }
+        std::vector<std::uint32_t> set_indexes(indexes.size());
+        size_t batch_set = m.set_values(keys.data(), values.data(), indexes.data(), indexes.size(), set_indexes.data());
+        bool reported = batch_set < indexes.size();
+        for (std::uint32_t i = 0; i < indexes.size(); i++)
+        {
+            bool is_reported = std::find(set_indexes.begin(), set_indexes.begin() + batch_set, i) != \
+                set_indexes.begin() + batch_set;
+            reported = reported && is_reported == std::get<0>(m.get(keys[i]));
+        }
+        TEST(reported, "a partly set batch should report exactly the pairs it set");
+
+        // As MSET does it, over several data stores: the room is made
+        // for the whole batch before any pair is set
+        auto set_if_room = [&](std::vector<HashedKey>& batch_keys)
+        {
+            m.lock_writes();
+            bool has_room = m.make_room_for_values_unsafe(
+                batch_keys.data(), values.data(), indexes.data(), indexes.size());
+            size_t batch_set = has_room ? m.set_values_unsafe(
+                batch_keys.data(), values.data(), indexes.data(), indexes.size(), set_indexes.data()) : 0;
+            m.unlock_writes();
+            return batch_set;
+        };
+        std::vector<std::string> mset_names;
+        std::vector<HashedKey> mset_keys;
+        for (std::uint32_t i = 0; i < 10; i++)
+            mset_names.push_back("mset" + std::to_string(i));
+        for (std::uint32_t i = 0; i < 10; i++)
+            mset_keys.emplace_back(mset_names[i]);
+
+        size_t num_found = 0;
+        TEST(0 == set_if_room(mset_keys), "a batch without room should be refused");
+        for (auto& key: mset_keys)
+            num_found += std::get<0>(m.get(key));
+        TEST(0 == num_found, "a refused batch should not set any pair");
+
+        for (int i = 100; i < 600; i++)
+            m.del("key" + std::to_string(i));
+        TEST(10 == set_if_room(mset_keys), "a batch with room should be set in full");
+    }
+    else
+    {
+        TEST(20000 == num_set && m.get_num_evicted() > 0, "writes should evict other keys");
+        TEST(std::get<0>(m.get("key19999")), "the key just written should be kept");
+    }
+}
+
+static void record_scanned_key(std::string_view key, std::string_view value, std::int64_t expire_at, void* context)
+{
+    static_cast<std::multiset<std::string>*>(context)->insert(std::string(key));
+}
+
+void scan_tests(DataStoreInterface& m, const char* name)
+{
+    std::cout << std::endl << "Running scan tests for " << name << std::endl;
+
+    for (int i = 0; i < 1000; i++)
+        m.set("key" + std::to_string(i), "v");
+    m.set(HashedKey("expired"), "v", unix_time_ms() - 1);
+
+    // The table grows several times in the middle of the walk
+    std::multiset<std::string> seen;
+    size_t cursor = 0;
+    int num_calls = 0;
+    do
+    {
+        cursor = m.scan(cursor, 16, record_scanned_key, &seen);
+        if (10 == ++num_calls)
+        {
+            for (int i = 0; i < 20000; i++)
+                m.set("more" + std::to_string(i), "v");
+        }
+    } while (cursor);
+
+    bool all_seen = true;
+    for (int i = 0; i < 1000; i++)
+        all_seen = all_seen && seen.count("key" + std::to_string(i));
+    TEST(all_seen, "keys present during the whole walk should be visited");
+    TEST(!seen.count("expired"), "expired keys should not be visited");
+}
+
+void snapshot_tests()
+{
+    std::cout << std::endl << "Running snapshot tests " << std::endl;
+
+    const char* path = "/tmp/ds_tests_snapshot.kvs";
+    std::int64_t now = unix_time_ms();
+    DataStore written[2];
+    DataStoreInterface* writer_stores[2] = {&written[0], &written[1]};
+    std::vector<std::string> keys;
+    for (int i = 0; i < 10000; i++)
+        keys.push_back("key" + std::to_string(i));
+    for (auto& key: keys)
+    {
+        HashedKey hashed_key(key);
+        writer_stores[get_partition(hashed_key, 2)]->set(hashed_key, "value:" + key);
+    }
+    std::string binary("bin\0value", 9);
+    written[0].set(HashedKey("session"), binary, now + 60000);
+    written[1].set(HashedKey("gone"), "v", now - 1);
+
+    unlink(path);
+    SnapshotWriter writer(writer_stores, 2, path, 0);
+    TEST(writer.write(), "Should be able to write a snapshot");
+    TEST(10001 == writer.m_last_save_keys, "snapshot should have every key that did not expire");
+
+    // Loaded into more data stores, of the other kind
+    ReadOptimizedDataStore loaded[4];
+    DataStoreInterface* loader_stores[4] = {&loaded[0], &loaded[1], &loaded[2], &loaded[3]};
+    size_t num_loaded;
+    TEST(load_snapshot(path, loader_stores, 4, num_loaded) && 10001 == num_loaded, "Should be able to load the snapshot");
+
+    bool all_found = true;
+    for (auto& key: keys)
+    {
+        HashedKey hashed_key(key);
+        auto [succ, value] = loader_stores[get_partition(hashed_key, 4)]->get(hashed_key);
+        all_found = all_found && succ && value == "value:" + key;
+    }
+    TEST(all_found, "every key should be loaded into its data store");
+
+    HashedKey session("session");
+    std::int64_t expire_at;
+    DataStoreInterface* store = loader_stores[get_partition(session, 4)];
+    TEST(std::get<1>(store->get(session)) == binary && store->get_expiry(session, expire_at) && \
+        expire_at == now + 60000, "values and expiry times should round trip");
+
+    size_t size;
+    {
+        struct stat st;
+        stat(path, &st);
+        size = st.st_size;
+    }
+    TEST(0 == truncate(path, size - 1), "Should be able to truncate the snapshot");
+    DataStore empty;
+    DataStoreInterface* empty_stores[1] = {&empty};
+    TEST(!load_snapshot(path, empty_stores, 1, num_loaded), "a truncated snapshot should be rejected");
+    unlink(path);
+    TEST(load_snapshot(path, empty_stores, 1, num_loaded) && 0 == num_loaded, "a missing snapshot should mean no keys");
+}
+
+void append_log_tests()
+{
+    std::cout << std::endl << "Running append log tests " << std::endl;
+
+    const char* path = "/tmp/ds_tests_aof";
+    std::vector<std::uint64_t> segments;
+    list_log_segments(path, segments);
+    for (auto segment: segments)
+        unlink(get_log_segment_path(path, segment).c_str());
+
+    std::int64_t now = unix_time_ms();
+    size_t num_replayed;
+    {
+        AppendLog log(path, 2, APPENDFSYNC_ALWAYS);
+        TEST(log.start() && 1 == log.get_segment(), "Should be able to start an append log");
+
+        // Logged the way the orchestrator does, into the shard of the key
+        auto append_set = [&log](const std::string& key, const std::string& value, std::int64_t expire_at)
+        {
+            size_t shard = get_partition(HashedKey(key), 2);
+            std::unique_lock lock(log.get_mutex(shard));
+            return log.append_set(shard, key, value, expire_at);
+        };
+        for (int i = 0; i < 1000; i++)
+            append_set("key" + std::to_string(i), "v1", EXPIRE_NEVER);
+        append_set("gone", "v", now - 1);
+        std::uint64_t ticket = append_set("session", "s", now + 60000);
+        log.wait_for_sync(ticket);
+        TEST(log.m_num_syncs > 0 && !log.m_is_failed, "with always, a write should be synced when waited for");
+
+        std::uint64_t segment;
+        TEST(log.start_segment(segment) && 2 == segment, "Should be able to start a new segment");
+        for (int i = 0; i < 1000; i += 2)
+            append_set("key" + std::to_string(i), "v2", EXPIRE_NEVER);
+        for (int i = 1; i < 1000; i += 4)
+        {
+            std::string key = "key" + std::to_string(i);
+            size_t shard = get_partition(HashedKey(key), 2);
+            std::unique_lock lock(log.get_mutex(shard));
+            log.append_del(shard, key);
+        }
+        {
+            size_t shard = get_partition(HashedKey("session"), 2);
+            std::unique_lock lock(log.get_mutex(shard));
+            log.append_expire(shard, "session", EXPIRE_NEVER);
+        }
+    }
+
+    ReadOptimizedDataStore replayed[4];
+    DataStoreInterface* stores[4] = {&replayed[0], &replayed[1], &replayed[2], &replayed[3]};
+    TEST(replay_append_log(path, stores, 4, num_replayed) && 1753 == num_replayed, "Should be able to replay the log");
+
+    bool is_right = true;
+    for (int i = 0; i < 1000; i++)
+    {
+        HashedKey key("key" + std::to_string(i));
+        auto [succ, value] = stores[get_partition(key, 4)]->get(key);
+        if (0 == i % 2)
+            is_right = is_right && succ && value == "v2";
+        else if (1 == i % 4)
+            is_right = is_right && !succ;
+        else
+            is_right = is_right && succ && value == "v1";
+    }
+    TEST(is_right, "the last write of every key should win");
+
+    HashedKey gone("gone");
+    HashedKey session("session");
+    std::int64_t expire_at;
+    TEST(!std::get<0>(stores[get_partition(gone, 4)]->get(gone)), "expired keys should not be replayed");
+    TEST(stores[get_partition(session, 4)]->get_expiry(session, expire_at) && EXPIRE_NEVER == expire_at, \
+        "expiry changes should be replayed");
+
+    // A crash in the middle of the last write
+    std::string last = get_log_segment_path(path, 2);
+    struct stat st;
+    stat(last.c_str(), &st);
+    TEST(0 == truncate(last.c_str(), st.st_size - 1), "Should be able to truncate the segment");
+    DataStore empty;
+    DataStoreInterface* empty_stores[1] = {&empty};
+    TEST(replay_append_log(path, empty_stores, 1, num_replayed) && 1752 == num_replayed, \
+        "a record cut short should end the segment");
+
+    {
+        AppendLog log(path, 2, APPENDFSYNC_NO);
+        TEST(log.start() && 3 == log.get_segment(), "a restarted log should begin a new segment");
+        log.remove_segments_before(3);
+    }
+    list_log_segments(path, segments);
+    TEST(1 == segments.size() && 3 == segments[0], "older segments should be removed");
+
+    FILE* f = fopen(get_log_segment_path(path, 3).c_str(), "a");
+    fputc(0x7f, f);
+    fclose(f);
+    TEST(!replay_append_log(path, empty_stores, 1, num_replayed), "a corrupt segment should be rejected");
+    unlink(get_log_segment_path(path, 3).c_str());
+
+    // A disk that refuses every write, as a file size limit does
+    {
+        AppendLog log(path, 1, APPENDFSYNC_ALWAYS);
+        TEST(log.start(), "Should be able to start an append log");
+
+        struct rlimit saved_limit;
+        getrlimit(RLIMIT_FSIZE, &saved_limit);
+        struct rlimit limit = saved_limit;
+        limit.rlim_cur = APPEND_LOG_MAGIC_SIZE;
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &limit);
+
+        std::uint64_t ticket;
+        {
+            std::unique_lock lock(log.get_mutex(0));
+            ticket = log.append_set(0, "key", "value", EXPIRE_NEVER);
+        }
+        TEST(!log.wait_for_sync(ticket) && log.m_is_failed, "a write that cannot be synced should end the wait with an error");
+
+        // A flush that started before the limit was lifted may still fail
+        setrlimit(RLIMIT_FSIZE, &saved_limit);
+        signal(SIGXFSZ, SIG_DFL);
+        bool is_synced = false;
+        for (int i = 0; i < 100 && !is_synced; i++)
+            is_synced = log.wait_for_sync(ticket);
+        TEST(is_synced && !log.m_is_failed, "the write should be synced once the disk takes it");
+    }
+    list_log_segments(path, segments);
+    for (auto segment: segments)
+        unlink(get_log_segment_path(path, segment).c_str());
+}
+
+/**
+ * @brief wait until a replica has all the writes of the backlog
+ *
+ * @return true if it caught up within a few seconds
+ */
+static bool wait_for_replica(ReplicationReplica& replica, ReplicationBacklog& backlog)
+{
+    for (int i = 0; i < 500; i++)
+    {
+        if (replica.m_is_connected && replica.m_offset == backlog.get_end_offset())
+            return true;
+        usleep(10000);
+    }
+    return false;
+}
+
+void replication_tests()
+{
+    std::cout << std::endl << "Running replication tests " << std::endl;
+
+    {
+        ReplicationBacklog backlog(8);
+        TEST(backlog.init(), "Should be able to allocate a backlog");
+        char buffer[8];
+        backlog.append("abcdef");
+        backlog.append("ghij");
+        TEST(2 == backlog.get_start_offset() && 10 == backlog.get_end_offset(), "the backlog should keep the newest bytes");
+        TEST(4 == backlog.read(6, buffer, sizeof(buffer), 0) && 0 == memcmp(buffer, "ghij", 4), \
+            "reads should wrap around the ring");
+        TEST(-1 == backlog.read(1, buffer, sizeof(buffer), 0), "offsets that fell out should be refused");
+        TEST(0 == backlog.read(10, buffer, sizeof(buffer), 0), "there should be nothing after the end");
+    }
+
+    DataStore primary_stores[2];
+    DataStoreInterface* primary_ptrs[2] = {&primary_stores[0], &primary_stores[1]};
+    ReadOptimizedDataStore replica_stores[4];
+    DataStoreInterface* replica_ptrs[4] = {&replica_stores[0], &replica_stores[1], &replica_stores[2], &replica_stores[3]};
+
+    ReplicationBacklog backlog(1024 * 1024);
+    backlog.init();
+    AppendLog log("", 2, APPENDFSYNC_NO, &backlog);
+    TEST(log.start() && !log.is_persistent(), "Should be able to start a log without a file");
+
+    // Written the way the orchestrator does
+    auto set = [&](const std::string& key, const std::string& value)
+    {
+        HashedKey hashed_key(key);
+        size_t shard = get_partition(hashed_key, 2);
+        std::unique_lock lock(log.get_mutex(shard));
+        primary_ptrs[shard]->set(hashed_key, value);
+        log.append_set(shard, key, value, EXPIRE_NEVER);
+    };
+    for (int i = 0; i < 5000; i++)
+        set("key" + std::to_string(i), "before");
+
+    ReplicationPrimary primary(17379, primary_ptrs, 2, &backlog);
+    TEST(primary.start(), "Should be able to start the primary");
+    ReplicationReplica replica("localhost", 17379, replica_ptrs, 4, "/tmp/ds_tests_replica.sync");
+    TEST(replica.start(), "Should be able to start the replica");
+
+    for (int i = 0; i < 5000; i += 2)
+        set("key" + std::to_string(i), "after");
+    log.flush();
+    TEST(wait_for_replica(replica, backlog), "the replica should catch up with the primary");
+
+    auto check = [&](const std::string& odd_value)
+    {
+        bool is_right = true;
+        for (int i = 0; i < 5000; i++)
+        {
+            HashedKey key("key" + std::to_string(i));
+            auto [succ, value] = replica_ptrs[get_partition(key, 4)]->get(key);
+            is_right = is_right && succ && value == (i % 2 ? odd_value : "after");
+        }
+        return is_right;
+    };
+    TEST(1 == replica.m_num_full_syncs && check("before"), "the replica should have the snapshot and the writes after it");
+
+    replica.stop();
+    for (int i = 1; i < 5000; i += 2)
+        set("key" + std::to_string(i), "while away");
+    log.flush();
+    TEST(replica.start() && wait_for_replica(replica, backlog), "the replica should reconnect");
+    TEST(1 == replica.m_num_full_syncs && 1 == primary.m_num_partial_syncs && check("while away"), \
+        "a replica that reconnects should go on from its offset");
+
+    replica.stop();
+    primary.stop();
+}
+
+/**
+ * @brief shared between the threads of the concurrency test
+ * 
+ */
+struct ConcurrencyTestData
+{
+    ReadOptimizedDataStore*     m_store;
+    std::atomic<bool>           m_stop;
+    std::atomic<bool>           m_failed;
+};
+
+static void* concurrent_reader(void* arg)
+{
+    ConcurrencyTestData* data = static_cast<ConcurrencyTestData*>(arg);
+    while (!data->m_stop)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            std::string output;
+            // Stable keys must always be found, with a valid value
+            if (!data->m_store->append_value("stable" + std::to_string(i), output) ||
+                output != std::to_string(i))
+                data->m_failed = true;
+            data->m_store->append_value("churn" + std::to_string(i), output);
+        }
+    }
+    return nullptr;
+}
+
+void read_optimized_concurrency_tests()
+{
+    std::cout << std::endl << "Running read optimized store concurrency tests " << std::endl;
+
+    ReadOptimizedDataStore m;
+    for (int i = 0; i < 64; i++)
+        m.set("stable" + std::to_string(i), std::to_string(i));
+
+    ConcurrencyTestData data;
+    data.m_store = &m;
+    data.m_stop = false;
+    data.m_failed = false;
+
+    pthread_t readers[4];
+    for (auto& reader: readers)
+        pthread_create(&reader, nullptr, concurrent_reader, &data);
+
+    // Overwrites, deletes and resizes while the readers are running
+    for (int round = 0; round < 200; round++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            m.set("churn" + std::to_string(i), std::to_string(round));
+            m.set("stable" + std::to_string(i), std::to_string(i));
+        }
+        for (int i = 0; i < 64; i++)
+            m.del("churn" + std::to_string(i));
+        for (int i = 0; i < 50; i++)
+            m.set("grow" + std::to_string(round * 50 + i), "g");
+    }
+
+    data.m_stop = true;
+    for (auto& reader: readers)
+        pthread_join(reader, nullptr);
+
+    TEST(!data.m_failed, "readers should always see stable keys during writes");
+    auto [succ, readValue] = m.get("grow9999");
+    TEST(succ && readValue == std::string("g"), "keys set during reads should be found");
+}
+
+/**
+ * @brief a node that imports the keys of a migration, and changes the
+ * keys of the batch it is sent while it has not acknowledged it
+ *
+ */
+struct FakeTarget
+{
+    int                                 m_fd;
+    Cluster*                            m_cluster;
+    DataStore*                          m_stores;
+    size_t                              m_num_stores;
+    std::map<std::string, std::string>  m_keys;
+    std::vector<std::string>            m_received;
+    bool                                m_was_unlocked;
+    std::string                         m_changed;
+    std::string                         m_deleted;
+};
+
+/**
+ * @brief parse a RESP array of bulk strings at the start of a buffer
+ *
+ * @return size_t the bytes of the command, 0 if it is incomplete
+ */
+static size_t parse_test_command(const std::string& buffer, std::vector<std::string>& args)
+{
+    args.clear();
+    size_t end = buffer.find("\r\n");
+    if (std::string::npos == end || '*' != buffer[0])
+        return 0;
+    size_t count = std::stoul(buffer.substr(1, end - 1));
+    size_t pos = end + 2;
+    for (size_t i = 0; i < count; i++)
+    {
+        end = buffer.find("\r\n", pos);
+        if (std::string::npos == end)
+            return 0;
+        size_t size = std::stoul(buffer.substr(pos + 1, end - pos - 1));
+        if (buffer.size() < end + 2 + size + 2)
+            return 0;
+        args.push_back(buffer.substr(end + 2, size));
+        pos = end + 2 + size + 2;
+    }
+    return pos;
+}
+
+static void* fake_target(void* arg)
+{
+    FakeTarget* target = static_cast<FakeTarget*>(arg);
+    int fd = accept(target->m_fd, nullptr, nullptr);
+    std::string buffer;
+    char chunk[4096];
+    ssize_t n;
+    while (fd >= 0 && (n = recv(fd, chunk, sizeof(chunk), 0)) > 0)
+    {
+        buffer.append(chunk, n);
+        std::vector<std::string> args;
+        size_t size;
+        std::string replies;
+        while ((size = parse_test_command(buffer, args)))
+        {
+            buffer.erase(0, size);
+            if ("SET" == args[0])
+            {
+                target->m_keys[args[1]] = args[2];
+                target->m_received.push_back(args[1]);
+            }
+            else if ("DEL" == args[0])
+                target->m_keys.erase(args[1]);
+            replies += "+OK\r\n";
+
+            // Commands for the slot, as clients send them, while the
+            // first batch waits for its replies
+            if ("SET" == args[0] && 2 == target->m_received.size())
+            {
+                HashedKey changed(target->m_received[0]);
+                HashedKey deleted(target->m_received[1]);
+                std::shared_mutex& mutex = target->m_cluster->get_slot_mutex(changed.m_slot);
+                target->m_was_unlocked = mutex.try_lock_shared();
+                if (target->m_was_unlocked)
+                {
+                    target->m_stores[get_partition(changed, target->m_num_stores)].set(changed, "changed");
+                    target->m_stores[get_partition(deleted, target->m_num_stores)].del(deleted);
+                    mutex.unlock_shared();
+                }
+                target->m_changed = changed.m_key;
+                target->m_deleted = deleted.m_key;
+            }
+        }
+        if (replies.size() && send(fd, replies.data(), replies.size(), 0) <= 0)
+            break;
+    }
+    if (fd >= 0)
+        close(fd);
+    return nullptr;
+}
+
+void cluster_tests()
+{
+    std::cout << std::endl << "Running cluster tests " << std::endl;
+
+    TEST(12739 == get_key_slot("123456789"), "slots should be the CRC16 of Redis Cluster");
+    TEST(12182 == get_key_slot("foo"), "slots should match those of Redis Cluster");
+    TEST(get_key_slot("{user1000}.following") == get_key_slot("user1000"), "only the hash tag should be hashed");
+    TEST(get_key_slot("foo{bar}{zap}") == get_key_slot("bar"), "the first hash tag should be used");
+    TEST(get_key_slot("{}foo") == crc16("{}foo") % CLUSTER_SLOTS, "an empty hash tag should hash the whole key");
+    TEST(HashedKey("foo").m_slot == 12182, "a hashed key should have its slot");
+    TEST(get_partition(HashedKey("{tag}a"), 8) == get_partition(HashedKey("{tag}b"), 8), \
+        "the keys of a slot should be in the same data store");
+
+    std::vector<ClusterSlotRange> ranges;
+    TEST(parse_cluster_nodes("10.0.0.1:7001@0-8191,10.0.0.2:7002@8192-16383,10.0.0.1:7001@42", ranges) && \
+        3 == ranges.size() && "10.0.0.2" == ranges[1].m_host && 7002 == ranges[1].m_port && \
+        8192 == ranges[1].m_first && 16383 == ranges[1].m_last && 42 == ranges[2].m_last, \
+        "slot ranges should be parsed");
+    for (const char* spec: {"10.0.0.1:7001", "10.0.0.1@0-5", "10.0.0.1:7001@5-1", "10.0.0.1:7001@0-16384", ":1@0"})
+        TEST(!parse_cluster_nodes(spec, ranges), "invalid slot ranges should be rejected");
+
+    const size_t num_stores = 4;
+    DataStore stores[num_stores];
+    DataStoreInterface* store_ptrs[num_stores];
+    for (size_t i = 0; i < num_stores; i++)
+        store_ptrs[i] = &stores[i];
+
+    ranges.clear();
+    parse_cluster_nodes("127.0.0.1:7001@0-8191,127.0.0.1:7002@8192-16382", ranges);
+    Cluster cluster(store_ptrs, num_stores, nullptr);
+    TEST(cluster.init(ranges, "127.0.0.1", 7001), "a cluster should be set up");
+    int self = cluster.get_self();
+    int other = cluster.get_or_add_node("127.0.0.1:7002");
+    TEST(2 == cluster.get_num_nodes() && other != self && other >= 0, "nodes should be known once");
+    TEST(self == cluster.get_owner(0) && other == cluster.get_owner(16382) && -1 == cluster.get_owner(16383), \
+        "slots should belong to their nodes");
+    TEST(other == cluster.get_or_add_node(cluster.get_node(other).m_id), "nodes should be found by id");
+    TEST(CLUSTER_NODE_ID_SIZE == cluster.get_node(other).m_id.size() && \
+        cluster.get_node(self).m_id != cluster.get_node(other).m_id, "nodes should have distinct ids");
+    TEST(-1 == cluster.get_or_add_node("not a node"), "invalid nodes should be rejected");
+
+    TEST(!cluster.set_slot_migrating(9000, other), "only the slots of this node should migrate");
+    TEST(!cluster.set_slot_migrating(5, self), "a slot should not migrate to its own node");
+    TEST(!cluster.set_slot_importing(5, other), "a slot of this node should not be imported");
+    TEST(cluster.set_slot_importing(9000, other) && other == cluster.get_importing(9000), \
+        "a slot of another node should be imported");
+    cluster.set_slot_node(9000, self);
+    TEST(self == cluster.get_owner(9000) && -1 == cluster.get_importing(9000), \
+        "a slot should change owner, and stop being imported");
+
+    // The migration thread is not started, the slot stays migrating
+    TEST(cluster.set_slot_migrating(5, other) && other == cluster.get_migrating(5), "a slot should migrate");
+    cluster.set_slot_stable(5);
+    TEST(-1 == cluster.get_migrating(5) && self == cluster.get_owner(5), "a stable slot should stay here");
+
+    std::vector<std::string> keys;
+    for (int i = 0; i < 100; i++)
+    {
+        std::string key = "{slot}" + std::to_string(i);
+        HashedKey hashed_key(key);
+        stores[get_partition(hashed_key, num_stores)].set(hashed_key, "value");
+        stores[get_partition(HashedKey(std::to_string(i)), num_stores)].set(HashedKey(std::to_string(i)), "value");
+    }
+    size_t num_in_slot = 0;
+    for (int i = 0; i < 100; i++)
+        num_in_slot += get_key_slot(std::to_string(i)) == get_key_slot("slot") ? 1 : 0;
+    TEST(100 + num_in_slot == cluster.count_keys_in_slot(get_key_slot("slot")), "the keys of a slot should be counted");
+    cluster.get_keys_in_slot(get_key_slot("slot"), 10, keys);
+    TEST(10 == keys.size() && get_key_slot(keys[0]) == get_key_slot("slot"), "the keys of a slot should be listed");
+
+    FakeTarget target = {socket(AF_INET, SOCK_STREAM, 0), &cluster, stores, num_stores, {}, {}, false, "", ""};
+    struct sockaddr_in address;
+    socklen_t address_size = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    TEST(0 == bind(target.m_fd, (struct sockaddr*)&address, sizeof(address)) && \
+        0 == listen(target.m_fd, 1) && \
+        0 == getsockname(target.m_fd, (struct sockaddr*)&address, &address_size), "a fake target should listen");
+    int importer = cluster.get_or_add_node("127.0.0.1:" + std::to_string(ntohs(address.sin_port)));
+    pthread_t target_thread;
+    pthread_create(&target_thread, nullptr, fake_target, &target);
+
+    std::uint16_t slot = get_key_slot("slot");
+    size_t num_keys = cluster.count_keys_in_slot(slot);
+    TEST(self == cluster.get_owner(slot) && importer >= 0 && cluster.start() && \
+        cluster.set_slot_migrating(slot, importer), "a slot should start migrating");
+    for (int i = 0; i < 1000 && !cluster.m_num_migrated_slots; i++)
+        usleep(10000);
+    cluster.stop();
+    pthread_join(target_thread, nullptr);
+    close(target.m_fd);
+
+    TEST(importer == cluster.get_owner(slot) && 0 == cluster.count_keys_in_slot(slot), \
+        "a migrated slot should belong to its target, and have no keys left here");
+    TEST(target.m_was_unlocked, "commands for a migrating slot should not wait for the target");
+    TEST(num_keys - 1 == target.m_keys.size() && "changed" == target.m_keys[target.m_changed] && \
+        !target.m_keys.count(target.m_deleted), \
+        "keys changed while their batch was sent should be sent again, or deleted on the target");
+}
+
 int main(int argc, char** argv)
 {
     basic_tests();
+    hashed_key_tests();
+    {
+        DataStore ds;
+        ReadOptimizedDataStore ro;
+        visit_value_tests(ds, "DataStore");
+        visit_value_tests(ro, "ReadOptimizedDataStore");
+        batch_tests(ds, "DataStore");
+        batch_tests(ro, "ReadOptimizedDataStore");
+    }
+    timer_wheel_tests();
+    {
+        DataStore ds;
+        ReadOptimizedDataStore ro;
+        expiry_tests(ds, "DataStore");
+        expiry_tests(ro, "ReadOptimizedDataStore");
+    }
+    read_optimized_tests();
+    read_optimized_concurrency_tests();
+    {
+        DataStore ds;
+        ReadOptimizedDataStore ro;
+        scan_tests(ds, "DataStore");
+        scan_tests(ro, "ReadOptimizedDataStore");
+    }
+    snapshot_tests();
+    append_log_tests();
+    replication_tests();
+    cluster_tests();
+    slab_allocator_tests();
+    compact_encoding_tests();
+    for (eviction_policy_t policy: {EVICTION_NOEVICTION, EVICTION_LRU, EVICTION_LFU})
+    {
+        DataStore ds;
+        ReadOptimizedDataStore ro;
+        eviction_tests(ds, "DataStore", policy);
+        eviction_tests(ro, "ReadOptimizedDataStore", policy);
+    }
 
     std::cout << std::endl << "All tests passed" << std::endl;
 }
\ No newline at end of file
@@ -0,0 +1,265 @@
+#include "event_loop.h"
+#include "orchestrator.h"
+
+/**
+ * @brief events every connection owned by an event loop is
+ * registered for. Being edge triggered, EPOLLOUT is only reported
+ * again once a socket that filled up has room, which is when a
+ * partially written response can be finished.
+ * 
+ */
+#define EVENT_LOOP_SOCKET_EVENTS (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)
+
+bool EventLoop::start()
+{
+    m_epoll_fd = epoll_create1(0);
+    if (m_epoll_fd < 0)
+    {
+        perror("epoll_create");
+        LOG_ERROR("epoll create failed, errno = " << errno);
+        return false;
+    }
+
+    m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup_fd < 0)
+    {
+        perror("eventfd");
+        LOG_ERROR("eventfd failed, errno = " << errno);
+        return false;
+    }
+
+    // Connections are identified by their state pointer, the eventfd
+    // is the only registration with a null pointer
+    struct epoll_event event;
+    event.data.ptr = nullptr;
+    event.events = EPOLLIN;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event))
+    {
+        perror("epoll_ctl");
+        LOG_ERROR("epoll_ctl add of eventfd failed, errno = " << errno);
+        return false;
+    }
+
+    int retval;
+    if (0 != (retval = create_pinned_thread(
+        &m_thread_id,
+        m_cpus,
+        EventLoop::thread_start_routine,
+        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval << " errno = " \
+            << errno);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void EventLoop::stop()
+{
+    if (m_is_running)
+    {
+        m_is_destroying = true;
+        wakeup();
+        pthread_join(m_thread_id, nullptr);
+        m_is_running = false;
+    }
+
+    if (m_wakeup_fd >= 0)
+        close(m_wakeup_fd);
+    if (m_epoll_fd >= 0)
+        close(m_epoll_fd);
+    m_wakeup_fd = -1;
+    m_epoll_fd = -1;
+}
+
+bool EventLoop::add_connection(int fd)
+{
+    State* state = new (std::nothrow) State(fd);
+    if (!state)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    state->m_state = STATE_ACCEPTED;
+
+    std::unique_lock lock(m_new_connections_mtx);
+    try
+    {
+        m_new_connections.push_back(state);
+    }
+    catch(...)
+    {
+        delete state;
+        return false;
+    }
+    lock.unlock();
+
+    wakeup();
+    return true;
+}
+
+void EventLoop::wakeup()
+{
+    if (m_wakeup_pending.exchange(true))
+        return;
+
+    uint64_t one = 1;
+    if (sizeof(one) != write(m_wakeup_fd, &one, sizeof(one)))
+    {
+        perror("write");
+        LOG_ERROR("eventfd write failed, errno = " << errno);
+    }
+}
+
+void EventLoop::pick_up_new_connections()
+{
+    std::vector<State*> new_connections;
+
+    {
+        std::unique_lock lock(m_new_connections_mtx);
+        new_connections.swap(m_new_connections);
+    }
+
+    for (auto state: new_connections)
+    {
+        struct epoll_event event;
+        event.data.ptr = state;
+        event.events = EVENT_LOOP_SOCKET_EVENTS;
+
+        try
+        {
+            m_connections.insert(state);
+        }
+        catch(...)
+        {
+            LOG_ERROR("Unknown exception");
+            close(state->m_socket);
+            delete state;
+            continue;
+        }
+
+        // Anything the client sent before this point is reported
+        // by the first epoll_wait, even though it is edge triggered
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, state->m_socket, &event))
+        {
+            perror("epoll_ctl");
+            LOG_ERROR("epoll_ctl add failed fd = " << state->m_socket \
+                << " errno = " << errno);
+            close_connection(state);
+            continue;
+        }
+
+        state->m_state = STATE_WAITING_FOR_EPOLL;
+    }
+}
+
+void EventLoop::close_connection(State* state)
+{
+    LOG_DEBUG(state->m_socket << ": closing connection");
+    m_connections.erase(state);
+    close(state->m_socket);
+    delete state;
+}
+
+bool EventLoop::serve(State* state)
+{
+    // Finish the previous response before taking new commands, the
+    // commands stay in the socket buffer in the meantime
+    if (STATE_WAITING_FOR_WRITABLE == state->m_state)
+    {
+        auto result = m_porchestrator->write_to_socket(*state);
+        if (WRITE_RESULT_PENDING == result)
+        {
+            state->m_state = STATE_WAITING_FOR_WRITABLE;
+            return true;
+        }
+        if (WRITE_RESULT_CLOSED == result || state->m_is_error)
+        {
+            close_connection(state);
+            return false;
+        }
+        state->clear();
+    }
+
+    // The commands held back by the output limit are already read,
+    // and run without waiting for the socket
+    do
+    {
+        bool has_commands = state->m_is_output_limited;
+        state->set_state(STATE_IN_READ_LOOP);
+        auto result = m_porchestrator->read_from_socket(*state);
+        if (READ_RESULT_CLOSED == result)
+        {
+            close_connection(state);
+            return false;
+        }
+
+        // Spurious wakeup, or only part of a command has arrived
+        if ((READ_RESULT_NO_DATA == result && !has_commands) ||
+            !m_porchestrator->parse_and_run(*state))
+        {
+            state->m_state = STATE_WAITING_FOR_EPOLL;
+            return true;
+        }
+
+        auto write_result = m_porchestrator->write_to_socket(*state);
+        if (WRITE_RESULT_PENDING == write_result)
+        {
+            state->set_state(STATE_WAITING_FOR_WRITABLE);
+            return true;
+        }
+
+        if (WRITE_RESULT_CLOSED == write_result || state->m_is_error)
+        {
+            close_connection(state);
+            return false;
+        }
+
+        state->clear();
+    } while (state->m_is_output_limited);
+
+    state->m_state = STATE_WAITING_FOR_EPOLL;
+    return true;
+}
+
+void EventLoop::loop()
+{
+    std::vector<struct epoll_event> events;
+    events.resize(m_batch_size);
+
+    while (!m_is_destroying)
+    {
+        int n_fd = epoll_wait(
+            m_epoll_fd,
+            events.data(),
+            (int)events.size(),
+            -1);
+
+        for (int i = 0; i < n_fd; i++)
+        {
+            State* state = static_cast<State*>(events[i].data.ptr);
+            if (state)
+            {
+                serve(state);
+                continue;
+            }
+
+            uint64_t count;
+            m_wakeup_pending = false;
+            if (read(m_wakeup_fd, &count, sizeof(count)) < 0 &&
+                EAGAIN != errno)
+            {
+                perror("read");
+                LOG_ERROR("eventfd read failed, errno = " << errno);
+            }
+            pick_up_new_connections();
+        }
+    }
+
+    pick_up_new_connections();
+    while (m_connections.size())
+        close_connection(*m_connections.begin());
+}
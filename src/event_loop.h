@@ -0,0 +1,197 @@
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+#include "common_include.h"
+#include "state.h"
+#include "cpu_topology.h"
+
+#include <pthread.h>
+#include <sys/epoll.h>
+
+class Orchestrator;
+
+/**
+ * @brief A run-to-completion event loop
+ * 
+ * This is the engine used in SERVER_MODE_EVENT_LOOP. Each event
+ * loop runs on its own thread, owns its own epoll instance and all
+ * the connections that the accepting thread handed to it. When
+ * a connection becomes readable, the loop reads it, parses and runs
+ * every complete command, and writes the responses back, all on the
+ * same thread. There are no queue handoffs and no per connection
+ * locks, since a connection is only ever touched by its own loop.
+ * 
+ */
+class EventLoop
+{
+public:
+    /**
+     * @brief the orchestrator that runs the commands
+     * 
+     */
+    Orchestrator*                   m_porchestrator;
+
+    /**
+     * @brief the epoll instance owned by this loop
+     * 
+     */
+    int                             m_epoll_fd;
+
+    /**
+     * @brief eventfd used to tell the loop about new connections,
+     * or that it must stop
+     * 
+     */
+    int                             m_wakeup_fd;
+
+    /**
+     * @brief set while a wakeup is pending on m_wakeup_fd
+     * 
+     */
+    std::atomic<bool>               m_wakeup_pending;
+
+    /**
+     * @brief the thread running the loop
+     * 
+     */
+    pthread_t                       m_thread_id;
+
+    /**
+     * @brief set to ask the loop to terminate
+     * 
+     */
+    std::atomic<bool>               m_is_destroying;
+
+    /**
+     * @brief set once the loop thread has been started
+     * 
+     */
+    bool                            m_is_running;
+
+    /**
+     * @brief connections accepted for this loop that it has not
+     * picked up yet
+     * 
+     */
+    std::vector<State*>             m_new_connections;
+
+    /**
+     * @brief mutex to synchronize m_new_connections
+     * 
+     */
+    std::mutex                      m_new_connections_mtx;
+
+    /**
+     * @brief all connections owned by this loop, only ever accessed
+     * by the loop thread
+     * 
+     */
+    std::unordered_set<State*>      m_connections;
+
+    /**
+     * @brief maximum number of events returned by one epoll_wait
+     * 
+     */
+    int                             m_batch_size;
+
+    /**
+     * @brief the CPUs the loop thread runs on, empty to let it run
+     * anywhere, set before start()
+     * 
+     */
+    cpu_set_t                       m_cpus;
+
+    EventLoop(Orchestrator* porch, int batch_size):
+        m_porchestrator(porch),
+        m_epoll_fd(-1),
+        m_wakeup_fd(-1),
+        m_wakeup_pending(false),
+        m_is_destroying(false),
+        m_is_running(false),
+        m_batch_size(batch_size)
+    {
+        CPU_ZERO(&m_cpus);
+    }
+
+    ~EventLoop()
+    {
+        stop();
+    }
+
+    /**
+     * @brief create the epoll instance and start the loop thread
+     * 
+     * @return true on success
+     * @return false on failure
+     */
+    bool start();
+
+    /**
+     * @brief ask the loop to stop, wait for it, and close all of
+     * its connections
+     * 
+     */
+    void stop();
+
+    /**
+     * @brief hand a newly accepted connection to this loop
+     * 
+     * This is called from the accepting thread.
+     * 
+     * @param fd the accepted socket
+     * @return true on success
+     * @return false on failure, the caller must close the socket
+     */
+    bool add_connection(int fd);
+
+    /**
+     * @brief wake up the loop thread
+     * 
+     */
+    void wakeup();
+
+    /**
+     * @brief The loop run by the event loop thread
+     * 
+     */
+    void loop();
+
+    /**
+     * @brief read, run and respond to everything available on a
+     * connection
+     * 
+     * @param state the connection
+     * @return true if the connection is still open
+     * @return false if it was closed
+     */
+    bool serve(State* state);
+
+    /**
+     * @brief register the connections handed over by the accepting
+     * thread with this loop's epoll instance
+     * 
+     */
+    void pick_up_new_connections();
+
+    /**
+     * @brief close a connection and free its state
+     * 
+     * @param state the connection
+     */
+    void close_connection(State* state);
+
+    /**
+     * @brief the pthread function for the loop thread. A static glue
+     * is required because pthread cannot deal object methods
+     * 
+     * @param arg pointer to the event loop
+     * @return void* nullptr
+     */
+    static void* thread_start_routine(void* arg)
+    {
+        static_cast<EventLoop*>(arg)->loop();
+        return nullptr;
+    }
+};
+
+#endif /* #ifndef EVENT_LOOP_H_ */
@@ -0,0 +1,96 @@
+#include "expiry_reclaimer.h"
+#include "logger.h"
+
+bool ExpiryReclaimer::pass(std::int64_t now)
+{
+    bool is_behind = false;
+    size_t num_expired = 0;
+
+    for (size_t i = 0; i < m_num_datastores; i++)
+    {
+        size_t work = m_datastores[i]->reclaim_expired(
+                        now, EXPIRY_BUDGET_PER_PASS, num_expired);
+        if (work >= EXPIRY_BUDGET_PER_PASS)
+            is_behind = true;
+    }
+
+    if (num_expired)
+        m_num_expired += num_expired;
+    return is_behind;
+}
+
+void ExpiryReclaimer::loop()
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&m_mutex);
+    while (!m_is_stopping)
+    {
+        deadline.tv_nsec += (long)EXPIRY_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (!m_is_stopping && \
+                ETIMEDOUT != pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+            ;
+
+        if (m_is_stopping)
+            break;
+
+        pthread_mutex_unlock(&m_mutex);
+        while (pass(unix_time_ms()) && !m_is_stopping)
+            ;
+        pthread_mutex_lock(&m_mutex);
+
+        // After a long catch up, the next pass is an interval away
+        // from now rather than from the missed deadline
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec + 1)
+            deadline = now;
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void* ExpiryReclaimer::thread_start_routine(void* arg)
+{
+    static_cast<ExpiryReclaimer*>(arg)->loop();
+    return nullptr;
+}
+
+bool ExpiryReclaimer::start()
+{
+    int retval;
+
+    if (m_is_running)
+        return true;
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        ExpiryReclaimer::thread_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void ExpiryReclaimer::stop()
+{
+    if (!m_is_running)
+        return;
+
+    pthread_mutex_lock(&m_mutex);
+    m_is_stopping = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread_id, nullptr);
+    m_is_running = false;
+}
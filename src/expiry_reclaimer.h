@@ -0,0 +1,127 @@
+#ifndef EXPIRY_RECLAIMER_H_
+#define EXPIRY_RECLAIMER_H_
+
+#include "common_include.h"
+#include "data_store.h"
+#include <pthread.h>
+#include <ctime>
+
+/**
+ * @brief time between two passes over the data stores, in
+ * milliseconds
+ *
+ */
+#define EXPIRY_INTERVAL_MS 10
+
+/**
+ * @brief the most work done on a data store while holding its lock,
+ * in timers handed out, timers cascaded and ticks
+ *
+ */
+#define EXPIRY_BUDGET_PER_PASS 64
+
+/**
+ * @brief Deletes the keys that expired, in the background
+ *
+ * Every EXPIRY_INTERVAL_MS, it runs the timer wheel of every data
+ * store, with a bounded budget, so that a data store is only locked
+ * for a short while. When many keys expire at once, a data store uses
+ * up its budget, and the reclaimer goes over the data stores again
+ * right away, instead of waiting for the next interval, so that
+ * requests get the lock in between.
+ *
+ */
+class ExpiryReclaimer
+{
+private:
+    DataStoreInterface**                    m_datastores;
+    size_t                                  m_num_datastores;
+
+    /**
+     * @brief used with m_cond, on the monotonic clock, to wait for the
+     * next pass, and to be woken up by stop()
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+
+    /**
+     * @brief set by stop(), and also looked at between the passes of a
+     * catch up, without the mutex
+     *
+     */
+    std::atomic<bool>                       m_is_stopping;
+
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief the loop of the reclaimer thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg);
+
+public:
+    /**
+     * @brief number of keys deleted by the reclaimer
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_expired;
+
+    /**
+     * @brief create a reclaimer
+     *
+     * @param datastores the data stores, must outlive the reclaimer or
+     * stop()
+     * @param num_datastores the number of data stores
+     */
+    ExpiryReclaimer(DataStoreInterface** datastores, size_t num_datastores):
+        m_datastores(datastores),
+        m_num_datastores(num_datastores),
+        m_mutex(PTHREAD_MUTEX_INITIALIZER),
+        m_is_stopping(false),
+        m_is_running(false),
+        m_thread_id(),
+        m_num_expired(0)
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&m_cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    ~ExpiryReclaimer()
+    {
+        stop();
+        pthread_cond_destroy(&m_cond);
+    }
+
+    /**
+     * @brief start the reclaimer thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop the reclaimer thread, and wait for it
+     *
+     */
+    void stop();
+
+    /**
+     * @brief run the timer wheel of every data store once. Called by
+     * the reclaimer thread, and by tests.
+     *
+     * @param now the current unix time in ms
+     * @return true if a data store used up its budget, and may have
+     * more keys to delete
+     * @return false otherwise
+     */
+    bool pass(std::int64_t now);
+};
+
+#endif /* #ifndef EXPIRY_RECLAIMER_H_ */
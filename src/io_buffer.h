@@ -0,0 +1,332 @@
+#ifndef IO_BUFFER_H_
+#define IO_BUFFER_H_
+
+#include "common_include.h"
+#include <cstdlib>
+#include <cstring>
+
+/**
+ * @brief initial capacity of an IoBuffer, allocated on first use
+ *
+ */
+#define IO_BUFFER_INITIAL_CAPACITY 4096
+
+/**
+ * @brief the largest capacity of an IoBuffer, so that its offsets fit
+ * in 32 bits
+ *
+ */
+#define IO_BUFFER_MAX_CAPACITY (1U << 31)
+
+/**
+ * @brief number of released blocks of IO_BUFFER_INITIAL_CAPACITY
+ * every thread keeps for the next buffers it allocates
+ *
+ */
+#define IO_BUFFER_CACHE_SIZE 256
+
+/**
+ * @brief A growable byte buffer for socket I/O
+ *
+ * Bytes are appended at the end and consumed from the front. The
+ * buffer tracks exact lengths and never relies on NUL termination,
+ * so it is binary safe. Consuming is just an offset bump, and the
+ * unconsumed bytes are only moved to the front when room is needed
+ * at the end.
+ *
+ * The memory is only allocated when bytes are written, and is given
+ * back by release() once the buffer is empty, so that a connection
+ * that waits for its next request holds none. Blocks of the initial
+ * capacity are kept by every thread for the next buffers it needs,
+ * so a request does not go to malloc() for them.
+ *
+ */
+class IoBuffer
+{
+private:
+    /**
+     * @brief the released blocks of IO_BUFFER_INITIAL_CAPACITY a
+     * thread keeps
+     *
+     */
+    struct BlockCache
+    {
+        char*               m_blocks[IO_BUFFER_CACHE_SIZE];
+        size_t              m_num_blocks;
+
+        /**
+         * @brief the most blocks kept, 0 once the thread exits, so
+         * that a buffer freed later does not keep its block
+         *
+         */
+        size_t              m_limit;
+
+        BlockCache(): m_num_blocks(0), m_limit(IO_BUFFER_CACHE_SIZE)
+        {
+        }
+
+        ~BlockCache()
+        {
+            while (m_num_blocks)
+                free(m_blocks[--m_num_blocks]);
+            m_limit = 0;
+        }
+    };
+
+    static BlockCache& get_cache()
+    {
+        static thread_local BlockCache t_cache;
+        return t_cache;
+    }
+
+    /**
+     * @brief the memory, nullptr until first used
+     *
+     */
+    char*                   m_data;
+
+    /**
+     * @brief offset of the first unconsumed byte
+     *
+     */
+    std::uint32_t           m_start;
+
+    /**
+     * @brief offset one past the last byte
+     *
+     */
+    std::uint32_t           m_end;
+
+    /**
+     * @brief size of m_data
+     *
+     */
+    std::uint32_t           m_capacity;
+
+    /**
+     * @brief set when an append could not allocate memory, and the
+     * data in the buffer is therefore incomplete
+     *
+     */
+    bool                    m_failed;
+
+    /**
+     * @brief free m_data, or keep it in the cache of the thread
+     *
+     */
+    void free_data()
+    {
+        BlockCache& cache = get_cache();
+        if (IO_BUFFER_INITIAL_CAPACITY == m_capacity &&
+            cache.m_num_blocks < cache.m_limit)
+            cache.m_blocks[cache.m_num_blocks++] = m_data;
+        else
+            free(m_data);
+    }
+
+public:
+    IoBuffer():
+        m_data(nullptr),
+        m_start(0),
+        m_end(0),
+        m_capacity(0),
+        m_failed(false)
+    {
+    }
+
+    ~IoBuffer()
+    {
+        free_data();
+    }
+
+    IoBuffer(const IoBuffer&) = delete;
+    IoBuffer& operator=(const IoBuffer&) = delete;
+
+    /**
+     * @brief the bytes that have not been consumed yet
+     *
+     * @return const char* the first byte
+     */
+    const char* data() const { return m_data + m_start; }
+
+    /**
+     * @brief number of bytes that have not been consumed yet
+     *
+     * @return size_t the number of bytes
+     */
+    size_t size() const { return m_end - m_start; }
+
+    /**
+     * @brief whether there is nothing left to consume
+     *
+     * @return true if the buffer is empty
+     */
+    bool empty() const { return m_end == m_start; }
+
+    /**
+     * @brief the unconsumed bytes as a view
+     *
+     * @return std::string_view the bytes, valid until the next
+     * modification of the buffer
+     */
+    std::string_view view() const
+    {
+        return std::string_view(data(), size());
+    }
+
+    /**
+     * @brief whether an append failed since the last clear()
+     *
+     * @return true if data was lost
+     */
+    bool has_failed() const { return m_failed; }
+
+    /**
+     * @brief drop bytes from the front
+     *
+     * @param n the number of bytes, at most size()
+     */
+    void consume(size_t n)
+    {
+        m_start += (std::uint32_t)n;
+        if (m_start == m_end)
+            m_start = m_end = 0;
+    }
+
+    /**
+     * @brief drop bytes from the end
+     *
+     * @param n the number of unconsumed bytes to keep, at most size()
+     */
+    void truncate(size_t n)
+    {
+        m_end = m_start + (std::uint32_t)n;
+        if (m_start == m_end)
+            m_start = m_end = 0;
+    }
+
+    /**
+     * @brief drop all bytes, keeping the memory until release()
+     *
+     */
+    void clear()
+    {
+        m_start = m_end = 0;
+        m_failed = false;
+    }
+
+    /**
+     * @brief make sure at least n bytes can be written at the end
+     *
+     * @param n the number of bytes
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool reserve(size_t n)
+    {
+        if (m_capacity - m_end >= n)
+            return true;
+
+        // Moving the unconsumed bytes to the front may be enough
+        if (m_start && m_capacity - size() >= n)
+        {
+            memmove(m_data, m_data + m_start, size());
+            m_end -= m_start;
+            m_start = 0;
+            return true;
+        }
+
+        if (n > IO_BUFFER_MAX_CAPACITY - size())
+            return false;
+
+        size_t capacity = m_capacity ? m_capacity : IO_BUFFER_INITIAL_CAPACITY;
+        while (capacity - size() < n)
+            capacity *= 2;
+
+        if (!m_data && IO_BUFFER_INITIAL_CAPACITY == capacity)
+        {
+            BlockCache& cache = get_cache();
+            m_data = cache.m_num_blocks ?
+                cache.m_blocks[--cache.m_num_blocks] :
+                static_cast<char*>(malloc(capacity));
+            if (!m_data)
+                return false;
+
+            m_capacity = (std::uint32_t)capacity;
+            return true;
+        }
+
+        if (m_start)
+        {
+            memmove(m_data, m_data + m_start, size());
+            m_end -= m_start;
+            m_start = 0;
+        }
+
+        char* p = static_cast<char*>(realloc(m_data, capacity));
+        if (!p)
+            return false;
+
+        m_data = p;
+        m_capacity = (std::uint32_t)capacity;
+        return true;
+    }
+
+    /**
+     * @brief where new bytes can be written, e.g. by read()
+     *
+     * @return char* the first free byte
+     */
+    char* write_ptr() { return m_data + m_end; }
+
+    /**
+     * @brief number of bytes that can be written at write_ptr()
+     *
+     * @return size_t the number of bytes
+     */
+    size_t write_size() const { return m_capacity - m_end; }
+
+    /**
+     * @brief account for bytes written at write_ptr()
+     *
+     * @param n the number of bytes, at most write_size()
+     */
+    void commit(size_t n) { m_end += (std::uint32_t)n; }
+
+    /**
+     * @brief append bytes at the end
+     *
+     * @param bytes the bytes
+     * @return true on success
+     * @return false if out of memory, has_failed() is then set
+     */
+    bool append(std::string_view bytes)
+    {
+        if (!reserve(bytes.size()))
+        {
+            m_failed = true;
+            return false;
+        }
+
+        memcpy(write_ptr(), bytes.data(), bytes.size());
+        commit(bytes.size());
+        return true;
+    }
+
+    /**
+     * @brief give the memory back if the buffer is empty, a block of
+     * the initial capacity to the cache of the thread
+     *
+     */
+    void release()
+    {
+        if (empty())
+        {
+            free_data();
+            m_data = nullptr;
+            m_start = m_end = m_capacity = 0;
+        }
+    }
+};
+
+#endif /* #ifndef IO_BUFFER_H_ */
@@ -0,0 +1,782 @@
+#include "io_uring_loop.h"
+#include "orchestrator.h"
+
+IoUringLoop::IoUringLoop(Orchestrator* porch, int listen_fd):
+    m_porchestrator(porch),
+    m_listen_fd(listen_fd),
+    m_ring_fd(-1),
+    m_ring_ptr(nullptr),
+    m_ring_size(0),
+    m_sqes(nullptr),
+    m_sqes_size(0),
+    m_sq_head(nullptr),
+    m_sq_tail(nullptr),
+    m_sq_array(nullptr),
+    m_sq_mask(0),
+    m_sq_entries(0),
+    m_sq_local_tail(0),
+    m_num_to_submit(0),
+    m_cq_head(nullptr),
+    m_cq_tail(nullptr),
+    m_cq_mask(0),
+    m_cqes(nullptr),
+    m_buffers(nullptr),
+    m_num_provided(0),
+    m_wakeup_fd(-1),
+    m_wakeup_value(0),
+    m_num_in_flight(0),
+    m_is_accepting(false),
+    m_is_destroying(false),
+    m_is_running(false),
+    m_num_enters(0),
+    m_num_completions(0)
+{
+    CPU_ZERO(&m_cpus);
+}
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/**
+ * @brief what a request is, kept in the low bits of its user_data.
+ * The other bits are the connection it is for, if any.
+ *
+ */
+typedef enum
+{
+    IO_URING_OP_NONE,
+    IO_URING_OP_ACCEPT,
+    IO_URING_OP_WAKEUP,
+    IO_URING_OP_RECEIVE,
+    IO_URING_OP_SEND,
+    IO_URING_OP_PROVIDE
+} io_uring_op_t;
+
+#define IO_URING_OP_MASK 7
+
+/**
+ * @brief the group of the buffers provided for the receives
+ *
+ */
+#define IO_URING_BUFFER_GROUP 0
+
+/**
+ * @brief the most bytes asked for by one send
+ *
+ */
+#define IO_URING_MAX_SEND (1 << 30)
+
+static std::uint64_t get_user_data(void* connection, io_uring_op_t op)
+{
+    return reinterpret_cast<std::uint64_t>(connection) | op;
+}
+
+/**
+ * @brief the user_data of a provide, with the buffers it is for in
+ * place of a connection
+ *
+ */
+static std::uint64_t get_provide_user_data(unsigned buffer_id, unsigned num_buffers)
+{
+    return ((std::uint64_t)buffer_id << 32) | ((std::uint64_t)num_buffers << 8) | IO_URING_OP_PROVIDE;
+}
+
+bool IoUringLoop::setup_ring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+
+    m_ring_fd = syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+    if (m_ring_fd < 0)
+    {
+        perror("io_uring_setup");
+        LOG_ERROR("io_uring_setup failed, errno = " << errno);
+        return false;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP))
+    {
+        LOG_ERROR("io_uring is missing features, Linux 6.0 or later is needed");
+        return false;
+    }
+
+    // The submission and completion queues share one mapping
+    m_ring_size = std::max(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    void* ring = mmap(
+                    nullptr,
+                    m_ring_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    m_ring_fd,
+                    IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring)
+    {
+        perror("mmap");
+        LOG_ERROR("mmap of the io_uring failed, errno = " << errno);
+        return false;
+    }
+    m_ring_ptr = ring;
+
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(
+                    nullptr,
+                    m_sqes_size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    m_ring_fd,
+                    IORING_OFF_SQES);
+    if (MAP_FAILED == sqes)
+    {
+        perror("mmap");
+        LOG_ERROR("mmap of the io_uring entries failed, errno = " << errno);
+        return false;
+    }
+    m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    char* base = static_cast<char*>(m_ring_ptr);
+    m_sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+    m_sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+    m_sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+    m_sq_entries = params.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+    m_cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe*>(base + params.cq_off.cqes);
+
+    m_buffers = new (std::nothrow) char[IO_URING_NUM_BUFFERS * IO_URING_BUFFER_SIZE];
+    if (!m_buffers)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    // A buffer is at most once in m_unprovided, keeping one never
+    // allocates
+    try
+    {
+        m_unprovided.reserve(IO_URING_NUM_BUFFERS);
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    // Copied out of by the loop thread, they go to its node
+    const CpuTopology& topology = CpuTopology::get();
+    std::vector<int> nodes;
+    topology.get_nodes_of(m_cpus, nodes);
+    if (topology.get_num_nodes() > 1 && 1 == nodes.size())
+        bind_memory_to_node(m_buffers, IO_URING_NUM_BUFFERS * IO_URING_BUFFER_SIZE, nodes[0]);
+
+    // Submitted ahead of the first receive
+    return provide_buffers(0, IO_URING_NUM_BUFFERS);
+}
+
+void IoUringLoop::destroy_ring()
+{
+    if (m_sqes)
+        munmap(m_sqes, m_sqes_size);
+    if (m_ring_ptr)
+        munmap(m_ring_ptr, m_ring_size);
+    if (m_ring_fd >= 0)
+        close(m_ring_fd);
+    delete[] m_buffers;
+
+    m_sqes = nullptr;
+    m_ring_ptr = nullptr;
+    m_ring_fd = -1;
+    m_buffers = nullptr;
+}
+
+struct io_uring_sqe* IoUringLoop::get_sqe()
+{
+    if (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+    {
+        // The kernel takes all the entries submitted, unless it fails
+        if (!enter(0) ||
+            m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+        {
+            LOG_ERROR("io_uring submission queue is full");
+            return nullptr;
+        }
+    }
+
+    unsigned index = m_sq_local_tail & m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    m_sq_local_tail++;
+    m_num_to_submit++;
+    return sqe;
+}
+
+bool IoUringLoop::enter(unsigned wait_for)
+{
+    // The entries are only seen by the kernel once they are filled in
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+
+    while (true)
+    {
+        int rc = syscall(
+                    __NR_io_uring_enter,
+                    m_ring_fd,
+                    m_num_to_submit,
+                    wait_for,
+                    IORING_ENTER_GETEVENTS,
+                    nullptr,
+                    0);
+        if (rc >= 0)
+        {
+            m_num_to_submit -= std::min((unsigned)rc, m_num_to_submit);
+            break;
+        }
+
+        if (EINTR == errno)
+            continue;
+
+        // The completions that overflowed must be reaped first
+        if (EBUSY == errno || EAGAIN == errno)
+            break;
+
+        perror("io_uring_enter");
+        LOG_ERROR("io_uring_enter failed, errno = " << errno);
+        return false;
+    }
+
+    m_num_enters.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+bool IoUringLoop::provide_buffers(unsigned buffer_id, unsigned num_buffers)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+    {
+        for (unsigned i = 0; i < num_buffers; i++)
+            m_unprovided.push_back(buffer_id + i);
+        return false;
+    }
+
+    // Only a failure has a completion
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = num_buffers;
+    sqe->addr = reinterpret_cast<std::uint64_t>(m_buffers + buffer_id * IO_URING_BUFFER_SIZE);
+    sqe->len = IO_URING_BUFFER_SIZE;
+    sqe->off = buffer_id;
+    sqe->buf_group = IO_URING_BUFFER_GROUP;
+    sqe->user_data = get_provide_user_data(buffer_id, num_buffers);
+
+    m_num_provided += num_buffers;
+    return true;
+}
+
+void IoUringLoop::provide_unprovided()
+{
+    while (!m_unprovided.empty())
+    {
+        unsigned buffer_id = m_unprovided.back();
+        m_unprovided.pop_back();
+        if (!provide_buffers(buffer_id, 1))
+            break;
+    }
+}
+
+void IoUringLoop::rearm_starved()
+{
+    // Armed after the buffers provided in the same submission, as many
+    // receives as there are buffers, in the order they starved. The
+    // others wait for the buffers these ones use to come back.
+    size_t num_rearmed = std::min(m_starved.size(), m_num_provided);
+    for (size_t i = 0; i < num_rearmed; i++)
+    {
+        Connection* connection = m_starved[i];
+        connection->m_is_starved = false;
+        if (!queue_receive(connection))
+        {
+            start_closing(connection);
+            set_ready(connection);
+        }
+    }
+
+    // A connection that starts closing leaves m_starved in serve(), by
+    // then it is not starved any more
+    m_starved.erase(m_starved.begin(), m_starved.begin() + num_rearmed);
+}
+
+bool IoUringLoop::queue_accept()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = get_user_data(nullptr, IO_URING_OP_ACCEPT);
+
+    m_is_accepting = true;
+    m_num_in_flight++;
+    return true;
+}
+
+bool IoUringLoop::queue_wakeup()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wakeup_fd;
+    sqe->addr = reinterpret_cast<std::uint64_t>(&m_wakeup_value);
+    sqe->len = sizeof(m_wakeup_value);
+    sqe->user_data = get_user_data(nullptr, IO_URING_OP_WAKEUP);
+
+    m_num_in_flight++;
+    return true;
+}
+
+bool IoUringLoop::queue_receive(Connection* connection)
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = connection->m_state.m_socket;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = IO_URING_BUFFER_GROUP;
+    sqe->user_data = get_user_data(connection, IO_URING_OP_RECEIVE);
+
+    connection->m_is_receiving = true;
+    m_num_in_flight++;
+    return true;
+}
+
+bool IoUringLoop::queue_send(Connection* connection)
+{
+    State& state = connection->m_state;
+
+    if (state.m_output.empty() && !state.m_special_error)
+        state.m_output.append(REPLY_ERROR);
+
+    // An unrecoverable error goes out after all the responses that
+    // were produced before it
+    if (state.m_special_error)
+    {
+        state.m_output.append(std::string_view(state.m_special_error));
+        state.m_special_error = nullptr;
+    }
+
+    // A response that is resumed is timed from its first send
+    if (STATE_IN_WRITE_LOOP != state.m_state)
+        state.set_state(STATE_IN_WRITE_LOOP);
+
+    struct io_uring_sqe* sqe = get_sqe();
+    if (!sqe)
+        return false;
+
+    // The output is not touched until the send completes
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = state.m_socket;
+    sqe->addr = reinterpret_cast<std::uint64_t>(state.m_output.data());
+    sqe->len = std::min(state.m_output.size(), (size_t)IO_URING_MAX_SEND);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = get_user_data(connection, IO_URING_OP_SEND);
+
+    connection->m_is_sending = true;
+    m_num_in_flight++;
+    return true;
+}
+
+void IoUringLoop::start_closing(Connection* connection)
+{
+    if (connection->m_is_closing)
+        return;
+
+    connection->m_is_closing = true;
+    if (connection->m_is_receiving || connection->m_is_sending)
+        shutdown(connection->m_state.m_socket, SHUT_RDWR);
+}
+
+void IoUringLoop::set_ready(Connection* connection)
+{
+    if (connection->m_is_ready)
+        return;
+
+    try
+    {
+        m_ready.push_back(connection);
+        connection->m_is_ready = true;
+    }
+    catch(...)
+    {
+        serve(connection);
+    }
+}
+
+void IoUringLoop::on_receive(Connection* connection, int res, unsigned flags)
+{
+    State& state = connection->m_state;
+
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        unsigned buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+        m_num_provided--;
+        if (res > 0 && !connection->m_is_closing &&
+            !state.m_input.append(std::string_view(
+                m_buffers + buffer_id * IO_URING_BUFFER_SIZE, res)))
+        {
+            LOG_ERROR(state.m_socket << ": Out of memory for input");
+            start_closing(connection);
+        }
+
+        // Kept for the next submission if the queue is full
+        provide_buffers(buffer_id, 1);
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        connection->m_is_receiving = false;
+
+    // The client closed the connection
+    if (0 == res)
+        start_closing(connection);
+    else if (res < 0 && -ENOBUFS != res)
+    {
+        if (!connection->m_is_closing && -ECONNRESET != res)
+            LOG_ERROR(state.m_socket << ": error, receive failed, err = " << -res);
+        start_closing(connection);
+    }
+
+    // A receive is ended by the kernel when it runs out of buffers, it
+    // waits for the ones used by this batch of completions to be
+    // provided again rather than fail again right away
+    if (!connection->m_is_receiving && !connection->m_is_closing)
+    {
+        bool is_starved = false;
+        if (-ENOBUFS == res)
+        {
+            try
+            {
+                m_starved.push_back(connection);
+                connection->m_is_starved = true;
+                is_starved = true;
+            }
+            catch(...)
+            {
+            }
+        }
+
+        if (!is_starved && !queue_receive(connection))
+            start_closing(connection);
+    }
+
+    set_ready(connection);
+}
+
+void IoUringLoop::on_send(Connection* connection, int res)
+{
+    State& state = connection->m_state;
+    connection->m_is_sending = false;
+    set_ready(connection);
+
+    if (res < 0)
+    {
+        if (!connection->m_is_closing && -EPIPE != res && -ECONNRESET != res)
+            LOG_ERROR(state.m_socket << ": Send failed, err = " << -res);
+        start_closing(connection);
+        return;
+    }
+
+    state.m_output.consume(res);
+    if (connection->m_is_closing)
+        return;
+
+    // The socket took only part of the responses
+    if (!state.m_output.empty())
+    {
+        if (!queue_send(connection))
+            start_closing(connection);
+        return;
+    }
+
+    ServerStats::get()->record_request(state);
+    if (state.m_is_error)
+    {
+        start_closing(connection);
+        return;
+    }
+
+    // The commands received in the meantime are run by serve()
+    state.clear();
+    state.m_state = STATE_WAITING_FOR_EPOLL;
+}
+
+void IoUringLoop::serve(Connection* connection)
+{
+    State& state = connection->m_state;
+    connection->m_is_ready = false;
+
+    if (!connection->m_is_closing && !connection->m_is_sending && !state.m_input.empty())
+    {
+        state.set_state(STATE_IN_READ_LOOP);
+        if (m_porchestrator->parse_and_run(state))
+        {
+            if (!queue_send(connection))
+                start_closing(connection);
+        }
+        else
+        {
+            // Only part of a command has arrived
+            state.m_state = STATE_WAITING_FOR_EPOLL;
+        }
+    }
+
+    if (connection->m_is_closing && !connection->m_is_receiving && !connection->m_is_sending)
+    {
+        LOG_DEBUG(state.m_socket << ": closing connection");
+        if (connection->m_is_starved)
+            m_starved.erase(std::find(m_starved.begin(), m_starved.end(), connection));
+        m_connections.erase(connection);
+        close(state.m_socket);
+        delete connection;
+    }
+}
+
+void IoUringLoop::reap()
+{
+    unsigned head = *m_cq_head;
+    unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+    std::uint64_t num_completions = tail - head;
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe* cqe = &m_cqes[head & m_cq_mask];
+        std::uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+
+        // The entry is handed back before requests are queued, which
+        // may need room in the completion queue
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+
+        auto op = user_data & IO_URING_OP_MASK;
+        auto connection = reinterpret_cast<Connection*>(user_data & ~(std::uint64_t)IO_URING_OP_MASK);
+        bool is_done = !(flags & IORING_CQE_F_MORE);
+        if (IO_URING_OP_NONE != op && IO_URING_OP_PROVIDE != op && is_done)
+            m_num_in_flight--;
+
+        switch (op)
+        {
+        case IO_URING_OP_ACCEPT:
+            if (res >= 0)
+            {
+                connection = new (std::nothrow) Connection(res);
+                if (!connection)
+                {
+                    LOG_ERROR("Out of memory");
+                    close(res);
+                    break;
+                }
+
+                LOG_DEBUG(res << ": Accepted by io_uring loop");
+                try
+                {
+                    m_connections.insert(connection);
+                }
+                catch(...)
+                {
+                    LOG_ERROR("Unknown exception");
+                    close(res);
+                    delete connection;
+                    break;
+                }
+
+                connection->m_state.m_state = STATE_WAITING_FOR_EPOLL;
+                if (!queue_receive(connection))
+                {
+                    start_closing(connection);
+                    serve(connection);
+                }
+            }
+            else if (-EINVAL != res && -ECANCELED != res)
+                LOG_ERROR("accept failed, err = " << -res);
+
+            // The listening socket was shut down when it is EINVAL
+            if (is_done)
+            {
+                m_is_accepting = false;
+                if (!m_is_destroying && -EINVAL != res && !queue_accept())
+                    LOG_ERROR("Could not accept connections anymore");
+            }
+            break;
+
+        case IO_URING_OP_WAKEUP:
+            if (!m_is_destroying)
+                queue_wakeup();
+            break;
+
+        case IO_URING_OP_RECEIVE:
+            on_receive(connection, res, flags);
+            break;
+
+        case IO_URING_OP_SEND:
+            on_send(connection, res);
+            break;
+
+        case IO_URING_OP_PROVIDE:
+        {
+            // Only failures complete, the buffers are tried again
+            unsigned buffer_id = user_data >> 32;
+            unsigned num_buffers = (user_data >> 8) & 0xffffff;
+            LOG_ERROR("io_uring could not provide " << num_buffers << " buffers, err = " << -res);
+            m_num_provided -= num_buffers;
+            for (unsigned i = 0; i < num_buffers; i++)
+                m_unprovided.push_back(buffer_id + i);
+            break;
+        }
+
+        default:
+            // A cancel finds nothing when the accept ended by itself
+            if (res < 0 && -ENOENT != res)
+                LOG_ERROR("io_uring request failed, err = " << -res);
+            break;
+        }
+    }
+
+    m_num_completions.fetch_add(num_completions, std::memory_order_relaxed);
+}
+
+void IoUringLoop::loop()
+{
+    if (!queue_wakeup() || !queue_accept())
+        LOG_ERROR("io_uring loop could not start accepting");
+
+    while (!m_is_destroying)
+    {
+        // No system call for the completions that are already there,
+        // unless there is something to submit
+        bool has_completions = *m_cq_head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        if ((m_num_to_submit || !has_completions) && !enter(has_completions ? 0 : 1))
+            break;
+
+        reap();
+        for (size_t i = 0; i < m_ready.size(); i++)
+            serve(m_ready[i]);
+        m_ready.clear();
+
+        provide_unprovided();
+        rearm_starved();
+        for (size_t i = 0; i < m_ready.size(); i++)
+            serve(m_ready[i]);
+        m_ready.clear();
+    }
+
+    // The requests left are ended by shutting their sockets down, and
+    // are waited for, since the kernel may still use the buffers
+    if (m_is_accepting)
+    {
+        struct io_uring_sqe* sqe = get_sqe();
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+            sqe->addr = get_user_data(nullptr, IO_URING_OP_ACCEPT);
+            sqe->user_data = get_user_data(nullptr, IO_URING_OP_NONE);
+        }
+    }
+    for (auto connection: m_connections)
+        start_closing(connection);
+
+    while (m_num_in_flight && enter(1))
+    {
+        reap();
+        for (size_t i = 0; i < m_ready.size(); i++)
+            serve(m_ready[i]);
+        m_ready.clear();
+    }
+
+    for (auto connection: m_connections)
+    {
+        close(connection->m_state.m_socket);
+        delete connection;
+    }
+    m_connections.clear();
+    m_starved.clear();
+}
+
+bool IoUringLoop::start()
+{
+    if (!setup_ring())
+        return false;
+
+    m_wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (m_wakeup_fd < 0)
+    {
+        perror("eventfd");
+        LOG_ERROR("eventfd failed, errno = " << errno);
+        return false;
+    }
+
+    int retval;
+    if (0 != (retval = create_pinned_thread(
+        &m_thread_id,
+        m_cpus,
+        IoUringLoop::thread_start_routine,
+        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval << " errno = " \
+            << errno);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void IoUringLoop::stop()
+{
+    if (m_is_running)
+    {
+        m_is_destroying = true;
+        std::uint64_t one = 1;
+        if (sizeof(one) != write(m_wakeup_fd, &one, sizeof(one)))
+        {
+            perror("write");
+            LOG_ERROR("eventfd write failed, errno = " << errno);
+        }
+        pthread_join(m_thread_id, nullptr);
+        m_is_running = false;
+    }
+
+    if (m_wakeup_fd >= 0)
+        close(m_wakeup_fd);
+    m_wakeup_fd = -1;
+    destroy_ring();
+}
+
+#else /* #ifdef HAVE_IO_URING */
+
+bool IoUringLoop::start()
+{
+    LOG_ERROR("The server is built without io_uring");
+    return false;
+}
+
+void IoUringLoop::stop()
+{
+}
+
+#endif /* #ifdef HAVE_IO_URING */
@@ -0,0 +1,383 @@
+#ifndef IO_URING_LOOP_H_
+#define IO_URING_LOOP_H_
+
+#include "common_include.h"
+#include "state.h"
+#include "cpu_topology.h"
+
+#include <pthread.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+
+/**
+ * @brief entries of the submission queue of every ring, the
+ * completion queue has twice as many
+ *
+ */
+#define IO_URING_ENTRIES 4096
+
+/**
+ * @brief number and size of the buffers every ring provides to the
+ * kernel for the receives, the number is a power of two
+ *
+ */
+#define IO_URING_NUM_BUFFERS 256
+#define IO_URING_BUFFER_SIZE 16384
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+class Orchestrator;
+
+/**
+ * @brief A run-to-completion loop on an io_uring
+ *
+ * This is the engine used in SERVER_MODE_IO_URING. It works like an
+ * EventLoop, every loop runs on its own thread and owns its
+ * connections, but the I/O is done by the kernel instead of being
+ * asked for once the sockets are ready:
+ *
+ * 1. Every loop has a multishot accept on the listening socket, so
+ * there is no accepting thread, and a connection belongs to the loop
+ * that accepted it.
+ * 2. Every connection has a multishot receive, which completes each
+ * time data arrives, into one of the IO_URING_NUM_BUFFERS buffers
+ * the loop provides to the kernel. The data is appended to the input
+ * of the connection, and the buffer is provided again with the next
+ * submission.
+ * 3. Once all the completions at hand are processed, the commands
+ * received are run, and a send of the responses of every connection
+ * is queued.
+ * 4. The sends are submitted by the same io_uring_enter that waits
+ * for the next completions.
+ *
+ * So a loop makes one system call per batch of completions, however
+ * many connections and commands they are for. A connection waits for
+ * its responses to be sent before it runs more commands, and what it
+ * receives in the meantime stays in its input.
+ *
+ * The ring is set up with the raw system calls of <linux/io_uring.h>,
+ * and the loop is only built where that header exists. It needs
+ * Linux 6.0 or later.
+ *
+ */
+class IoUringLoop
+{
+private:
+    /**
+     * @brief a connection, and the requests it has in the ring
+     *
+     */
+    struct Connection
+    {
+        State                       m_state;
+
+        /**
+         * @brief set while the multishot receive is armed, and while a
+         * send is in the ring
+         *
+         */
+        bool                        m_is_receiving;
+        bool                        m_is_sending;
+
+        /**
+         * @brief set once the connection must be closed, it is freed
+         * when it has no request left in the ring
+         *
+         */
+        bool                        m_is_closing;
+
+        /**
+         * @brief set while the connection is in m_ready
+         *
+         */
+        bool                        m_is_ready;
+
+        /**
+         * @brief set while the connection is in m_starved
+         *
+         */
+        bool                        m_is_starved;
+
+        explicit Connection(int fd):
+            m_state(fd),
+            m_is_receiving(false),
+            m_is_sending(false),
+            m_is_closing(false),
+            m_is_ready(false),
+            m_is_starved(false)
+        {
+        }
+    };
+
+    Orchestrator*                   m_porchestrator;
+
+    /**
+     * @brief the listening socket every loop accepts on
+     *
+     */
+    int                             m_listen_fd;
+
+    /**
+     * @brief the ring, and its mappings
+     *
+     */
+    int                             m_ring_fd;
+    void*                           m_ring_ptr;
+    size_t                          m_ring_size;
+    struct io_uring_sqe*            m_sqes;
+    size_t                          m_sqes_size;
+
+    /**
+     * @brief the submission queue, m_sq_local_tail counts the entries
+     * filled, which are published to the kernel on the next enter()
+     *
+     */
+    unsigned*                       m_sq_head;
+    unsigned*                       m_sq_tail;
+    unsigned*                       m_sq_array;
+    unsigned                        m_sq_mask;
+    unsigned                        m_sq_entries;
+    unsigned                        m_sq_local_tail;
+    unsigned                        m_num_to_submit;
+
+    /**
+     * @brief the completion queue
+     *
+     */
+    unsigned*                       m_cq_head;
+    unsigned*                       m_cq_tail;
+    unsigned                        m_cq_mask;
+    struct io_uring_cqe*            m_cqes;
+
+    /**
+     * @brief the buffers provided to the kernel for the receives
+     *
+     */
+    char*                           m_buffers;
+
+    /**
+     * @brief number of buffers the kernel has, as far as the
+     * completions tell
+     *
+     */
+    size_t                          m_num_provided;
+
+    /**
+     * @brief the buffers to provide again, because the submission
+     * queue was full or the kernel failed to take them. Room for all
+     * the buffers is reserved up front.
+     *
+     */
+    std::vector<unsigned>           m_unprovided;
+
+    /**
+     * @brief eventfd read by the ring, written to by stop()
+     *
+     */
+    int                             m_wakeup_fd;
+    std::uint64_t                   m_wakeup_value;
+
+    /**
+     * @brief requests in the ring that will complete, the loop waits
+     * for all of them before it frees the connections
+     *
+     */
+    size_t                          m_num_in_flight;
+
+    /**
+     * @brief set while the multishot accept is armed
+     *
+     */
+    bool                            m_is_accepting;
+
+    /**
+     * @brief all connections owned by this loop, only ever accessed
+     * by the loop thread
+     *
+     */
+    std::unordered_set<Connection*> m_connections;
+
+    /**
+     * @brief the connections that had a completion since they were
+     * last served
+     *
+     */
+    std::vector<Connection*>        m_ready;
+
+    /**
+     * @brief the connections whose receive ended for lack of buffers,
+     * it is armed again once the kernel has some
+     *
+     */
+    std::vector<Connection*>        m_starved;
+
+    pthread_t                       m_thread_id;
+    std::atomic<bool>               m_is_destroying;
+    bool                            m_is_running;
+
+    /**
+     * @brief the CPUs the loop thread runs on, empty to let it run
+     * anywhere
+     *
+     */
+    cpu_set_t                       m_cpus;
+
+    /**
+     * @brief create the ring, map it, and provide the buffers
+     *
+     * @return true on success
+     */
+    bool setup_ring();
+
+    /**
+     * @brief unmap and close the ring, and free the buffers
+     *
+     */
+    void destroy_ring();
+
+    /**
+     * @brief get a free entry of the submission queue
+     *
+     * @return io_uring_sqe* the entry, cleared, nullptr if the queue
+     * is full even after submitting it
+     */
+    struct io_uring_sqe* get_sqe();
+
+    /**
+     * @brief submit the entries filled, and wait for completions
+     *
+     * @param wait_for the number of completions to wait for
+     * @return true on success
+     */
+    bool enter(unsigned wait_for);
+
+    /**
+     * @brief provide buffers to the kernel
+     *
+     * @param buffer_id the first buffer
+     * @param num_buffers the number of buffers from that one
+     * @return true if queued
+     * @return false if the submission queue is full, the buffers are
+     * then kept in m_unprovided
+     */
+    bool provide_buffers(unsigned buffer_id, unsigned num_buffers);
+
+    /**
+     * @brief provide the buffers of m_unprovided, and arm the receives
+     * of the starved connections again if the kernel has buffers
+     *
+     */
+    void provide_unprovided();
+    void rearm_starved();
+
+    /**
+     * @brief queue the requests of the loop and of a connection
+     *
+     * @return true if queued
+     */
+    bool queue_accept();
+    bool queue_wakeup();
+    bool queue_receive(Connection* connection);
+    bool queue_send(Connection* connection);
+
+    /**
+     * @brief process all the completions in the completion queue
+     *
+     */
+    void reap();
+
+    /**
+     * @brief process the completion of a receive or of a send
+     *
+     */
+    void on_receive(Connection* connection, int res, unsigned flags);
+    void on_send(Connection* connection, int res);
+
+    /**
+     * @brief take a connection that had a completion in m_ready
+     *
+     */
+    void set_ready(Connection* connection);
+
+    /**
+     * @brief run the commands received on a connection and send the
+     * responses, or free it once it is closing and has no request left
+     *
+     */
+    void serve(Connection* connection);
+
+    /**
+     * @brief start closing a connection, its requests are ended by
+     * shutting the socket down
+     *
+     */
+    void start_closing(Connection* connection);
+
+    /**
+     * @brief the loop run by the loop thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg)
+    {
+        static_cast<IoUringLoop*>(arg)->loop();
+        return nullptr;
+    }
+
+public:
+    /**
+     * @brief calls of io_uring_enter, and completions processed, so
+     * that INFO shows the system calls per completion
+     *
+     */
+    std::atomic<std::uint64_t>      m_num_enters;
+    std::atomic<std::uint64_t>      m_num_completions;
+
+    /**
+     * @brief create a loop, start() sets it up
+     *
+     * @param porch the orchestrator that runs the commands
+     * @param listen_fd the listening socket
+     */
+    IoUringLoop(Orchestrator* porch, int listen_fd);
+
+    ~IoUringLoop()
+    {
+        stop();
+    }
+
+    /**
+     * @brief run the loop thread on a set of CPUs, must be called
+     * before start()
+     *
+     * The buffers of the ring then come from the node of the CPUs,
+     * if they are all on one.
+     *
+     * @param cpus the CPUs, an empty set to let it run anywhere
+     */
+    void set_cpus(const cpu_set_t& cpus) { m_cpus = cpus; }
+
+    /**
+     * @brief set the ring up and start the loop thread
+     *
+     * @return true on success
+     * @return false on failure, or if the server is built without
+     * io_uring
+     */
+    bool start();
+
+    /**
+     * @brief ask the loop to stop, wait for it, and close all of its
+     * connections
+     *
+     * The listening socket must have been shut down first.
+     *
+     */
+    void stop();
+};
+
+#endif /* #ifndef IO_URING_LOOP_H_ */
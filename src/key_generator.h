@@ -0,0 +1,149 @@
+#ifndef KEY_GENERATOR_H_
+#define KEY_GENERATOR_H_
+
+#include "common_include.h"
+#include <cmath>
+#include <cstdint>
+
+/**
+ * @brief How the keys of a benchmark are picked
+ *
+ */
+typedef enum
+{
+    /**
+     * @brief every key is as likely
+     *
+     */
+    KEY_DISTRIBUTION_UNIFORM,
+    /**
+     * @brief a few keys are hot, the n-th most popular key is picked
+     * with a probability proportional to 1 / n^theta
+     *
+     */
+    KEY_DISTRIBUTION_ZIPFIAN
+} key_distribution_t;
+
+/**
+ * @brief A small and fast xorshift random number generator, one per
+ * thread, so that picking keys does not contend on a shared state
+ *
+ */
+class FastRandom
+{
+private:
+    std::uint64_t           m_state;
+
+public:
+    explicit FastRandom(std::uint64_t seed): m_state(seed | 1) {}
+
+    std::uint64_t next()
+    {
+        m_state ^= m_state << 13;
+        m_state ^= m_state >> 7;
+        m_state ^= m_state << 17;
+        return m_state;
+    }
+
+    /**
+     * @brief a number in [0, 1)
+     *
+     */
+    double next_double()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+/**
+ * @brief Picks key indexes in [0, num_keys) with a given distribution
+ *
+ * The Zipfian generator follows "Quickly Generating Billion-Record
+ * Synthetic Databases" (Gray et al., SIGMOD 1994), as YCSB does. The
+ * popular keys are scattered over the key space by a hash, so that
+ * they do not all land in the same shard.
+ *
+ */
+class KeyGenerator
+{
+private:
+    key_distribution_t      m_distribution;
+    std::uint64_t           m_num_keys;
+    FastRandom              m_random;
+
+    double                  m_theta;
+    double                  m_zeta_n;
+    double                  m_alpha;
+    double                  m_eta;
+
+    static double zeta(std::uint64_t n, double theta)
+    {
+        double sum = 0;
+        for (std::uint64_t i = 1; i <= n; i++)
+            sum += 1.0 / std::pow((double)i, theta);
+        return sum;
+    }
+
+public:
+    /**
+     * @brief create a generator, the Zipfian setup is linear in the
+     * number of keys
+     *
+     * @param distribution the distribution
+     * @param num_keys number of keys, at least 1
+     * @param theta the skew of a Zipfian distribution, in (0, 1)
+     * @param seed the seed of the random numbers
+     */
+    KeyGenerator(
+        key_distribution_t distribution,
+        std::uint64_t num_keys,
+        double theta,
+        std::uint64_t seed):
+        m_distribution(distribution),
+        m_num_keys(std::max(num_keys, (std::uint64_t)1)),
+        m_random(seed),
+        m_theta(theta),
+        m_zeta_n(0),
+        m_alpha(0),
+        m_eta(0)
+    {
+        if (KEY_DISTRIBUTION_ZIPFIAN != m_distribution)
+            return;
+
+        double zeta_2 = zeta(2, theta);
+        m_zeta_n = zeta(m_num_keys, theta);
+        m_alpha = 1.0 / (1.0 - theta);
+        m_eta = (1.0 - std::pow(2.0 / m_num_keys, 1.0 - theta)) / \
+            (1.0 - zeta_2 / m_zeta_n);
+    }
+
+    /**
+     * @brief pick the next key
+     *
+     * @return std::uint64_t the key index
+     */
+    std::uint64_t next()
+    {
+        if (KEY_DISTRIBUTION_UNIFORM == m_distribution)
+            return m_random.next() % m_num_keys;
+
+        double u = m_random.next_double();
+        double uz = u * m_zeta_n;
+        std::uint64_t rank;
+        if (uz < 1.0)
+            rank = 0;
+        else if (uz < 1.0 + std::pow(0.5, m_theta))
+            rank = 1;
+        else
+            rank = (std::uint64_t)(m_num_keys * \
+                std::pow(m_eta * u - m_eta + 1.0, m_alpha));
+        rank = std::min(rank, m_num_keys - 1);
+
+        // Scatter the ranks with a multiplicative hash
+        return (rank * 0x9E3779B97F4A7C15ULL) % m_num_keys;
+    }
+
+    FastRandom& get_random() { return m_random; }
+};
+
+#endif /* #ifndef KEY_GENERATOR_H_ */
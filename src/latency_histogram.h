@@ -0,0 +1,188 @@
+#ifndef LATENCY_HISTOGRAM_H_
+#define LATENCY_HISTOGRAM_H_
+
+#include "common_include.h"
+#include <chrono>
+#include <cstdint>
+
+/**
+ * @brief each power of two is split into 1 << LATENCY_SUB_BUCKET_BITS
+ * buckets, so that a recorded value is off by at most 1/8th
+ *
+ */
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+
+/**
+ * @brief values from 2^LATENCY_MAX_BITS nanoseconds, about 17 seconds,
+ * up all go to the last bucket
+ *
+ */
+#define LATENCY_MAX_BITS 34
+
+#define LATENCY_NUM_BUCKETS \
+    ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+/**
+ * @brief the current time, for measuring latencies
+ *
+ * @return std::int64_t steady clock nanoseconds
+ */
+inline std::int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief A log-linear latency histogram in the style of HdrHistogram
+ *
+ * Only one thread records into a histogram, so the counts are updated
+ * with plain relaxed stores instead of read-modify-writes. Any thread
+ * can add them up into a LatencySnapshot at any time.
+ *
+ */
+class LatencyHistogram
+{
+private:
+    std::atomic<std::uint64_t>      m_counts[LATENCY_NUM_BUCKETS];
+
+public:
+    LatencyHistogram()
+    {
+        for (auto& count: m_counts)
+            count.store(0, std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief the bucket a value goes to
+     *
+     * Values below LATENCY_SUB_BUCKETS have a bucket each. Above, the
+     * bucket is picked by the highest set bit, and the
+     * LATENCY_SUB_BUCKET_BITS bits below it.
+     *
+     * @param ns the value, in nanoseconds
+     * @return int the index of the bucket
+     */
+    static int get_bucket(std::int64_t ns)
+    {
+        if (ns < LATENCY_SUB_BUCKETS)
+            return ns < 0 ? 0 : (int)ns;
+
+        int msb = 63 - __builtin_clzll((std::uint64_t)ns);
+        if (msb >= LATENCY_MAX_BITS)
+            return LATENCY_NUM_BUCKETS - 1;
+
+        int shift = msb - LATENCY_SUB_BUCKET_BITS;
+        return (shift + 1) * LATENCY_SUB_BUCKETS + \
+            (int)((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+    }
+
+    /**
+     * @brief the largest value that goes to a bucket
+     *
+     * @param bucket the index of the bucket
+     * @return std::int64_t the value, in nanoseconds
+     */
+    static std::int64_t get_bucket_limit(int bucket)
+    {
+        if (bucket < LATENCY_SUB_BUCKETS)
+            return bucket;
+
+        int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+        std::int64_t low = (std::int64_t)(LATENCY_SUB_BUCKETS + \
+            bucket % LATENCY_SUB_BUCKETS) << shift;
+        return low + ((std::int64_t)1 << shift) - 1;
+    }
+
+    /**
+     * @brief record a value, only called by the owning thread
+     *
+     * @param ns the value, in nanoseconds
+     */
+    void record(std::int64_t ns)
+    {
+        auto& count = m_counts[get_bucket(ns)];
+        count.store(count.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+    }
+
+    std::uint64_t get_count(int bucket) const
+    {
+        return m_counts[bucket].load(std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief The sum of any number of LatencyHistograms, at some point in
+ * time
+ *
+ */
+struct LatencySnapshot
+{
+    std::uint64_t                   m_counts[LATENCY_NUM_BUCKETS];
+    std::uint64_t                   m_total;
+
+    LatencySnapshot(): m_counts(), m_total(0) {}
+
+    /**
+     * @brief add the counts of a histogram
+     *
+     * @param histogram the histogram
+     */
+    void add(const LatencyHistogram& histogram)
+    {
+        for (int i = 0; i < LATENCY_NUM_BUCKETS; i++)
+        {
+            std::uint64_t count = histogram.get_count(i);
+            m_counts[i] += count;
+            m_total += count;
+        }
+    }
+
+    /**
+     * @brief the value below which a share of the recorded values are
+     *
+     * @param percentile between 0 and 100
+     * @return std::int64_t the upper limit of the bucket the
+     * percentile falls in, in nanoseconds, 0 if nothing was recorded
+     */
+    std::int64_t get_percentile(double percentile) const
+    {
+        if (!m_total)
+            return 0;
+
+        std::uint64_t wanted = (std::uint64_t)(percentile / 100.0 * m_total);
+        wanted = std::max(std::min(wanted, m_total), (std::uint64_t)1);
+
+        std::uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_NUM_BUCKETS; i++)
+        {
+            seen += m_counts[i];
+            if (seen >= wanted)
+                return LatencyHistogram::get_bucket_limit(i);
+        }
+        return LatencyHistogram::get_bucket_limit(LATENCY_NUM_BUCKETS - 1);
+    }
+
+    /**
+     * @brief format the count and the usual percentiles, for INFO
+     *
+     * @return std::string count=N,p50=...,p99=...,p999=...,max=...
+     * with the percentiles in microseconds
+     */
+    std::string to_string() const
+    {
+        std::stringstream ss;
+        ss.setf(std::ios::fixed);
+        ss.precision(3);
+        ss << "count=" << m_total \
+            << ",p50=" << get_percentile(50) / 1000.0 \
+            << ",p99=" << get_percentile(99) / 1000.0 \
+            << ",p999=" << get_percentile(99.9) / 1000.0 \
+            << ",max=" << get_percentile(100) / 1000.0;
+        return ss.str();
+    }
+};
+
+#endif /* #ifndef LATENCY_HISTOGRAM_H_ */
@@ -0,0 +1,490 @@
+#include "common_include.h"
+#include "latency_histogram.h"
+#include "key_generator.h"
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * @brief Settings of a load generator run
+ *
+ */
+struct LoadConfig
+{
+    std::string             m_host;
+    int                     m_port;
+
+    /**
+     * @brief number of client threads, each with its own connection
+     *
+     */
+    int                     m_clients;
+
+    /**
+     * @brief commands sent at once on a connection before waiting for
+     * their replies
+     *
+     */
+    int                     m_pipeline;
+
+    int                     m_duration_s;
+    int                     m_num_keys;
+    int                     m_value_size;
+
+    /**
+     * @brief shares of GET, SET and DEL, in percent
+     *
+     */
+    int                     m_get_percent;
+    int                     m_set_percent;
+    int                     m_del_percent;
+
+    key_distribution_t      m_distribution;
+    double                  m_zipf_theta;
+
+    /**
+     * @brief set all keys before measuring, so that GETs hit
+     *
+     */
+    bool                    m_is_preloading;
+
+    LoadConfig():
+        m_host("127.0.0.1"),
+        m_port(6379),
+        m_clients(8),
+        m_pipeline(1),
+        m_duration_s(10),
+        m_num_keys(100000),
+        m_value_size(16),
+        m_get_percent(80),
+        m_set_percent(20),
+        m_del_percent(0),
+        m_distribution(KEY_DISTRIBUTION_UNIFORM),
+        m_zipf_theta(0.99),
+        m_is_preloading(true)
+    {
+    }
+};
+
+/**
+ * @brief What one client thread measured
+ *
+ */
+struct ClientResult
+{
+    LatencyHistogram        m_latency;
+    std::uint64_t           m_ops;
+    std::uint64_t           m_hits;
+    std::uint64_t           m_misses;
+    std::uint64_t           m_errors;
+    bool                    m_has_failed;
+
+    ClientResult(): m_ops(0), m_hits(0), m_misses(0), m_errors(0), m_has_failed(false) {}
+};
+
+static void usage(const char* progname)
+{
+    std::cerr << "Usage: " << progname << " [options]" << std::endl;
+    std::cerr << "  --host HOST             server address (default 127.0.0.1)" << std::endl;
+    std::cerr << "  --port N                server port (default 6379)" << std::endl;
+    std::cerr << "  --clients N             client threads, one connection each (default 8)" << std::endl;
+    std::cerr << "  --pipeline N            commands in flight per connection (default 1)" << std::endl;
+    std::cerr << "  --duration N            seconds to run (default 10)" << std::endl;
+    std::cerr << "  --keys N                number of distinct keys (default 100000)" << std::endl;
+    std::cerr << "  --value-size N          bytes per value (default 16)" << std::endl;
+    std::cerr << "  --mix GET:SET:DEL       shares of the commands in percent (default 80:20:0)" << std::endl;
+    std::cerr << "  --distribution TYPE     uniform (default) or zipfian" << std::endl;
+    std::cerr << "  --zipf-theta X          skew of the zipfian distribution (default 0.99)" << std::endl;
+    std::cerr << "  --preload 0|1           set all keys before measuring (default 1)" << std::endl;
+}
+
+static bool parse_int(const char* s, int& value, int min)
+{
+    char* endptr = nullptr;
+    long n = strtol(s, &endptr, 10);
+    if (endptr == s || *endptr || n < min || n > INT32_MAX)
+        return false;
+    value = (int)n;
+    return true;
+}
+
+static bool parse_args(int argc, char** argv, LoadConfig& config)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* option = argv[i];
+        if (0 == strcmp(option, "--help"))
+            return false;
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << option << std::endl;
+            return false;
+        }
+
+        const char* value = argv[++i];
+        bool valid = true;
+
+        if (0 == strcmp(option, "--host"))
+            config.m_host = value;
+        else if (0 == strcmp(option, "--port"))
+            valid = parse_int(value, config.m_port, 1);
+        else if (0 == strcmp(option, "--clients"))
+            valid = parse_int(value, config.m_clients, 1);
+        else if (0 == strcmp(option, "--pipeline"))
+            valid = parse_int(value, config.m_pipeline, 1);
+        else if (0 == strcmp(option, "--duration"))
+            valid = parse_int(value, config.m_duration_s, 1);
+        else if (0 == strcmp(option, "--keys"))
+            valid = parse_int(value, config.m_num_keys, 1);
+        else if (0 == strcmp(option, "--value-size"))
+            valid = parse_int(value, config.m_value_size, 0);
+        else if (0 == strcmp(option, "--mix"))
+        {
+            int get, set, del;
+            valid = 3 == sscanf(value, "%d:%d:%d", &get, &set, &del) && \
+                get >= 0 && set >= 0 && del >= 0 && get + set + del == 100;
+            config.m_get_percent = get;
+            config.m_set_percent = set;
+            config.m_del_percent = del;
+        }
+        else if (0 == strcmp(option, "--distribution"))
+        {
+            if (0 == strcmp(value, "uniform"))
+                config.m_distribution = KEY_DISTRIBUTION_UNIFORM;
+            else if (0 == strcmp(value, "zipfian"))
+                config.m_distribution = KEY_DISTRIBUTION_ZIPFIAN;
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--zipf-theta"))
+        {
+            config.m_zipf_theta = atof(value);
+            valid = config.m_zipf_theta > 0 && config.m_zipf_theta < 1;
+        }
+        else if (0 == strcmp(option, "--preload"))
+        {
+            int preload;
+            valid = parse_int(value, preload, 0) && preload <= 1;
+            config.m_is_preloading = 1 == preload;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << option << std::endl;
+            return false;
+        }
+
+        if (!valid)
+        {
+            std::cerr << "Invalid value '" << value << "' for " << option << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+static int connect_to_server(const LoadConfig& config)
+{
+    struct addrinfo hints;
+    struct addrinfo* result;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    std::string port = std::to_string(config.m_port);
+    if (0 != getaddrinfo(config.m_host.c_str(), port.c_str(), &hints, &result))
+    {
+        std::cerr << "Could not resolve " << config.m_host << std::endl;
+        return -1;
+    }
+
+    int fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd >= 0 && 0 != connect(fd, result->ai_addr, result->ai_addrlen))
+    {
+        perror("connect");
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd >= 0)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ * @brief append a command in RESP form
+ *
+ * @param out the buffer
+ * @param args the name of the command, and its arguments
+ */
+static void append_command(std::string& out, std::initializer_list<std::string_view> args)
+{
+    out += "*" + std::to_string(args.size()) + "\r\n";
+    for (auto arg: args)
+    {
+        out += "$" + std::to_string(arg.size()) + "\r\n";
+        out.append(arg);
+        out += "\r\n";
+    }
+}
+
+/**
+ * @brief find the end of the reply at the start of a buffer
+ *
+ * @param p start of the buffer
+ * @param end end of the buffer
+ * @param next set to the first byte after the reply
+ * @return int the type byte of the reply, 'n' for a nil bulk string,
+ * 0 if the reply is incomplete
+ */
+static int scan_reply(const char* p, const char* end, const char*& next)
+{
+    const char* crlf = (const char*)memmem(p, end - p, "\r\n", 2);
+    if (!crlf)
+        return 0;
+
+    if ('$' != *p)
+    {
+        next = crlf + 2;
+        return *p;
+    }
+
+    long length = strtol(p + 1, nullptr, 10);
+    if (length < 0)
+    {
+        next = crlf + 2;
+        return 'n';
+    }
+    if (end - (crlf + 2) < length + 2)
+        return 0;
+    next = crlf + 2 + length + 2;
+    return '$';
+}
+
+static bool send_all(int fd, const std::string& data)
+{
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * @brief read replies until a number of them have arrived
+ *
+ * @param fd the connection
+ * @param buffer bytes read but not consumed yet, kept across calls
+ * @param count the number of replies
+ * @param on_reply called with the type of each reply, see scan_reply
+ * @return true on success
+ */
+template <typename F>
+static bool read_replies(int fd, std::string& buffer, int count, F on_reply)
+{
+    char chunk[65536];
+    size_t offset = 0;
+
+    while (count)
+    {
+        const char* next;
+        int type = scan_reply(buffer.data() + offset,
+                    buffer.data() + buffer.size(), next);
+        if (type)
+        {
+            offset = next - buffer.data();
+            on_reply(type);
+            count--;
+            continue;
+        }
+
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return false;
+        buffer.erase(0, offset);
+        offset = 0;
+        buffer.append(chunk, n);
+    }
+
+    buffer.erase(0, offset);
+    return true;
+}
+
+static std::string make_key(std::uint64_t index)
+{
+    return "key:" + std::to_string(index);
+}
+
+/**
+ * @brief set the keys of one client's share
+ *
+ * @return true on success
+ */
+static bool preload(const LoadConfig& config, int client, int fd, const std::string& value)
+{
+    const int BATCH = 64;
+    std::string request;
+    std::string buffer;
+
+    for (int first = client; first < config.m_num_keys; first += BATCH * config.m_clients)
+    {
+        int count = 0;
+        request.clear();
+        for (int i = first; i < config.m_num_keys && count < BATCH; i += config.m_clients, count++)
+            append_command(request, {"SET", make_key(i), value});
+
+        if (!send_all(fd, request) || !read_replies(fd, buffer, count, [](int) {}))
+            return false;
+    }
+    return true;
+}
+
+static void run_client(
+    const LoadConfig& config,
+    int client,
+    std::int64_t start_time,
+    ClientResult& result)
+{
+    int fd = connect_to_server(config);
+    if (fd < 0)
+    {
+        result.m_has_failed = true;
+        return;
+    }
+
+    std::string value(config.m_value_size, 'x');
+    KeyGenerator keys(config.m_distribution, config.m_num_keys,
+        config.m_zipf_theta, 0x12345 + client * 7919);
+    FastRandom& random = keys.get_random();
+
+    std::string request;
+    std::string buffer;
+    std::vector<std::int64_t> send_times(config.m_pipeline);
+    std::int64_t deadline = start_time + config.m_duration_s * 1000000000LL;
+
+    while (true)
+    {
+        std::int64_t now = now_ns();
+        if (now >= deadline)
+            break;
+
+        request.clear();
+        for (int i = 0; i < config.m_pipeline; i++)
+        {
+            std::string key = make_key(keys.next());
+            int dice = (int)(random.next() % 100);
+            if (dice < config.m_get_percent)
+                append_command(request, {"GET", key});
+            else if (dice < config.m_get_percent + config.m_set_percent)
+                append_command(request, {"SET", key, value});
+            else
+                append_command(request, {"DEL", key});
+        }
+
+        std::int64_t sent = now_ns();
+        if (!send_all(fd, request) || \
+            !read_replies(fd, buffer, config.m_pipeline, [&](int type) {
+                result.m_latency.record(now_ns() - sent);
+                result.m_ops++;
+                if ('$' == type)
+                    result.m_hits++;
+                else if ('n' == type)
+                    result.m_misses++;
+                else if ('-' == type)
+                    result.m_errors++;
+            }))
+        {
+            std::cerr << "Client " << client << ": connection lost" << std::endl;
+            result.m_has_failed = true;
+            break;
+        }
+    }
+
+    close(fd);
+}
+
+int main(int argc, char** argv)
+{
+    LoadConfig config;
+    if (!parse_args(argc, argv, config))
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (config.m_is_preloading)
+    {
+        std::string value(config.m_value_size, 'x');
+        std::vector<std::thread> loaders;
+        std::atomic<bool> has_failed = false;
+        for (int c = 0; c < config.m_clients; c++)
+            loaders.emplace_back([&, c]() {
+                int fd = connect_to_server(config);
+                if (fd < 0 || !preload(config, c, fd, value))
+                    has_failed = true;
+                if (fd >= 0)
+                    close(fd);
+            });
+        for (auto& loader: loaders)
+            loader.join();
+        if (has_failed)
+        {
+            std::cerr << "Preloading the keys failed" << std::endl;
+            exit(1);
+        }
+    }
+
+    std::vector<ClientResult> results(config.m_clients);
+    std::vector<std::thread> clients;
+    std::int64_t start_time = now_ns();
+    for (int c = 0; c < config.m_clients; c++)
+        clients.emplace_back(run_client, std::cref(config), c, start_time, std::ref(results[c]));
+    for (auto& client: clients)
+        client.join();
+    double elapsed = (now_ns() - start_time) / 1e9;
+
+    LatencySnapshot latency;
+    ClientResult total;
+    for (auto& result: results)
+    {
+        latency.add(result.m_latency);
+        total.m_ops += result.m_ops;
+        total.m_hits += result.m_hits;
+        total.m_misses += result.m_misses;
+        total.m_errors += result.m_errors;
+        total.m_has_failed |= result.m_has_failed;
+    }
+
+    std::cout << config.m_clients << " clients, pipeline " << config.m_pipeline \
+        << ", " << config.m_num_keys << " keys " \
+        << (KEY_DISTRIBUTION_ZIPFIAN == config.m_distribution ? "zipfian" : "uniform") \
+        << ", " << config.m_value_size << " byte values, mix " << config.m_get_percent \
+        << ":" << config.m_set_percent << ":" << config.m_del_percent << std::endl;
+    std::cout << "ops: " << total.m_ops << " in " << elapsed << "s, " \
+        << (std::uint64_t)(total.m_ops / elapsed) << " ops/s" << std::endl;
+    std::cout << "hits: " << total.m_hits << ", misses: " << total.m_misses \
+        << ", errors: " << total.m_errors << std::endl;
+    std::cout << "latency (us): p50 " << latency.get_percentile(50) / 1000.0 \
+        << ", p99 " << latency.get_percentile(99) / 1000.0 \
+        << ", p999 " << latency.get_percentile(99.9) / 1000.0 \
+        << ", max " << latency.get_percentile(100) / 1000.0 << std::endl;
+
+    return total.m_has_failed || total.m_errors ? 1 : 0;
+}
@@ -0,0 +1,477 @@
+#include "logger.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+
+std::atomic<int> g_log_level(LOG_LEVEL);
+
+/**
+ * @brief The log buffer of one thread, a ring of bytes with a single
+ * producer, the thread, and a single consumer, the flusher
+ *
+ * Only complete lines are ever published, so whatever the consumer
+ * finds can be written out as is.
+ *
+ */
+struct LogRing
+{
+    char                                        m_data[LOG_RING_SIZE];
+
+    /**
+     * @brief total bytes ever written, only changed by the producer
+     *
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_head;
+
+    /**
+     * @brief total bytes ever read, only changed by the consumer
+     *
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> m_tail;
+
+    /**
+     * @brief set when the thread has exited, the ring is freed once
+     * it has been drained
+     *
+     */
+    std::atomic<bool>                           m_is_orphaned;
+
+    LogRing(): m_head(0), m_tail(0), m_is_orphaned(false) {}
+
+    /**
+     * @brief add a line, called by the producer
+     *
+     * @param line the line
+     * @return true on success
+     * @return false if there is no room
+     */
+    bool push(std::string_view line)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        size_t tail = m_tail.load(std::memory_order_acquire);
+        if (LOG_RING_SIZE - (head - tail) < line.size())
+            return false;
+
+        size_t offset = head % LOG_RING_SIZE;
+        size_t first = std::min(line.size(), LOG_RING_SIZE - offset);
+        memcpy(m_data + offset, line.data(), first);
+        memcpy(m_data, line.data() + first, line.size() - first);
+
+        m_head.store(head + line.size(), std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief take bytes out, called by the consumer
+     *
+     * @param out where the bytes are copied to
+     * @param size the room in out
+     * @return size_t the number of bytes copied
+     */
+    size_t pop(char* out, size_t size)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t head = m_head.load(std::memory_order_acquire);
+        size_t n = std::min(size, head - tail);
+
+        size_t offset = tail % LOG_RING_SIZE;
+        size_t first = std::min(n, LOG_RING_SIZE - offset);
+        memcpy(out, m_data + offset, first);
+        memcpy(out + first, m_data, n - first);
+
+        m_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+};
+
+/**
+ * @brief Writes the lines of all threads to stderr in the background
+ *
+ * The flusher sleeps until a thread logs a line, waits a little so
+ * that more lines pile up, and writes out everything at once. Threads
+ * only take the mutex when they register their ring, and when they
+ * wake the flusher up.
+ *
+ */
+class LogFlusher
+{
+private:
+    /**
+     * @brief protects m_rings and m_is_stopping, used with m_cond
+     *
+     */
+    pthread_mutex_t                 m_mutex;
+    pthread_cond_t                  m_cond;
+    std::vector<LogRing*>           m_rings;
+    bool                            m_is_stopping;
+    bool                            m_is_running;
+    pthread_t                       m_thread_id;
+
+    /**
+     * @brief serializes drain(), between the flusher and log_flush()
+     *
+     */
+    pthread_mutex_t                 m_drain_mutex;
+
+    /**
+     * @brief set when lines were added since the last drain
+     *
+     */
+    std::atomic<bool>               m_is_pending;
+
+    /**
+     * @brief drops already reported, protected by m_drain_mutex
+     *
+     */
+    std::uint64_t                   m_reported_dropped;
+
+    void loop();
+
+    static void* thread_start_routine(void* arg)
+    {
+        static_cast<LogFlusher*>(arg)->loop();
+        return nullptr;
+    }
+
+public:
+    /**
+     * @brief number of lines dropped
+     *
+     */
+    std::atomic<std::uint64_t>      m_dropped;
+
+    LogFlusher():
+        m_mutex(PTHREAD_MUTEX_INITIALIZER),
+        m_is_stopping(false),
+        m_is_running(false),
+        m_thread_id(),
+        m_drain_mutex(PTHREAD_MUTEX_INITIALIZER),
+        m_is_pending(false),
+        m_reported_dropped(0),
+        m_dropped(0)
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&m_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if (0 == pthread_create(&m_thread_id, NULL,
+                                LogFlusher::thread_start_routine, this))
+            m_is_running = true;
+    }
+
+    /**
+     * @brief create a ring for the calling thread
+     *
+     * @return LogRing* the ring, or nullptr if out of memory
+     */
+    LogRing* register_ring();
+
+    /**
+     * @brief let the flusher know that there are lines to write
+     *
+     */
+    void notify()
+    {
+        if (m_is_pending.load(std::memory_order_relaxed) || \
+                m_is_pending.exchange(true))
+            return;
+
+        pthread_mutex_lock(&m_mutex);
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+    }
+
+    /**
+     * @brief write out every line buffered so far
+     *
+     */
+    void drain();
+
+    size_t get_num_rings()
+    {
+        pthread_mutex_lock(&m_mutex);
+        size_t num_rings = m_rings.size();
+        pthread_mutex_unlock(&m_mutex);
+        return num_rings;
+    }
+
+    /**
+     * @brief stop the flusher thread, and write what is left
+     *
+     */
+    void stop();
+};
+
+/**
+ * @brief the flusher, created on first use and never destroyed, so
+ * that threads still logging at exit never use a dead object
+ *
+ * @return LogFlusher* the flusher
+ */
+static LogFlusher* get_flusher()
+{
+    static LogFlusher* flusher = []() {
+        LogFlusher* f = new LogFlusher;
+        atexit([]() { get_flusher()->stop(); });
+        return f;
+    }();
+    return flusher;
+}
+
+LogRing* LogFlusher::register_ring()
+{
+    LogRing* ring = new (std::nothrow) LogRing;
+    if (!ring)
+        return nullptr;
+
+    pthread_mutex_lock(&m_mutex);
+    try
+    {
+        m_rings.push_back(ring);
+    }
+    catch (...)
+    {
+        delete ring;
+        ring = nullptr;
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    return ring;
+}
+
+void LogFlusher::drain()
+{
+    char                    buffer[LOG_RING_SIZE];
+    std::vector<LogRing*>   rings;
+
+    pthread_mutex_lock(&m_drain_mutex);
+
+    m_is_pending.store(false);
+
+    pthread_mutex_lock(&m_mutex);
+    try
+    {
+        rings = m_rings;
+    }
+    catch (...)
+    {
+    }
+    pthread_mutex_unlock(&m_mutex);
+
+    for (auto ring: rings)
+    {
+        // Read first, the last lines of an exited thread are still
+        // drained below
+        bool is_orphaned = ring->m_is_orphaned.load();
+
+        size_t n;
+        while ((n = ring->pop(buffer, sizeof(buffer))))
+        {
+            for (size_t done = 0; done < n; )
+            {
+                ssize_t written = write(STDERR_FILENO, buffer + done, n - done);
+                if (written <= 0 && EINTR != errno)
+                    break;
+                if (written > 0)
+                    done += written;
+            }
+        }
+
+        if (is_orphaned)
+        {
+            pthread_mutex_lock(&m_mutex);
+            m_rings.erase(std::find(m_rings.begin(), m_rings.end(), ring));
+            pthread_mutex_unlock(&m_mutex);
+            delete ring;
+        }
+    }
+
+    std::uint64_t dropped = m_dropped.load();
+    if (dropped != m_reported_dropped)
+    {
+        int n = snprintf(buffer, sizeof(buffer), "%llu log lines dropped\n",
+                    (unsigned long long)(dropped - m_reported_dropped));
+        if (n > 0)
+        {
+            ssize_t written = write(STDERR_FILENO, buffer, n);
+            (void)written;
+        }
+        m_reported_dropped = dropped;
+    }
+
+    pthread_mutex_unlock(&m_drain_mutex);
+}
+
+void LogFlusher::loop()
+{
+    pthread_mutex_lock(&m_mutex);
+    while (!m_is_stopping)
+    {
+        if (!m_is_pending.load())
+        {
+            pthread_cond_wait(&m_cond, &m_mutex);
+            continue;
+        }
+
+        // Let the rest of a burst pile up
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_DELAY_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!m_is_stopping && \
+                ETIMEDOUT != pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+            ;
+
+        pthread_mutex_unlock(&m_mutex);
+        drain();
+        pthread_mutex_lock(&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void LogFlusher::stop()
+{
+    if (m_is_running)
+    {
+        pthread_mutex_lock(&m_mutex);
+        m_is_stopping = true;
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_mutex);
+
+        pthread_join(m_thread_id, nullptr);
+        m_is_running = false;
+    }
+
+    drain();
+}
+
+/**
+ * @brief The logging state of a thread
+ *
+ */
+struct ThreadLog
+{
+    LogLineBuffer       m_buffer;
+    std::ostream        m_stream;
+
+    /**
+     * @brief discards everything, for nested lines
+     *
+     */
+    std::ostream        m_sink;
+
+    /**
+     * @brief the ring, created on the first line
+     *
+     */
+    LogRing*            m_ring;
+
+    /**
+     * @brief set while a line is being formatted on m_stream
+     *
+     */
+    bool                m_is_in_use;
+
+    ThreadLog():
+        m_stream(&m_buffer),
+        m_sink(nullptr),
+        m_ring(nullptr),
+        m_is_in_use(false)
+    {
+    }
+
+    ~ThreadLog()
+    {
+        if (m_ring)
+        {
+            m_ring->m_is_orphaned.store(true);
+            get_flusher()->notify();
+        }
+    }
+};
+
+static thread_local ThreadLog t_log;
+
+LogLine::LogLine(): m_stream(&t_log.m_sink), m_is_nested(true)
+{
+    ThreadLog& log = t_log;
+    if (log.m_is_in_use)
+        return;
+
+    log.m_is_in_use = true;
+    log.m_buffer.reset();
+
+    // Formatting flags set by the previous line do not carry over
+    log.m_stream.clear();
+    log.m_stream.flags(std::ios_base::dec | std::ios_base::skipws);
+    log.m_stream.fill(' ');
+    log.m_stream.precision(6);
+
+    m_stream = &log.m_stream;
+    m_is_nested = false;
+}
+
+LogLine::~LogLine()
+{
+    LogFlusher* flusher = get_flusher();
+
+    if (m_is_nested)
+    {
+        flusher->m_dropped++;
+        return;
+    }
+
+    ThreadLog& log = t_log;
+    log.m_is_in_use = false;
+
+    if (!log.m_ring && !(log.m_ring = flusher->register_ring()))
+    {
+        flusher->m_dropped++;
+        return;
+    }
+
+    if (!log.m_ring->push(log.m_buffer.finish()))
+        flusher->m_dropped++;
+
+    flusher->notify();
+}
+
+void log_set_level(int level)
+{
+    g_log_level.store(std::max(level, LOG_LEVEL));
+}
+
+bool log_parse_level(const char* name, int& level)
+{
+    static const char* names[] = {"trace", "debug", "info", "warn", "error", "none"};
+
+    for (int i = LOG_LEVEL_TRACE; i <= LOG_LEVEL_NONE; i++)
+    {
+        if (0 == strcmp(name, names[i]))
+        {
+            level = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+void log_flush()
+{
+    get_flusher()->drain();
+}
+
+std::uint64_t log_get_dropped()
+{
+    return get_flusher()->m_dropped.load();
+}
+
+size_t log_get_num_rings()
+{
+    return get_flusher()->get_num_rings();
+}
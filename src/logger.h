@@ -0,0 +1,217 @@
+#ifndef LOGGER_H_
+#define LOGGER_H_
+
+#include "common_include.h"
+#include <streambuf>
+#include <ostream>
+
+/**
+ * @brief Log levels, in increasing severity
+ *
+ */
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_NONE  5
+
+/**
+ * @brief the lowest level compiled in, set by the Makefile. Logs below
+ * it compile to nothing, their arguments are not even evaluated.
+ *
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/**
+ * @brief bytes buffered per thread, a line that does not fit is
+ * dropped rather than blocking the thread
+ *
+ */
+#define LOG_RING_SIZE (64 * 1024)
+
+/**
+ * @brief longest line, longer ones are truncated
+ *
+ */
+#define LOG_MAX_LINE 1024
+
+/**
+ * @brief how long the flusher waits after the first line of a batch,
+ * so that a burst is written with few system calls
+ *
+ */
+#define LOG_FLUSH_DELAY_MS 10
+
+/**
+ * @brief the lowest level logged at run time, at least LOG_LEVEL
+ *
+ */
+extern std::atomic<int> g_log_level;
+
+/**
+ * @brief set the lowest level logged at run time
+ *
+ * Levels below LOG_LEVEL are compiled out, and stay off.
+ *
+ * @param level one of LOG_LEVEL_*
+ */
+void log_set_level(int level);
+
+/**
+ * @brief parse a level name
+ *
+ * @param name trace, debug, info, warn, error or none
+ * @param level the level
+ * @return true if the name is valid
+ */
+bool log_parse_level(const char* name, int& level);
+
+/**
+ * @brief write all buffered lines now, and wait until they are
+ * written
+ *
+ */
+void log_flush();
+
+/**
+ * @brief number of lines dropped because a buffer was full
+ *
+ * @return std::uint64_t the number of lines
+ */
+std::uint64_t log_get_dropped();
+
+/**
+ * @brief number of thread buffers, the one of a thread that exited is
+ * freed once drained
+ *
+ * @return size_t the number of buffers
+ */
+size_t log_get_num_rings();
+
+/**
+ * @brief A stream buffer over a fixed array, so that formatting a line
+ * does not allocate
+ *
+ */
+class LogLineBuffer: public std::streambuf
+{
+private:
+    char                m_buffer[LOG_MAX_LINE];
+
+protected:
+    /**
+     * @brief the line is full, the rest of it is dropped
+     *
+     */
+    int_type overflow(int_type c) override
+    {
+        return traits_type::not_eof(c);
+    }
+
+public:
+    LogLineBuffer()
+    {
+        reset();
+    }
+
+    /**
+     * @brief start a new line, keeping room for the newline
+     *
+     */
+    void reset()
+    {
+        setp(m_buffer, m_buffer + LOG_MAX_LINE - 1);
+    }
+
+    /**
+     * @brief end the line with a newline
+     *
+     * @return std::string_view the whole line
+     */
+    std::string_view finish()
+    {
+        *pptr() = '\n';
+        return std::string_view(m_buffer, pptr() - m_buffer + 1);
+    }
+};
+
+/**
+ * @brief One line being logged, which is handed to the buffer of the
+ * thread when the object goes out of scope
+ *
+ * Use the LOG_* macros instead of this class directly.
+ *
+ */
+class LogLine
+{
+private:
+    /**
+     * @brief the stream the line is formatted on
+     *
+     */
+    std::ostream*       m_stream;
+
+    /**
+     * @brief set for a line logged while formatting another line on
+     * the same thread. It goes to a stream that discards it, and is
+     * counted as dropped.
+     *
+     */
+    bool                m_is_nested;
+
+public:
+    LogLine();
+    ~LogLine();
+
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    std::ostream& stream() { return *m_stream; }
+};
+
+#define LOG_AT(level, expr) \
+    do \
+    { \
+        if ((level) >= g_log_level.load(std::memory_order_relaxed)) \
+        { \
+            LogLine log_line; \
+            log_line.stream() << expr; \
+        } \
+    } while (0)
+
+#define LOG_DISABLED(expr) do {} while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(expr) LOG_AT(LOG_LEVEL_TRACE, expr)
+#else
+#define LOG_TRACE(expr) LOG_DISABLED(expr)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(expr) LOG_AT(LOG_LEVEL_DEBUG, expr)
+#else
+#define LOG_DEBUG(expr) LOG_DISABLED(expr)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(expr) LOG_AT(LOG_LEVEL_INFO, expr)
+#else
+#define LOG_INFO(expr) LOG_DISABLED(expr)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(expr) LOG_AT(LOG_LEVEL_WARN, expr)
+#else
+#define LOG_WARN(expr) LOG_DISABLED(expr)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(expr) LOG_AT(LOG_LEVEL_ERROR, expr)
+#else
+#define LOG_ERROR(expr) LOG_DISABLED(expr)
+#endif
+
+#endif /* #ifndef LOGGER_H_ */
@@ -1,4 +1,5 @@
 #include "orchestrator.h"
+#include <charconv>
 
 /**
  * @brief close a file descriptor and remove all associated data
@@ -29,7 +30,7 @@ void Orchestrator::create_server_socket()
     if (m_server_socket <= 0)
     {
         perror("socket");
-        std::cerr << "Could not create socket, errno = " << errno << std::endl;
+        LOG_ERROR("Could not create socket, errno = " << errno);
         assert(0);
         exit(1);
     }
@@ -42,13 +43,13 @@ void Orchestrator::create_server_socket()
             sizeof(opt)))
     {
         perror("setsockopt");
-        std::cerr << "setsockopt failed with error = " << errno << std::endl;
+        LOG_ERROR("setsockopt failed with error = " << errno);
         assert(0);
         exit(1);
     }
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORTNUM);
+    address.sin_port = htons(m_config.m_port);
 
     if (bind(
             m_server_socket,
@@ -56,15 +57,17 @@ void Orchestrator::create_server_socket()
             sizeof(address)))
     {
         perror("bind");
-        std::cerr << "bind failed with error = " << errno << std::endl;
+        LOG_ERROR("bind failed with error = " << errno);
         assert(0);
         exit(1);
     }
 
-    if (listen(m_server_socket, 10) < 0)
+    // A burst of clients must not overflow the queue of connections
+    // waiting to be accepted, a dropped SYN is retried a second later
+    if (listen(m_server_socket, SOMAXCONN) < 0)
     {
         perror("listen");
-        std::cerr << "listen failed with error = " << errno << std::endl;
+        LOG_ERROR("listen failed with error = " << errno);
         exit(1);
     }
 }
@@ -78,36 +81,20 @@ void Orchestrator::create_server_socket()
 bool Orchestrator::spawn_accepting_thread()
 {
     int retval;
-    if (0 != (retval = pthread_create(
+    if (0 != (retval = create_pinned_thread(
         &m_accepting_thread_id,
-        NULL,
+        m_placement.m_io_cpus,
         Orchestrator::accepting_thread_pthread_fn,
         this)))
     {
-        std::cerr << "pthread_create failed with rc = " << retval \
-                << " errno = " << errno << std::endl;
+        LOG_ERROR("pthread_create failed with rc = " << retval << " errno = " \
+            << errno);
         return false;
     }
 
     return true;
 }
 
-/**
- * @brief signal handler used to trap SIGUSR1
- * The signal mechanism is used to interrupt the epoll_wait
- * system call. In case a new connection is accepted, it
- * must be added to the epoll structure immediately.
- * 
- * @param signo the signal 
- * @param info 
- * @param context 
- */
-void sigusr1_handler(int signo, siginfo_t *info, void *context)
-{
-    std::cout << "sigusr1 delivered" << std::endl;
-    return;
-}
-
 /**
  * @brief spawn the thread that calls epoll for ready sockets
  * 
@@ -118,14 +105,14 @@ bool Orchestrator::spawn_epoll_thread()
 {
     int retval;
 
-    if (0 != (retval = pthread_create(
+    if (0 != (retval = create_pinned_thread(
         &m_epoll_thread_id,
-        NULL,
+        m_placement.m_io_cpus,
         Orchestrator::epoll_thread_pthread_fn,
         this)))
     {
-        std::cerr << "pthread_create failed with rc = " << retval \
-                << " errno = " << errno << std::endl;
+        LOG_ERROR("pthread_create failed with rc = " << retval << " errno = " \
+            << errno);
         return false;
     }
 
@@ -133,8 +120,8 @@ bool Orchestrator::spawn_epoll_thread()
 }
 /**
  * @brief loop and accept connections on the listening socket
- * Once a connection is received, it then adds it to the queue
- * which the epoll thread uses, and wakes up the epoll thread.
+ * Once a connection is received, it is registered with epoll
+ * so that the epoll thread picks it up when it becomes readable.
  * 
  */
 void Orchestrator::accepting_thread_loop()
@@ -151,246 +138,270 @@ void Orchestrator::accepting_thread_loop()
                             (socklen_t*)&addrlen);
         if (new_socket < 0)
         {
+            if (m_is_destroying)
+                return;
             perror("accept");
-            std::cerr << "accept failed with rc = " << new_socket;
-            std::cerr << " errno = " << errno << std::endl;
+            LOG_ERROR("accept failed with rc = " << new_socket << " errno = " \
+                << errno);
             continue;
         }
 
         int flags = fcntl(new_socket, F_GETFL, 0);
         if (0 != fcntl(new_socket, F_SETFL, flags | O_NONBLOCK))
         {
-            std::cerr << new_socket << \
-                    ": could not set nonblocking" << std::endl;
+            LOG_ERROR(new_socket << ": could not set nonblocking");
         }
 
-        std::unique_lock    lock(m_all_sockets_mtx);
-        try
+        // In the run-to-completion mode, each connection is owned by
+        // its event loop. Where the loops are pinned, a connection goes
+        // to the loop on the CPU, or at least on the node, that
+        // receives its packets, and they are spread round-robin
+        // otherwise.
+        if (m_event_loops.size())
         {
-            auto state = State::create_state(new_socket);
-            if (state)
+            int cpu = -1;
+            socklen_t cpu_len = sizeof(cpu);
+            int index = -1;
+            if (!m_placement.m_cpu_loops.empty() && \
+                0 == getsockopt(new_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len) && \
+                cpu >= 0 && cpu < (int)m_placement.m_cpu_loops.size())
+                index = m_placement.m_cpu_loops[cpu];
+
+            if (index >= 0)
+                m_num_steered_connections++;
+            else
             {
-                state->m_state = STATE_ACCEPTED;
-                m_all_sockets[new_socket] = state;
+                index = m_next_event_loop;
+                m_next_event_loop = (m_next_event_loop + 1) % m_event_loops.size();
             }
+            auto ploop = m_event_loops[index];
+            LOG_DEBUG(new_socket << ": Accepted, handing to event loop");
+            if (!ploop->add_connection(new_socket))
+                close(new_socket);
+            continue;
         }
-        catch (...)
-        {
-            std::cerr << "Unknown exception" << std::endl;
-            assert(0);
-            exit(1);
-        }
-        lock.unlock();
 
-        std::unique_lock    lock2(m_epoll_sockets_mtx);
-        try
+        auto state = PipelineState::create_state(new_socket, this);
+        if (!state || !m_all_sockets.insert(new_socket, state))
         {
-            m_epoll_sockets.insert(new_socket);
+            LOG_ERROR(new_socket << ": Out of memory for the connection");
+            close(new_socket);
+            continue;
         }
-        catch(const std::exception& e)
+        state->m_state = STATE_WAITING_FOR_EPOLL;
+
+        LOG_DEBUG(new_socket << ": Accepted, registering with epoll");
+
+        if (!epoll_register(new_socket))
         {
-            std::cerr << "Unknown exception" << std::endl;
-            assert(0);
-            exit(1);
+            remove_socket(new_socket);
+            close(new_socket);
         }
-        lock2.unlock();
-
-        std::cerr << new_socket << \
-            ": Accepted, waking up epoll thread" << std::endl;
-        
-        wakeup_epoll_thread();
     }
 }
 
 /**
- * @brief Add a file descriptor to queue for epoll
- * This queue is monitored by the thread which executes
- * epoll.
- * The thread is woken up.
+ * @brief register a newly accepted socket with epoll
  * 
- * @param fd file descriptor to monitor for changes
+ * Every socket is registered exactly once, edge triggered and
+ * one-shot. Once it reports readiness it stays disabled in the
+ * kernel until it is re-armed with epoll_rearm(), so the epoll
+ * thread never has to rebuild its interest list.
+ * 
+ * @param fd the file descriptor to register
+ * @return true on success
+ * @return false on failure
  */
-void Orchestrator::add_to_epoll_queue(int fd)
+bool Orchestrator::epoll_register(int fd)
 {
-    std::unique_lock lock(m_epoll_sockets_mtx);
-    try
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = EPOLL_SOCKET_EVENTS;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event))
     {
-        m_epoll_sockets.insert(fd);
-    }
-    catch(...)
-    {
-        std::cerr << "Unknown exception" << std::endl;
-        assert(0);
-        exit(1);
+        perror("epoll_ctl");
+        LOG_ERROR("epoll_ctl add failed fd = " << fd << " errno = " << errno);
+        return false;
     }
-    lock.unlock();
-    std::cerr << fd << ": Added to epoll queue" << std::endl;
-    wakeup_epoll_thread();
+    return true;
 }
 
 /**
- * @brief Wake up the epoll thread by sending it a signal
+ * @brief re-enable a socket that has already been registered
  * 
+ * This is a single EPOLL_CTL_MOD, and is called once the response
+ * has been written and the socket is ready for the next command.
+ * 
+ * @param fd the file descriptor to re-arm
+ * @return true on success
+ * @return false on failure
  */
-void Orchestrator::wakeup_epoll_thread()
-{
-    // force the epoll thread to wakeup by sending SIGUSR1
-    pthread_kill(m_epoll_thread_id, SIGUSR1);
-}
-
-/**
- * @brief remove all monitoring file descriptors from epoll
- * This is the unsafe version of the function, and the caller
- * must hold the m_epoll_sockets_mtx lock before calling it
- */
-void Orchestrator::epoll_empty_unsafe()
+bool Orchestrator::epoll_rearm(int fd, uint32_t events)
 {
-    for (auto fd: m_epoll_sockets)
+    struct epoll_event event;
+    event.data.fd = fd;
+    event.events = events;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &event))
     {
-        struct epoll_event event;
-        event.data.fd = fd;
-        event.events = EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR | EPOLLET;
-        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, &event))
-        {
-            if (ENOENT != errno)
-            {
-                perror("epoll_ctl");
-                std::cerr << "epoll_ctl failed fd = " << fd \
-                    <<" errno = " << errno << std::endl;
-            }
-        }
+        perror("epoll_ctl");
+        LOG_ERROR("epoll_ctl mod failed fd = " << fd << " errno = " << errno);
+        return false;
     }
+    return true;
 }
 
 /**
- * @brief remove all monitoring file descriptors from epoll
+ * @brief reset the state of a socket that has nothing more to
+ * write, and hand it back to epoll to wait for the next command
+ * 
+ * The caller must hold the state's mutex. It is released here,
+ * and the socket is closed if it cannot be re-armed.
  * 
+ * @param pstate is the state associated with the file descriptor
+ * @return true on success
+ * @return false if the socket had to be closed
  */
-void Orchestrator::epoll_empty()
+bool Orchestrator::return_to_epoll(std::shared_ptr<State> pstate)
 {
-    std::shared_lock lock(m_epoll_sockets_mtx);
-    return epoll_empty_unsafe();
+    auto fd = pstate->m_socket;
+
+    LOG_DEBUG(fd << ": Re-arming in epoll");
+    pstate->reset();
+    pstate->m_state = STATE_WAITING_FOR_EPOLL;
+    if (!epoll_rearm(fd))
+    {
+        pstate->m_mutex.lock();
+        close_and_cleanup(fd, pstate, this);
+        return false;
+    }
+    return true;
 }
 
 /**
- * @brief rebuild the epoll monitor from the set of fd's
+ * @brief hand a socket whose response was only partially written
+ * back to epoll, to wait until it is writable
  * 
- * This is the unsafe version of the function. the caller
- * must hold the mutex before calling it.
+ * The caller must hold the state's mutex. It is released here,
+ * and the socket is closed if it cannot be re-armed. The rest of
+ * the response stays in the state's m_output.
  * 
+ * @param pstate is the state associated with the file descriptor
+ * @return true on success
+ * @return false if the socket had to be closed
  */
-void Orchestrator::epoll_rearm_unsafe()
+bool Orchestrator::wait_for_writable(std::shared_ptr<State> pstate)
 {
-    for (auto fd: m_epoll_sockets)
+    auto fd = pstate->m_socket;
+
+    LOG_DEBUG(fd << ": Waiting to become writable");
+    // Timed from the first time the response did not fit
+    if (pstate->m_stage_time[STATE_WAITING_FOR_WRITABLE])
+        pstate->m_state = STATE_WAITING_FOR_WRITABLE;
+    else
+        pstate->set_state(STATE_WAITING_FOR_WRITABLE);
+    pstate->m_mutex.unlock();
+    if (!epoll_rearm(fd, EPOLL_SOCKET_WRITE_EVENTS))
     {
-        struct epoll_event event;
-        event.data.fd = fd;
-        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event))
-        {
-            if (ENOENT != errno)
-            {
-                perror("epoll_ctl");
-                std::cerr << "epoll_ctl failed, errno = " \
-                    << errno << std::endl;
-            }
-        }
+        pstate->m_mutex.lock();
+        close_and_cleanup(fd, pstate, this);
+        return false;
     }
+    return true;
 }
 
 /**
- * @brief rebuild the epoll monitor from the set of fd's
+ * @brief Wake up the epoll thread through the eventfd
+ * 
+ * Wakeups that arrive while one is already pending are coalesced,
+ * so at most one write to the eventfd is outstanding at any time.
  * 
  */
-void Orchestrator::epoll_rearm()
+void Orchestrator::wakeup_epoll_thread()
 {
-    std::unique_lock lock(m_epoll_sockets_mtx);
-    return epoll_rearm_unsafe();
+    if (m_wakeup_pending.exchange(true))
+        return;
+
+    uint64_t one = 1;
+    if (sizeof(one) != write(m_wakeup_fd, &one, sizeof(one)))
+    {
+        perror("write");
+        LOG_ERROR("eventfd write failed, errno = " << errno);
+    }
 }
 
 /**
  * @brief Loop and call epoll, and send ready sockets to workers
  * 
- * Loops and calls epoll. When a ready socket is found, it is
- * posted to the thread pool which processes it.
+ * Loops and calls epoll. All the sockets found ready by one
+ * epoll_wait are posted to the thread pool as a single batch.
+ * 
+ * This is where the load is admitted: while a pool has reached its
+ * queue limit, the sockets to read are deferred, and polled for
+ * every EPOLL_OVERLOAD_RETRY_MS until the pools catch up, so that
+ * the requests wait in the socket buffers rather than in the queues.
  * 
  */
 void Orchestrator::epoll_thread_loop()
 {
-    int retval;
-    struct epoll_event events[MAX_EPOLL_EVENTS + 1];
+    std::vector<struct epoll_event>                 events;
+    std::vector<std::shared_ptr<JobInterface> >     jobs;
 
-    struct sigaction action;
-    action.sa_sigaction = &sigusr1_handler;
-    action.sa_flags = SA_SIGINFO  | SA_RESTART;
-    if (retval = sigaction(SIGUSR1, &action, NULL))
-    {
-        perror("sigaction");
-        std::cerr << "Fatal: sigaction failed with rc = " << retval;
-        std::cerr << " errno = " << errno << std::endl;
-        exit(1);
-    }
+    events.resize(m_config.m_epoll_batch_size);
+    jobs.reserve(m_config.m_epoll_batch_size);
 
-    while(true)
+    while(!m_is_destroying)
     {
-        //std::cerr << "epoll looping" << std::endl;
-        std::unordered_set<int> ready_fds;
-        epoll_empty();
-        epoll_rearm();
-        bzero(events, sizeof(events));
+        // Every wakeup is explicit, so there is no need for a timeout,
+        // unless sockets wait for the pools to catch up
         int n_fd = epoll_wait(
             m_epoll_fd,
-            events,
-            MAX_EPOLL_EVENTS,
-            1000);
-        if (n_fd)
+            events.data(),
+            (int)events.size(),
+            m_deferred_sockets.empty() ? -1 : EPOLL_OVERLOAD_RETRY_MS);
+
+        bool is_overloaded = m_config.m_pool_queue_limit && this->is_overloaded();
+        if (!is_overloaded && m_deferred_sockets.size())
         {
-            // Take both locks to maintain lock heirarchy
-            std::shared_lock lock0(m_all_sockets_mtx);
-            std::unique_lock lock(m_epoll_sockets_mtx);
-            try
-            {    
-                for (int i = 0; i < n_fd; i++)
-                {
-                    if (0 == events[i].events)
-                        continue;
-                    ready_fds.insert(events[i].data.fd);
-                    std::cerr << events[i].data.fd << \
-                        ": ePOll, ready for read" << std::endl;
-                }
-            }
-            catch(...)
+            for (int fd: m_deferred_sockets)
             {
-                std::cerr << __FILE__ << ":" << __LINE__;
-                std::cerr << " Error inserting into set" << std::endl;
+                auto job = create_processing_job(fd, false);
+                if (job)
+                    jobs.push_back(job);
             }
+            m_deferred_sockets.clear();
+        }
 
-            epoll_empty_unsafe();
-            for (auto fd: ready_fds)
-            {
-                auto it = m_epoll_sockets.find(fd);
-                if (it != m_epoll_sockets.end())
-                    m_epoll_sockets.erase(it);
-            }
+        // Sockets are one-shot, so every fd reported here is already
+        // disabled in the kernel until the write job re-arms it.
+        for (int i = 0; i < n_fd; i++)
+        {
+            if (0 == events[i].events)
+                continue;
 
-            if (ready_fds.size())
+            if (m_wakeup_fd == events[i].data.fd)
             {
-                std::unique_lock lock2(m_processing_sockets_mtx);
-                try
-                {
-                    for (auto fd: ready_fds)
-                        m_processing_sockets.insert(fd);
-                }
-                catch(...)
+                uint64_t count;
+                m_wakeup_pending = false;
+                if (read(m_wakeup_fd, &count, sizeof(count)) < 0 && 
+                    EAGAIN != errno)
                 {
-                    std::cerr << __FILE__ << ":" << __LINE__;
-                    std::cerr << " Error inserting into set" << std::endl;
+                    perror("read");
+                    LOG_ERROR("eventfd read failed, errno = " << errno);
                 }
+                continue;
             }
 
-            lock0.unlock();
-            lock.unlock();
-            for (auto fd: ready_fds)
-                create_processing_job(fd);
+            LOG_DEBUG(events[i].data.fd << ": ePOll, ready for read");
+            auto job = create_processing_job(events[i].data.fd, is_overloaded);
+            if (job)
+                jobs.push_back(job);
+        }
+
+        if (jobs.size())
+        {
+            if (0 != m_processing_threadpool->add_jobs(jobs))
+                LOG_ERROR("Error adding jobs to processing threadpool");
+            jobs.clear();
         }
     }
 }
@@ -404,35 +415,65 @@ void Orchestrator::epoll_thread_loop()
  * process it.
  * 
  * @param fd file descriptor to be posted for read
+ * @param is_overloaded whether a pool is full
+ * @return std::shared_ptr<JobInterface> the job, or nullptr if
+ * the socket is no longer valid, deferred or answered
  */
-void Orchestrator::create_processing_job(int fd)
+std::shared_ptr<JobInterface> Orchestrator::create_processing_job(int fd, bool is_overloaded)
 {
-    std::shared_ptr<State>      p(nullptr);
+    std::shared_ptr<State>      p = m_all_sockets.lock(fd);
+    if (!p)
+        return std::shared_ptr<JobInterface>(nullptr);
 
+    // A socket waiting to finish a response can only be writable
+    auto pconnection = static_cast<PipelineState*>(p.get());
+    if (STATE_WAITING_FOR_WRITABLE == p->m_state)
+        return PipelineState::get_job(p, pconnection->m_write_job);
+
+    // New commands wait, or are turned away, until the pools catch up
+    if (is_overloaded)
     {
-        std::shared_mutex(m_all_sockets_mtx);
-        assert(m_all_sockets.find(fd) != m_all_sockets.end());
-        p = m_all_sockets[fd];
-        assert(!!p);
-        p->m_mutex.lock();
+        if (OVERLOAD_BUSY == m_config.m_overload_policy)
+            reject_busy(p);
+        else
+        {
+            p->m_mutex.unlock();
+            m_deferred_sockets.push_back(fd);
+            m_num_deferred_reads++;
+        }
+        return std::shared_ptr<JobInterface>(nullptr);
     }
 
-    p->m_state = STATE_WAITING_FOR_READ_JOB;
+    p->set_state(STATE_WAITING_FOR_READ_JOB);
+    return PipelineState::get_job(p, pconnection->m_read_job);
+}
+
+/**
+ * @brief answer all the commands a socket has sent with -BUSY,
+ * on the epoll thread, without running them
+ * 
+ * @param pstate is the state associated with the file descriptor
+ */
+void Orchestrator::reject_busy(std::shared_ptr<State> pstate)
+{
+    auto fd = pstate->m_socket;
 
-    SocketReadJob* job = new (std::nothrow) SocketReadJob(this, p);
-    if (!job)
+    LOG_DEBUG(fd << ": Overloaded, rejecting the commands");
+    pstate->set_state(STATE_IN_READ_LOOP);
+    auto result = read_from_socket(*pstate);
+    if (READ_RESULT_CLOSED == result)
     {
-        std::cerr << "Out of memory" << std::endl;
+        close_and_cleanup(fd, pstate, this);
         return;
     }
 
-    if (0 != m_processing_threadpool->add_job(\
-                            std::shared_ptr<JobInterface>(job)))
+    if (READ_RESULT_NO_DATA == result || !parse_and_run(*pstate, true))
     {
-        std::cerr << "Error adding job to processing threadpool" << std::endl;
+        return_to_epoll(pstate);
+        return;
     }
-    else
-        std::cerr << fd << ": Added a job to read the data" << std::endl;
+
+    send_responses(pstate);
 }
 
 /**
@@ -447,7 +488,26 @@ bool Orchestrator::create_epoll_fd()
     if (m_epoll_fd < 0)
     {
         perror("epoll_create");
-        std::cerr << "epoll create failed, errno = " << errno;
+        LOG_ERROR("epoll create failed, errno = " << errno);
+        return false;
+    }
+
+    m_wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup_fd < 0)
+    {
+        perror("eventfd");
+        LOG_ERROR("eventfd failed, errno = " << errno);
+        return false;
+    }
+
+    // The eventfd stays level triggered so that a wakeup is never lost
+    struct epoll_event event;
+    event.data.fd = m_wakeup_fd;
+    event.events = EPOLLIN;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wakeup_fd, &event))
+    {
+        perror("epoll_ctl");
+        LOG_ERROR("epoll_ctl add of eventfd failed, errno = " << errno);
         return false;
     }
     return true;
@@ -461,39 +521,8 @@ bool Orchestrator::create_epoll_fd()
  */
 void Orchestrator::remove_socket(int fd)
 {
-    std::cerr << fd << ": removing from all queues" << std::endl;
-    {
-        std::unique_lock lock(m_all_sockets_mtx);
-        auto it = m_all_sockets.find(fd);
-        if (it != m_all_sockets.end())
-        {
-            auto state = m_all_sockets[fd];
-            state->m_mutex.lock();
-            m_all_sockets.erase(it);
-            state->m_mutex.unlock();
-        }
-    }
-
-    {
-        std::unique_lock lock(m_epoll_sockets_mtx);
-        auto it = m_epoll_sockets.find(fd);
-        if (it != m_epoll_sockets.end())
-            m_epoll_sockets.erase(it);
-    }
-
-    {
-        std::unique_lock lock(m_processing_sockets_mtx);
-        auto it = m_processing_sockets.find(fd);
-        if (it != m_processing_sockets.end())
-            m_processing_sockets.erase(it);
-    }
-
-    {
-        std::unique_lock lock(m_write_sockets_mtx);
-        auto it = m_write_sockets.find(fd);
-        if (it != m_write_sockets.end())
-            m_write_sockets.erase(it);
-    }
+    LOG_DEBUG(fd << ": removing from all queues");
+    m_all_sockets.erase(fd);
 }
 
 /**
@@ -509,15 +538,9 @@ void Orchestrator::remove_socket(int fd)
 bool Orchestrator::add_to_parse_and_run_queue(
                     std::shared_ptr<State> pstate)
 {
-    ParseAndRunJob* job = new (std::nothrow) ParseAndRunJob(this, pstate);
-    if (!job)
-    {
-        std::cerr << "Out of memory" << std::endl;
-        return false;
-    }
-
-    if (0 != m_parse_and_run_threadpool->add_job(\
-                            std::shared_ptr<JobInterface>(job)))
+    auto pconnection = static_cast<PipelineState*>(pstate.get());
+    if (0 != m_parse_and_run_threadpool->add_job(
+            PipelineState::get_job(pstate, pconnection->m_parse_and_run_job)))
         return false;
     
     return true;
@@ -533,25 +556,80 @@ bool Orchestrator::add_to_parse_and_run_queue(
  */
 bool Orchestrator::add_to_write_queue(std::shared_ptr<State> pstate)
 {
-    SocketWriteJob* job = new (std::nothrow) SocketWriteJob(this, pstate);
-    if (!job)
-    {
-        std::cerr << "Out of memory" << std::endl;
-        return false;
-    }
-
-    if (0 != m_write_threadpool->add_job(std::shared_ptr<JobInterface>(job)))
+    auto pconnection = static_cast<PipelineState*>(pstate.get());
+    if (0 != m_write_threadpool->add_job(
+            PipelineState::get_job(pstate, pconnection->m_write_job)))
         return false;
     
     return true;
 }
 
 /**
- * TODO: Refactor this function, into three different classes
- * for each command: set, get and del
- * And those classes should be responsible for both validating
- * and actual action
+ * @brief the ticket of the last write this thread logged, waited for
+ * once the commands read together have all run
+ * 
+ */
+static thread_local std::uint64_t t_log_ticket = 0;
+
+/**
+ * @brief whether the next command of the connection being run by this
+ * thread follows an ASKING
+ * 
+ */
+static thread_local bool t_is_asking = false;
+
+/**
+ * @brief perform the ASKING command, the next command may use a slot
+ * this node imports
+ * 
+ */
+static bool do_asking(Orchestrator*, const CommandView&, IoBuffer& response)
+{
+    t_is_asking = true;
+    response.append(REPLY_OK);
+    return false;
+}
+
+/**
+ * @brief a handler that calls a method of the orchestrator
+ * 
+ */
+#define COMMAND_HANDLER(call) \
+    [](Orchestrator* porch, const CommandView& command, IoBuffer& response) \
+    { return porch->call; }
+
+/**
+ * @brief the commands the server runs, with their arguments and keys,
+ * see CommandSpec
+ * 
+ */
+static constexpr CommandSpec g_commands[] =
+{
+    {"get",     COMMAND_GET,     COMMAND_HANDLER(do_get(command, response)),         2,  2, 1, COMMAND_FLAG_READ,  1,  1, 1},
+    {"set",     COMMAND_SET,     COMMAND_HANDLER(do_set(command, response)),         3,  5, 2, COMMAND_FLAG_WRITE, 1,  1, 1},
+    {"del",     COMMAND_DEL,     COMMAND_HANDLER(do_del(command, response)),         2, -1, 1, COMMAND_FLAG_WRITE, 1, -1, 1},
+    {"mget",    COMMAND_MGET,    COMMAND_HANDLER(do_mget(command, response)),        2, -1, 1, COMMAND_FLAG_READ,  1, -1, 1},
+    {"mset",    COMMAND_MSET,    COMMAND_HANDLER(do_mset(command, response)),        3, -1, 2, COMMAND_FLAG_WRITE, 1, -1, 2},
+    {"expire",  COMMAND_EXPIRE,  COMMAND_HANDLER(do_expire(command, response, 1000)), 3,  3, 1, COMMAND_FLAG_WRITE, 1,  1, 1},
+    {"pexpire", COMMAND_PEXPIRE, COMMAND_HANDLER(do_expire(command, response, 1)),   3,  3, 1, COMMAND_FLAG_WRITE, 1,  1, 1},
+    {"ttl",     COMMAND_TTL,     COMMAND_HANDLER(do_ttl(command, response, 1000)),   2,  2, 1, COMMAND_FLAG_READ,  1,  1, 1},
+    {"pttl",    COMMAND_PTTL,    COMMAND_HANDLER(do_ttl(command, response, 1)),      2,  2, 1, COMMAND_FLAG_READ,  1,  1, 1},
+    {"persist", COMMAND_PERSIST, COMMAND_HANDLER(do_persist(command, response)),     2,  2, 1, COMMAND_FLAG_WRITE, 1,  1, 1},
+    {"info",    COMMAND_INFO,    COMMAND_HANDLER(do_info(command, response)),        1,  2, 1, 0,                  0,  0, 0},
+    {"stats",   COMMAND_INFO,    COMMAND_HANDLER(do_info(command, response)),        1,  2, 1, 0,                  0,  0, 0},
+    {"save",    COMMAND_SAVE,    COMMAND_HANDLER(do_save(command, response, false)), 1,  1, 1, 0,                  0,  0, 0},
+    {"bgsave",  COMMAND_BGSAVE,  COMMAND_HANDLER(do_save(command, response, true)),  1,  1, 1, 0,                  0,  0, 0},
+    {"cluster", COMMAND_CLUSTER, COMMAND_HANDLER(do_cluster(command, response)),     2, -1, 1, 0,                  0,  0, 0},
+    {"asking",  COMMAND_ASKING,  do_asking,                                          1,  1, 1, 0,                  0,  0, 0},
+};
+
+/**
+ * @brief the perfect hash of the command names, found at compile time
+ * 
  */
+static constexpr CommandTable g_command_table(g_commands);
+static_assert(g_command_table.is_perfect(), "no perfect hash of the command names");
+
 /**
  * @brief given an abstract object, find whether it is a valid
  * command or not.
@@ -560,429 +638,1748 @@ bool Orchestrator::add_to_write_queue(std::shared_ptr<State> pstate)
  * After parsing, this function will decide whether it is a valid
  * command or not
  * 
- * @param p the parsed input in object form
- * @return std::tuple<bool, command_type_t> a tuple of two items:
- * 1. whether it is valid or not
- * 2. the type of command if it is valid
+ * @param command the parsed input in object form
+ * @return const CommandSpec* the command, nullptr if there is no
+ * command of that name or it does not take those arguments
  */
-std::tuple<bool, command_type_t>
-Orchestrator::is_valid_command(std::shared_ptr<AbstractRespObject> p)
+const CommandSpec* Orchestrator::find_command(const CommandView& command)
 {
-    if (! p->m_is_aggregate)
-        return std::make_tuple(false, COMMAND_INVALID);
-    
-    RespArray* p_array_obj = static_cast<RespArray*>(p.get());
-    auto array = p_array_obj->get_array();
-
-    if (array.size() <= 1)
-        return std::make_tuple(false, COMMAND_INVALID);
+    if (command.m_argc < 1)
+        return nullptr;
 
-    auto command_string = array[0]->to_string();
-    command_type_t type = COMMAND_INVALID;
+    const CommandSpec* spec = g_command_table.find(command.argv(0));
+    if (!spec || !spec->accepts_argc(command.m_argc))
+        return nullptr;
+    return spec;
+}
 
-    if (command_string == std::string("get") || 
-        command_string == std::string("del"))
+/**
+ * @brief given a parsed command, perform the requested operations
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response to the command is
+ * appended here, ready to be sent to the client
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_operation(
+    const CommandView& command,
+    IoBuffer& response)
+{
+    const CommandSpec* spec = find_command(command);
+    if (!spec)
     {
-        if (command_string == std::string("get"))
-            type = COMMAND_GET;
-        else
-            type = COMMAND_DEL;
+        response.append(REPLY_INVALID_COMMAND);
+        return false;
+    }
 
-        if (array.size() >= 2 && 
-            (RESP_BULK_STRING == array[1]->m_datatype ||
-                RESP_STRING == array[1]->m_datatype))
-            return std::make_tuple(true, type);
-        else
-            return std::make_tuple(false, COMMAND_INVALID);
+    // A replica only changes with its primary
+    if (m_repl_replica && spec->is_write())
+    {
+        response.append(REPLY_READONLY);
+        return false;
     }
-    else if (command_string == std::string("set"))
+
+    // Nothing more is acknowledged until the append log can be
+    // written again
+    if (m_append_log && m_append_log->m_is_failed && spec->is_write())
     {
-        if (array.size() >= 3 &&
-            (RESP_BULK_STRING == array[1]->m_datatype ||
-                RESP_STRING == array[1]->m_datatype))
-            return std::make_tuple(true, COMMAND_SET);
-        else
-            return std::make_tuple(false, COMMAND_INVALID);
+        response.append(REPLY_MISCONF);
+        return false;
     }
-    else
-        return std::make_tuple(false, COMMAND_INVALID);
+
+    // ASKING only lasts for the command that follows it
+    bool is_asking = t_is_asking;
+    t_is_asking = false;
+
+    // The slot stays where it is until the command is done
+    std::shared_lock<std::shared_mutex> slot_lock;
+    if (m_cluster && route_in_cluster(command, *spec, is_asking, slot_lock, response))
+        return false;
+
+    return spec->m_handler(this, command, response);
 }
 
 /**
- * @brief Get the partition id of the hash table, based on the
- * key.
- * 
- * For performance reasons, instead of using a single hash,
- * we use multiple hashes, and the decision to choose the
- * correct hash is taken based on the first character of the key.
- * 
- * This is done because on high load, a single hash would be
- * affected by lock contention. Using several hashes will
- * reduce the lock contention.
- * 
- * Additionally, reader-writer locks are used to increase
- * concurrency even more.
+ * @brief append a -MOVED or -ASK redirection
  * 
- * @param varname name of the variable
- * @return int partition id of the correct hash to use
  */
-int Orchestrator::get_partition(const std::string& varname)
+static void append_redirect(IoBuffer& response, std::string_view kind, int slot, const ClusterNode& node)
 {
-    if (0 == varname.length())
-        return 0;
-    char x = varname[0];
-    return x % NUM_DATASTORES;
+    char buffer[32];
+    int length = snprintf(buffer, sizeof(buffer), " %d ", slot);
+    response.append("-");
+    response.append(kind);
+    response.append(std::string_view(buffer, length));
+    response.append(node.m_address);
+    response.append("\r\n");
 }
 
 /**
- * @brief given a parsed command, perform the requested operations
+ * @brief send a command to the node that serves its keys, in a
+ * cluster
  * 
  * @param command command after parsing, as received from client
- * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
- * a tuple containing two items
- * 1. has there been a fatal error, which mandates the
- *    client connection must be closed
- * 2. output of the operation as an object that can be serialized
- *    and sent to the client as response.
+ * @param spec the command
+ * @param is_asking whether the command follows an ASKING
+ * @param slot_lock set to the shared lock of the slot, which the
+ * command runs with
+ * @param response the redirection is appended here
+ * @return true if the command is answered with a redirection or
+ * an error
+ * @return false if it runs here
  */
-std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-Orchestrator::do_operation(std::shared_ptr<AbstractRespObject> command)
+bool Orchestrator::route_in_cluster(
+    const CommandView& command,
+    const CommandSpec& spec,
+    bool is_asking,
+    std::shared_lock<std::shared_mutex>& slot_lock,
+    IoBuffer& response)
 {
-    // TODO: Fill this up
-    auto [is_valid, cmd_type] = is_valid_command(command);
-    if (!is_valid)
+    int first = spec.m_first_key;
+    int last = spec.get_last_key(command.m_argc);
+    int step = spec.m_key_step;
+    if (!first)
+        return false;
+
+    std::uint16_t slot = get_key_slot(command.argv(first));
+    for (int i = first + step; i <= last; i += step)
     {
-        RespError* error = new (std::nothrow) RespError("Invalid command");
-        if (!error)
+        if (get_key_slot(command.argv(i)) != slot)
         {
-            std::cerr << "Out of memory, exiting" << std::endl;
-            exit(1);
+            response.append(REPLY_CROSSSLOT);
+            return true;
         }
-        return std::make_tuple(
-            false,
-            std::shared_ptr<AbstractRespObject>((AbstractRespObject*)error));
     }
 
-    if (COMMAND_GET == cmd_type)
-        return do_get(command);
-    else if (COMMAND_SET == cmd_type)
-        return do_set(command);
-    else if (COMMAND_DEL == cmd_type)
-        return do_del(command);
+    slot_lock = std::shared_lock<std::shared_mutex>(m_cluster->get_slot_mutex(slot));
+    int owner = m_cluster->get_owner(slot);
+    if (owner != m_cluster->get_self())
+    {
+        if (is_asking && m_cluster->get_importing(slot) >= 0)
+            return false;
+
+        if (owner < 0)
+            response.append(REPLY_CLUSTERDOWN);
+        else
+            append_redirect(response, "MOVED", slot, m_cluster->get_node(owner));
+        return true;
+    }
 
-    RespError* error = \
-               new (std::nothrow) RespError(std::string("generic error"));
-    if (!error)
+    int target = m_cluster->get_migrating(slot);
+    if (target < 0)
+        return false;
+
+    // The keys that were moved, and the new ones, are on the target
+    int num_keys = 0;
+    int num_found = 0;
+    for (int i = first; i <= last; i += step)
     {
-        std::cerr << "Out of memory. exiting" << std::endl;
-        exit(1);
+        HashedKey key(command.argv(i));
+        std::int64_t expire_at;
+        num_keys++;
+        if (m_datastore[get_partition(key)]->get_expiry(key, expire_at))
+            num_found++;
     }
-    std::shared_ptr<AbstractRespObject> p((AbstractRespObject*)error);
-    return std::make_tuple(false, p);
+
+    if (num_found == num_keys)
+        return false;
+    if (num_found)
+        response.append(REPLY_TRYAGAIN);
+    else
+        append_redirect(response, "ASK", slot, m_cluster->get_node(target));
+    return true;
 }
 
 /**
- * @brief in case of a SET command, perform the action
+ * @brief parse a command argument as an integer
  * 
- * @param pobj command after parsing, as received from client
- * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
- * a tuple containing two items
- * 1. has there been a fatal error, which mandates the
- *    client connection must be closed
- * 2. output of the operation as an object that can be serialized
- *    and sent to the client as response.
+ * @param s the argument
+ * @param value set to the integer
+ * @return true if the argument is an integer
+ * @return false otherwise
  */
-std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-Orchestrator::do_set(std::shared_ptr<AbstractRespObject> pobj)
+static bool parse_integer(std::string_view s, long long& value)
 {
-    RespArray* p_array_obj = static_cast<RespArray*>(pobj.get());
-    auto array = p_array_obj->get_array();
-    auto varname = array[1]->to_string();
-    auto partition = get_partition(varname);
-    auto value = array[2]->serialize();
-
-    auto success = m_datastore[partition].set(varname.c_str(), value.c_str());
-    if (success)
-    {
-        auto *p = new (std::nothrow) RespString(std::string("OK"));
-        if (!p)
-        {
-            std::cerr << "Outo of memory" << std::endl;
-            exit(1);
-        }
-        return std::make_tuple(
-            false, 
-            std::shared_ptr<AbstractRespObject>(\
-                static_cast<AbstractRespObject*>(p)));
-    }
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+    return std::errc() == ec && end == s.data() + s.size();
+}
 
-    RespError* err_obj = new RespError("Failed to set the value");
-    if (!err_obj)
-    {
-        std::cerr << "Out of memory " << std::endl;
-        exit(1);
-    }
+/**
+ * @brief the expiry time of a key with a given time to live
+ * 
+ * @param ttl the time to live, positive
+ * @param unit_ms the unit of ttl, in milliseconds
+ * @param expire_at set to the unix time in ms at which the key expires
+ * @return true on success
+ * @return false if the time is out of range
+ */
+static bool get_expire_time(long long ttl, std::int64_t unit_ms, std::int64_t& expire_at)
+{
+    std::int64_t now = unix_time_ms();
+    if (ttl <= 0 || ttl > (INT64_MAX - now) / unit_ms)
+        return false;
 
-    return std::make_tuple(
-        false,
-        std::shared_ptr<AbstractRespObject>((AbstractRespObject*)err_obj));
+    expire_at = now + ttl * unit_ms;
+    return true;
 }
 
 /**
- * @brief In case of the GET command, perform the action
+ * @brief in case of a SET command, perform the action
  * 
- * @param pobj command after parsing, as received from client
- * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
- * a tuple containing two items
- * 1. has there been a fatal error, which mandates the
- *    client connection must be closed
- * 2. output of the operation as an object that can be serialized
- *    and sent to the client as response.
+ * An optional EX seconds or PX milliseconds gives the key a time to
+ * live, EXAT seconds or PXAT milliseconds an expiry time as a unix
+ * time, otherwise the key does not expire. A time in the past is kept,
+ * the key is then gone at once, as a key moved by a slot migration
+ * may have expired in between.
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
  */
-std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-Orchestrator::do_get(std::shared_ptr<AbstractRespObject> pobj)
+bool Orchestrator::do_set(
+    const CommandView& command,
+    IoBuffer& response)
 {
-    RespArray* p_array_obj = static_cast<RespArray*>(pobj.get());
-    auto array = p_array_obj->get_array();
-    auto varname = array[1]->to_string();
-    auto partition = get_partition(varname);
-    
-    auto [found, value] = m_datastore[partition].get(varname.c_str());
+    HashedKey key(command.argv(1));
+    size_t partition = get_partition(key);
 
-    if (!found)
+    std::int64_t expire_at = EXPIRE_NEVER;
+    if (5 == command.m_argc)
     {
-        auto *p = new (std::nothrow) RespBulkString(std::string(""));
-        if (!p)
+        std::int64_t unit_ms;
+        bool is_absolute = false;
+        long long ttl;
+
+        if (command_name_equals(command.argv(3), "ex"))
+            unit_ms = 1000;
+        else if (command_name_equals(command.argv(3), "px"))
+            unit_ms = 1;
+        else if (command_name_equals(command.argv(3), "exat"))
         {
-            std::cerr << "Outo of memory" << std::endl;
-            exit(1);
+            unit_ms = 1000;
+            is_absolute = true;
+        }
+        else if (command_name_equals(command.argv(3), "pxat"))
+        {
+            unit_ms = 1;
+            is_absolute = true;
+        }
+        else
+        {
+            response.append(REPLY_INVALID_COMMAND);
+            return false;
         }
 
-        p->set_null(true);
-        return std::make_tuple(
-            false, 
-            std::shared_ptr<AbstractRespObject>(\
-                static_cast<AbstractRespObject*>(p)));
-    }
-
-    RespParser parser(value);
-    auto [err, ret] = parser.get_generic_object();
-    if (ERROR_SUCCESS != err)
-    {
-        std::cerr << "IMPORTANT: could not parse value from hash '"\
-            << value << "'" << std::endl;
-
-        auto *p = new (std::nothrow) RespBulkString(std::string(""));
-        if (!p)
+        if (!parse_integer(command.argv(4), ttl))
+        {
+            response.append(REPLY_NOT_AN_INTEGER);
+            return false;
+        }
+        if (is_absolute ? ttl <= 0 || ttl > INT64_MAX / unit_ms : \
+                !get_expire_time(ttl, unit_ms, expire_at))
         {
-            std::cerr << "Outo of memory" << std::endl;
-            exit(1);
+            response.append(REPLY_INVALID_EXPIRE);
+            return false;
         }
+        if (is_absolute)
+            expire_at = ttl * unit_ms;
+    }
 
-        p->set_null(true);
-        return std::make_tuple(
-            false, 
-            std::shared_ptr<AbstractRespObject>(\
-                static_cast<AbstractRespObject*>(p)));
+    auto log_lock = lock_append_log(partition);
+    if (m_datastore[partition]->set(key, command.argv(2), expire_at))
+    {
+        if (m_append_log)
+            t_log_ticket = m_append_log->append_set(
+                partition, key.m_key, command.argv(2), expire_at);
+        if (auto counters = ServerStats::get()->get_shard_counters(partition))
+            counters->count_set();
+        response.append(REPLY_OK);
     }
+    else
+        response.append(get_set_failed_reply());
 
-    return std::make_tuple(true, ret);
+    return false;
 }
 
 /**
- * @brief delete one variable from the appropriate hash
+ * @brief In case of the GET command, perform the action
+ * 
+ * The value is framed as a bulk string straight from the data store
+ * into the response.
  * 
- * @param pobj command after parsing, as received from the client
- * @return true on successful deletion
- * @return false on failure to delete for any reason, including
- * if the item was not present in the first place.
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
  */
-bool Orchestrator::do_del_internal(std::shared_ptr<AbstractRespObject> pobj)
+bool Orchestrator::do_get(
+    const CommandView& command,
+    IoBuffer& response)
 {
-    auto key = pobj->to_string();
-    auto partition = get_partition(key);
-    return m_datastore[partition].del(key.c_str());
+    HashedKey key(command.argv(1));
+    size_t partition = get_partition(key);
+
+    bool found = m_datastore[partition]->visit_value(
+                    key,
+                    [](std::string_view value, void* context)
+                    {
+                        append_bulk_string(*static_cast<IoBuffer*>(context), value);
+                    },
+                    &response);
+    if (!found)
+        response.append(REPLY_NIL);
+
+    if (auto counters = ServerStats::get()->get_shard_counters(partition))
+        counters->count_get(found);
+
+    return false;
 }
 
 /**
- * @brief perform the DEL command
+ * @brief perform the EXPIRE and PEXPIRE commands
+ * 
+ * A time to live that is not positive deletes the key.
  * 
- * @param pobj command after parsing, as received from client
- * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
- * a tuple containing two items
- * 1. has there been a fatal error, which mandates the
- *    client connection must be closed
- * 2. output of the operation as an object that can be serialized
- *    and sent to the client as response.
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @param unit_ms the unit of the time to live, in milliseconds
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
  */
-std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-Orchestrator::do_del(std::shared_ptr<AbstractRespObject> pobj)
+bool Orchestrator::do_expire(
+    const CommandView& command,
+    IoBuffer& response,
+    std::int64_t unit_ms)
 {
-    RespArray* p_array_obj = static_cast<RespArray*>(pobj.get());
-    auto array = p_array_obj->get_array();
-    
-    int del_count = 0;
-    for (int i = 1; i < array.size(); i++)
+    HashedKey key(command.argv(1));
+    size_t partition = get_partition(key);
+
+    long long ttl;
+    if (!parse_integer(command.argv(2), ttl))
     {
-        if (do_del_internal(array[i]))
-            del_count++;
+        response.append(REPLY_NOT_AN_INTEGER);
+        return false;
     }
 
-    RespInteger* ret = new (std::nothrow) RespInteger(del_count);
-    if (!ret)
+    if (ttl <= 0)
     {
-        std::cerr << "Out of memory " << std::endl;
-        exit(1);
+        auto log_lock = lock_append_log(partition);
+        bool deleted = m_datastore[partition]->del(key);
+        if (deleted && m_append_log)
+            t_log_ticket = m_append_log->append_del(partition, key.m_key);
+        append_integer_reply(response, deleted ? 1 : 0);
+        return false;
     }
 
-    return std::make_tuple(
-        false,
-        std::shared_ptr<AbstractRespObject>(
-            static_cast<AbstractRespObject*>(ret)));
+    std::int64_t expire_at;
+    if (!get_expire_time(ttl, unit_ms, expire_at))
+    {
+        response.append(REPLY_INVALID_EXPIRE);
+        return false;
+    }
 
+    auto log_lock = lock_append_log(partition);
+    std::int64_t previous;
+    bool found = m_datastore[partition]->set_expiry(key, expire_at, previous);
+    if (found && m_append_log)
+        t_log_ticket = m_append_log->append_expire(partition, key.m_key, expire_at);
+    append_integer_reply(response, found ? 1 : 0);
+    return false;
 }
 
 /**
- * @brief start the server
+ * @brief perform the TTL and PTTL commands
  * 
- * @return int 0 on success
+ * The reply is -2 if the key does not exist, and -1 if it does
+ * not expire.
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @param unit_ms the unit of the time to live, in milliseconds
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
  */
-int Orchestrator::run_server()
+bool Orchestrator::do_ttl(
+    const CommandView& command,
+    IoBuffer& response,
+    std::int64_t unit_ms)
 {
-    create_server_socket();
-    if (!create_epoll_fd())
+    HashedKey key(command.argv(1));
+    size_t partition = get_partition(key);
+
+    std::int64_t expire_at;
+    if (!m_datastore[partition]->get_expiry(key, expire_at))
+        append_integer_reply(response, -2);
+    else if (EXPIRE_NEVER == expire_at)
+        append_integer_reply(response, -1);
+    else
     {
-        std::cerr << "failed to create epoll socket." << std::endl;
-        return -1;
+        std::int64_t remaining = std::max(expire_at - unix_time_ms(), (std::int64_t)0);
+        append_integer_reply(response, (remaining + unit_ms / 2) / unit_ms);
     }
-    if (!spawn_epoll_thread())
+    return false;
+}
+
+/**
+ * @brief perform the PERSIST command
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_persist(
+    const CommandView& command,
+    IoBuffer& response)
+{
+    HashedKey key(command.argv(1));
+    size_t partition = get_partition(key);
+
+    auto log_lock = lock_append_log(partition);
+    std::int64_t previous;
+    bool found = m_datastore[partition]->set_expiry(key, EXPIRE_NEVER, previous);
+    bool persisted = found && EXPIRE_NEVER != previous;
+    if (persisted && m_append_log)
+        t_log_ticket = m_append_log->append_expire(partition, key.m_key, EXPIRE_NEVER);
+    append_integer_reply(response, persisted ? 1 : 0);
+    return false;
+}
+
+/**
+ * @brief the batch of the multi-key command being run by this thread,
+ * kept between commands so that its memory is reused
+ * 
+ */
+static thread_local KeyBatch t_key_batch;
+
+/**
+ * @brief collect the keys of a multi-key command, and group them
+ * by partition
+ * 
+ * @param command the command, whose keys start at argument 1
+ * @param step 1 if the arguments are all keys, 2 if every key is
+ * followed by its value
+ * @param batch the batch to fill, cleared first
+ * @return true on success
+ * @return false if out of memory
+ */
+bool Orchestrator::group_keys(
+    const CommandView& command,
+    int step,
+    KeyBatch& batch)
+{
+    batch.clear();
+    try
     {
-        std::cerr << "Failed to spawn thread that polls for ready sockets" << std::endl;
-        return -1;
+        for (int i = 1; i < command.m_argc; i += step)
+        {
+            batch.m_keys.emplace_back(command.argv(i));
+            batch.m_partitions.push_back(get_partition(batch.m_keys.back()));
+            batch.m_indexes.push_back(batch.m_indexes.size());
+            if (2 == step)
+                batch.m_values.push_back(command.argv(i + 1));
+        }
     }
-    if (!spawn_accepting_thread())
+    catch (...)
     {
-        std::cerr << "Failed to spawn thread that accepts connections" << std::endl;
-        return -1;
+        LOG_ERROR("Out of memory");
+        return false;
     }
 
-    return 0;
+    // Stable, so that the keys of a partition keep the order of the
+    // command
+    std::stable_sort(batch.m_indexes.begin(), batch.m_indexes.end(),
+        [&batch](std::uint32_t a, std::uint32_t b)
+        {
+            return batch.m_partitions[a] < batch.m_partitions[b];
+        });
+    return true;
 }
 
-#define BUFSIZE 513
+/**
+ * @brief perform the DEL command
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_del(
+    const CommandView& command,
+    IoBuffer& response)
+{
+    KeyBatch& batch = t_key_batch;
+    if (!group_keys(command, 1, batch))
+    {
+        response.append(REPLY_GENERIC_ERROR);
+        return false;
+    }
+
+    try
+    {
+        batch.m_set_indexes.resize(batch.m_keys.size());
+    }
+    catch (...)
+    {
+        batch.clear();
+        response.append(REPLY_GENERIC_ERROR);
+        return false;
+    }
+
+    size_t del_count = 0;
+    batch.for_each_partition(
+        [&](std::uint32_t partition, const std::uint32_t* indexes, size_t count)
+        {
+            auto log_lock = lock_append_log(partition);
+            std::uint32_t* deleted_indexes = batch.m_set_indexes.data();
+            size_t deleted = m_datastore[partition]->del_keys(
+                                batch.m_keys.data(), indexes, count, deleted_indexes);
+            del_count += deleted;
+
+            // Only the keys that were there are logged
+            if (m_append_log)
+            {
+                for (size_t i = 0; i < deleted; i++)
+                    t_log_ticket = m_append_log->append_del(
+                        partition, batch.m_keys[deleted_indexes[i]].m_key);
+            }
+
+            if (auto counters = ServerStats::get()->get_shard_counters(partition))
+                counters->count_dels(count, deleted);
+        });
+
+    batch.clear();
+    append_integer_reply(response, del_count);
+    return false;
+}
 
 /**
- * @brief Reads from a socket and stores the values the state
+ * @brief perform the MGET command
  * 
- * It runs as a part of the read worker pool. When done,
- * it then invokes the parser worker pool.
+ * The reply is an array with the value of every key, or nil for
+ * the keys that are not found, in the order of the command.
  * 
- * @return int on success it returns 0, otherwise a number
- * to indicate the error
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
  */
-int SocketReadJob::run()
+bool Orchestrator::do_mget(
+    const CommandView& command,
+    IoBuffer& response)
 {
-    m_pstate->m_state = STATE_IN_READ_LOOP;
-    auto fd = m_pstate->m_socket;
-    std::cerr << fd << ": Picked up for reading" << std::endl;
-    char buffer[BUFSIZE];
+    KeyBatch& batch = t_key_batch;
+    bool is_ok = group_keys(command, 1, batch);
+    if (is_ok)
+    {
+        try
+        {
+            batch.m_found.assign(batch.m_keys.size(), {SIZE_MAX, 0});
+        }
+        catch (...)
+        {
+            is_ok = false;
+        }
+    }
 
-    int read_bytes;
-    int save_errno;
-    
-    do 
+    // Values come out grouped by partition, they are gathered first,
+    // then written in the order of the keys
+    batch.for_each_partition(
+        [&](std::uint32_t partition, const std::uint32_t* indexes, size_t count)
+        {
+            if (!is_ok)
+                return;
+
+            size_t found = m_datastore[partition]->visit_values(
+                batch.m_keys.data(),
+                indexes,
+                count,
+                [](std::uint32_t index, std::string_view value, void* context)
+                {
+                    KeyBatch* batch = static_cast<KeyBatch*>(context);
+                    try
+                    {
+                        batch->m_found[index] = {batch->m_found_values.size(), value.size()};
+                        batch->m_found_values.append(value);
+                    }
+                    catch (...)
+                    {
+                        batch->m_found[index] = {SIZE_MAX, 0};
+                    }
+                },
+                &batch);
+
+            if (auto counters = ServerStats::get()->get_shard_counters(partition))
+                counters->count_gets(count, found);
+        });
+
+    if (!is_ok)
     {
-        bzero(buffer, sizeof(buffer));
-        read_bytes = read(fd, buffer, BUFSIZE);
-        save_errno = errno;
-        if (read_bytes > 0)
-            m_pstate->m_read_data += buffer;
-    } while (read_bytes > 0);
+        batch.clear();
+        response.append(REPLY_GENERIC_ERROR);
+        return false;
+    }
 
-    if ((-1 == read_bytes && EAGAIN != save_errno) ||
-        m_pstate->m_read_data == std::string(""))
+    append_array_header(response, batch.m_keys.size());
+    for (auto [offset, size]: batch.m_found)
     {
-        perror("read");
-        std::cerr << fd << ": error, read " << read_bytes << \
-            " bytes, err = " << errno << std::endl;
-        close_and_cleanup(fd, m_pstate, m_porchestrator);
-        return read_bytes;
+        if (SIZE_MAX == offset)
+            response.append(REPLY_NIL);
+        else
+            append_bulk_string(response, std::string_view(batch.m_found_values).substr(offset, size));
     }
 
-    if (false == m_porchestrator->add_to_parse_and_run_queue(m_pstate))
+    batch.clear();
+    return false;
+}
+
+/**
+ * @brief perform the MSET command
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_mset(
+    const CommandView& command,
+    IoBuffer& response)
+{
+    KeyBatch& batch = t_key_batch;
+    if (!group_keys(command, 2, batch))
     {
-        std::cerr << fd << ": Adding to parse queue failed" << std::endl;
-        close_and_cleanup(fd, m_pstate, m_porchestrator);
-        return -1;
+        response.append(REPLY_GENERIC_ERROR);
+        return false;
     }
 
-    std::cerr << fd << ": Added to parse queue" << std::endl;
+    try
+    {
+        batch.m_set_indexes.resize(batch.m_keys.size());
+    }
+    catch (...)
+    {
+        batch.clear();
+        response.append(REPLY_GENERIC_ERROR);
+        return false;
+    }
 
-    return 0;
+    // MSET sets all the pairs or none: every data store of the batch
+    // makes room for its pairs before any of them is set, and nobody
+    // else writes to them until they are. They are held in increasing
+    // order of their partitions, as for_each_partition() goes.
+    bool has_room = true;
+    batch.for_each_partition(
+        [&](std::uint32_t partition, const std::uint32_t* indexes, size_t count)
+        {
+            if (m_append_log)
+                m_append_log->get_mutex(partition).lock();
+            m_datastore[partition]->lock_writes();
+            has_room = has_room && m_datastore[partition]->make_room_for_values_unsafe(
+                batch.m_keys.data(), batch.m_values.data(), indexes, count);
+        });
+
+    size_t num_set = 0;
+    batch.for_each_partition(
+        [&](std::uint32_t partition, const std::uint32_t* indexes, size_t count)
+        {
+            if (!has_room)
+                return;
+
+            std::uint32_t* set_indexes = batch.m_set_indexes.data();
+            size_t partition_set = m_datastore[partition]->set_values_unsafe(
+                batch.m_keys.data(), batch.m_values.data(), indexes, count, set_indexes);
+            num_set += partition_set;
+
+            // Only the keys that were set are logged, a partition may
+            // still be partly set when out of memory
+            if (m_append_log)
+            {
+                for (size_t i = 0; i < partition_set; i++)
+                    t_log_ticket = m_append_log->append_set(
+                        partition, batch.m_keys[set_indexes[i]].m_key,
+                        batch.m_values[set_indexes[i]], EXPIRE_NEVER);
+            }
+
+            if (auto counters = ServerStats::get()->get_shard_counters(partition))
+                counters->count_sets(partition_set);
+        });
+
+    batch.for_each_partition(
+        [&](std::uint32_t partition, const std::uint32_t*, size_t)
+        {
+            m_datastore[partition]->unlock_writes();
+            if (m_append_log)
+                m_append_log->get_mutex(partition).unlock();
+        });
+
+    if (num_set == batch.m_keys.size())
+        response.append(REPLY_OK);
+    else
+        response.append(get_set_failed_reply());
+
+    batch.clear();
+    return false;
 }
 
 /**
- * @brief The job in the work-queue which parses the input
- * that is received from the user, and then performs the
- * appropriate action
+ * @brief the "name:value" lines of CLUSTER INFO, and of the cluster
+ * section of INFO
  * 
- * @return int 0 on success
+ * @param cluster the cluster
+ * @param ss the lines are written here
  */
-int ParseAndRunJob::run()
+static void write_cluster_info(Cluster& cluster, std::stringstream& ss)
+{
+    int self = cluster.get_self();
+    int num_nodes = cluster.get_num_nodes();
+    std::vector<bool> has_slots(num_nodes);
+    size_t num_assigned = 0;
+    size_t num_mine = 0;
+    size_t num_migrating = 0;
+    size_t num_importing = 0;
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+    {
+        int owner = cluster.get_owner(slot);
+        if (owner >= 0)
+        {
+            num_assigned++;
+            has_slots[owner] = true;
+        }
+        if (owner == self)
+            num_mine++;
+        if (cluster.get_migrating(slot) >= 0)
+            num_migrating++;
+        if (cluster.get_importing(slot) >= 0)
+            num_importing++;
+    }
+
+    ss << "cluster_enabled:1\r\n";
+    ss << "cluster_state:" << (CLUSTER_SLOTS == num_assigned ? "ok" : "fail") << "\r\n";
+    ss << "cluster_slots_assigned:" << num_assigned << "\r\n";
+    ss << "cluster_known_nodes:" << num_nodes << "\r\n";
+    ss << "cluster_size:" << std::count(has_slots.begin(), has_slots.end(), true) << "\r\n";
+    ss << "cluster_my_slots:" << num_mine << "\r\n";
+    ss << "cluster_migrating_slots:" << num_migrating << "\r\n";
+    ss << "cluster_importing_slots:" << num_importing << "\r\n";
+    ss << "cluster_migrated_slots:" << cluster.m_num_migrated_slots << "\r\n";
+    ss << "cluster_migrated_keys:" << cluster.m_num_migrated_keys << "\r\n";
+}
+
+/**
+ * @brief the name of a timed state in INFO
+ * 
+ * @param state the state
+ * @return const char* the name, nullptr if the state is not timed
+ */
+static const char* get_stage_name(int state)
+{
+    switch (state)
+    {
+        case STATE_WAITING_FOR_READ_JOB:    return "waiting_for_read_job";
+        case STATE_IN_READ_LOOP:            return "in_read_loop";
+        case STATE_WAITING_FOR_PARSING:     return "waiting_for_parsing";
+        case STATE_PARSING:                 return "parsing";
+        case STATE_WAITING_FOR_WRITE:       return "waiting_for_write";
+        case STATE_IN_WRITE_LOOP:           return "in_write_loop";
+        case STATE_WAITING_FOR_WRITABLE:    return "waiting_for_writable";
+        default:                            return nullptr;
+    }
+}
+
+std::string Orchestrator::get_info(std::string_view section)
+{
+    std::stringstream ss;
+    bool is_all = section.empty();
+    bool is_pipeline = SERVER_MODE_PIPELINE == m_config.m_mode;
+
+    if (is_all || command_name_equals(section, "server"))
+    {
+        ss << "# Server\r\n";
+        ss << "mode:" << (is_pipeline ? "pipeline" : \
+            SERVER_MODE_IO_URING == m_config.m_mode ? "io-uring" : "event-loop") << "\r\n";
+        if (m_io_uring_loops.size())
+        {
+            std::uint64_t num_enters = 0;
+            std::uint64_t num_completions = 0;
+            for (auto ploop: m_io_uring_loops)
+            {
+                num_enters += ploop->m_num_enters.load(std::memory_order_relaxed);
+                num_completions += ploop->m_num_completions.load(std::memory_order_relaxed);
+            }
+            ss << "io_uring_enters:" << num_enters << "\r\n";
+            ss << "io_uring_completions:" << num_completions << "\r\n";
+        }
+        if (is_pipeline)
+            ss << "scheduler:" << (SCHEDULER_WORK_STEALING == m_config.m_scheduler ? \
+                "work-stealing" : "single-queue") << "\r\n";
+        ss << "datastore:" << (DATASTORE_READ_OPTIMIZED == m_config.m_datastore_type ? \
+            "read-optimized" : "locked") << "\r\n";
+        ss << "datastores:" << m_num_datastores << "\r\n";
+        ss << "uptime_in_seconds:" << (now_ns() - m_start_time) / 1000000000L << "\r\n";
+        ss << "log_lines_dropped:" << log_get_dropped() << "\r\n";
+        ss << "expired_keys:" << m_expiry_reclaimer->m_num_expired << "\r\n";
+        ss << "\r\n";
+    }
+
+    if (is_all || command_name_equals(section, "persistence"))
+    {
+        ss << "# Persistence\r\n";
+        ss << "snapshot_file:" << m_config.m_snapshot_file << "\r\n";
+        if (m_snapshot_writer)
+        {
+            ss << "snapshot_in_progress:" << (m_snapshot_writer->m_is_saving ? 1 : 0) << "\r\n";
+            ss << "snapshots_saved:" << m_snapshot_writer->m_num_saved << "\r\n";
+            ss << "snapshots_failed:" << m_snapshot_writer->m_num_failed << "\r\n";
+            ss << "last_save_time:" << m_snapshot_writer->m_last_save_time / 1000 << "\r\n";
+            ss << "last_save_keys:" << m_snapshot_writer->m_last_save_keys << "\r\n";
+            ss << "last_save_bytes:" << m_snapshot_writer->m_last_save_bytes << "\r\n";
+        }
+        ss << "aof_enabled:" << (m_config.m_aof_file.empty() ? 0 : 1) << "\r\n";
+        if (m_append_log && m_append_log->is_persistent())
+        {
+            static const char* fsync_names[] = {"always", "everysec", "no"};
+            ss << "aof_file:" << m_config.m_aof_file << "\r\n";
+            ss << "aof_fsync:" << fsync_names[m_append_log->get_fsync()] << "\r\n";
+            ss << "aof_segment:" << m_append_log->get_segment() << "\r\n";
+            ss << "aof_bytes_written:" << m_append_log->m_bytes_written << "\r\n";
+            ss << "aof_syncs:" << m_append_log->m_num_syncs << "\r\n";
+            ss << "aof_errors:" << m_append_log->m_num_errors << "\r\n";
+            ss << "aof_last_write_status:" << (m_append_log->m_is_failed ? "err" : "ok") << "\r\n";
+        }
+        ss << "\r\n";
+    }
+
+    if (is_all || command_name_equals(section, "replication"))
+    {
+        ss << "# Replication\r\n";
+        ss << "role:" << (m_repl_replica ? "replica" : "primary") << "\r\n";
+        if (m_repl_replica)
+        {
+            ss << "primary_host:" << m_repl_replica->get_host() << "\r\n";
+            ss << "primary_port:" << m_repl_replica->get_port() << "\r\n";
+            ss << "primary_link_status:" << (m_repl_replica->m_is_connected ? "up" : "down") << "\r\n";
+            ss << "replica_repl_offset:" << m_repl_replica->m_offset << "\r\n";
+            ss << "replica_full_syncs:" << m_repl_replica->m_num_full_syncs << "\r\n";
+            ss << "replica_writes_applied:" << m_repl_replica->m_num_applied << "\r\n";
+        }
+        if (m_repl_primary)
+        {
+            auto replicas = m_repl_primary->get_replicas();
+            std::uint64_t end = m_repl_backlog->get_end_offset();
+            ss << "connected_replicas:" << replicas.size() << "\r\n";
+            for (size_t i = 0; i < replicas.size(); i++)
+                ss << "replica" << i << ":addr=" << replicas[i].first \
+                    << ",offset=" << replicas[i].second \
+                    << ",lag_bytes=" << end - std::min(end, replicas[i].second) << "\r\n";
+            ss << "primary_repl_offset:" << end << "\r\n";
+            ss << "repl_backlog_size:" << m_repl_backlog->get_size() << "\r\n";
+            ss << "repl_backlog_first_byte_offset:" << m_repl_backlog->get_start_offset() << "\r\n";
+            ss << "full_syncs:" << m_repl_primary->m_num_full_syncs << "\r\n";
+            ss << "partial_syncs:" << m_repl_primary->m_num_partial_syncs << "\r\n";
+        }
+        ss << "\r\n";
+    }
+
+    if (m_cluster && (is_all || command_name_equals(section, "cluster")))
+    {
+        ss << "# Cluster\r\n";
+        write_cluster_info(*m_cluster, ss);
+        ss << "\r\n";
+    }
+
+    if (is_all || command_name_equals(section, "memory"))
+    {
+        size_t used_memory = 0;
+        std::uint64_t num_evicted = 0;
+        for (size_t i = 0; i < m_num_datastores; i++)
+        {
+            used_memory += m_datastore[i]->get_used_memory();
+            num_evicted += m_datastore[i]->get_num_evicted();
+        }
+
+        const char* policy = "lru";
+        if (EVICTION_NOEVICTION == m_config.m_maxmemory_policy)
+            policy = "noeviction";
+        else if (EVICTION_LFU == m_config.m_maxmemory_policy)
+            policy = "lfu";
+
+        ss << "# Memory\r\n";
+        ss << "used_memory:" << used_memory << "\r\n";
+        ss << "maxmemory:" << m_config.m_max_memory << "\r\n";
+        ss << "maxmemory_policy:" << policy << "\r\n";
+        ss << "evicted_keys:" << num_evicted << "\r\n";
+        ss << "\r\n";
+    }
+
+    // The latencies are in microseconds
+    if (is_all || command_name_equals(section, "latency"))
+    {
+        LatencySnapshot stages[STATE_NUM_STATES];
+        LatencySnapshot request;
+        ServerStats::get()->get_latency(stages, request);
+
+        ss << "# Latency\r\n";
+        ss << "request:" << request.to_string() << "\r\n";
+        for (int i = STATE_FIRST_TIMED; i <= STATE_LAST_TIMED; i++)
+        {
+            if (stages[i].m_total)
+                ss << "stage_" << get_stage_name(i) << ":" \
+                    << stages[i].to_string() << "\r\n";
+        }
+        ss << "\r\n";
+    }
+
+    if (is_pipeline && (is_all || command_name_equals(section, "pools")))
+    {
+        std::tuple<const char*, ThreadPool*> pools[] = {
+            {"read", m_processing_threadpool},
+            {"parse", m_parse_and_run_threadpool},
+            {"write", m_write_threadpool}
+        };
+
+        ss << "# Pools\r\n";
+        for (auto [name, pool]: pools)
+        {
+            ThreadPoolStats stats;
+            LatencySnapshot wait;
+            LatencySnapshot service;
+            pool->get_stats(stats);
+            pool->get_latency(wait, service);
+
+            ss << "pool_" << name << ":threads=" << stats.m_num_threads \
+                << ",idle=" << stats.m_num_idle \
+                << ",queue_depth=" << stats.m_queue_depth \
+                << ",jobs=" << stats.m_jobs_run << "\r\n";
+            ss << "pool_" << name << "_wait:" << wait.to_string() << "\r\n";
+            ss << "pool_" << name << "_service:" << service.to_string() << "\r\n";
+        }
+        ss << "pools_grown:" << m_pool_controller->m_num_grown << "\r\n";
+        ss << "pools_shrunk:" << m_pool_controller->m_num_shrunk << "\r\n";
+        ss << "\r\n";
+    }
+
+    if (is_all || command_name_equals(section, "backpressure"))
+    {
+        ss << "# Backpressure\r\n";
+        ss << "pool_queue_limit:" << m_config.m_pool_queue_limit << "\r\n";
+        ss << "overload_policy:" \
+            << (OVERLOAD_BUSY == m_config.m_overload_policy ? "busy" : "defer") << "\r\n";
+        ss << "client_output_limit:" << m_config.m_client_output_limit << "\r\n";
+        ss << "deferred_reads:" << m_num_deferred_reads << "\r\n";
+        ss << "busy_replies:" << m_num_busy_replies << "\r\n";
+        ss << "output_limited:" << m_num_output_limited << "\r\n";
+        ss << "\r\n";
+    }
+
+    if (is_all || command_name_equals(section, "cpu"))
+    {
+        const CpuTopology& topology = CpuTopology::get();
+        auto get_cpus = [](const cpu_set_t& cpus) {
+            return is_cpu_set_empty(cpus) ? std::string("any") : format_cpu_list(cpus);
+        };
+
+        ss << "# Cpu\r\n";
+        ss << "cpu_affinity:" << (CPU_AFFINITY_NUMA == m_config.m_cpu_affinity ? \
+            "numa" : "none") << "\r\n";
+        ss << "numa_nodes:" << topology.get_num_nodes() << "\r\n";
+        for (int i = 0; i < topology.get_num_nodes(); i++)
+        {
+            int node = topology.get_node_id(i);
+            ss << "node" << node << ":cpus=" << format_cpu_list(topology.get_node_cpus(i)) \
+                << ",shards=" << std::count(m_placement.m_shard_nodes.begin(),
+                    m_placement.m_shard_nodes.end(), node) << "\r\n";
+        }
+        if (!m_io_uring_loops.size())
+            ss << "io_cpus:" << get_cpus(m_placement.m_io_cpus) << "\r\n";
+        if (is_pipeline)
+        {
+            ss << "read_cpus:" << get_cpus(m_placement.m_read_cpus) << "\r\n";
+            ss << "parse_cpus:" << get_cpus(m_placement.m_parse_cpus) << "\r\n";
+            ss << "write_cpus:" << get_cpus(m_placement.m_write_cpus) << "\r\n";
+        }
+        for (size_t i = 0; i < m_placement.m_loop_cpus.size(); i++)
+            ss << "loop" << i << "_cpus:" << get_cpus(m_placement.m_loop_cpus[i]) << "\r\n";
+        if (m_event_loops.size())
+            ss << "steered_connections:" << m_num_steered_connections << "\r\n";
+        ss << "\r\n";
+    }
+
+    if (is_all || command_name_equals(section, "shards"))
+    {
+        auto totals = ServerStats::get()->get_shard_totals();
+        ShardTotals sum;
+
+        ss << "# Shards\r\n";
+        for (size_t i = 0; i < totals.size(); i++)
+        {
+            auto& shard = totals[i];
+            ss << "shard_" << i << ":ops=" << shard.get_ops() \
+                << ",gets=" << shard.m_gets << ",sets=" << shard.m_sets \
+                << ",dels=" << shard.m_dels << ",hits=" << shard.m_hits \
+                << ",misses=" << shard.m_misses << "\r\n";
+
+            sum.m_gets += shard.m_gets;
+            sum.m_sets += shard.m_sets;
+            sum.m_dels += shard.m_dels;
+            sum.m_hits += shard.m_hits;
+            sum.m_misses += shard.m_misses;
+        }
+        ss << "total_ops:" << sum.get_ops() << "\r\n";
+        ss << "total_hits:" << sum.m_hits << "\r\n";
+        ss << "total_misses:" << sum.m_misses << "\r\n";
+        ss << "\r\n";
+    }
+
+    return ss.str();
+}
+
+/**
+ * @brief perform the INFO command
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_info(
+    const CommandView& command,
+    IoBuffer& response)
 {
-    m_pstate->m_state = STATE_PARSING;
-    auto fd = m_pstate->m_socket;
-    std::cerr << fd << ": Picked up for parsing" << std::endl;
+    try
+    {
+        std::string info = get_info(command.m_argc > 1 ? command.argv(1) : "");
+        append_bulk_string(response, info);
+    }
+    catch (...)
+    {
+        response.append(REPLY_GENERIC_ERROR);
+    }
 
+    return false;
+}
 
-    RespParser parser(m_pstate->m_read_data);
-    auto [err, parsed_obj] = parser.get_generic_object();
-    if (ERROR_SUCCESS != err)
+/**
+ * @brief perform the SAVE and BGSAVE commands
+ * 
+ * SAVE writes the snapshot in the calling thread, and only replies
+ * once it is on disk.
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @param is_background whether the snapshot is written in the
+ * background
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_save(
+    const CommandView& command,
+    IoBuffer& response,
+    bool is_background)
+{
+    if (!m_snapshot_writer)
+        response.append(REPLY_NO_SNAPSHOT_FILE);
+    else if (is_background)
+        response.append(m_snapshot_writer->request() ? \
+            REPLY_BGSAVE_STARTED : REPLY_BGSAVE_IN_PROGRESS);
+    else
+        response.append(m_snapshot_writer->write() ? REPLY_OK : REPLY_SAVE_FAILED);
+
+    return false;
+}
+
+/**
+ * @brief parse a slot argument
+ * 
+ * @return true if it is a slot
+ */
+static bool parse_slot(std::string_view s, std::uint16_t& slot)
+{
+    long long value;
+    if (!parse_integer(s, value) || value < 0 || value >= CLUSTER_SLOTS)
+        return false;
+
+    slot = value;
+    return true;
+}
+
+/**
+ * @brief perform the CLUSTER command
+ * 
+ * @param command command after parsing, as received from client
+ * @param response the serialized response is appended here
+ * @return true if there has been a fatal error, which mandates the
+ * client connection must be closed
+ * @return false otherwise
+ */
+bool Orchestrator::do_cluster(
+    const CommandView& command,
+    IoBuffer& response)
+{
+    if (!m_cluster)
+    {
+        response.append(REPLY_CLUSTER_DISABLED);
+        return false;
+    }
+
+    auto subcommand = command.argv(1);
+    std::uint16_t slot = 0;
+    if ((command_name_equals(subcommand, "countkeysinslot") || \
+            command_name_equals(subcommand, "getkeysinslot") || \
+            command_name_equals(subcommand, "setslot")) && \
+        (command.m_argc < 3 || !parse_slot(command.argv(2), slot)))
     {
-        std::cerr << fd << ": Could not parse command '" \
-            << m_pstate->m_read_data << "'" << std::endl;
+        response.append(command.m_argc < 3 ? REPLY_INVALID_COMMAND : REPLY_INVALID_SLOT);
+        return false;
+    }
+
+    try
+    {
+        if (command_name_equals(subcommand, "keyslot") && 3 == command.m_argc)
+            append_integer_reply(response, get_key_slot(command.argv(2)));
+        else if (command_name_equals(subcommand, "myid") && 2 == command.m_argc)
+            append_bulk_string(response, m_cluster->get_node(m_cluster->get_self()).m_id);
+        else if (command_name_equals(subcommand, "info") && 2 == command.m_argc)
+        {
+            std::stringstream ss;
+            write_cluster_info(*m_cluster, ss);
+            append_bulk_string(response, ss.str());
+        }
+        else if (command_name_equals(subcommand, "slots") && 2 == command.m_argc)
+        {
+            // Consecutive slots of the same node make a range
+            std::vector<std::tuple<int, int, int>> ranges;
+            for (int i = 0; i < CLUSTER_SLOTS; i++)
+            {
+                int owner = m_cluster->get_owner(i);
+                if (owner < 0)
+                    continue;
+                if (!ranges.empty() && std::get<1>(ranges.back()) == i - 1 && \
+                        std::get<2>(ranges.back()) == owner)
+                    std::get<1>(ranges.back()) = i;
+                else
+                    ranges.emplace_back(i, i, owner);
+            }
+
+            append_array_header(response, ranges.size());
+            for (auto [first, last, owner]: ranges)
+            {
+                const ClusterNode& node = m_cluster->get_node(owner);
+                append_array_header(response, 3);
+                append_integer_reply(response, first);
+                append_integer_reply(response, last);
+                append_array_header(response, 3);
+                append_bulk_string(response, node.m_host);
+                append_integer_reply(response, node.m_port);
+                append_bulk_string(response, node.m_id);
+            }
+        }
+        else if (command_name_equals(subcommand, "nodes") && 2 == command.m_argc)
+        {
+            // The format of Redis Cluster, the bus port is only shown
+            std::string nodes;
+            int self = m_cluster->get_self();
+            for (int i = 0; i < m_cluster->get_num_nodes(); i++)
+            {
+                const ClusterNode& node = m_cluster->get_node(i);
+                nodes += node.m_id + " " + node.m_address + "@" + std::to_string(node.m_port + 10000);
+                nodes += i == self ? " myself,master" : " master";
+                nodes += " - 0 0 0 connected";
+
+                int first = -1;
+                for (int j = 0; j <= CLUSTER_SLOTS; j++)
+                {
+                    bool is_owned = j < CLUSTER_SLOTS && m_cluster->get_owner(j) == i;
+                    if (is_owned && first < 0)
+                        first = j;
+                    if (is_owned || first < 0)
+                        continue;
+
+                    nodes += " " + std::to_string(first);
+                    if (j - 1 != first)
+                        nodes += "-" + std::to_string(j - 1);
+                    first = -1;
+                }
+
+                for (int j = 0; i == self && j < CLUSTER_SLOTS; j++)
+                {
+                    int target = m_cluster->get_migrating(j);
+                    int source = m_cluster->get_importing(j);
+                    if (target >= 0)
+                        nodes += " [" + std::to_string(j) + "->-" + m_cluster->get_node(target).m_id + "]";
+                    if (source >= 0)
+                        nodes += " [" + std::to_string(j) + "-<-" + m_cluster->get_node(source).m_id + "]";
+                }
+                nodes += "\n";
+            }
+            append_bulk_string(response, nodes);
+        }
+        else if (command_name_equals(subcommand, "countkeysinslot") && 3 == command.m_argc)
+            append_integer_reply(response, m_cluster->count_keys_in_slot(slot));
+        else if (command_name_equals(subcommand, "getkeysinslot") && 4 == command.m_argc)
+        {
+            long long count;
+            if (!parse_integer(command.argv(3), count) || count < 0)
+            {
+                response.append(REPLY_NOT_AN_INTEGER);
+                return false;
+            }
 
-        m_pstate->m_is_error = true;
+            std::vector<std::string> keys;
+            m_cluster->get_keys_in_slot(slot, count, keys);
+            append_array_header(response, keys.size());
+            for (auto& key: keys)
+                append_bulk_string(response, key);
+        }
+        else if (command_name_equals(subcommand, "setslot") && 4 == command.m_argc && \
+                command_name_equals(command.argv(3), "stable"))
+        {
+            m_cluster->set_slot_stable(slot);
+            response.append(REPLY_OK);
+        }
+        else if (command_name_equals(subcommand, "setslot") && 5 == command.m_argc)
+        {
+            auto action = command.argv(3);
+            int node = m_cluster->get_or_add_node(command.argv(4));
+            bool is_ok = true;
 
-        RespError* e = new RespError(
-            std::string("Unable to parse '") 
-                + std::string(m_pstate->m_read_data)
-                + std::string("'. Try again."));
+            if (node < 0)
+            {
+                response.append(REPLY_UNKNOWN_NODE);
+                return false;
+            }
 
-        m_pstate->m_response = \
-               std::shared_ptr<AbstractRespObject>((AbstractRespObject*)e);
+            if (command_name_equals(action, "node"))
+                m_cluster->set_slot_node(slot, node);
+            else if (command_name_equals(action, "migrating"))
+                is_ok = m_cluster->set_slot_migrating(slot, node);
+            else if (command_name_equals(action, "importing"))
+                is_ok = m_cluster->set_slot_importing(slot, node);
+            else
+            {
+                response.append(REPLY_INVALID_COMMAND);
+                return false;
+            }
+            response.append(is_ok ? REPLY_OK : REPLY_SETSLOT_FAILED);
+        }
+        else
+            response.append(REPLY_INVALID_COMMAND);
+    }
+    catch (...)
+    {
+        response.append(REPLY_GENERIC_ERROR);
+    }
+
+    return false;
+}
 
-        if (false == m_porchestrator->add_to_write_queue(m_pstate))
+/**
+ * @brief start the server
+ * 
+ * @return int 0 on success
+ */
+int Orchestrator::run_server()
+{
+    // A client that goes away while its response is being written
+    // must only fail that write, not terminate the server
+    signal(SIGPIPE, SIG_IGN);
+
+    create_server_socket();
+    if (SERVER_MODE_IO_URING == m_config.m_mode)
+    {
+        if (!start_io_uring_loops())
         {
-            std::cerr << fd << ": Add to write queue failed" << std::endl;
-            close_and_cleanup(fd, m_pstate, m_porchestrator);
+            LOG_ERROR("Failed to start the io_uring loops");
             return -1;
         }
+    }
+    else if (SERVER_MODE_EVENT_LOOP == m_config.m_mode)
+    {
+        if (!start_event_loops())
+        {
+            LOG_ERROR("Failed to start the event loops");
+            return -1;
+        }
+    }
+    else
+    {
+        if (!create_epoll_fd())
+        {
+            LOG_ERROR("failed to create epoll socket.");
+            return -1;
+        }
+        if (!spawn_epoll_thread())
+        {
+            LOG_ERROR("Failed to spawn thread that polls for ready sockets");
+            return -1;
+        }
+    }
+    // The io_uring loops accept their own connections
+    if (m_io_uring_loops.empty() && !spawn_accepting_thread())
+    {
+        LOG_ERROR("Failed to spawn thread that accepts connections");
+        return -1;
+    }
+
+    m_is_running = true;
+    return 0;
+}
+
+/**
+ * @brief stop the accepting and epoll threads and wait for them
+ * to terminate
+ * 
+ */
+void Orchestrator::stop_server()
+{
+    if (!m_is_running)
+        return;
+
+    m_is_destroying = true;
+
+    // Unblocks the accept() call, and ends the accepts of the io_uring
+    // loops
+    shutdown(m_server_socket, SHUT_RDWR);
+    if (m_io_uring_loops.size())
+    {
+        for (auto ploop: m_io_uring_loops)
+            delete ploop;
+        m_io_uring_loops.clear();
+    }
+    else if (m_event_loops.size())
+    {
+        pthread_join(m_accepting_thread_id, nullptr);
+        for (auto ploop: m_event_loops)
+            delete ploop;
+        m_event_loops.clear();
+    }
+    else
+    {
+        pthread_join(m_accepting_thread_id, nullptr);
+        wakeup_epoll_thread();
+        pthread_join(m_epoll_thread_id, nullptr);
+        close(m_wakeup_fd);
+        close(m_epoll_fd);
+    }
+
+    close(m_server_socket);
+    m_is_running = false;
+}
+
+/**
+ * @brief create and start the event loops used in
+ * SERVER_MODE_EVENT_LOOP
+ * 
+ * @return true on success
+ * @return false on failure
+ */
+bool Orchestrator::start_event_loops()
+{
+    int num_loops = m_config.get_num_event_loops();
+
+    for (int i = 0; i < num_loops; i++)
+    {
+        EventLoop* ploop = new (std::nothrow) EventLoop(
+                                this,
+                                m_config.m_epoll_batch_size);
+        if (!ploop)
+        {
+            LOG_ERROR("Out of memory");
+            return false;
+        }
+        ploop->m_cpus = m_placement.m_loop_cpus[i];
+
+        m_event_loops.push_back(ploop);
+        if (!ploop->start())
+            return false;
+    }
+
+    LOG_INFO("Started " << num_loops << " event loops");
+    return true;
+}
+
+/**
+ * @brief create and start the io_uring loops used in
+ * SERVER_MODE_IO_URING
+ * 
+ * @return true on success
+ * @return false on failure
+ */
+bool Orchestrator::start_io_uring_loops()
+{
+    int num_loops = m_config.get_num_event_loops();
+
+    for (int i = 0; i < num_loops; i++)
+    {
+        IoUringLoop* ploop = new (std::nothrow) IoUringLoop(
+                                this,
+                                m_server_socket);
+        if (!ploop)
+        {
+            LOG_ERROR("Out of memory");
+            return false;
+        }
+        ploop->set_cpus(m_placement.m_loop_cpus[i]);
+
+        m_io_uring_loops.push_back(ploop);
+        if (!ploop->start())
+            return false;
+    }
+
+    LOG_INFO("Started " << num_loops << " io_uring loops");
+    return true;
+}
+
+/**
+ * @brief size of the stack buffer that catches what does not fit in
+ * a connection's input buffer in a single read
+ * 
+ */
+#define READ_SPILL_SIZE 65536
+
+/**
+ * @brief free space the input buffer is grown to before each read
+ * 
+ */
+#define READ_MIN_FREE 4096
+
+/**
+ * @brief read everything that is available on a socket
+ * 
+ * The socket is non-blocking, and is read until it would block.
+ * The data is appended to the state's m_input.
+ * 
+ * Each read is a readv into the free space of the input buffer and
+ * a large stack buffer, so that a big request is read in few system
+ * calls without growing every connection's buffer up front. A read
+ * that does not fill both means the socket has been drained.
+ * 
+ * @param state the state associated with the socket
+ * @return read_result_t whether new data was read, or the
+ * socket must be closed
+ */
+read_result_t Orchestrator::read_from_socket(State& state)
+{
+    auto fd = state.m_socket;
+    char spill[READ_SPILL_SIZE];
+    size_t total_read = 0;
+
+    while (true)
+    {
+        if (!state.m_input.reserve(READ_MIN_FREE))
+        {
+            LOG_ERROR(fd << ": Out of memory for input");
+            return READ_RESULT_CLOSED;
+        }
+
+        struct iovec iov[2];
+        iov[0].iov_base = state.m_input.write_ptr();
+        iov[0].iov_len = state.m_input.write_size();
+        iov[1].iov_base = spill;
+        iov[1].iov_len = sizeof(spill);
+
+        ssize_t read_bytes = readv(fd, iov, 2);
+        if (read_bytes < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                break;
+
+            perror("readv");
+            LOG_ERROR(fd << ": error, read failed, err = " << errno);
+            return READ_RESULT_CLOSED;
+        }
+
+        // The client closed the connection
+        if (0 == read_bytes)
+            return READ_RESULT_CLOSED;
+
+        size_t in_buffer = std::min((size_t)read_bytes, iov[0].iov_len);
+        state.m_input.commit(in_buffer);
+        if (!state.m_input.append(
+                std::string_view(spill, read_bytes - in_buffer)))
+        {
+            LOG_ERROR(fd << ": Out of memory for input");
+            return READ_RESULT_CLOSED;
+        }
+
+        total_read += read_bytes;
+        if ((size_t)read_bytes < iov[0].iov_len + iov[1].iov_len)
+            break;
+    }
+
+    // The connection is idle, it does not keep the memory meanwhile
+    if (0 == total_read)
+    {
+        state.m_input.release();
+        return READ_RESULT_NO_DATA;
+    }
+
+    return READ_RESULT_DATA;
+}
+
+/**
+ * @brief parse and run all the complete commands in the state's
+ * m_input
+ * 
+ * All complete commands are run in order, and their responses
+ * are collected in m_output so that they can be sent back in
+ * one write. An incomplete trailing command is left in the input
+ * until the rest of it has been read.
+ * 
+ * @param state the state associated with the socket
+ * @return true if there is a response to write
+ * @return false if only part of a command has been received
+ */
+bool Orchestrator::parse_and_run(State& state, bool is_rejecting)
+{
+    state.set_state(STATE_PARSING);
+    auto fd = state.m_socket;
+
+    RespParser parser(state.m_input.data(), state.m_input.size());
+    CommandView command;
+    size_t output_limit = is_rejecting ? 0 : m_config.m_client_output_limit;
+    t_is_asking = state.m_is_asking;
+    state.m_is_output_limited = false;
+    size_t batch_start = state.m_output.size();
+    size_t num_commands = 0;
+    while (parser.has_more() && !state.m_is_error)
+    {
+        // The rest waits until the responses so far have been sent
+        if (output_limit && state.m_output.size() >= output_limit)
+        {
+            state.m_is_output_limited = true;
+            m_num_output_limited++;
+            break;
+        }
+
+        auto err = parser.get_next_command(command);
+        if (ERROR_INCOMPLETE == err)
+            break;
+
+        if (ERROR_SUCCESS != err)
+        {
+            std::string input(state.m_input.view());
+            LOG_ERROR(fd << ": Could not parse command '" << input << "'");
+
+            state.m_is_error = true;
+
+            RespError e(
+                std::string("Unable to parse '") 
+                    + input
+                    + std::string("'. Try again."));
+            state.m_output.append(e.serialize());
+            break;
+        }
+
+        if (is_rejecting)
+        {
+            state.m_output.append(REPLY_BUSY);
+            m_num_busy_replies++;
+            continue;
+        }
+
+        auto response_length = state.m_output.size();
+        num_commands++;
+        if (do_operation(command, state.m_output))
+        {
+            state.m_is_error = true;
+            if (response_length == state.m_output.size())
+                state.set_default_special_error();
+        }
+
+        // The responses are incomplete, nothing sensible can follow
+        if (state.m_output.has_failed())
+        {
+            LOG_ERROR(fd << ": Out of memory for output");
+            state.set_default_special_error();
+        }
+    }
+
+    state.m_input.consume(parser.get_consumed_length());
+    state.m_is_asking = t_is_asking;
+
+    // One wait for all the writes of the batch, before any of them is
+    // acknowledged. If they cannot be synced, none of the replies of
+    // the batch goes out, every command gets an error instead.
+    if (t_log_ticket)
+    {
+        if (!m_append_log->wait_for_sync(t_log_ticket))
+        {
+            LOG_ERROR(fd << ": Append log failed, " << num_commands << " replies replaced with errors");
+            state.m_output.truncate(batch_start);
+            for (size_t i = 0; i < num_commands; i++)
+                state.m_output.append(REPLY_MISCONF);
+        }
+        t_log_ticket = 0;
+    }
+
+    return state.m_is_error || !state.m_output.empty();
+}
+
+/**
+ * @brief send the responses collected in the state back to
+ * the client
+ * 
+ * The responses and a trailing unrecoverable error, if any, are
+ * gathered with writev. Whatever the socket does not accept is
+ * kept in the state's m_output.
+ * 
+ * @param state the state associated with the socket
+ * @return write_result_t whether everything was written, the rest
+ * must wait for the socket to become writable, or the socket must
+ * be closed
+ */
+write_result_t Orchestrator::write_to_socket(State& state)
+{
+    // A response that is resumed is timed from its first write
+    if (STATE_WAITING_FOR_WRITABLE == state.m_state)
+        state.m_state = STATE_IN_WRITE_LOOP;
+    else
+        state.set_state(STATE_IN_WRITE_LOOP);
+    auto fd = state.m_socket;
+
+    if (state.m_output.empty() && !state.m_special_error)
+        state.m_output.append(REPLY_ERROR);
+
+    // An unrecoverable error goes out after all the responses that
+    // were produced before it
+    while (!state.m_output.empty() || state.m_special_error)
+    {
+        size_t error_length = state.m_special_error ? strlen(state.m_special_error) : 0;
+
+        struct iovec iov[2];
+        int n_iov = 0;
+        if (!state.m_output.empty())
+        {
+            iov[n_iov].iov_base = const_cast<char*>(state.m_output.data());
+            iov[n_iov].iov_len = state.m_output.size();
+            n_iov++;
+        }
+        if (error_length)
+        {
+            iov[n_iov].iov_base = const_cast<char*>(state.m_special_error);
+            iov[n_iov].iov_len = error_length;
+            n_iov++;
+        }
+
+        ssize_t bytes_written = writev(fd, iov, n_iov);
+        if (bytes_written < 0)
+        {
+            if (EINTR == errno)
+                continue;
+            if (EAGAIN == errno || EWOULDBLOCK == errno)
+                return WRITE_RESULT_PENDING;
+
+            perror("writev");
+            LOG_ERROR(fd << ": Write failed with rc = " << bytes_written \
+                << " error = " << errno);
+            return WRITE_RESULT_CLOSED;
+        }
+
+        size_t from_output = std::min((size_t)bytes_written, state.m_output.size());
+        state.m_output.consume(from_output);
+
+        // Skip what was written of the error
+        size_t from_error = bytes_written - from_output;
+        if (from_error)
+            state.m_special_error = from_error < error_length ?
+                state.m_special_error + from_error : nullptr;
+    }
+
+    ServerStats::get()->record_request(state);
+    return WRITE_RESULT_DONE;
+}
 
+/**
+ * @brief Reads from a socket and stores the values the state
+ * 
+ * It runs as a part of the read worker pool. When done,
+ * it then invokes the parser worker pool.
+ * 
+ * @return int on success it returns 0, otherwise a number
+ * to indicate the error
+ */
+int SocketReadJob::run()
+{
+    // Nothing of the job itself is touched after it hands the state
+    // on, the same job may already be queued again by then
+    std::shared_ptr<State> pstate = static_cast<PipelineState*>(m_pstate)->shared_from_this();
+    pstate->set_state(STATE_IN_READ_LOOP);
+    auto fd = pstate->m_socket;
+    LOG_DEBUG(fd << ": Picked up for reading");
+
+    auto result = m_porchestrator->read_from_socket(*pstate);
+    if (READ_RESULT_CLOSED == result)
+    {
+        close_and_cleanup(fd, pstate, m_porchestrator);
         return -1;
     }
 
-    m_pstate->m_object = parsed_obj;
+    // Spurious wakeup, nothing new to parse
+    if (READ_RESULT_NO_DATA == result)
+    {
+        m_porchestrator->return_to_epoll(pstate);
+        return 0;
+    }
 
-    auto [is_fatal, response] = m_porchestrator->do_operation(
-                                    m_pstate->m_object);
-    m_pstate->m_response = response;
+    pstate->set_state(STATE_WAITING_FOR_PARSING);
+    if (false == m_porchestrator->add_to_parse_and_run_queue(pstate))
+    {
+        LOG_ERROR(fd << ": Adding to parse queue failed");
+        close_and_cleanup(fd, pstate, m_porchestrator);
+        return -1;
+    }
+
+    LOG_DEBUG(fd << ": Added to parse queue");
+
+    return 0;
+}
 
-    if (is_fatal)
+/**
+ * @brief The job in the work-queue which parses the input
+ * that is received from the user, and then performs the
+ * appropriate action
+ * 
+ * @return int 0 on success
+ */
+int ParseAndRunJob::run()
+{
+    // Nothing of the job itself is touched after it hands the state
+    // on, the same job may already be queued again by then
+    std::shared_ptr<State> pstate = static_cast<PipelineState*>(m_pstate)->shared_from_this();
+    auto fd = pstate->m_socket;
+    LOG_DEBUG(fd << ": Picked up for parsing");
+
+    // Only part of a command has been received so far
+    if (!m_porchestrator->parse_and_run(*pstate))
     {
-        m_pstate->m_is_error = true;
-        if (!response)
-            m_pstate->set_default_special_error();
+        m_porchestrator->return_to_epoll(pstate);
+        return 0;
     }
 
-    if (false == m_porchestrator->add_to_write_queue(m_pstate))
+    pstate->set_state(STATE_WAITING_FOR_WRITE);
+    if (false == m_porchestrator->add_to_write_queue(pstate))
     {
-        std::cerr << fd << ": Add to write queue failed" << std::endl;
-        close_and_cleanup(fd, m_pstate, m_porchestrator);
+        LOG_ERROR(fd << ": Add to write queue failed");
+        close_and_cleanup(fd, pstate, m_porchestrator);
         return -1;    
     }
 
-    std::cerr << fd << ": Added to write queue" << std::endl;
+    LOG_DEBUG(fd << ": Added to write queue");
 
 
     return 0;
@@ -997,48 +2394,54 @@ int ParseAndRunJob::run()
  */
 int SocketWriteJob::run()
 {
-    m_pstate->m_state = STATE_PARSING;
-    auto fd = m_pstate->m_socket;
+    // Nothing of the job itself is touched after it hands the state
+    // on, the same job may already be queued again by then
+    std::shared_ptr<State> pstate = static_cast<PipelineState*>(m_pstate)->shared_from_this();
 
-    std::cerr << fd << ": Picked up write job";
+    LOG_DEBUG(pstate->m_socket << ": Picked up write job");
 
-    char default_buffer[] = "-ERROR\r\n";
-    char* buffer;
-    std::string response_string;
+    return m_porchestrator->send_responses(pstate);
+}
 
-    if (m_pstate->m_special_error[0])
-        buffer = m_pstate->m_special_error;
-    else if (m_pstate->m_response)
-    {
-        response_string = m_pstate->m_response->serialize();
-        buffer = const_cast<char*>(response_string.c_str());
-    }
-    else
+/**
+ * @brief send the responses of a socket, and hand it on
+ * 
+ * @param pstate is the state associated with the file descriptor
+ * @return int 0 on success, -1 if the socket was closed
+ */
+int Orchestrator::send_responses(std::shared_ptr<State> pstate)
+{
+    auto fd = pstate->m_socket;
+    auto result = write_to_socket(*pstate);
+    if (WRITE_RESULT_CLOSED == result)
     {
-        buffer = default_buffer;
+        close_and_cleanup(fd, pstate, this);
+        return -1;
     }
 
-    int buflen = strlen(buffer);
-
-    auto bytes_written = write(fd, buffer, buflen);
+    // The rest is written once the socket drains
+    if (WRITE_RESULT_PENDING == result)
+        return wait_for_writable(pstate) ? 0 : -1;
 
-    if (bytes_written < 0)
+    if (pstate->m_is_error)
     {
-        perror("write");
-        std::cout << fd << ": Write failed with rc = " << bytes_written \
-            << " error = " << errno << std::endl;
-        close_and_cleanup(fd, m_pstate, m_porchestrator);
-        return -1;
+        close_and_cleanup(fd, pstate, this);
+        return 0;
     }
 
-    if (m_pstate->m_is_error)
-        close_and_cleanup(fd, m_pstate, m_porchestrator);
-    else
+    // The commands held back by the output limit are already read
+    if (pstate->m_is_output_limited)
     {
-        std::cerr << fd << ": Adding back to epoll queue" << std::endl;
-        m_pstate->reset();
-        m_porchestrator->add_to_epoll_queue(fd);
+        pstate->clear();
+        pstate->set_state(STATE_WAITING_FOR_PARSING);
+        if (!add_to_parse_and_run_queue(pstate))
+        {
+            LOG_ERROR(fd << ": Adding to parse queue failed");
+            close_and_cleanup(fd, pstate, this);
+            return -1;
+        }
+        return 0;
     }
 
-    return 0;
+    return return_to_epoll(pstate) ? 0 : -1;
 }
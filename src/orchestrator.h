@@ -5,7 +5,22 @@
 #include "thread_pool.h"
 #include "resp_parser.h"
 #include "data_store.h"
+#include "read_optimized_store.h"
 #include "state.h"
+#include "connection_table.h"
+#include "server_config.h"
+#include "event_loop.h"
+#include "io_uring_loop.h"
+#include "replies.h"
+#include "command_table.h"
+#include "pool_controller.h"
+#include "logger.h"
+#include "server_stats.h"
+#include "expiry_reclaimer.h"
+#include "snapshot.h"
+#include "append_log.h"
+#include "replication.h"
+#include "cluster.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -13,47 +28,192 @@
 #include <stdlib.h>
 #include <netinet/in.h>
 #include <string.h>
-#include <signal.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <signal.h>
+
 
-#define NUM_DATASTORES 10
-#define PORTNUM 6379
-#define MAX_EPOLL_EVENTS 10
+/**
+ * @brief events every client socket is registered for
+ * 
+ */
+#define EPOLL_SOCKET_EVENTS (EPOLLIN | EPOLLRDHUP | EPOLLONESHOT | EPOLLET)
+
+/**
+ * @brief events a client socket is re-armed for while a response
+ * is only partially written
+ * 
+ */
+#define EPOLL_SOCKET_WRITE_EVENTS (EPOLLOUT | EPOLLRDHUP | EPOLLONESHOT | EPOLLET)
+
+/**
+ * @brief how often the deferred sockets are polled, while the pools
+ * are overloaded, in milliseconds
+ * 
+ */
+#define EPOLL_OVERLOAD_RETRY_MS 1
 
 class Orchestrator;
 class SocketReadJob;
 class ParseAndRunJob;
 
 /**
- * @brief enum defines the different types of commands
+ * @brief a KeyBatch whose vectors grew beyond this many keys gives
+ * their memory back once the command is done
+ * 
+ */
+#define KEY_BATCH_KEPT_CAPACITY 4096
+
+/**
+ * @brief The keys of a multi-key command, grouped by the partition
+ * they belong to
  * 
- * Commands can be get, set or del
+ * Every data store is then visited once per command, taking its lock
+ * once for all of its keys. Within a partition, the keys keep the
+ * order of the command, so that the last value of a key given twice
+ * to MSET wins.
+ * 
+ */
+struct KeyBatch
+{
+    /**
+     * @brief the keys, in the order of the command
+     * 
+     */
+    std::vector<HashedKey>                      m_keys;
+
+    /**
+     * @brief the values, for MSET
+     * 
+     */
+    std::vector<std::string_view>               m_values;
+
+    /**
+     * @brief the partition of every key
+     * 
+     */
+    std::vector<std::uint32_t>                  m_partitions;
+
+    /**
+     * @brief indexes in m_keys, sorted by partition
+     * 
+     */
+    std::vector<std::uint32_t>                  m_indexes;
+
+    /**
+     * @brief the indexes in m_keys of the pairs MSET has set, or of
+     * the keys DEL has deleted, within the partition being written
+     * 
+     */
+    std::vector<std::uint32_t>                  m_set_indexes;
+
+    /**
+     * @brief the values found by MGET, one after the other
+     * 
+     */
+    std::string                                 m_found_values;
+
+    /**
+     * @brief offset and size in m_found_values of the value of every
+     * key, the offset is SIZE_MAX if the key was not found
+     * 
+     */
+    std::vector<std::pair<size_t, size_t>>      m_found;
+
+    /**
+     * @brief forget the keys of the last command
+     * 
+     */
+    void clear()
+    {
+        if (m_keys.capacity() > KEY_BATCH_KEPT_CAPACITY)
+        {
+            *this = KeyBatch();
+            return;
+        }
+
+        m_keys.clear();
+        m_values.clear();
+        m_partitions.clear();
+        m_indexes.clear();
+        m_set_indexes.clear();
+        m_found_values.clear();
+        m_found.clear();
+    }
+
+    /**
+     * @brief call a function once for every partition of the batch
+     * 
+     * @param fn called with the partition, and the indexes of its keys
+     * as a pointer and a count
+     */
+    template <typename Fn>
+    void for_each_partition(Fn fn) const
+    {
+        size_t begin = 0;
+        while (begin < m_indexes.size())
+        {
+            std::uint32_t partition = m_partitions[m_indexes[begin]];
+            size_t end = begin + 1;
+            while (end < m_indexes.size() && \
+                    m_partitions[m_indexes[end]] == partition)
+                end++;
+
+            fn(partition, &m_indexes[begin], end - begin);
+            begin = end;
+        }
+    }
+};
+
+/**
+ * @brief outcome of reading everything available on a socket
  * 
  */
 typedef enum
 {
     /**
-     * @brief invalid command
+     * @brief new data was appended to the state
+     * 
+     */
+    READ_RESULT_DATA,
+    /**
+     * @brief the socket had nothing to read
+     * 
+     */
+    READ_RESULT_NO_DATA,
+    /**
+     * @brief the peer closed the connection or the read failed,
+     * and the socket must be closed
      * 
      */
-    COMMAND_INVALID,
+    READ_RESULT_CLOSED
+} read_result_t;
+
+/**
+ * @brief outcome of writing the pending responses to a socket
+ * 
+ */
+typedef enum
+{
     /**
-     * @brief get command
+     * @brief all the responses were written
      * 
      */
-    COMMAND_GET,
+    WRITE_RESULT_DONE,
     /**
-     * @brief del command
+     * @brief the socket buffer is full, the rest must be written
+     * once the socket becomes writable
      * 
      */
-    COMMAND_DEL,
+    WRITE_RESULT_PENDING,
     /**
-     * @brief set command
+     * @brief the write failed, and the socket must be closed
      * 
      */
-    COMMAND_SET
-} command_type_t;
+    WRITE_RESULT_CLOSED
+} write_result_t;
 
 /**
  * @brief Job to read from a socket
@@ -68,10 +228,11 @@ class SocketReadJob: public JobInterface
 {
 public:
     /**
-     * @brief the state associated with the socket
+     * @brief the state associated with the socket, kept alive by
+     * the pointer through which the job was queued
      * 
      */
-    std::shared_ptr<State>      m_pstate;
+    State*                      m_pstate;
 
     /**
      * @brief the orchestrator object
@@ -81,7 +242,7 @@ public:
 
     SocketReadJob(
         Orchestrator*           porch,
-        std::shared_ptr<State>  pstate)
+        State*                  pstate)
     {
         m_porchestrator = porch;
         m_pstate = pstate;
@@ -110,10 +271,11 @@ class ParseAndRunJob: public JobInterface
 {
 public:
     /**
-     * @brief The state associated with the socket
+     * @brief The state associated with the socket, kept alive by
+     * the pointer through which the job was queued
      * 
      */
-    std::shared_ptr<State>      m_pstate;
+    State*                      m_pstate;
 
     /**
      * @brief Pointer to the orchestrator object
@@ -123,7 +285,7 @@ public:
 
     ParseAndRunJob(
         Orchestrator*           porch,
-        std::shared_ptr<State>  pstate)
+        State*                  pstate)
     {
         m_porchestrator = porch;
         m_pstate = pstate;
@@ -147,10 +309,11 @@ class SocketWriteJob: public JobInterface
 {
 public:
     /**
-     * @brief state associated with the socket
+     * @brief state associated with the socket, kept alive by
+     * the pointer through which the job was queued
      * 
      */
-    std::shared_ptr<State>      m_pstate;
+    State*                      m_pstate;
 
     /**
      * @brief pointer to the orchestrator object
@@ -160,7 +323,7 @@ public:
 
     SocketWriteJob(
         Orchestrator*           porch,
-        std::shared_ptr<State>  pstate)
+        State*                  pstate)
     {
         m_porchestrator = porch;
         m_pstate = pstate;
@@ -175,6 +338,67 @@ public:
     int run();
 };
 
+/**
+ * @brief The state of a connection served by the pipeline, together
+ * with the jobs that move it through the thread pools
+ * 
+ * The jobs carry no per-request data, so every connection reuses its
+ * own three jobs for all of its requests instead of allocating new
+ * ones. A job is queued through a shared_ptr that shares ownership of
+ * the connection, so a queued job keeps its connection alive.
+ * 
+ */
+struct PipelineState: public State, public std::enable_shared_from_this<PipelineState>
+{
+    SocketReadJob               m_read_job;
+    ParseAndRunJob              m_parse_and_run_job;
+    SocketWriteJob              m_write_job;
+
+    PipelineState(int fd, Orchestrator* porch):
+        State(fd),
+        m_read_job(porch, this),
+        m_parse_and_run_job(porch, this),
+        m_write_job(porch, this)
+    {
+    }
+
+    /**
+     * @brief Create a state object, with its control block in the
+     * same allocation
+     * 
+     * @param fd the file descriptor for which to create a state
+     * @param porch the orchestrator that runs the jobs
+     * @return std::shared_ptr<State> the state, or nullptr if out of
+     * memory
+     */
+    static std::shared_ptr<State>
+    create_state(int fd, Orchestrator* porch)
+    {
+        try
+        {
+            return std::make_shared<PipelineState>(fd, porch);
+        }
+        catch (...)
+        {
+            return std::shared_ptr<State>(nullptr);
+        }
+    }
+
+    /**
+     * @brief get one of the connection's jobs, to be queued
+     * 
+     * @param pstate the shared pointer owning the connection
+     * @param job the job, a member of the connection
+     * @return std::shared_ptr<JobInterface> the job, sharing ownership
+     * of the connection
+     */
+    static std::shared_ptr<JobInterface>
+    get_job(const std::shared_ptr<State>& pstate, JobInterface& job)
+    {
+        return std::shared_ptr<JobInterface>(pstate, &job);
+    }
+};
+
 /**
  * @brief This class orchestrates the entire server
  * 
@@ -202,11 +426,8 @@ public:
  * Mostly locks should not be held simultaneously.
  * But in case they need to, this should be the order
  * 
- * 1. m_all_sockets_mtx
+ * 1. the lock of m_all_sockets
  * 2. State.m_mutex
- * 3. m_epoll_sockets_mtx
- * 4. m_write_sockets_mtx
- * 5. m_write_sockets_mtx
  */
 class Orchestrator
 {
@@ -217,11 +438,8 @@ class Orchestrator
      * Mostly locks should not be held simultaneously.
      * But in case they need to, this should be the order
      * 
-     * 1. m_all_sockets_mtx
+     * 1. the lock of m_all_sockets
      * 2. State.m_mutex
-     * 3. m_epoll_sockets_mtx
-     * 4. m_write_sockets_mtx
-     * 5. m_write_sockets_mtx
      */
 
     
@@ -234,96 +452,112 @@ public:
     int                                             m_server_socket;
 
     /**
-     * @brief A map of all valid sockets, to its associated state
+     * @brief A table of all valid sockets, to its associated state
      * This state gets passed to all worker threads, but
      * this is the master table in case we need it.
      * 
      */
-    std::unordered_map<int, std::shared_ptr<State>> m_all_sockets;
+    ConnectionTable                                 m_all_sockets;
 
     /**
-     * @brief shared mutex to synchronize m_all_sockets
+     * @brief Thread pool to schedule jobs to parse the data
+     * already read from the socket and then take the appropriate action
      * 
      */
-    std::shared_mutex                               m_all_sockets_mtx;
-
+    ThreadPool*                                     m_processing_threadpool;
+ 
     /**
-     * @brief Thread pool to schedule jobs to read from the socket
+     * @brief The thread pool to parse and run all jobs
      * 
      */
-    ThreadPool*                                     m_read_threadpool;
+    ThreadPool*                                     m_parse_and_run_threadpool;
 
     /**
-     * @brief Sockets which are currently not ready and are being
-     * monitored if they become ready at any point of time
+     * @brief Thread pool to send teh response back to the client
      * 
      */
-    std::unordered_set<int>                         m_epoll_sockets;
+    ThreadPool*                                     m_write_threadpool;
 
     /**
-     * @brief lock to synchronize m_epoll_sockets
+     * @brief grows and shrinks the thread pools with their load
      * 
      */
-    std::shared_mutex                               m_epoll_sockets_mtx;
+    PoolSizeController*                             m_pool_controller;
 
     /**
-     * @brief Thread pool to schedule jobs to parse the data
-     * already read from the socket and then take the appropriate action
+     * @brief deletes the keys that expired, in the background
      * 
      */
-    ThreadPool*                                     m_processing_threadpool;
- 
+    ExpiryReclaimer*                                m_expiry_reclaimer;
+
     /**
-     * @brief Not really used
+     * @brief writes snapshots in the background, nullptr if there is
+     * no snapshot file
      * 
      */
-    std::unordered_set<int>                         m_processing_sockets;
- 
+    SnapshotWriter*                                 m_snapshot_writer;
+
     /**
-     * @brief Not really used
+     * @brief orders the writes, and hands them to the append log file
+     * and to the replicas, nullptr if there is neither
      * 
      */
-    std::shared_mutex                               m_processing_sockets_mtx;
+    AppendLog*                                      m_append_log;
 
     /**
-     * @brief The thread pool to parse and run all jobs
+     * @brief the writes kept for the replicas, and the server they
+     * connect to, nullptr if there are no replicas
      * 
      */
-    ThreadPool*                                     m_parse_and_run_threadpool;
+    ReplicationBacklog*                             m_repl_backlog;
+    ReplicationPrimary*                             m_repl_primary;
 
     /**
-     * @brief Thread pool to send teh response back to the client
+     * @brief follows the primary, nullptr if this server is not a
+     * replica
      * 
      */
-    ThreadPool*                                     m_write_threadpool;
+    ReplicationReplica*                             m_repl_replica;
 
     /**
-     * @brief Not really used
+     * @brief the slots of the cluster, nullptr if this server is not
+     * in a cluster
      * 
      */
-    std::unordered_set<int>                         m_write_sockets;
+    Cluster*                                        m_cluster;
 
     /**
-     * @brief Not really used
+     * @brief Datastores are the hash tables, keys are partitioned
+     * across them by their hash for greater parallelism
      * 
      */
-    std::shared_mutex                               m_write_sockets_mtx;
+    DataStoreInterface**                            m_datastore;
 
     /**
-     * @brief Datastores are the hash tables, we use 10 hash-tables
-     * partitioned by the first character for greater parallelism
+     * @brief number of entries in m_datastore, a power of two
      * 
      */
-    DataStore                                       m_datastore[NUM_DATASTORES];
+    size_t                                          m_num_datastores;
 
     /**
      * @brief In case the server is asked to shut down, all threads
      * should look at this.
      * 
-     * Currently unimplemented.
+     */
+    std::atomic<bool>                               m_is_destroying;
+
+    /**
+     * @brief the configuration the server was started with
      * 
      */
-    bool                                            m_is_destroying;
+    ServerConfig                                    m_config;
+
+    /**
+     * @brief where the threads run, and the shards take their memory
+     * from, worked out from m_config
+     * 
+     */
+    CpuPlacement                                    m_placement;
 
     /**
      * @brief The thread id that listens for new connections and accepts
@@ -345,36 +579,312 @@ public:
      */
     int                                             m_epoll_fd;
 
-    Orchestrator():
+    /**
+     * @brief eventfd registered in m_epoll_fd, used to wake up the
+     * epoll thread
+     * 
+     */
+    int                                             m_wakeup_fd;
+
+    /**
+     * @brief set while a wakeup is pending on m_wakeup_fd, so that
+     * concurrent wakeups are coalesced into a single write
+     * 
+     */
+    std::atomic<bool>                               m_wakeup_pending;
+
+    /**
+     * @brief set once the accepting and epoll threads are running
+     * 
+     */
+    bool                                            m_is_running;
+
+    /**
+     * @brief the event loops, only used in SERVER_MODE_EVENT_LOOP
+     * 
+     */
+    std::vector<EventLoop*>                         m_event_loops;
+
+    /**
+     * @brief the io_uring loops, only used in SERVER_MODE_IO_URING,
+     * they accept their own connections
+     * 
+     */
+    std::vector<IoUringLoop*>                       m_io_uring_loops;
+
+    /**
+     * @brief the event loop that gets the next accepted connection,
+     * only accessed from the accepting thread
+     * 
+     */
+    size_t                                          m_next_event_loop;
+
+    /**
+     * @brief connections handed to the loop of the CPU their packets
+     * are received on, rather than round-robin
+     * 
+     */
+    std::atomic<std::uint64_t>                      m_num_steered_connections;
+
+    /**
+     * @brief the sockets that became readable while a pool was full,
+     * left disabled in epoll until the pools catch up, only accessed
+     * from the epoll thread
+     * 
+     */
+    std::vector<int>                                m_deferred_sockets;
+
+    /**
+     * @brief how often the load was shed: sockets whose reading was
+     * deferred, commands answered with -BUSY, and batches of commands
+     * cut short by the output limit of their client
+     * 
+     */
+    std::atomic<std::uint64_t>                      m_num_deferred_reads;
+    std::atomic<std::uint64_t>                      m_num_busy_replies;
+    std::atomic<std::uint64_t>                      m_num_output_limited;
+
+    /**
+     * @brief when the server was created, for the uptime in INFO
+     * 
+     */
+    std::int64_t                                    m_start_time;
+
+    Orchestrator(const ServerConfig& config = ServerConfig()):
         m_server_socket(-1),
-        m_epoll_fd(-1)
+        m_processing_threadpool(nullptr),
+        m_parse_and_run_threadpool(nullptr),
+        m_write_threadpool(nullptr),
+        m_pool_controller(nullptr),
+        m_expiry_reclaimer(nullptr),
+        m_snapshot_writer(nullptr),
+        m_append_log(nullptr),
+        m_repl_backlog(nullptr),
+        m_repl_primary(nullptr),
+        m_repl_replica(nullptr),
+        m_cluster(nullptr),
+        m_datastore(nullptr),
+        m_num_datastores(config.get_num_datastores()),
+        m_config(config),
+        m_epoll_fd(-1),
+        m_wakeup_fd(-1),
+        m_wakeup_pending(false),
+        m_is_running(false),
+        m_next_event_loop(0),
+        m_num_steered_connections(0),
+        m_num_deferred_reads(0),
+        m_num_busy_replies(0),
+        m_num_output_limited(0),
+        m_start_time(now_ns())
     {
-        ThreadPoolFactory tfp;
-        m_read_threadpool = tfp.create_thread_pool(8, false);
-        m_processing_threadpool = tfp.create_thread_pool(8, false);
-        m_write_threadpool = tfp.create_thread_pool(8, false);
-        m_parse_and_run_threadpool = tfp.create_thread_pool(8, false);
         m_is_destroying = false;
+        ServerStats::get()->set_num_shards(m_num_datastores);
+        m_config.get_cpu_placement(m_placement);
+
+        m_datastore = new (std::nothrow) DataStoreInterface*[m_num_datastores]();
+        if (!m_datastore)
+        {
+            LOG_ERROR("Out of memory");
+            exit(1);
+        }
+
+        for (size_t i = 0; i < m_num_datastores; i++)
+        {
+            if (DATASTORE_READ_OPTIMIZED == m_config.m_datastore_type)
+                m_datastore[i] = new (std::nothrow) ReadOptimizedDataStore;
+            else
+                m_datastore[i] = new (std::nothrow) DataStore;
+
+            if (!m_datastore[i])
+            {
+                LOG_ERROR("Out of memory");
+                exit(1);
+            }
+            m_datastore[i]->set_memory_limit(
+                m_config.get_datastore_max_memory(), m_config.m_maxmemory_policy);
+            m_datastore[i]->set_numa_node(m_placement.m_shard_nodes[i]);
+        }
+
+        size_t num_loaded;
+        if (!m_config.m_snapshot_file.empty() && \
+            !load_snapshot(m_config.m_snapshot_file, m_datastore, m_num_datastores, num_loaded))
+        {
+            LOG_ERROR("Failed to load the snapshot");
+            exit(1);
+        }
+
+        // The log has the writes done since the snapshot was started,
+        // it goes on top of it
+        if (!m_config.m_aof_file.empty() && \
+            !replay_append_log(m_config.m_aof_file, m_datastore, m_num_datastores, num_loaded))
+        {
+            LOG_ERROR("Failed to replay the append log");
+            exit(1);
+        }
+
+        if (m_config.m_replication_port)
+        {
+            m_repl_backlog = new (std::nothrow) ReplicationBacklog(m_config.m_repl_backlog_size);
+            if (!m_repl_backlog || !m_repl_backlog->init())
+            {
+                LOG_ERROR("Failed to create the replication backlog");
+                exit(1);
+            }
+        }
+
+        // The replicas get their writes from the log, with or without
+        // a file
+        if (!m_config.m_aof_file.empty() || m_repl_backlog)
+        {
+            m_append_log = new (std::nothrow) AppendLog(
+                                m_config.m_aof_file, m_num_datastores,
+                                m_config.m_appendfsync, m_repl_backlog);
+            if (!m_append_log || !m_append_log->start())
+            {
+                LOG_ERROR("Failed to start the append log");
+                exit(1);
+            }
+        }
+
+        if (m_repl_backlog)
+        {
+            m_repl_primary = new (std::nothrow) ReplicationPrimary(
+                                m_config.m_replication_port,
+                                m_datastore, m_num_datastores,
+                                m_repl_backlog);
+            if (!m_repl_primary || !m_repl_primary->start())
+            {
+                LOG_ERROR("Failed to start the replication port");
+                exit(1);
+            }
+        }
+
+        if (!m_config.m_replicaof_host.empty())
+        {
+            m_repl_replica = new (std::nothrow) ReplicationReplica(
+                                m_config.m_replicaof_host,
+                                m_config.m_replicaof_port,
+                                m_datastore, m_num_datastores,
+                                m_config.m_snapshot_file.empty() ? "" : m_config.m_snapshot_file + ".sync");
+            if (!m_repl_replica || !m_repl_replica->start())
+            {
+                LOG_ERROR("Failed to start the replication");
+                exit(1);
+            }
+        }
+
+        if (!m_config.m_cluster_slots.empty())
+        {
+            m_cluster = new (std::nothrow) Cluster(m_datastore, m_num_datastores, m_append_log);
+            std::string host = m_config.m_cluster_announce_host;
+            int port = m_config.m_cluster_announce_port;
+            if (host.empty())
+            {
+                host = "127.0.0.1";
+                port = m_config.m_port;
+            }
+
+            if (!m_cluster || !m_cluster->init(m_config.m_cluster_slots, host, port) || \
+                !m_cluster->start())
+            {
+                LOG_ERROR("Failed to set up the cluster");
+                exit(1);
+            }
+        }
+
+        if (!m_config.m_snapshot_file.empty())
+        {
+            m_snapshot_writer = new (std::nothrow) SnapshotWriter(
+                                    m_datastore, m_num_datastores,
+                                    m_config.m_snapshot_file,
+                                    m_config.m_snapshot_interval_s,
+                                    m_append_log);
+            if (!m_snapshot_writer || !m_snapshot_writer->start())
+            {
+                LOG_ERROR("Failed to start the snapshot writer");
+                exit(1);
+            }
+        }
+
+        m_expiry_reclaimer = new (std::nothrow) ExpiryReclaimer(m_datastore, m_num_datastores);
+        if (!m_expiry_reclaimer || !m_expiry_reclaimer->start())
+        {
+            LOG_ERROR("Failed to start the expiry reclaimer");
+            exit(1);
+        }
+
+        // The event loops do all the work themselves
+        if (SERVER_MODE_PIPELINE != m_config.m_mode)
+            return;
+
+        ThreadPoolFactory tfp;
+        auto scheduler = m_config.m_scheduler;
+        auto sizing = m_config.get_pool_sizing();
+        int num_threads = std::clamp(DEFAULT_POOL_THREADS,
+            sizing.m_min_threads, sizing.m_max_threads);
+        m_processing_threadpool = tfp.create_thread_pool(num_threads, false, scheduler);
+        m_write_threadpool = tfp.create_thread_pool(num_threads, false, scheduler);
+        m_parse_and_run_threadpool = tfp.create_thread_pool(num_threads, false, scheduler);
+        if (!m_processing_threadpool || !m_write_threadpool || !m_parse_and_run_threadpool)
+        {
+            LOG_ERROR("Failed to create the thread pools");
+            exit(1);
+        }
+        m_processing_threadpool->m_queue_limit = m_config.m_pool_queue_limit;
+        m_write_threadpool->m_queue_limit = m_config.m_pool_queue_limit;
+        m_parse_and_run_threadpool->m_queue_limit = m_config.m_pool_queue_limit;
+        if (0 != m_processing_threadpool->set_cpus(m_placement.m_read_cpus) || \
+            0 != m_parse_and_run_threadpool->set_cpus(m_placement.m_parse_cpus) || \
+            0 != m_write_threadpool->set_cpus(m_placement.m_write_cpus))
+        {
+            LOG_ERROR("Failed to place the thread pools");
+            exit(1);
+        }
+
+        m_pool_controller = new (std::nothrow) PoolSizeController(sizing);
+        if (!m_pool_controller || \
+            !m_pool_controller->add_pool("read", m_processing_threadpool) || \
+            !m_pool_controller->add_pool("parse", m_parse_and_run_threadpool) || \
+            !m_pool_controller->add_pool("write", m_write_threadpool) || \
+            !m_pool_controller->start())
+        {
+            LOG_ERROR("Failed to start the pool size controller");
+            exit(1);
+        }
     }
 
     ~Orchestrator()
     {
+        stop_server();
+
         /*
          * It is important to first call destroy before deleting it
          * Otherwise, it might lead to threads working on deleted objects
          */
-        if (m_read_threadpool)
-            m_read_threadpool->destroy();
+        // Stopped first, it resizes the pools
+        delete m_pool_controller;
+
         if (m_processing_threadpool)
             m_processing_threadpool->destroy();
         if (m_write_threadpool)
             m_write_threadpool->destroy();
         if (m_parse_and_run_threadpool)
             m_parse_and_run_threadpool->destroy();
-        delete m_read_threadpool;
         delete m_processing_threadpool;
         delete m_write_threadpool;
         delete m_parse_and_run_threadpool;
+
+        // Stopped before the data stores they work on go away
+        delete m_repl_replica;
+        delete m_repl_primary;
+        delete m_cluster;
+        delete m_snapshot_writer;
+        delete m_append_log;
+        delete m_repl_backlog;
+        delete m_expiry_reclaimer;
+        for (size_t i = 0; i < m_num_datastores; i++)
+            delete m_datastore[i];
+        delete[] m_datastore;
     }
 
     /**
@@ -393,8 +903,8 @@ public:
 
     /**
      * @brief loop and accept connections on the listening socket
-     * Once a connection is received, it then adds it to the queue
-     * which the epoll thread uses, and wakes up the epoll thread.
+     * Once a connection is received, it is registered with epoll
+     * so that the epoll thread picks it up when it becomes readable.
      * 
      */
     void accepting_thread_loop();
@@ -410,20 +920,24 @@ public:
     /**
      * @brief Loop and call epoll, and send ready sockets to workers
      * 
-     * Loops and calls epoll. When a ready socket is found, it is
-     * posted to the thread pool which processes it.
+     * Loops and calls epoll. All the sockets found ready by one
+     * epoll_wait are posted to the thread pool as a single batch.
      * 
      */
     void epoll_thread_loop();
 
     /**
-     * @brief Wake up the epoll thread by sending it a signal
+     * @brief Wake up the epoll thread through the eventfd
+     * 
+     * Wakeups that arrive while one is already pending are coalesced,
+     * so at most one write to the eventfd is outstanding at any time.
      * 
      */  
     void wakeup_epoll_thread();
 
     /**
-     * @brief creates the file descriptor on which epoll is run
+     * @brief creates the file descriptor on which epoll is run,
+     * along with the eventfd used to wake up the epoll thread
      * 
      * @return true on success
      * @return false on failure
@@ -439,44 +953,177 @@ public:
     void remove_socket(int fd);
 
     /**
-     * @brief rebuild the epoll monitor from the set of fd's
+     * @brief register a newly accepted socket with epoll
      * 
+     * Every socket is registered exactly once, edge triggered and
+     * one-shot. Once it reports readiness it stays disabled in the
+     * kernel until it is re-armed with epoll_rearm(), so the epoll
+     * thread never has to rebuild its interest list.
+     * 
+     * @param fd the file descriptor to register
+     * @return true on success
+     * @return false on failure
      */
-    void epoll_rearm();
+    bool epoll_register(int fd);
 
     /**
-     * @brief rebuild the epoll monitor from the set of fd's
+     * @brief re-enable a socket that has already been registered
      * 
-     * This is the unsafe version of the function. the caller
-     * must hold the mutex before calling it.
+     * This is a single EPOLL_CTL_MOD, and is called once the response
+     * has been written and the socket is ready for the next command,
+     * or with EPOLL_SOCKET_WRITE_EVENTS when a response could only be
+     * partially written.
      * 
+     * @param fd the file descriptor to re-arm
+     * @param events the events to wait for
+     * @return true on success
+     * @return false on failure
      */
-    void epoll_rearm_unsafe();
+    bool epoll_rearm(int fd, uint32_t events = EPOLL_SOCKET_EVENTS);
 
     /**
-     * @brief remove all monitoring file descriptors from epoll
+     * @brief reset the state of a socket that has nothing more to
+     * write, and hand it back to epoll to wait for the next command
      * 
+     * The caller must hold the state's mutex. It is released here,
+     * and the socket is closed if it cannot be re-armed.
+     * 
+     * @param pstate is the state associated with the file descriptor
+     * @return true on success
+     * @return false if the socket had to be closed
      */
-    void epoll_empty();
+    bool return_to_epoll(std::shared_ptr<State> pstate);
 
     /**
-     * @brief remove all monitoring file descriptors from epoll
-     * This is the unsafe version of the function, and the caller
-     * must hold the m_epoll_sockets_mtx lock before calling it
+     * @brief hand a socket whose response was only partially written
+     * back to epoll, to wait until it is writable
+     * 
+     * The caller must hold the state's mutex. It is released here,
+     * and the socket is closed if it cannot be re-armed. The rest of
+     * the response stays in the state's m_output.
+     * 
+     * @param pstate is the state associated with the file descriptor
+     * @return true on success
+     * @return false if the socket had to be closed
      */
-    void epoll_empty_unsafe();
+    bool wait_for_writable(std::shared_ptr<State> pstate);
 
     /**
-     * @brief creates a processing job for a ready to read fd
+     * @brief creates a processing job for a ready fd
      * 
      * When a file descriptor becomes ready, a job is created
      * to be posted to a thread-pool.
      * The job will then read from the file descriptor and then
-     * process it.
+     * process it, or finish writing a response if the socket was
+     * waiting to become writable.
+     * 
+     * While the pools are overloaded, a socket to read is deferred,
+     * or answered with -BUSY, see overload_policy_t, a socket to
+     * write still gets its job.
      * 
      * @param fd file descriptor to be posted for read
+     * @param is_overloaded whether a pool is full
+     * @return std::shared_ptr<JobInterface> the job, or nullptr if
+     * the socket is no longer valid, deferred or answered
      */
-    void create_processing_job(int fd);
+    std::shared_ptr<JobInterface> create_processing_job(int fd, bool is_overloaded);
+
+    /**
+     * @brief whether one of the pools has reached its queue limit
+     * 
+     */
+    bool is_overloaded() const
+    {
+        return m_processing_threadpool->is_full() || \
+            m_parse_and_run_threadpool->is_full() || \
+            m_write_threadpool->is_full();
+    }
+
+    /**
+     * @brief answer all the commands a socket has sent with -BUSY,
+     * on the epoll thread, without running them
+     * 
+     * The caller must hold the state's mutex, it is released here.
+     * 
+     * @param pstate is the state associated with the file descriptor
+     */
+    void reject_busy(std::shared_ptr<State> pstate);
+
+    /**
+     * @brief send the responses of a socket, and hand it on: back to
+     * epoll, to the parse pool if commands were held back by the
+     * output limit, or closed
+     * 
+     * The caller must hold the state's mutex, it is released here.
+     * 
+     * @param pstate is the state associated with the file descriptor
+     * @return int 0 on success, -1 if the socket was closed
+     */
+    int send_responses(std::shared_ptr<State> pstate);
+
+    /**
+     * @brief read everything that is available on a socket
+     * 
+     * The socket is non-blocking, and is read until it would block.
+     * The data is appended to the state's m_input.
+     * 
+     * @param state the state associated with the socket
+     * @return read_result_t whether new data was read, or the
+     * socket must be closed
+     */
+    read_result_t read_from_socket(State& state);
+
+    /**
+     * @brief parse and run all the complete commands in the state's
+     * m_input
+     * 
+     * All complete commands are run in order, and their responses
+     * are collected in m_output so that they can be sent back in
+     * one write. An incomplete trailing command is left in the input
+     * until the rest of it has been read. Once the responses reach
+     * the output limit of a client, the rest of the commands are left
+     * in the input, and m_is_output_limited is set.
+     * 
+     * @param state the state associated with the socket
+     * @param is_rejecting answer every command with -BUSY instead of
+     * running it
+     * @return true if there is a response to write
+     * @return false if only part of a command has been received
+     */
+    bool parse_and_run(State& state, bool is_rejecting = false);
+
+    /**
+     * @brief send the responses collected in the state back to
+     * the client
+     * 
+     * The responses and a trailing unrecoverable error, if any, are
+     * gathered with writev. Whatever the socket does not accept is
+     * kept in the state's m_output.
+     * 
+     * @param state the state associated with the socket
+     * @return write_result_t whether everything was written, the rest
+     * must wait for the socket to become writable, or the socket must
+     * be closed
+     */
+    write_result_t write_to_socket(State& state);
+
+    /**
+     * @brief create and start the event loops used in
+     * SERVER_MODE_EVENT_LOOP
+     * 
+     * @return true on success
+     * @return false on failure
+     */
+    bool start_event_loops();
+
+    /**
+     * @brief create and start the io_uring loops used in
+     * SERVER_MODE_IO_URING
+     * 
+     * @return true on success
+     * @return false on failure
+     */
+    bool start_io_uring_loops();
 
     /**
      * @brief add the state associated with a file descriptor
@@ -504,67 +1151,253 @@ public:
      * @brief given a parsed command, perform the requested operations
      * 
      * @param command command after parsing, as received from client
-     * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
-     * a tuple containing two items
-     * 1. has there been a fatal error, which mandates the
-     *    client connection must be closed
-     * 2. output of the operation as an object that can be serialized
-     *    and sent to the client as response.
+     * @param response the serialized response to the command is
+     * appended here, ready to be sent to the client
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
      */
-    std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-        do_operation(std::shared_ptr<AbstractRespObject> command);
+    bool do_operation(
+        const CommandView& command,
+        IoBuffer& response);
 
     /**
      * @brief In case of the GET command, perform the action
      * 
-     * @param pobj command after parsing, as received from client
-     * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
-     * a tuple containing two items
-     * 1. has there been a fatal error, which mandates the
-     *    client connection must be closed
-     * 2. output of the operation as an object that can be serialized
-     *    and sent to the client as response.
+     * The stored bytes are already the wire encoding of the value, and
+     * are copied straight into the response.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
      */    
-    std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-        do_get(std::shared_ptr<AbstractRespObject> p);
+    bool do_get(
+        const CommandView& command,
+        IoBuffer& response);
 
     /**
      * @brief in case of a SET command, perform the action
      * 
-     * @param pobj command after parsing, as received from client
-     * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
-     * a tuple containing two items
-     * 1. has there been a fatal error, which mandates the
-     *    client connection must be closed
-     * 2. output of the operation as an object that can be serialized
-     *    and sent to the client as response.
+     * The value is stored in its wire encoding, so that a GET can send
+     * it back as it is. An optional EX seconds or PX milliseconds gives
+     * the key a time to live, EXAT or PXAT an expiry time as a unix
+     * time, otherwise the key does not expire.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
      */
-    std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-        do_set(std::shared_ptr<AbstractRespObject> p);
+    bool do_set(
+        const CommandView& command,
+        IoBuffer& response);
 
     /**
      * @brief perform the DEL command
      * 
-     * @param pobj command after parsing, as received from client
-     * @return std::tuple<bool, std::shared_ptr<AbstractRespObject> > 
-     * a tuple containing two items
-     * 1. has there been a fatal error, which mandates the
-     *    client connection must be closed
-     * 2. output of the operation as an object that can be serialized
-     *    and sent to the client as response.
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_del(
+        const CommandView& command,
+        IoBuffer& response);
+
+    /**
+     * @brief perform the MGET command
+     * 
+     * The reply is an array with the value of every key, or nil for
+     * the keys that are not found, in the order of the command.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_mget(
+        const CommandView& command,
+        IoBuffer& response);
+
+    /**
+     * @brief perform the MSET command
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_mset(
+        const CommandView& command,
+        IoBuffer& response);
+
+    /**
+     * @brief perform the EXPIRE and PEXPIRE commands
+     * 
+     * A time to live that is not positive deletes the key.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @param unit_ms the unit of the time to live, in milliseconds
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_expire(
+        const CommandView& command,
+        IoBuffer& response,
+        std::int64_t unit_ms);
+
+    /**
+     * @brief perform the TTL and PTTL commands
+     * 
+     * The reply is -2 if the key does not exist, and -1 if it does
+     * not expire.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @param unit_ms the unit of the time to live, in milliseconds
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_ttl(
+        const CommandView& command,
+        IoBuffer& response,
+        std::int64_t unit_ms);
+
+    /**
+     * @brief perform the PERSIST command
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_persist(
+        const CommandView& command,
+        IoBuffer& response);
+
+    /**
+     * @brief send a command to the node that serves its keys, in a
+     * cluster
+     * 
+     * The keys of a command must all be in the same slot. A slot of
+     * another node gets -MOVED, unless this node imports it and the
+     * command follows an ASKING. A slot this node moves away gets -ASK
+     * when none of the keys are left here, and -TRYAGAIN when only some
+     * of them are.
+     * 
+     * @param command command after parsing, as received from client
+     * @param spec the command
+     * @param is_asking whether the command follows an ASKING
+     * @param slot_lock set to the shared lock of the slot, which the
+     * command runs with
+     * @param response the redirection is appended here
+     * @return true if the command is answered with a redirection or
+     * an error
+     * @return false if it runs here
+     */
+    bool route_in_cluster(
+        const CommandView& command,
+        const CommandSpec& spec,
+        bool is_asking,
+        std::shared_lock<std::shared_mutex>& slot_lock,
+        IoBuffer& response);
+
+    /**
+     * @brief perform the CLUSTER command
+     * 
+     * The subcommands are KEYSLOT, SLOTS, NODES, MYID, INFO,
+     * COUNTKEYSINSLOT, GETKEYSINSLOT and SETSLOT, with the arguments of
+     * Redis Cluster. A node may be given by its id or as HOST:PORT.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_cluster(
+        const CommandView& command,
+        IoBuffer& response);
+
+    /**
+     * @brief collect the keys of a multi-key command, and group them
+     * by partition
+     * 
+     * @param command the command, whose keys start at argument 1
+     * @param step 1 if the arguments are all keys, 2 if every key is
+     * followed by its value
+     * @param batch the batch to fill, cleared first
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool group_keys(
+        const CommandView& command,
+        int step,
+        KeyBatch& batch);
+
+    /**
+     * @brief perform the INFO command
+     * 
+     * The reply is a bulk string of "name:value" lines, grouped in
+     * sections that each start with a "# Section" line. An optional
+     * argument selects a single section.
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_info(
+        const CommandView& command,
+        IoBuffer& response);
+
+    /**
+     * @brief perform the SAVE and BGSAVE commands
+     * 
+     * @param command command after parsing, as received from client
+     * @param response the serialized response is appended here
+     * @param is_background whether the snapshot is written in the
+     * background
+     * @return true if there has been a fatal error, which mandates the
+     * client connection must be closed
+     * @return false otherwise
+     */
+    bool do_save(
+        const CommandView& command,
+        IoBuffer& response,
+        bool is_background);
+
+    /**
+     * @brief format the INFO sections
+     * 
+     * @param section the section to format, empty for all of them
+     * @return std::string the "name:value" lines
      */
-    std::tuple<bool, std::shared_ptr<AbstractRespObject> >
-        do_del(std::shared_ptr<AbstractRespObject> p);
+    std::string get_info(std::string_view section);
 
     /**
-     * @brief delete one variable from the appropriate hash
+     * @brief the reply to a write that the data store refused
+     * 
+     * With a memory limit, a refused write is almost always one that
+     * would not fit, and gets the error clients expect for it.
      * 
-     * @param pobj command after parsing, as received from the client
-     * @return true on successful deletion
-     * @return false on failure to delete for any reason, including
-     * if the item was not present in the first place.
+     * @return std::string_view the reply
      */
-    bool do_del_internal(std::shared_ptr<AbstractRespObject> pobj);
+    std::string_view get_set_failed_reply() const
+    {
+        return m_config.m_max_memory ? REPLY_OOM : REPLY_SET_FAILED;
+    }
 
 
     /**
@@ -600,37 +1433,38 @@ public:
     }
 
 
-    /**
-     * TODO: Refactor this function, into three different classes
-     * for each command: set, get and del
-     * And those classes should be responsible for both validating
-     * and actual action
-     */
     /**
      * @brief given an abstract object, find whether it is a valid
      * command or not.
      * 
      * When a command is received from the client, it is parsed.
      * After parsing, this function will decide whether it is a valid
-     * command or not
+     * command or not, with one lookup in the perfect hash of the
+     * command names, see CommandTable.
+     * 
+     * Command names are not case sensitive.
      * 
-     * @param p the parsed input in object form
-     * @return std::tuple<bool, command_type_t> a tuple of two items:
-     * 1. whether it is valid or not
-     * 2. the type of command if it is valid
+     * @param command the parsed input
+     * @return const CommandSpec* the command, nullptr if there is no
+     * command of that name or it does not take those arguments
      */
-    std::tuple<bool, command_type_t>
-        is_valid_command(std::shared_ptr<AbstractRespObject> p);
+    const CommandSpec* find_command(const CommandView& command);
     
     /**
-     * @brief Add a file descriptor to queue for epoll
-     * This queue is monitored by the thread which executes
-     * epoll.
-     * The thread is woken up.
+     * @brief lock the append log of a partition, so that a write and
+     * its record are in the same order in the data store and in the
+     * log
      * 
-     * @param fd file descriptor to monitor for changes
+     * @param partition the partition
+     * @return std::unique_lock<std::mutex> the lock, which owns nothing
+     * if there is no append log
      */
-    void add_to_epoll_queue(int fd);
+    std::unique_lock<std::mutex> lock_append_log(size_t partition)
+    {
+        if (!m_append_log)
+            return std::unique_lock<std::mutex>();
+        return std::unique_lock<std::mutex>(m_append_log->get_mutex(partition));
+    }
 
     /**
      * @brief Get the partition id of the hash table, based on the
@@ -638,7 +1472,9 @@ public:
      * 
      * For performance reasons, instead of using a single hash,
      * we use multiple hashes, and the decision to choose the
-     * correct hash is taken based on the first character of the key.
+     * correct hash is taken based on the hash of the whole key.
+     * The same hash is then reused by the lookup inside the
+     * chosen hash table.
      * 
      * This is done because on high load, a single hash would be
      * affected by lock contention. Using several hashes will
@@ -647,10 +1483,13 @@ public:
      * Additionally, reader-writer locks are used to increase
      * concurrency even more.
      * 
-     * @param varname name of the variable
-     * @return int partition id of the correct hash to use
+     * @param key name of the variable, along with its hash
+     * @return size_t partition id of the correct hash to use
      */
-    int get_partition(const std::string& s);
+    size_t get_partition(const HashedKey& key)
+    {
+        return ::get_partition(key, m_num_datastores);
+    }
 
     /**
      * @brief run a server
@@ -658,6 +1497,13 @@ public:
      * @return int 0 on success
      */
     int run_server();
+
+    /**
+     * @brief stop the accepting and epoll threads and wait for them
+     * to terminate
+     * 
+     */
+    void stop_server();
 };
 
 #endif /* #ifndef ORCHESTRATOR_H_ */
\ No newline at end of file
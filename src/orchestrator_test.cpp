@@ -0,0 +1,497 @@
+#include "orchestrator.h"
+#include "append_log.h"
+#include <fstream>
+#include <sstream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+
+#define TEST(x, y) {\
+    if (!(x))\
+    {\
+        std::cout << "FAILED: " << y << std::endl;\
+        exit(1);\
+    }\
+    else\
+    {\
+        std::cout << "PASSED: " << y << std::endl;\
+    }\
+}
+
+/**
+ * @brief first port of the servers the tests start, every test uses
+ * its own so that a closing listener does not get in the way
+ *
+ */
+#define TEST_PORT 17400
+
+/**
+ * @brief connect to a server of the tests
+ *
+ * @param port the port of the server
+ * @return int the socket, -1 on error
+ */
+static int connect_to(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval timeout = { 10, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/**
+ * @brief send all the bytes of a request
+ *
+ * @return true if everything was sent
+ */
+static bool send_all(int fd, const std::string& bytes)
+{
+    size_t sent = 0;
+    while (sent < bytes.size())
+    {
+        ssize_t n = send(fd, bytes.data() + sent, bytes.size() - sent, 0);
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+/**
+ * @brief receive exactly the given number of bytes
+ *
+ * @return std::string the bytes, shorter on error or timeout
+ */
+static std::string recv_exactly(int fd, size_t size)
+{
+    std::string bytes(size, '\0');
+    size_t received = 0;
+    while (received < size)
+    {
+        ssize_t n = recv(fd, &bytes[received], size - received, 0);
+        if (n <= 0)
+            break;
+        received += n;
+    }
+    bytes.resize(received);
+    return bytes;
+}
+
+/**
+ * @brief a command in the RESP protocol
+ *
+ */
+static std::string make_command(const std::vector<std::string>& args)
+{
+    std::string command = "*" + std::to_string(args.size()) + "\r\n";
+    for (auto& arg: args)
+        command += "$" + std::to_string(arg.size()) + "\r\n" + arg + "\r\n";
+    return command;
+}
+
+static std::string make_bulk(const std::string& bytes)
+{
+    return "$" + std::to_string(bytes.size()) + "\r\n" + bytes + "\r\n";
+}
+
+/**
+ * @brief read a bulk string reply
+ *
+ * @return std::string the string, empty on error
+ */
+static std::string recv_bulk(int fd)
+{
+    std::string header;
+    while (header.size() < 2 || header.compare(header.size() - 2, 2, "\r\n"))
+    {
+        char c;
+        if (recv(fd, &c, 1, 0) <= 0)
+            return "";
+        header += c;
+    }
+    if ('$' != header[0])
+        return "";
+    size_t size = std::stoul(header.substr(1));
+    std::string bulk = recv_exactly(fd, size + 2);
+    return bulk.size() == size + 2 ? bulk.substr(0, size) : "";
+}
+
+/**
+ * @brief a field of INFO
+ *
+ * @return long long its value, -1 if it is not found
+ */
+static long long get_info_field(int fd, const std::string& section, const std::string& field)
+{
+    if (!send_all(fd, make_command({"INFO", section})))
+        return -1;
+    std::string info = recv_bulk(fd);
+    size_t pos = info.find("\r\n" + field + ":");
+    if (std::string::npos == pos)
+        return -1;
+    return std::stoll(info.substr(pos + field.size() + 3));
+}
+
+/**
+ * @brief send one request to every client, then read every reply, in
+ * rounds, so that all the sockets are ready at once
+ *
+ * @return true if every client got the expected reply in every round
+ */
+static bool run_rounds(const std::vector<int>& fds, const std::string& request,
+    const std::string& expected, int num_rounds)
+{
+    bool is_ok = true;
+    for (int round = 0; is_ok && round < num_rounds; round++)
+    {
+        for (int fd: fds)
+            is_ok = send_all(fd, request) && is_ok;
+        for (int fd: fds)
+            is_ok = recv_exactly(fd, expected.size()) == expected && is_ok;
+    }
+    return is_ok;
+}
+
+/**
+ * @brief connect several clients
+ *
+ */
+static std::vector<int> connect_clients(int port, size_t num_clients)
+{
+    std::vector<int> fds;
+    for (size_t i = 0; i < num_clients; i++)
+    {
+        int fd = connect_to(port);
+        if (fd < 0)
+            break;
+        fds.push_back(fd);
+    }
+    return fds;
+}
+
+static void close_clients(std::vector<int>& fds)
+{
+    for (int fd: fds)
+        close(fd);
+    fds.clear();
+}
+
+void pipeline_tests()
+{
+    std::cout << std::endl << "Running pipeline tests " << std::endl;
+
+    ServerConfig config;
+    config.m_port = TEST_PORT + 2;
+    config.m_num_datastores = 4;
+    config.m_pool_queue_limit = 1;
+    config.m_epoll_batch_size = 1;
+    Orchestrator orchestrator(config);
+    TEST(0 == orchestrator.run_server(), "Start a pipeline server");
+
+    // Every command needs the one-shot registration re-armed
+    int fd = connect_to(config.m_port);
+    TEST(fd >= 0, "Connect to the pipeline server");
+    bool is_ok = true;
+    for (int i = 0; is_ok && i < 200; i++)
+    {
+        std::string value = std::to_string(i);
+        std::string expected = std::string("+OK\r\n") + make_bulk(value);
+        is_ok = send_all(fd, make_command({"SET", "counter", value}) + make_command({"GET", "counter"})) && \
+            recv_exactly(fd, expected.size()) == expected;
+    }
+    TEST(is_ok, "A socket should be re-armed after every response");
+
+    // Edge triggered, the rest of a command is a new edge
+    std::string request = make_command({"SET", "split", "value"});
+    TEST(send_all(fd, request.substr(0, 10)), "Send part of a command");
+    usleep(50000);
+    TEST(send_all(fd, request.substr(10)) && "+OK\r\n" == recv_exactly(fd, 5),
+        "The rest of a command should be read once it arrives");
+
+    // The response does not fit in the socket buffers until it is read
+    std::string value(8 * 1024 * 1024, 'v');
+    request = make_command({"SET", "huge", value}) + make_command({"GET", "huge"});
+    std::string expected = std::string("+OK\r\n") + make_bulk(value);
+    TEST(send_all(fd, request), "Send a command with a large response");
+    usleep(100000);
+    TEST(recv_exactly(fd, expected.size()) == expected,
+        "A socket should be re-armed for writing until its response is sent");
+
+    // With a queue limit of one job, and one socket per epoll_wait, the
+    // sockets that are ready at once overload the pools, and wait in the
+    // epoll thread
+    std::vector<int> fds = connect_clients(config.m_port, 64);
+    TEST(64 == fds.size(), "Connect many clients to the pipeline server");
+    TEST(run_rounds(fds, make_command({"GET", "counter"}), make_bulk("199"), 50),
+        "Every client should be answered while the pools are overloaded");
+    close_clients(fds);
+    TEST(get_info_field(fd, "backpressure", "deferred_reads") > 0,
+        "The sockets that arrive while the pools are full should be deferred");
+    close(fd);
+}
+
+/**
+ * @brief milliseconds on the monotonic clock
+ *
+ */
+static long long now_ms()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void epoll_wakeup_tests()
+{
+    std::cout << std::endl << "Running epoll wakeup tests " << std::endl;
+
+    ServerConfig config;
+    config.m_port = TEST_PORT + 3;
+    config.m_num_datastores = 4;
+    config.m_epoll_batch_size = 1024;
+    long long stop_ms;
+    {
+        Orchestrator orchestrator(config);
+        TEST(0 == orchestrator.run_server(), "Start a pipeline server with a large epoll batch");
+
+        // The epoll thread waits without a timeout, a new socket must
+        // still be served at once
+        bool is_ok = true;
+        long long start = now_ms();
+        for (int i = 0; is_ok && i < 50; i++)
+        {
+            int fd = connect_to(config.m_port);
+            is_ok = fd >= 0 && send_all(fd, make_command({"GET", "missing"})) && \
+                "$-1\r\n" == recv_exactly(fd, 5);
+            if (fd >= 0)
+                close(fd);
+        }
+        TEST(is_ok && now_ms() - start < 1000, "New connections should be served without waiting for a timeout");
+
+        // All the sockets ready at once are handed over in one batch
+        std::vector<int> fds = connect_clients(config.m_port, 256);
+        TEST(256 == fds.size(), "Connect many clients to the pipeline server");
+        TEST(run_rounds(fds, make_command({"GET", "missing"}), "$-1\r\n", 20),
+            "Every client should be answered when its socket is part of a large batch");
+        close_clients(fds);
+
+        // Nothing is ready, only the eventfd can end the wait
+        usleep(100000);
+        stop_ms = now_ms();
+    }
+    TEST(now_ms() - stop_ms < 1000, "An idle epoll thread should be woken up to stop");
+}
+
+void event_loop_tests()
+{
+    std::cout << std::endl << "Running event loop tests " << std::endl;
+
+    ServerConfig config;
+    config.m_port = TEST_PORT + 4;
+    config.m_mode = SERVER_MODE_EVENT_LOOP;
+    config.m_num_event_loops = 2;
+    config.m_num_datastores = 4;
+    config.m_client_output_limit = 64 * 1024;
+    Orchestrator orchestrator(config);
+    TEST(0 == orchestrator.run_server(), "Start an event loop server");
+
+    int fd = connect_to(config.m_port);
+    TEST(fd >= 0, "Connect to the event loop server");
+    std::string value(32 * 1024, 'v');
+    TEST(send_all(fd, make_command({"SET", "big", value})) && "+OK\r\n" == recv_exactly(fd, 5),
+        "Set a value larger than half the output limit");
+
+    // The client does not read, the commands past the limit wait for
+    // the responses before them to be sent
+    std::string request;
+    std::string expected;
+    for (int i = 0; i < 400; i++)
+    {
+        request += make_command({"GET", "big"});
+        expected += make_bulk(value);
+    }
+    TEST(send_all(fd, request), "Pipeline more responses than the output limit");
+    usleep(200000);
+    TEST(recv_exactly(fd, expected.size()) == expected,
+        "The commands held back by the output limit should all be answered in order");
+    TEST(get_info_field(fd, "backpressure", "output_limited") > 0,
+        "The responses past the output limit should hold back the commands");
+
+    // The commands after a response that waits for the socket to be
+    // writable stay in the socket buffer until it is sent
+    std::string huge(8 * 1024 * 1024, 'h');
+    TEST(send_all(fd, make_command({"SET", "huge", huge})) && "+OK\r\n" == recv_exactly(fd, 5),
+        "Set a value larger than the socket buffers");
+    request = make_command({"GET", "huge"}) + make_command({"SET", "after", "1"}) + make_command({"GET", "after"});
+    expected = make_bulk(huge) + "+OK\r\n" + make_bulk("1");
+    TEST(send_all(fd, request), "Pipeline commands after a large response");
+    usleep(200000);
+    TEST(recv_exactly(fd, expected.size()) == expected,
+        "A response that waited for the socket should be finished before the next commands");
+
+    // A client that goes away with a response still pending is closed
+    TEST(send_all(fd, make_command({"GET", "huge"})), "Ask for a large response");
+    usleep(100000);
+    close(fd);
+    fd = connect_to(config.m_port);
+    TEST(fd >= 0 && send_all(fd, make_command({"GET", "after"})) && make_bulk("1") == recv_exactly(fd, 7),
+        "The loops should go on after a client left with a response pending");
+    close(fd);
+}
+
+void append_log_tests()
+{
+    std::cout << std::endl << "Running append log tests " << std::endl;
+
+    const char* path = "/tmp/orchestrator_test_aof";
+    std::vector<std::uint64_t> segments;
+    list_log_segments(path, segments);
+    for (auto segment: segments)
+        unlink(get_log_segment_path(path, segment).c_str());
+
+    ServerConfig config;
+    config.m_port = TEST_PORT + 1;
+    config.m_num_datastores = 4;
+    config.m_aof_file = path;
+    config.m_appendfsync = APPENDFSYNC_ALWAYS;
+    {
+        Orchestrator orchestrator(config);
+        TEST(0 == orchestrator.run_server(), "Start a server with an append log");
+
+        int fd = connect_to(config.m_port);
+        TEST(fd >= 0, "Connect to the server");
+        std::string request = make_command({"SET", "a", "1"}) +
+            make_command({"SET", "b", "2"}) +
+            make_command({"DEL", "a", "b", "c", "d"});
+        std::string expected = "+OK\r\n+OK\r\n:2\r\n";
+        TEST(send_all(fd, request) && recv_exactly(fd, expected.size()) == expected,
+            "DEL should count the keys that were there");
+        close(fd);
+    }
+
+    size_t num_sets = 0;
+    size_t num_dels = 0;
+    bool is_ok = true;
+    list_log_segments(path, segments);
+    for (auto segment: segments)
+    {
+        std::ifstream file(get_log_segment_path(path, segment), std::ios::binary);
+        std::stringstream ss;
+        ss << file.rdbuf();
+        std::string data = ss.str();
+        is_ok = is_ok && data.size() >= APPEND_LOG_MAGIC_SIZE;
+        const char* p = data.data() + APPEND_LOG_MAGIC_SIZE;
+        const char* end = data.data() + data.size();
+        LogRecord record;
+        while (is_ok && p < end)
+        {
+            is_ok = 1 == decode_log_record(p, end, record);
+            num_sets += is_ok && APPEND_LOG_OP_SET == record.m_op ? 1 : 0;
+            num_dels += is_ok && APPEND_LOG_OP_DEL == record.m_op ? 1 : 0;
+        }
+        unlink(get_log_segment_path(path, segment).c_str());
+    }
+    TEST(is_ok && 2 == num_sets && 2 == num_dels,
+        "Only the keys DEL deleted should be logged");
+}
+
+#ifdef HAVE_IO_URING
+void io_uring_tests()
+{
+    std::cout << std::endl << "Running io_uring tests " << std::endl;
+
+    ServerConfig config;
+    config.m_port = TEST_PORT;
+    config.m_mode = SERVER_MODE_IO_URING;
+    config.m_num_event_loops = 2;
+    config.m_num_datastores = 4;
+
+    Orchestrator orchestrator(config);
+    if (orchestrator.run_server())
+    {
+        // A kernel or sandbox without io_uring cannot run these
+        std::cout << "SKIPPED: io_uring is not available" << std::endl;
+        return;
+    }
+
+    int fd = connect_to(config.m_port);
+    TEST(fd >= 0, "Connect to the io_uring server");
+
+    std::string request = make_command({"SET", "foo", "bar"}) +
+        make_command({"GET", "foo"});
+    std::string expected = std::string("+OK\r\n") + make_bulk("bar");
+    TEST(send_all(fd, request), "Send a pipelined SET and GET");
+    TEST(recv_exactly(fd, expected.size()) == expected,
+        "The io_uring server replies to a pipelined SET and GET");
+
+    // Spans several provided receive buffers, which are handed back
+    // to the ring while the request is still incomplete
+    std::string value(5 * IO_URING_BUFFER_SIZE + 123, 'x');
+    for (size_t i = 0; i < value.size(); i += 97)
+        value[i] = 'a' + i % 26;
+    request = make_command({"SET", "big", value}) +
+        make_command({"GET", "big"});
+    expected = std::string("+OK\r\n") + make_bulk(value);
+    TEST(send_all(fd, request), "Send a value larger than a receive buffer");
+    TEST(recv_exactly(fd, expected.size()) == expected,
+        "The io_uring server reassembles a value over several receive buffers");
+
+    // Every client reading at once needs more buffers than the ring
+    // has, the ones that run out must still be served
+    std::vector<int> fds;
+    size_t num_clients = 200;
+    std::string chunk = make_command(
+        {"SET", "k", std::string(IO_URING_BUFFER_SIZE * 2, 'y')});
+    for (size_t i = 0; i < num_clients; i++)
+    {
+        int client = connect_to(config.m_port);
+        if (client < 0)
+            break;
+        fds.push_back(client);
+    }
+    TEST(fds.size() == num_clients, "Connect many clients to the io_uring server");
+
+    bool is_sent = true;
+    for (int client: fds)
+        is_sent = send_all(client, chunk + chunk) && is_sent;
+    TEST(is_sent, "Send two large SETs on every connection");
+
+    bool is_replied = true;
+    for (int client: fds)
+    {
+        is_replied = recv_exactly(client, 10) == "+OK\r\n+OK\r\n" && is_replied;
+        close(client);
+    }
+    TEST(is_replied, "Every connection gets its replies when receive buffers run short");
+
+    close(fd);
+}
+#endif
+
+int main()
+{
+    pipeline_tests();
+    epoll_wakeup_tests();
+    event_loop_tests();
+    append_log_tests();
+#ifdef HAVE_IO_URING
+    io_uring_tests();
+#endif
+    std::cout << "All tests passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,187 @@
+#include "pool_controller.h"
+#include "logger.h"
+
+std::string PoolSizingDecision::to_string() const
+{
+    std::stringstream ss;
+    ss << "Pool " << m_pool_name << ": " << m_old_threads << " -> " \
+        << m_new_threads << " threads, queue depth " << m_queue_depth \
+        << ", average wait " << m_wait_us << "us";
+    return ss.str();
+}
+
+bool PoolSizeController::add_pool(const char* name, ThreadPool* pool)
+{
+    ManagedPool managed;
+    managed.m_name = name;
+    managed.m_pool = pool;
+    managed.m_quiet_samples = 0;
+    pool->get_stats(managed.m_last);
+
+    try
+    {
+        m_pools.push_back(managed);
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    return true;
+}
+
+void PoolSizeController::record(const PoolSizingDecision& decision)
+{
+    LOG_INFO(decision.to_string());
+
+    std::lock_guard<std::mutex> lock(m_history_mutex);
+    try
+    {
+        if (m_history.size() >= POOL_CONTROLLER_HISTORY)
+            m_history.pop_front();
+        m_history.push_back(decision);
+    }
+    catch (...)
+    {
+        // The history is only informational
+    }
+}
+
+void PoolSizeController::control(ManagedPool& managed)
+{
+    ThreadPoolStats stats;
+    managed.m_pool->get_stats(stats);
+
+    std::uint64_t jobs = stats.m_jobs_run - managed.m_last.m_jobs_run;
+    std::uint64_t wait_us = jobs ? \
+        (stats.m_wait_ns - managed.m_last.m_wait_ns) / jobs / 1000 : 0;
+    managed.m_last = stats;
+
+    PoolSizingDecision decision;
+    decision.m_pool_name = managed.m_name;
+    decision.m_time = std::time(nullptr);
+    decision.m_old_threads = stats.m_num_threads;
+    decision.m_new_threads = stats.m_num_threads;
+    decision.m_queue_depth = stats.m_queue_depth;
+    decision.m_wait_us = wait_us;
+
+    bool is_behind = stats.m_queue_depth > (size_t)stats.m_num_threads || \
+        wait_us > (std::uint64_t)m_config.m_target_wait_us;
+
+    if (is_behind && stats.m_num_threads < m_config.m_max_threads)
+    {
+        managed.m_quiet_samples = 0;
+
+        int wanted = std::min(m_config.m_max_threads,
+            stats.m_num_threads + std::max(1, stats.m_num_threads / 2));
+        while (decision.m_new_threads < wanted && \
+                0 == managed.m_pool->add_thread())
+            decision.m_new_threads++;
+
+        if (decision.m_new_threads != decision.m_old_threads)
+        {
+            m_num_grown++;
+            record(decision);
+        }
+        return;
+    }
+
+    if (stats.m_queue_depth || !stats.m_num_idle || is_behind)
+    {
+        managed.m_quiet_samples = 0;
+        return;
+    }
+
+    // Keeps shrinking one thread per sample for as long as it is quiet
+    if (++managed.m_quiet_samples < m_config.m_quiet_samples || \
+            stats.m_num_threads <= m_config.m_min_threads)
+        return;
+
+    if (0 == managed.m_pool->remove_thread())
+    {
+        decision.m_new_threads--;
+        m_num_shrunk++;
+        record(decision);
+    }
+}
+
+void PoolSizeController::sample()
+{
+    for (auto& managed: m_pools)
+        control(managed);
+}
+
+void PoolSizeController::loop()
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&m_mutex);
+    while (!m_is_stopping)
+    {
+        deadline.tv_nsec += (long)m_config.m_interval_ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        while (!m_is_stopping && \
+                ETIMEDOUT != pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+            ;
+
+        if (m_is_stopping)
+            break;
+
+        pthread_mutex_unlock(&m_mutex);
+        sample();
+        pthread_mutex_lock(&m_mutex);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void* PoolSizeController::thread_start_routine(void* arg)
+{
+    static_cast<PoolSizeController*>(arg)->loop();
+    return nullptr;
+}
+
+bool PoolSizeController::start()
+{
+    int retval;
+
+    if (m_is_running)
+        return true;
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        PoolSizeController::thread_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void PoolSizeController::stop()
+{
+    if (!m_is_running)
+        return;
+
+    pthread_mutex_lock(&m_mutex);
+    m_is_stopping = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread_id, nullptr);
+    m_is_running = false;
+}
+
+std::vector<PoolSizingDecision> PoolSizeController::get_recent_decisions()
+{
+    std::lock_guard<std::mutex> lock(m_history_mutex);
+    return std::vector<PoolSizingDecision>(m_history.begin(), m_history.end());
+}
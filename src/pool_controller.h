@@ -0,0 +1,263 @@
+#ifndef POOL_CONTROLLER_H_
+#define POOL_CONTROLLER_H_
+
+#include "common_include.h"
+#include "thread_pool.h"
+#include <pthread.h>
+#include <ctime>
+
+/**
+ * @brief number of past decisions kept by a PoolSizeController
+ *
+ */
+#define POOL_CONTROLLER_HISTORY 64
+
+/**
+ * @brief Bounds and thresholds of a PoolSizeController
+ *
+ */
+struct PoolSizingConfig
+{
+    /**
+     * @brief fewest threads a pool is shrunk to
+     *
+     */
+    int                             m_min_threads;
+
+    /**
+     * @brief most threads a pool is grown to
+     *
+     */
+    int                             m_max_threads;
+
+    /**
+     * @brief time between two samples of the pools, in milliseconds
+     *
+     */
+    int                             m_interval_ms;
+
+    /**
+     * @brief a pool grows when its jobs wait longer than this on
+     * average, in microseconds
+     *
+     */
+    int                             m_target_wait_us;
+
+    /**
+     * @brief number of samples in a row a pool has to be idle before
+     * it starts to shrink
+     *
+     */
+    int                             m_quiet_samples;
+
+    PoolSizingConfig():
+        m_min_threads(2),
+        m_max_threads(64),
+        m_interval_ms(100),
+        m_target_wait_us(1000),
+        m_quiet_samples(10)
+    {
+    }
+};
+
+/**
+ * @brief One resize of a pool, and what it was based on
+ *
+ */
+struct PoolSizingDecision
+{
+    /**
+     * @brief the name of the pool
+     *
+     */
+    const char*                     m_pool_name;
+
+    /**
+     * @brief wall clock time of the decision
+     *
+     */
+    std::time_t                     m_time;
+
+    int                             m_old_threads;
+    int                             m_new_threads;
+
+    /**
+     * @brief jobs waiting to run when the decision was taken
+     *
+     */
+    size_t                          m_queue_depth;
+
+    /**
+     * @brief average time jobs waited during the last interval, in
+     * microseconds
+     *
+     */
+    std::uint64_t                   m_wait_us;
+
+    /**
+     * @brief format the decision for a log line
+     *
+     * @return std::string the description
+     */
+    std::string to_string() const;
+};
+
+/**
+ * @brief Grows and shrinks thread pools with their load
+ *
+ * A background thread samples every pool at a fixed interval. A pool
+ * grows by half its size, at least one thread, when more jobs are
+ * waiting than it has threads, or when jobs waited longer than the
+ * target on average, so that a burst is absorbed in a few intervals.
+ * A pool shrinks by one thread per interval once it has had idle
+ * threads and an empty queue for m_quiet_samples samples in a row.
+ *
+ * Every decision is logged, counted and kept in a short history.
+ *
+ */
+class PoolSizeController
+{
+private:
+    /**
+     * @brief A pool under control, and its previous sample
+     *
+     */
+    struct ManagedPool
+    {
+        const char*                 m_name;
+        ThreadPool*                 m_pool;
+        ThreadPoolStats             m_last;
+        int                         m_quiet_samples;
+    };
+
+    PoolSizingConfig                        m_config;
+
+    /**
+     * @brief the pools, only changed before start()
+     *
+     */
+    std::vector<ManagedPool>                m_pools;
+
+    /**
+     * @brief the most recent decisions, oldest first
+     *
+     */
+    std::deque<PoolSizingDecision>          m_history;
+
+    /**
+     * @brief protects m_history
+     *
+     */
+    std::mutex                              m_history_mutex;
+
+    /**
+     * @brief protects m_is_stopping, and is used with m_cond, on the
+     * monotonic clock, to wait for the next sample
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+    bool                                    m_is_stopping;
+
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief record a decision
+     *
+     * @param decision the decision
+     */
+    void record(const PoolSizingDecision& decision);
+
+    /**
+     * @brief sample one pool and resize it if needed
+     *
+     * @param managed the pool
+     */
+    void control(ManagedPool& managed);
+
+    /**
+     * @brief the loop of the controller thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg);
+
+public:
+    /**
+     * @brief number of times a pool was grown
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_grown;
+
+    /**
+     * @brief number of times a pool was shrunk
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_shrunk;
+
+    PoolSizeController(const PoolSizingConfig& config = PoolSizingConfig()):
+        m_config(config),
+        m_mutex(PTHREAD_MUTEX_INITIALIZER),
+        m_is_stopping(false),
+        m_is_running(false),
+        m_thread_id(),
+        m_num_grown(0),
+        m_num_shrunk(0)
+    {
+        // The samples are timed on a monotonic clock, so that wall
+        // clock changes do not stall the controller
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&m_cond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    ~PoolSizeController()
+    {
+        stop();
+        pthread_cond_destroy(&m_cond);
+    }
+
+    /**
+     * @brief put a pool under control, must be called before start()
+     *
+     * @param name the name used in the decisions
+     * @param pool the pool, must outlive the controller or stop()
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool add_pool(const char* name, ThreadPool* pool);
+
+    /**
+     * @brief start the controller thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop the controller thread, and wait for it
+     *
+     */
+    void stop();
+
+    /**
+     * @brief sample all pools once, and resize them if needed. Called
+     * by the controller thread, and by tests.
+     *
+     */
+    void sample();
+
+    /**
+     * @brief the most recent decisions
+     *
+     * @return std::vector<PoolSizingDecision> the decisions, oldest
+     * first
+     */
+    std::vector<PoolSizingDecision> get_recent_decisions();
+};
+
+#endif /* #ifndef POOL_CONTROLLER_H_ */
@@ -0,0 +1,794 @@
+#include "read_optimized_store.h"
+#include "logger.h"
+#include "cpu_topology.h"
+#include <cstring>
+
+/**
+ * @brief initial number of slots of a table
+ *
+ */
+#define RO_INITIAL_CAPACITY 64
+
+/**
+ * @brief number of retired objects after which a writer tries to
+ * free some of them
+ *
+ */
+#define RO_RECLAIM_THRESHOLD 64
+
+/**
+ * @brief marks a slot whose entry was deleted. Probing goes on past a
+ * tombstone, it is only recycled by a writer or dropped on a resize.
+ * It is never dereferenced.
+ *
+ */
+static RoEntry g_tombstone;
+#define RO_TOMBSTONE (&g_tombstone)
+
+/**
+ * @brief gives the record back when the thread exits
+ *
+ */
+struct ThreadRecordHolder
+{
+    EpochManager::ThreadRecord* m_record = nullptr;
+
+    ~ThreadRecordHolder()
+    {
+        if (m_record)
+        {
+            m_record->m_epoch.store(
+                EpochManager::EPOCH_INACTIVE,
+                std::memory_order_release);
+            m_record->m_in_use.store(false, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local ThreadRecordHolder t_record_holder;
+
+EpochManager::EpochManager():
+    m_global_epoch(0),
+    m_num_records(0)
+{
+    for (auto& record: m_records)
+    {
+        record.m_epoch.store(EPOCH_INACTIVE, std::memory_order_relaxed);
+        record.m_in_use.store(false, std::memory_order_relaxed);
+        record.m_nesting = 0;
+    }
+}
+
+EpochManager& EpochManager::instance()
+{
+    static EpochManager manager;
+    return manager;
+}
+
+EpochManager::ThreadRecord* EpochManager::get_thread_record()
+{
+    if (t_record_holder.m_record)
+        return t_record_holder.m_record;
+
+    while (true)
+    {
+        for (int i = 0; i < MAX_EPOCH_THREADS; i++)
+        {
+            bool expected = false;
+            if (m_records[i].m_in_use.load(std::memory_order_relaxed) ||
+                !m_records[i].m_in_use.compare_exchange_strong(expected, true))
+                continue;
+
+            int num = m_num_records.load(std::memory_order_relaxed);
+            while (num < i + 1 &&
+                !m_num_records.compare_exchange_weak(num, i + 1));
+
+            m_records[i].m_nesting = 0;
+            t_record_holder.m_record = &m_records[i];
+            return t_record_holder.m_record;
+        }
+
+        // More readers than records, wait for a thread to exit
+        std::this_thread::yield();
+    }
+}
+
+void EpochManager::enter()
+{
+    ThreadRecord* record = get_thread_record();
+    if (record->m_nesting++)
+        return;
+
+    // The announcement must be visible before any shared pointer is
+    // loaded, or a writer could advance past it and free what we read
+    record->m_epoch.store(
+        m_global_epoch.load(std::memory_order_relaxed),
+        std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void EpochManager::exit()
+{
+    ThreadRecord* record = t_record_holder.m_record;
+    if (0 == --record->m_nesting)
+        record->m_epoch.store(EPOCH_INACTIVE, std::memory_order_release);
+}
+
+std::uint64_t EpochManager::try_advance()
+{
+    std::uint64_t epoch = m_global_epoch.load(std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    int num = m_num_records.load(std::memory_order_acquire);
+    for (int i = 0; i < num; i++)
+    {
+        std::uint64_t announced =
+            m_records[i].m_epoch.load(std::memory_order_acquire);
+        if (EPOCH_INACTIVE != announced && epoch != announced)
+            return epoch;
+    }
+
+    m_global_epoch.compare_exchange_strong(epoch, epoch + 1);
+    return m_global_epoch.load(std::memory_order_seq_cst);
+}
+
+RoEntry* RoEntry::create(
+    const HashedKey& key,
+    std::string_view value,
+    std::int64_t expire_at)
+{
+    if (key.m_key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+        return nullptr;
+
+    void* p = ::operator new(
+                sizeof(RoEntry) + key.m_key.size() + value.size(),
+                std::nothrow);
+    if (!p)
+        return nullptr;
+
+    RoEntry* entry = static_cast<RoEntry*>(p);
+    entry->m_hash = key.m_hash;
+    entry->m_expire_at = expire_at;
+    entry->m_timer_at = EXPIRE_NEVER;
+    entry->m_key_length = (std::uint32_t)key.m_key.size();
+    entry->m_value_length = (std::uint32_t)value.size();
+
+    char* data = reinterpret_cast<char*>(entry + 1);
+    memcpy(data, key.m_key.data(), key.m_key.size());
+    memcpy(data + key.m_key.size(), value.data(), value.size());
+    return entry;
+}
+
+void RoEntry::destroy(void* p)
+{
+    ::operator delete(p);
+}
+
+RoTable* RoTable::create(size_t capacity, int numa_node)
+{
+    RoTable* table = new (std::nothrow) RoTable;
+    if (!table)
+        return nullptr;
+
+    table->m_slots = new (std::nothrow) std::atomic<RoEntry*>[capacity];
+    if (!table->m_slots)
+    {
+        delete table;
+        return nullptr;
+    }
+
+    // Bound before the slots are cleared, which is when they are touched
+    bind_memory_to_node(table->m_slots, capacity * sizeof(std::atomic<RoEntry*>), numa_node);
+    for (size_t i = 0; i < capacity; i++)
+        table->m_slots[i].store(nullptr, std::memory_order_relaxed);
+    table->m_mask = capacity - 1;
+    return table;
+}
+
+/**
+ * @brief the bytes of a table, without its entries
+ *
+ */
+static size_t get_table_size(const RoTable* table)
+{
+    return sizeof(RoTable) + (table->m_mask + 1) * sizeof(std::atomic<RoEntry*>);
+}
+
+void RoTable::destroy(void* p)
+{
+    RoTable* table = static_cast<RoTable*>(p);
+    delete[] table->m_slots;
+    delete table;
+}
+
+ReadOptimizedDataStore::ReadOptimizedDataStore():
+    m_table(nullptr),
+    m_num_entries(0),
+    m_num_used(0),
+    m_used_memory(0),
+    m_max_memory(0),
+    m_policy(EVICTION_NOEVICTION),
+    m_num_evicted(0),
+    m_numa_node(-1)
+{
+    RoTable* table = RoTable::create(RO_INITIAL_CAPACITY);
+    if (!table)
+    {
+        LOG_ERROR("Out of memory");
+        throw std::bad_alloc();
+    }
+    m_table.store(table, std::memory_order_release);
+    m_used_memory.store(get_table_size(table), std::memory_order_relaxed);
+}
+
+ReadOptimizedDataStore::~ReadOptimizedDataStore()
+{
+    // No reader can be left by the time the store goes away
+    RoTable* table = m_table.load(std::memory_order_acquire);
+    for (size_t i = 0; i <= table->m_mask; i++)
+    {
+        RoEntry* entry = table->m_slots[i].load(std::memory_order_relaxed);
+        if (entry && RO_TOMBSTONE != entry)
+            RoEntry::destroy(entry);
+    }
+    RoTable::destroy(table);
+
+    for (auto& retired: m_retired)
+        retired.m_destroy(retired.m_ptr);
+}
+
+RoEntry* ReadOptimizedDataStore::find(const HashedKey& key)
+{
+    RoTable*    table   = m_table.load(std::memory_order_acquire);
+    size_t      index   = key.m_hash & table->m_mask;
+
+    while (true)
+    {
+        RoEntry* entry = table->m_slots[index].load(std::memory_order_acquire);
+        if (!entry)
+            return nullptr;
+
+        if (RO_TOMBSTONE != entry &&
+            entry->m_hash == key.m_hash &&
+            entry->key() == key.m_key)
+            return entry;
+
+        index = (index + 1) & table->m_mask;
+    }
+}
+
+bool ReadOptimizedDataStore::grow_unsafe()
+{
+    RoTable*    old_table       = m_table.load(std::memory_order_relaxed);
+    size_t      old_capacity    = old_table->m_mask + 1;
+
+    // Mostly tombstones, rehashing at the same size is enough
+    size_t capacity = old_capacity;
+    if (m_num_entries * 2 >= old_capacity)
+        capacity = old_capacity * 2;
+
+    RoTable* table = RoTable::create(capacity, m_numa_node);
+    if (!table)
+        return false;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        RoEntry* entry = old_table->m_slots[i].load(std::memory_order_relaxed);
+        if (!entry || RO_TOMBSTONE == entry)
+            continue;
+
+        size_t index = entry->m_hash & table->m_mask;
+        while (table->m_slots[index].load(std::memory_order_relaxed))
+            index = (index + 1) & table->m_mask;
+        table->m_slots[index].store(entry, std::memory_order_relaxed);
+    }
+
+    // Readers either see the old table, which stays intact until it
+    // is reclaimed, or the complete new one
+    m_table.store(table, std::memory_order_release);
+    m_num_used = m_num_entries;
+    m_used_memory.fetch_add(get_table_size(table) - get_table_size(old_table), std::memory_order_relaxed);
+    retire_unsafe(old_table, RoTable::destroy);
+    return true;
+}
+
+void ReadOptimizedDataStore::retire_unsafe(void* p, void (*destroy)(void*))
+{
+    try
+    {
+        m_retired.push_back(
+            {p, destroy, EpochManager::instance().current_epoch()});
+    }
+    catch(...)
+    {
+        // Leaking is the only safe option, a reader may still use it
+        LOG_ERROR("Out of memory, leaking retired object");
+        return;
+    }
+
+    if (m_retired.size() >= RO_RECLAIM_THRESHOLD)
+        reclaim_unsafe();
+}
+
+void ReadOptimizedDataStore::reclaim_unsafe()
+{
+    std::uint64_t epoch = EpochManager::instance().try_advance();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < m_retired.size(); i++)
+    {
+        if (m_retired[i].m_epoch + 2 <= epoch)
+            m_retired[i].m_destroy(m_retired[i].m_ptr);
+        else
+            m_retired[kept++] = m_retired[i];
+    }
+    m_retired.resize(kept);
+}
+
+void ReadOptimizedDataStore::schedule_unsafe(RoEntry* entry)
+{
+    if (EXPIRE_NEVER == entry->m_expire_at)
+        return;
+
+    // A timer that fires earlier reschedules itself when it finds the
+    // key expires later
+    if (EXPIRE_NEVER != entry->m_timer_at && entry->m_timer_at <= entry->m_expire_at)
+        return;
+
+    if (m_timers.add(entry->key(), entry->m_expire_at, unix_time_ms()))
+        entry->m_timer_at = entry->m_expire_at;
+}
+
+bool ReadOptimizedDataStore::insert_unsafe(RoEntry* new_entry)
+{
+    RoTable* table = m_table.load(std::memory_order_relaxed);
+    if ((m_num_used + 1) * 10 > (table->m_mask + 1) * 7)
+    {
+        if (!grow_unsafe())
+        {
+            LOG_ERROR("Out of memory");
+            RoEntry::destroy(new_entry);
+            return false;
+        }
+        table = m_table.load(std::memory_order_relaxed);
+    }
+
+    size_t  index       = new_entry->m_hash & table->m_mask;
+    size_t  free_index  = SIZE_MAX;
+
+    while (true)
+    {
+        RoEntry* entry = table->m_slots[index].load(std::memory_order_relaxed);
+        if (!entry)
+            break;
+
+        if (RO_TOMBSTONE == entry)
+        {
+            if (SIZE_MAX == free_index)
+                free_index = index;
+        }
+        else if (entry->m_hash == new_entry->m_hash && entry->key() == new_entry->key())
+        {
+            // The timer of the key carries over to its new entry
+            new_entry->m_timer_at = entry->m_timer_at;
+            table->m_slots[index].store(new_entry, std::memory_order_release);
+            m_used_memory.fetch_add(new_entry->get_size() - entry->get_size(), std::memory_order_relaxed);
+            retire_unsafe(entry, RoEntry::destroy);
+            schedule_unsafe(new_entry);
+            return true;
+        }
+
+        index = (index + 1) & table->m_mask;
+    }
+
+    if (SIZE_MAX == free_index)
+    {
+        free_index = index;
+        m_num_used++;
+    }
+
+    table->m_slots[free_index].store(new_entry, std::memory_order_release);
+    m_num_entries++;
+    m_used_memory.fetch_add(new_entry->get_size(), std::memory_order_relaxed);
+    schedule_unsafe(new_entry);
+    return true;
+}
+
+bool ReadOptimizedDataStore::erase_unsafe(const HashedKey& key)
+{
+    RoTable*    table   = m_table.load(std::memory_order_relaxed);
+    size_t      index   = key.m_hash & table->m_mask;
+
+    while (true)
+    {
+        RoEntry* entry = table->m_slots[index].load(std::memory_order_relaxed);
+        if (!entry)
+            return false;
+
+        if (RO_TOMBSTONE != entry &&
+            entry->m_hash == key.m_hash &&
+            entry->key() == key.m_key)
+        {
+            bool was_live = !is_expired(entry->m_expire_at);
+            unlink_unsafe(index);
+            return was_live;
+        }
+
+        index = (index + 1) & table->m_mask;
+    }
+}
+
+void ReadOptimizedDataStore::unlink_unsafe(size_t index)
+{
+    RoTable* table = m_table.load(std::memory_order_relaxed);
+    RoEntry* entry = table->m_slots[index].load(std::memory_order_relaxed);
+
+    table->m_slots[index].store(RO_TOMBSTONE, std::memory_order_release);
+    m_num_entries--;
+    m_used_memory.fetch_sub(entry->get_size(), std::memory_order_relaxed);
+    retire_unsafe(entry, RoEntry::destroy);
+}
+
+bool ReadOptimizedDataStore::make_room_unsafe(size_t needed)
+{
+    if (!m_max_memory)
+        return true;
+
+    std::int64_t now = unix_time_ms();
+    while (m_used_memory.load(std::memory_order_relaxed) + needed > m_max_memory)
+    {
+        if (EVICTION_NOEVICTION == m_policy || !m_num_entries)
+            return false;
+
+        // A few live slots from a random place, the first expired one
+        // goes, or else the first one
+        RoTable* table = m_table.load(std::memory_order_relaxed);
+        size_t victim = SIZE_MAX;
+        size_t num_sampled = 0;
+        size_t index = (size_t)rand() & table->m_mask;
+        for (size_t n = 0; n <= table->m_mask && num_sampled < EVICTION_SAMPLES; n++)
+        {
+            RoEntry* entry = table->m_slots[index].load(std::memory_order_relaxed);
+            if (entry && RO_TOMBSTONE != entry)
+            {
+                if (EXPIRE_NEVER != entry->m_expire_at && entry->m_expire_at <= now)
+                {
+                    victim = index;
+                    break;
+                }
+                if (!num_sampled++)
+                    victim = index;
+            }
+            index = (index + 1) & table->m_mask;
+        }
+
+        RoEntry* entry = table->m_slots[victim].load(std::memory_order_relaxed);
+        if (EXPIRE_NEVER == entry->m_expire_at || entry->m_expire_at > now)
+            m_num_evicted.fetch_add(1, std::memory_order_relaxed);
+        unlink_unsafe(victim);
+    }
+    return true;
+}
+
+bool ReadOptimizedDataStore::store_unsafe(RoEntry* new_entry)
+{
+    if (!make_room_unsafe(new_entry->get_size()))
+    {
+        RoEntry::destroy(new_entry);
+        return false;
+    }
+    return insert_unsafe(new_entry);
+}
+
+bool ReadOptimizedDataStore::set(
+    const HashedKey& key,
+    std::string_view value,
+    std::int64_t expire_at)
+{
+    // Built outside of the lock, it is not visible to anyone yet
+    RoEntry* new_entry = RoEntry::create(key, value, expire_at);
+    if (!new_entry)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    std::unique_lock lock(m_write_mutex);
+    return store_unsafe(new_entry);
+}
+
+bool ReadOptimizedDataStore::del(const HashedKey& key)
+{
+    std::unique_lock lock(m_write_mutex);
+    return erase_unsafe(key);
+}
+
+std::tuple<bool, std::string> ReadOptimizedDataStore::get(const HashedKey& key)
+{
+    EpochGuard guard;
+
+    RoEntry* entry = find(key);
+    if (!entry || is_expired(entry->m_expire_at))
+        return std::make_tuple(false, std::string());
+
+    return std::make_tuple(true, std::string(entry->value()));
+}
+
+bool ReadOptimizedDataStore::visit_value(
+    const HashedKey& key,
+    value_visitor_t visitor,
+    void* context)
+{
+    EpochGuard guard;
+
+    RoEntry* entry = find(key);
+    if (!entry || is_expired(entry->m_expire_at))
+        return false;
+
+    visitor(entry->value(), context);
+    return true;
+}
+
+bool ReadOptimizedDataStore::set_expiry(
+    const HashedKey& key,
+    std::int64_t expire_at,
+    std::int64_t& previous)
+{
+    std::unique_lock lock(m_write_mutex);
+
+    RoEntry* entry = find(key);
+    if (!entry)
+        return false;
+
+    if (is_expired(entry->m_expire_at))
+    {
+        erase_unsafe(key);
+        return false;
+    }
+
+    previous = entry->m_expire_at;
+    if (previous == expire_at)
+        return true;
+
+    // Published entries are immutable, the key gets a new one
+    RoEntry* new_entry = RoEntry::create(key, entry->value(), expire_at);
+    if (!new_entry)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+    return insert_unsafe(new_entry);
+}
+
+bool ReadOptimizedDataStore::get_expiry(const HashedKey& key, std::int64_t& expire_at)
+{
+    EpochGuard guard;
+
+    RoEntry* entry = find(key);
+    if (!entry || is_expired(entry->m_expire_at))
+        return false;
+
+    expire_at = entry->m_expire_at;
+    return true;
+}
+
+size_t ReadOptimizedDataStore::reclaim_expired(
+    std::int64_t now,
+    size_t budget,
+    size_t& num_expired)
+{
+    std::unique_lock lock(m_write_mutex);
+    return m_timers.expire(now, budget,
+        [this, now, &num_expired](const std::string& name, std::int64_t time)
+        {
+            HashedKey key(name);
+            RoEntry* entry = find(key);
+            if (!entry || entry->m_timer_at != time)
+                return;
+
+            entry->m_timer_at = EXPIRE_NEVER;
+            if (EXPIRE_NEVER == entry->m_expire_at)
+                return;
+
+            if (entry->m_expire_at <= now)
+            {
+                erase_unsafe(key);
+                num_expired++;
+            }
+            else
+                schedule_unsafe(entry);
+        });
+}
+
+size_t ReadOptimizedDataStore::scan(
+    size_t cursor,
+    size_t count,
+    entry_visitor_t visitor,
+    void* context)
+{
+    EpochGuard guard;
+
+    RoTable* table = m_table.load(std::memory_order_acquire);
+    std::int64_t now = unix_time_ms();
+    for (size_t n = 0; n < count; n++)
+    {
+        // The keys of a bucket are in the cluster that starts there,
+        // tombstones included
+        size_t bucket = cursor & table->m_mask;
+        for (size_t i = bucket;; i = (i + 1) & table->m_mask)
+        {
+            RoEntry* entry = table->m_slots[i].load(std::memory_order_acquire);
+            if (!entry)
+                break;
+            if (RO_TOMBSTONE == entry || (entry->m_hash & table->m_mask) != bucket)
+                continue;
+            if (EXPIRE_NEVER != entry->m_expire_at && entry->m_expire_at <= now)
+                continue;
+            visitor(entry->key(), entry->value(), entry->m_expire_at, context);
+        }
+
+        cursor = scan_next_cursor(cursor, table->m_mask);
+        if (!cursor)
+            break;
+    }
+    return cursor;
+}
+
+size_t ReadOptimizedDataStore::visit_values(
+    const HashedKey* keys,
+    const std::uint32_t* indexes,
+    size_t count,
+    indexed_value_visitor_t visitor,
+    void* context)
+{
+    EpochGuard guard;
+
+    size_t found = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        RoEntry* entry = find(keys[indexes[i]]);
+        if (!entry || is_expired(entry->m_expire_at))
+            continue;
+
+        visitor(indexes[i], entry->value(), context);
+        found++;
+    }
+    return found;
+}
+
+size_t ReadOptimizedDataStore::set_values(
+    const HashedKey* keys,
+    const std::string_view* values,
+    const std::uint32_t* indexes,
+    size_t count,
+    std::uint32_t* set_indexes)
+{
+    // As for set(), the entries are built before taking the lock
+    RoEntry** new_entries = new (std::nothrow) RoEntry*[count];
+    if (!new_entries)
+    {
+        LOG_ERROR("Out of memory");
+        return 0;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        new_entries[i] = RoEntry::create(keys[indexes[i]], values[indexes[i]], EXPIRE_NEVER);
+        if (!new_entries[i])
+            LOG_ERROR("Out of memory");
+    }
+
+    size_t num_set = 0;
+    {
+        std::unique_lock lock(m_write_mutex);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (new_entries[i] && store_unsafe(new_entries[i]))
+                set_indexes[num_set++] = indexes[i];
+        }
+    }
+
+    delete[] new_entries;
+    return num_set;
+}
+
+void ReadOptimizedDataStore::lock_writes()
+{
+    m_write_mutex.lock();
+}
+
+void ReadOptimizedDataStore::unlock_writes()
+{
+    m_write_mutex.unlock();
+}
+
+bool ReadOptimizedDataStore::make_room_for_values_unsafe(
+    const HashedKey* keys,
+    const std::string_view* values,
+    const std::uint32_t* indexes,
+    size_t count)
+{
+    if (!m_max_memory)
+        return true;
+
+    size_t needed = 0;
+    for (size_t i = 0; i < count; i++)
+        needed += sizeof(RoEntry) + keys[indexes[i]].m_key.size() + values[indexes[i]].size();
+
+    // The table doubles as in grow_unsafe(), the old one is uncounted
+    // right away
+    RoTable* table = m_table.load(std::memory_order_relaxed);
+    size_t capacity = table->m_mask + 1;
+    size_t new_capacity = capacity;
+    while ((m_num_used + count) * 10 > new_capacity * 7)
+        new_capacity *= 2;
+    needed += (new_capacity - capacity) * sizeof(std::atomic<RoEntry*>);
+
+    // A batch that cannot fit anyway does not evict everything first
+    if (needed > m_max_memory)
+        return false;
+    return make_room_unsafe(needed);
+}
+
+size_t ReadOptimizedDataStore::set_values_unsafe(
+    const HashedKey* keys,
+    const std::string_view* values,
+    const std::uint32_t* indexes,
+    size_t count,
+    std::uint32_t* set_indexes)
+{
+    size_t num_set = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        RoEntry* new_entry = RoEntry::create(keys[indexes[i]], values[indexes[i]], EXPIRE_NEVER);
+        if (!new_entry)
+            LOG_ERROR("Out of memory");
+        else if (store_unsafe(new_entry))
+            set_indexes[num_set++] = indexes[i];
+    }
+    return num_set;
+}
+
+size_t ReadOptimizedDataStore::del_keys(
+    const HashedKey* keys,
+    const std::uint32_t* indexes,
+    size_t count,
+    std::uint32_t* deleted_indexes)
+{
+    std::unique_lock lock(m_write_mutex);
+
+    size_t deleted = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (erase_unsafe(keys[indexes[i]]))
+            deleted_indexes[deleted++] = indexes[i];
+    }
+    return deleted;
+}
+
+void ReadOptimizedDataStore::set_memory_limit(size_t max_memory, eviction_policy_t policy)
+{
+    std::unique_lock lock(m_write_mutex);
+    m_max_memory = max_memory;
+    m_policy = policy;
+}
+
+void ReadOptimizedDataStore::set_numa_node(int node)
+{
+    std::unique_lock lock(m_write_mutex);
+    m_numa_node = node;
+
+    // The first table is small, and is moved rather than replaced
+    RoTable* table = m_table.load(std::memory_order_relaxed);
+    bind_memory_to_node(table->m_slots, (table->m_mask + 1) * sizeof(std::atomic<RoEntry*>), node);
+}
+
+size_t ReadOptimizedDataStore::get_used_memory()
+{
+    return m_used_memory.load(std::memory_order_relaxed);
+}
+
+std::uint64_t ReadOptimizedDataStore::get_num_evicted()
+{
+    return m_num_evicted.load(std::memory_order_relaxed);
+}
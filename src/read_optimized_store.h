@@ -0,0 +1,554 @@
+#ifndef READ_OPTIMIZED_STORE_H_
+#define READ_OPTIMIZED_STORE_H_
+
+#include "data_store.h"
+
+/**
+ * @brief maximum number of threads that can read from read optimized
+ * data stores at the same time
+ *
+ */
+#define MAX_EPOCH_THREADS 1024
+
+/**
+ * @brief Epoch based memory reclamation
+ *
+ * Readers of a ReadOptimizedDataStore take no locks, so a writer can
+ * never free an entry or a table directly, a reader may still be
+ * looking at it. Instead, every reader announces the global epoch in
+ * its own per-thread record while it is reading, and writers retire
+ * the memory they unlink along with the epoch at which they did it.
+ *
+ * The global epoch can only move forward once every active reader
+ * has announced the current epoch. Memory retired at epoch e is
+ * therefore no longer reachable by any reader once the global epoch
+ * has reached e + 2.
+ *
+ * Announcing only writes to the reader's own cache line, readers
+ * never write to memory shared with other threads.
+ *
+ */
+class EpochManager
+{
+public:
+    /**
+     * @brief announced epoch of a thread that is not reading
+     *
+     */
+    static constexpr std::uint64_t EPOCH_INACTIVE = UINT64_MAX;
+
+    /**
+     * @brief Per-thread record, each on its own cache line
+     *
+     */
+    struct alignas(CACHE_LINE_SIZE) ThreadRecord
+    {
+        /**
+         * @brief the epoch announced by the thread, EPOCH_INACTIVE
+         * if it is not reading
+         *
+         */
+        std::atomic<std::uint64_t>      m_epoch;
+
+        /**
+         * @brief whether a thread owns this record
+         *
+         */
+        std::atomic<bool>               m_in_use;
+
+        /**
+         * @brief nesting depth of enter(), only touched by the owner
+         *
+         */
+        int                             m_nesting;
+    };
+
+    /**
+     * @brief the global epoch
+     *
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<std::uint64_t>  m_global_epoch;
+
+    /**
+     * @brief records [0, m_num_records) may be in use
+     *
+     */
+    std::atomic<int>                                    m_num_records;
+
+    /**
+     * @brief the per-thread records
+     *
+     */
+    ThreadRecord                                        m_records[MAX_EPOCH_THREADS];
+
+    EpochManager();
+
+    /**
+     * @brief the process wide epoch manager
+     *
+     * @return EpochManager& the epoch manager
+     */
+    static EpochManager& instance();
+
+    /**
+     * @brief start reading, memory reachable from here on will not
+     * be freed until exit() is called
+     *
+     */
+    void enter();
+
+    /**
+     * @brief stop reading
+     *
+     */
+    void exit();
+
+    /**
+     * @brief the epoch at which memory retired now must be tagged
+     *
+     * @return std::uint64_t the global epoch
+     */
+    std::uint64_t current_epoch()
+    {
+        return m_global_epoch.load(std::memory_order_seq_cst);
+    }
+
+    /**
+     * @brief move the global epoch forward if every active reader
+     * has caught up with it
+     *
+     * @return std::uint64_t the global epoch after the attempt
+     */
+    std::uint64_t try_advance();
+
+    /**
+     * @brief get the record of the calling thread, claiming one
+     * when the thread reads for the first time
+     *
+     * @return ThreadRecord* the record of the calling thread
+     */
+    ThreadRecord* get_thread_record();
+};
+
+/**
+ * @brief RAII helper that calls EpochManager::enter() and exit()
+ *
+ */
+class EpochGuard
+{
+public:
+    EpochGuard() { EpochManager::instance().enter(); }
+    ~EpochGuard() { EpochManager::instance().exit(); }
+};
+
+/**
+ * @brief An immutable key-value pair. The key and the value are
+ * stored right after this header, in a single allocation.
+ *
+ * Entries are never modified once they are published, a SET or a
+ * change of the expiry time replaces the entry. The only exception is
+ * m_timer_at, which readers never look at.
+ *
+ */
+struct RoEntry
+{
+    /**
+     * @brief hash_key() of the key
+     *
+     */
+    size_t                  m_hash;
+
+    /**
+     * @brief unix time in ms at which the key expires, or EXPIRE_NEVER
+     *
+     */
+    std::int64_t            m_expire_at;
+
+    /**
+     * @brief the time of the timer that will look at the key next,
+     * EXPIRE_NEVER if there is none. Only used by writers, with the
+     * write mutex held.
+     *
+     */
+    std::int64_t            m_timer_at;
+
+    /**
+     * @brief length of the key
+     *
+     */
+    std::uint32_t           m_key_length;
+
+    /**
+     * @brief length of the value
+     *
+     */
+    std::uint32_t           m_value_length;
+
+    /**
+     * @brief the key
+     *
+     * @return std::string_view the key
+     */
+    std::string_view key() const
+    {
+        return std::string_view(
+                    reinterpret_cast<const char*>(this + 1),
+                    m_key_length);
+    }
+
+    /**
+     * @brief the value
+     *
+     * @return std::string_view the value
+     */
+    std::string_view value() const
+    {
+        return std::string_view(
+                    reinterpret_cast<const char*>(this + 1) + m_key_length,
+                    m_value_length);
+    }
+
+    /**
+     * @brief the size of the entry
+     *
+     * @return size_t the bytes allocated for it
+     */
+    size_t get_size() const
+    {
+        return sizeof(RoEntry) + m_key_length + m_value_length;
+    }
+
+    /**
+     * @brief allocate an entry
+     *
+     * @param key the key
+     * @param value the value
+     * @param expire_at unix time in ms at which the key expires, or
+     * EXPIRE_NEVER
+     * @return RoEntry* the entry, or nullptr if out of memory
+     */
+    static RoEntry* create(
+        const HashedKey& key,
+        std::string_view value,
+        std::int64_t expire_at);
+
+    /**
+     * @brief free an entry, in the form used for retired memory
+     *
+     * @param p the entry
+     */
+    static void destroy(void* p);
+};
+
+/**
+ * @brief An open addressing table of entries, with linear probing
+ *
+ */
+struct RoTable
+{
+    /**
+     * @brief number of slots - 1, the number of slots is a power of two
+     *
+     */
+    size_t                      m_mask;
+
+    /**
+     * @brief the slots, each is empty, a tombstone, or an entry
+     *
+     */
+    std::atomic<RoEntry*>*      m_slots;
+
+    /**
+     * @brief allocate an empty table
+     *
+     * @param capacity number of slots, must be a power of two
+     * @param numa_node the node the slots come from, -1 for any
+     * @return RoTable* the table, or nullptr if out of memory
+     */
+    static RoTable* create(size_t capacity, int numa_node = -1);
+
+    /**
+     * @brief free a table, but not the entries in it, in the form
+     * used for retired memory
+     *
+     * @param p the table
+     */
+    static void destroy(void* p);
+};
+
+/**
+ * @brief A data store for read-mostly workloads
+ *
+ * Readers take no locks, and do not write to any memory shared with
+ * other threads. The table is an open addressing table of pointers
+ * to immutable entries. Writers are serialized by a mutex, and
+ * publish new entries, tombstones and resized tables with single
+ * atomic stores. Memory they unlink is freed through the
+ * EpochManager once no reader can see it any more.
+ *
+ * With a memory limit, writers evict a key picked at random among a
+ * few sampled ones, expired keys first. Whatever the eviction policy,
+ * readers do not record their accesses, so that reading stays free of
+ * shared writes.
+ *
+ * It has the same interface as DataStore, and the orchestrator can
+ * use either.
+ *
+ */
+class alignas(CACHE_LINE_SIZE) ReadOptimizedDataStore: public DataStoreInterface
+{
+private:
+    /**
+     * @brief memory that was unlinked, and will be freed once no
+     * reader can see it
+     *
+     */
+    struct RetiredObject
+    {
+        void*               m_ptr;
+        void                (*m_destroy)(void*);
+        std::uint64_t       m_epoch;
+    };
+
+    /**
+     * @brief the current table, read by all readers
+     *
+     */
+    std::atomic<RoTable*>                           m_table;
+
+    /**
+     * @brief serializes the writers, on its own cache line so that
+     * taking it does not disturb the readers of m_table
+     *
+     */
+    alignas(CACHE_LINE_SIZE) std::mutex             m_write_mutex;
+
+    /**
+     * @brief number of live entries
+     *
+     */
+    size_t                                          m_num_entries;
+
+    /**
+     * @brief number of slots that are not empty, live entries and
+     * tombstones
+     *
+     */
+    size_t                                          m_num_used;
+
+    /**
+     * @brief retired memory that has not been freed yet
+     *
+     */
+    std::vector<RetiredObject>                      m_retired;
+
+    /**
+     * @brief the timers of the keys that expire, used with the write
+     * mutex held
+     *
+     */
+    TimerWheel                                      m_timers;
+
+    /**
+     * @brief bytes of the live entries and of the current table,
+     * updated by writers and read by get_used_memory()
+     *
+     */
+    std::atomic<size_t>                             m_used_memory;
+
+    /**
+     * @brief the memory limit, 0 if there is none
+     *
+     */
+    size_t                                          m_max_memory;
+
+    eviction_policy_t                               m_policy;
+
+    std::atomic<std::uint64_t>                      m_num_evicted;
+
+    /**
+     * @brief the node the tables come from, -1 for any. The entries
+     * come from the node of the thread that writes them.
+     *
+     */
+    int                                             m_numa_node;
+
+    /**
+     * @brief find the entry for a key
+     *
+     * The caller must either be inside an EpochGuard or hold the
+     * write mutex.
+     *
+     * @param key the key
+     * @return RoEntry* the entry, or nullptr if the key is not present
+     */
+    RoEntry* find(const HashedKey& key);
+
+    /**
+     * @brief make sure a timer looks at an entry by its expiry time
+     * Write mutex must be held by the caller.
+     *
+     * @param entry the entry
+     */
+    void schedule_unsafe(RoEntry* entry);
+
+    /**
+     * @brief publish an entry, replacing the one of the same key if any
+     * Write mutex must be held by the caller.
+     *
+     * @param new_entry the entry, owned by the table from now on, and
+     * freed if it cannot be inserted
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool insert_unsafe(RoEntry* new_entry);
+
+    /**
+     * @brief unlink the entry of a key
+     * Write mutex must be held by the caller.
+     *
+     * @param key the key
+     * @return true if the key was present, and had not expired
+     * @return false otherwise
+     */
+    bool erase_unsafe(const HashedKey& key);
+
+    /**
+     * @brief unlink the entry in a slot of the current table
+     * Write mutex must be held by the caller.
+     *
+     * @param index the slot, which holds an entry
+     */
+    void unlink_unsafe(size_t index);
+
+    /**
+     * @brief evict keys until there is room for more bytes
+     * Write mutex must be held by the caller.
+     *
+     * @param needed the bytes about to be allocated
+     * @return true if they fit within the memory limit
+     * @return false otherwise
+     */
+    bool make_room_unsafe(size_t needed);
+
+    /**
+     * @brief publish a new entry, after making room for it
+     * Write mutex must be held by the caller.
+     *
+     * @param new_entry the entry, owned by the table from now on, and
+     * freed if it cannot be inserted
+     * @return true on success
+     * @return false if out of memory, or over the memory limit
+     */
+    bool store_unsafe(RoEntry* new_entry);
+
+    /**
+     * @brief replace the table by one with room for more entries
+     * Write mutex must be held by the caller.
+     *
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool grow_unsafe();
+
+    /**
+     * @brief hand over unlinked memory to be freed later
+     * Write mutex must be held by the caller.
+     *
+     * @param p the memory
+     * @param destroy function that frees it
+     */
+    void retire_unsafe(void* p, void (*destroy)(void*));
+
+    /**
+     * @brief free the retired memory that no reader can see any more
+     * Write mutex must be held by the caller.
+     *
+     */
+    void reclaim_unsafe();
+
+public:
+    using DataStoreInterface::set;
+    using DataStoreInterface::del;
+    using DataStoreInterface::get;
+
+    ReadOptimizedDataStore();
+
+    ~ReadOptimizedDataStore();
+
+    bool set(const HashedKey& key, std::string_view value, std::int64_t expire_at);
+
+    bool del(const HashedKey& key);
+
+    std::tuple<bool, std::string> get(const HashedKey& key);
+
+    bool visit_value(
+        const HashedKey& key,
+        value_visitor_t visitor,
+        void* context);
+
+    bool set_expiry(
+        const HashedKey& key,
+        std::int64_t expire_at,
+        std::int64_t& previous);
+
+    bool get_expiry(const HashedKey& key, std::int64_t& expire_at);
+
+    size_t reclaim_expired(
+        std::int64_t now,
+        size_t budget,
+        size_t& num_expired);
+
+    size_t scan(
+        size_t cursor,
+        size_t count,
+        entry_visitor_t visitor,
+        void* context);
+
+    size_t visit_values(
+        const HashedKey* keys,
+        const std::uint32_t* indexes,
+        size_t count,
+        indexed_value_visitor_t visitor,
+        void* context);
+
+    size_t set_values(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* set_indexes);
+
+    void lock_writes();
+
+    void unlock_writes();
+
+    bool make_room_for_values_unsafe(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count);
+
+    size_t set_values_unsafe(
+        const HashedKey* keys,
+        const std::string_view* values,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* set_indexes);
+
+    size_t del_keys(
+        const HashedKey* keys,
+        const std::uint32_t* indexes,
+        size_t count,
+        std::uint32_t* deleted_indexes);
+
+    void set_memory_limit(size_t max_memory, eviction_policy_t policy);
+
+    void set_numa_node(int node);
+
+    size_t get_used_memory();
+
+    std::uint64_t get_num_evicted();
+};
+
+#endif /* #ifndef READ_OPTIMIZED_STORE_H_ */
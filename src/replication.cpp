@@ -0,0 +1,815 @@
+#include "replication.h"
+#include "append_log.h"
+#include "snapshot.h"
+#include "logger.h"
+#include <cstring>
+#include <random>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+bool write_full(int fd, const void* data, size_t size)
+{
+    const char* p = static_cast<const char*>(data);
+    while (size)
+    {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_full(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    while (size)
+    {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+int connect_to_host(const std::string& host, int port, int timeout_ms)
+{
+    struct addrinfo hints;
+    struct addrinfo* addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    std::string service = std::to_string(port);
+    int rc = getaddrinfo(host.c_str(), service.c_str(), &hints, &addresses);
+    if (rc)
+    {
+        LOG_WARN("Cannot resolve " << host << ": " << gai_strerror(rc));
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo* address = addresses; address && fd < 0; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        // Bounds the connect(), the host may be unreachable
+        struct timeval timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, address->ai_addr, address->ai_addrlen))
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (fd >= 0)
+    {
+        int opt = 1;
+        struct timeval no_timeout = {0, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &no_timeout, sizeof(no_timeout));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+    }
+    return fd;
+}
+
+/**
+ * @brief a deadline some milliseconds from now, on the monotonic clock
+ *
+ */
+static struct timespec get_deadline(int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+static void init_monotonic_cond(pthread_cond_t* cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+ReplicationBacklog::ReplicationBacklog(size_t size):
+    m_ring(nullptr),
+    m_size(size),
+    m_end(0),
+    m_mutex(PTHREAD_MUTEX_INITIALIZER),
+    m_is_stopping(false)
+{
+    init_monotonic_cond(&m_cond);
+}
+
+ReplicationBacklog::~ReplicationBacklog()
+{
+    delete[] m_ring;
+    pthread_cond_destroy(&m_cond);
+}
+
+bool ReplicationBacklog::init()
+{
+    if (!m_ring)
+        m_ring = new (std::nothrow) char[m_size];
+    if (!m_ring)
+    {
+        LOG_ERROR("Out of memory for a replication backlog of " << m_size << " bytes");
+        return false;
+    }
+    return true;
+}
+
+void ReplicationBacklog::append(std::string_view data)
+{
+    pthread_mutex_lock(&m_mutex);
+
+    // Only the end of a batch larger than the ring is kept
+    std::uint64_t end = m_end + data.size();
+    if (data.size() > m_size)
+        data.remove_prefix(data.size() - m_size);
+
+    size_t position = (end - data.size()) % m_size;
+    size_t first = std::min(data.size(), m_size - position);
+    memcpy(m_ring + position, data.data(), first);
+    memcpy(m_ring, data.data() + first, data.size() - first);
+
+    m_end = end;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+ssize_t ReplicationBacklog::read(std::uint64_t offset, char* buffer, size_t size, int timeout_ms)
+{
+    pthread_mutex_lock(&m_mutex);
+    if (offset == m_end && !m_is_stopping)
+    {
+        struct timespec deadline = get_deadline(timeout_ms);
+        while (offset == m_end && !m_is_stopping)
+        {
+            if (ETIMEDOUT == pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+                break;
+        }
+    }
+
+    ssize_t n = -1;
+    std::uint64_t start = m_end > m_size ? m_end - m_size : 0;
+    if (offset >= start && offset <= m_end)
+    {
+        n = std::min((std::uint64_t)size, m_end - offset);
+        size_t position = offset % m_size;
+        size_t first = std::min((size_t)n, m_size - position);
+        memcpy(buffer, m_ring + position, first);
+        memcpy(buffer + first, m_ring, n - first);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return n;
+}
+
+void ReplicationBacklog::stop()
+{
+    pthread_mutex_lock(&m_mutex);
+    m_is_stopping = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+}
+
+std::uint64_t ReplicationBacklog::get_start_offset()
+{
+    pthread_mutex_lock(&m_mutex);
+    std::uint64_t start = m_end > m_size ? m_end - m_size : 0;
+    pthread_mutex_unlock(&m_mutex);
+    return start;
+}
+
+std::uint64_t ReplicationBacklog::get_end_offset()
+{
+    pthread_mutex_lock(&m_mutex);
+    std::uint64_t end = m_end;
+    pthread_mutex_unlock(&m_mutex);
+    return end;
+}
+
+ReplicationPrimary::ReplicationPrimary(
+    int port,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    ReplicationBacklog* backlog):
+    m_datastores(datastores),
+    m_num_datastores(num_datastores),
+    m_backlog(backlog),
+    m_port(port),
+    m_listen_fd(-1),
+    m_run_id(0),
+    m_is_stopping(false),
+    m_is_running(false),
+    m_thread_id(),
+    m_num_full_syncs(0),
+    m_num_partial_syncs(0)
+{
+    // Never 0, which asks for a full sync
+    std::random_device seed;
+    while (!m_run_id)
+        m_run_id = ((std::uint64_t)seed() << 32) | seed();
+}
+
+bool ReplicationPrimary::start()
+{
+    int retval;
+    int opt = 1;
+    struct sockaddr_in address;
+
+    if (m_is_running)
+        return true;
+
+    m_listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_listen_fd < 0)
+    {
+        LOG_ERROR("Could not create the replication socket, errno = " << errno);
+        return false;
+    }
+
+    setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(m_port);
+    if (bind(m_listen_fd, (struct sockaddr*)&address, sizeof(address)) || \
+        listen(m_listen_fd, 10))
+    {
+        LOG_ERROR("Cannot listen on replication port " << m_port << ", errno = " << errno);
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        return false;
+    }
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        ReplicationPrimary::accept_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        return false;
+    }
+
+    m_is_running = true;
+    LOG_INFO("Replicas are served on port " << m_port);
+    return true;
+}
+
+void ReplicationPrimary::stop()
+{
+    if (!m_is_running)
+        return;
+
+    // Ends the accept(), and the reads and writes of the senders
+    m_is_stopping = true;
+    shutdown(m_listen_fd, SHUT_RDWR);
+    pthread_join(m_thread_id, nullptr);
+    close(m_listen_fd);
+    m_listen_fd = -1;
+
+    std::unique_lock lock(m_replicas_mutex);
+    for (auto& replica: m_replicas)
+        shutdown(replica.m_fd, SHUT_RDWR);
+    for (auto& replica: m_replicas)
+    {
+        pthread_join(replica.m_thread_id, nullptr);
+        close(replica.m_fd);
+    }
+    m_replicas.clear();
+    m_is_running = false;
+}
+
+void ReplicationPrimary::reap_unsafe()
+{
+    for (auto it = m_replicas.begin(); it != m_replicas.end();)
+    {
+        if (!it->m_is_done)
+        {
+            ++it;
+            continue;
+        }
+
+        pthread_join(it->m_thread_id, nullptr);
+        close(it->m_fd);
+        it = m_replicas.erase(it);
+    }
+}
+
+void ReplicationPrimary::accept_loop()
+{
+    while (!m_is_stopping)
+    {
+        struct sockaddr_in address;
+        socklen_t address_length = sizeof(address);
+        int fd = accept4(m_listen_fd, (struct sockaddr*)&address, &address_length, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (EINTR == errno || ECONNABORTED == errno)
+                continue;
+            if (!m_is_stopping)
+                LOG_ERROR("Replication accept failed, errno = " << errno);
+            break;
+        }
+
+        int opt = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt));
+
+        char host[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+
+        std::unique_lock lock(m_replicas_mutex);
+        reap_unsafe();
+        try
+        {
+            m_replicas.emplace_back();
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            close(fd);
+            continue;
+        }
+
+        Replica& replica = m_replicas.back();
+        replica.m_primary = this;
+        replica.m_fd = fd;
+        replica.m_address = std::string(host) + ":" + std::to_string(ntohs(address.sin_port));
+        replica.m_offset = 0;
+        replica.m_is_done = false;
+        if (pthread_create(&replica.m_thread_id, NULL, serve_start_routine, &replica))
+        {
+            LOG_ERROR("Cannot start a sender for replica " << replica.m_address);
+            close(fd);
+            m_replicas.pop_back();
+        }
+    }
+}
+
+void* ReplicationPrimary::accept_start_routine(void* arg)
+{
+    static_cast<ReplicationPrimary*>(arg)->accept_loop();
+    return nullptr;
+}
+
+void* ReplicationPrimary::serve_start_routine(void* arg)
+{
+    Replica& replica = *static_cast<Replica*>(arg);
+    replica.m_primary->serve(replica);
+    replica.m_is_done = true;
+    return nullptr;
+}
+
+bool ReplicationPrimary::send_snapshot(int fd, std::uint64_t offset)
+{
+    std::int64_t start = unix_time_ms();
+    int snapshot_fd = memfd_create("replication-snapshot", MFD_CLOEXEC);
+    if (snapshot_fd < 0)
+    {
+        LOG_ERROR("memfd_create failed, errno = " << errno);
+        return false;
+    }
+
+    std::uint64_t num_keys;
+    std::uint64_t num_bytes;
+    bool is_ok = write_snapshot(snapshot_fd, m_datastores, m_num_datastores, start, num_keys, num_bytes);
+
+    ReplicationHeader header;
+    memcpy(header.m_magic, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE);
+    header.m_run_id = m_run_id;
+    header.m_offset = offset;
+    header.m_snapshot_size = num_bytes;
+    is_ok = is_ok && write_full(fd, &header, sizeof(header));
+
+    off_t position = 0;
+    while (is_ok && (std::uint64_t)position < num_bytes)
+    {
+        ssize_t n = sendfile(fd, snapshot_fd, &position, num_bytes - position);
+        if (n < 0 && EINTR == errno)
+            continue;
+        is_ok = n > 0;
+    }
+    close(snapshot_fd);
+
+    if (is_ok)
+        LOG_INFO("Sent a snapshot of " << num_keys << " keys to a replica in " \
+            << unix_time_ms() - start << "ms");
+    return is_ok;
+}
+
+void ReplicationPrimary::serve(Replica& replica)
+{
+    ReplicationRequest request;
+    if (!read_full(replica.m_fd, &request, sizeof(request)) || \
+        memcmp(request.m_magic, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE))
+    {
+        LOG_WARN("Bad replication request from " << replica.m_address);
+        return;
+    }
+
+    // The offset is taken before the walk of the snapshot, so the
+    // stream has every write the walk may miss
+    std::uint64_t offset = m_backlog->get_end_offset();
+    bool is_partial = request.m_run_id == m_run_id && \
+        request.m_offset >= m_backlog->get_start_offset() && \
+        request.m_offset <= offset;
+    if (is_partial)
+    {
+        offset = request.m_offset;
+        ReplicationHeader header;
+        memcpy(header.m_magic, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE);
+        header.m_run_id = m_run_id;
+        header.m_offset = offset;
+        header.m_snapshot_size = 0;
+        if (!write_full(replica.m_fd, &header, sizeof(header)))
+            return;
+        m_num_partial_syncs++;
+        LOG_INFO("Replica " << replica.m_address << " goes on from offset " << offset);
+    }
+    else
+    {
+        if (!send_snapshot(replica.m_fd, offset))
+        {
+            LOG_WARN("Cannot send a snapshot to replica " << replica.m_address);
+            return;
+        }
+        m_num_full_syncs++;
+    }
+
+    char* buffer = new (std::nothrow) char[REPLICATION_SEND_SIZE];
+    if (!buffer)
+    {
+        LOG_ERROR("Out of memory");
+        return;
+    }
+
+    while (!m_is_stopping)
+    {
+        replica.m_offset = offset;
+        ssize_t n = m_backlog->read(offset, buffer, REPLICATION_SEND_SIZE, REPLICATION_POLL_MS);
+        if (n < 0)
+        {
+            LOG_WARN("Replica " << replica.m_address << " fell behind the backlog, " \
+                "it must sync again");
+            break;
+        }
+
+        if (n && !write_full(replica.m_fd, buffer, n))
+        {
+            LOG_INFO("Replica " << replica.m_address << " is gone");
+            break;
+        }
+        offset += n;
+    }
+    delete[] buffer;
+}
+
+std::vector<std::pair<std::string, std::uint64_t>> ReplicationPrimary::get_replicas()
+{
+    std::vector<std::pair<std::string, std::uint64_t>> replicas;
+    std::unique_lock lock(m_replicas_mutex);
+    for (auto& replica: m_replicas)
+    {
+        if (!replica.m_is_done)
+            replicas.emplace_back(replica.m_address, replica.m_offset.load());
+    }
+    return replicas;
+}
+
+ReplicationReplica::ReplicationReplica(
+    const std::string& host,
+    int port,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    const std::string& sync_path):
+    m_datastores(datastores),
+    m_num_datastores(num_datastores),
+    m_host(host),
+    m_port(port),
+    m_sync_path(sync_path),
+    m_run_id(0),
+    m_fd(-1),
+    m_mutex(PTHREAD_MUTEX_INITIALIZER),
+    m_is_stopping(false),
+    m_is_running(false),
+    m_thread_id(),
+    m_is_connected(false),
+    m_offset(0),
+    m_num_full_syncs(0),
+    m_num_applied(0)
+{
+    init_monotonic_cond(&m_cond);
+}
+
+bool ReplicationReplica::start()
+{
+    int retval;
+
+    if (m_is_running)
+        return true;
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        ReplicationReplica::thread_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void ReplicationReplica::stop()
+{
+    if (!m_is_running)
+        return;
+
+    pthread_mutex_lock(&m_mutex);
+    m_is_stopping = true;
+    int fd = m_fd;
+    if (fd >= 0)
+        shutdown(fd, SHUT_RDWR);
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread_id, nullptr);
+    m_is_running = false;
+}
+
+int ReplicationReplica::connect_to_primary()
+{
+    return connect_to_host(m_host, m_port, REPLICATION_RETRY_MS);
+}
+
+/**
+ * @brief the entry_visitor_t that collects the keys of a data store
+ *
+ */
+static void collect_key(std::string_view key, std::string_view value, std::int64_t expire_at, void* context)
+{
+    try
+    {
+        static_cast<std::vector<std::string>*>(context)->emplace_back(key);
+    }
+    catch (...)
+    {
+    }
+}
+
+void ReplicationReplica::clear_datastores()
+{
+    // Keys are collected first, deleting in the middle of a walk could
+    // move others behind the cursor
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < m_num_datastores; i++)
+    {
+        do
+        {
+            keys.clear();
+            size_t cursor = 0;
+            do
+            {
+                cursor = m_datastores[i]->scan(cursor, SNAPSHOT_SCAN_BUCKETS, collect_key, &keys);
+            } while (cursor);
+
+            for (auto& key: keys)
+                m_datastores[i]->del(HashedKey(key));
+        } while (!keys.empty());
+    }
+}
+
+int ReplicationReplica::receive_snapshot(int fd, std::uint64_t size)
+{
+    int snapshot_fd = m_sync_path.empty() ?
+        memfd_create("replication-sync", MFD_CLOEXEC) :
+        open(m_sync_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (snapshot_fd < 0)
+    {
+        LOG_ERROR("Cannot create a file for the snapshot of the primary, errno = " << errno);
+        return -1;
+    }
+
+    bool is_ok = true;
+    char buffer[64 * 1024];
+    while (is_ok && size)
+    {
+        ssize_t n = recv(fd, buffer, std::min(size, (std::uint64_t)sizeof(buffer)), 0);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+        {
+            LOG_WARN("The primary closed the link during the snapshot");
+            is_ok = false;
+            break;
+        }
+        size -= n;
+
+        for (ssize_t done = 0; is_ok && done < n; )
+        {
+            ssize_t written = write(snapshot_fd, buffer + done, n - done);
+            if (written < 0 && EINTR == errno)
+                continue;
+            if (written <= 0)
+            {
+                LOG_ERROR("Cannot write the snapshot of the primary, errno = " << errno);
+                is_ok = false;
+            }
+            else
+                done += written;
+        }
+    }
+
+    if (!is_ok)
+    {
+        close(snapshot_fd);
+        if (!m_sync_path.empty())
+            unlink(m_sync_path.c_str());
+        return -1;
+    }
+    return snapshot_fd;
+}
+
+void ReplicationReplica::sync(int fd)
+{
+    ReplicationRequest request;
+    memcpy(request.m_magic, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE);
+    request.m_run_id = m_run_id;
+    request.m_offset = m_offset;
+
+    ReplicationHeader header;
+    if (!write_full(fd, &request, sizeof(request)) || \
+        !read_full(fd, &header, sizeof(header)) || \
+        memcmp(header.m_magic, REPLICATION_MAGIC, REPLICATION_MAGIC_SIZE))
+    {
+        LOG_WARN("Replication handshake with " << m_host << ":" << m_port << " failed");
+        return;
+    }
+
+    if (header.m_snapshot_size)
+    {
+        std::int64_t start = unix_time_ms();
+        int snapshot_fd = receive_snapshot(fd, header.m_snapshot_size);
+        if (snapshot_fd < 0)
+            return;
+
+        // Not in sync with anything until the snapshot is loaded
+        m_run_id = 0;
+        clear_datastores();
+        size_t num_loaded;
+        bool is_ok = load_snapshot_fd(snapshot_fd, m_host + ":" + std::to_string(m_port), \
+                        m_datastores, m_num_datastores, num_loaded);
+        close(snapshot_fd);
+        if (!m_sync_path.empty())
+            unlink(m_sync_path.c_str());
+        if (!is_ok)
+            return;
+        m_num_full_syncs++;
+        LOG_INFO("Full sync with the primary done in " << unix_time_ms() - start << "ms");
+    }
+
+    m_run_id = header.m_run_id;
+    m_offset = header.m_offset;
+    m_is_connected = true;
+
+    // A record may be split between two reads, its start waits in the
+    // buffer for the rest
+    std::string input;
+    size_t consumed = 0;
+    char buffer[64 * 1024];
+    while (!m_is_stopping)
+    {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            break;
+
+        try
+        {
+            input.append(buffer, n);
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            break;
+        }
+
+        std::int64_t now = unix_time_ms();
+        const char* p = input.data() + consumed;
+        const char* end = input.data() + input.size();
+        int rc = 1;
+        while (p < end)
+        {
+            const char* begin = p;
+            LogRecord record;
+            rc = decode_log_record(p, end, record);
+            if (rc <= 0)
+            {
+                p = begin;
+                break;
+            }
+
+            HashedKey key(record.m_key);
+            apply_log_record(m_datastores[get_partition(key, m_num_datastores)], key, record, now);
+            m_num_applied++;
+        }
+
+        m_offset += p - (input.data() + consumed);
+        consumed = p - input.data();
+        if (rc < 0)
+        {
+            LOG_ERROR("Bad record in the replication stream, syncing again");
+            m_run_id = 0;
+            break;
+        }
+
+        if (consumed == input.size())
+        {
+            input.clear();
+            consumed = 0;
+        }
+        else if (consumed > input.size() / 2)
+        {
+            input.erase(0, consumed);
+            consumed = 0;
+        }
+    }
+    m_is_connected = false;
+}
+
+void ReplicationReplica::loop()
+{
+    while (!m_is_stopping)
+    {
+        int fd = connect_to_primary();
+        if (fd >= 0)
+        {
+            pthread_mutex_lock(&m_mutex);
+            m_fd = fd;
+            pthread_mutex_unlock(&m_mutex);
+
+            if (!m_is_stopping)
+            {
+                LOG_INFO("Connected to primary " << m_host << ":" << m_port);
+                sync(fd);
+                if (!m_is_stopping)
+                    LOG_WARN("Lost the link with primary " << m_host << ":" << m_port);
+            }
+
+            pthread_mutex_lock(&m_mutex);
+            m_fd = -1;
+            pthread_mutex_unlock(&m_mutex);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&m_mutex);
+        struct timespec deadline = get_deadline(REPLICATION_RETRY_MS);
+        while (!m_is_stopping)
+        {
+            if (ETIMEDOUT == pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+                break;
+        }
+        pthread_mutex_unlock(&m_mutex);
+    }
+}
+
+void* ReplicationReplica::thread_start_routine(void* arg)
+{
+    static_cast<ReplicationReplica*>(arg)->loop();
+    return nullptr;
+}
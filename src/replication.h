@@ -0,0 +1,489 @@
+#ifndef REPLICATION_H_
+#define REPLICATION_H_
+
+#include "common_include.h"
+#include "data_store.h"
+#include <pthread.h>
+#include <ctime>
+#include <list>
+
+/**
+ * @brief identifies the replication protocol, at the start of the
+ * request of a replica and of the reply of the primary
+ *
+ */
+#define REPLICATION_MAGIC "KVREPL01"
+#define REPLICATION_MAGIC_SIZE 8
+
+/**
+ * @brief default size of the backlog of writes kept for the replicas
+ *
+ */
+#define DEFAULT_REPL_BACKLOG_SIZE (16 * 1024 * 1024)
+
+/**
+ * @brief the most bytes of the backlog sent to a replica at once
+ *
+ */
+#define REPLICATION_SEND_SIZE (256 * 1024)
+
+/**
+ * @brief time a sender waits for new writes before it looks at
+ * whether it must stop, in milliseconds
+ *
+ */
+#define REPLICATION_POLL_MS 100
+
+/**
+ * @brief time between two attempts of a replica to reach its primary,
+ * in milliseconds
+ *
+ */
+#define REPLICATION_RETRY_MS 1000
+
+/**
+ * @brief write all of a buffer to a socket
+ *
+ * @return true on success
+ * @return false if the socket is closed or fails
+ */
+bool write_full(int fd, const void* data, size_t size);
+
+/**
+ * @brief read exactly a number of bytes from a socket
+ *
+ * @return true on success
+ * @return false if the socket is closed first, or fails
+ */
+bool read_full(int fd, void* data, size_t size);
+
+/**
+ * @brief connect to a TCP port, with TCP_NODELAY and keepalives
+ *
+ * @param host the name or address of the host
+ * @param port the port
+ * @param timeout_ms the longest a connection attempt may take
+ * @return int the socket, -1 on failure
+ */
+int connect_to_host(const std::string& host, int port, int timeout_ms);
+
+/**
+ * @brief What a replica sends once connected
+ *
+ * A replica that was already in sync with the run of the primary
+ * asks to go on from its offset. The primary then sends only the
+ * writes that followed, if they are still in its backlog.
+ *
+ */
+struct ReplicationRequest
+{
+    char                    m_magic[REPLICATION_MAGIC_SIZE];
+
+    /**
+     * @brief the run of the primary the replica was in sync with, 0
+     * for a full sync
+     *
+     */
+    std::uint64_t           m_run_id;
+
+    /**
+     * @brief offset in the stream of writes of the next byte the
+     * replica needs
+     *
+     */
+    std::uint64_t           m_offset;
+};
+
+/**
+ * @brief What the primary replies, followed by a snapshot of
+ * m_snapshot_size bytes, and then by the stream of writes from
+ * m_offset on
+ *
+ * The writes are append log records, see AppendLog. The snapshot
+ * does not need to be a single point in time: the writes from
+ * m_offset on are applied on top of it, in order for every key, and
+ * they include every write that the snapshot may have missed.
+ *
+ */
+struct ReplicationHeader
+{
+    char                    m_magic[REPLICATION_MAGIC_SIZE];
+    std::uint64_t           m_run_id;
+    std::uint64_t           m_offset;
+
+    /**
+     * @brief size of the snapshot, 0 when the replica goes on from
+     * its offset
+     *
+     */
+    std::uint64_t           m_snapshot_size;
+};
+
+/**
+ * @brief The most recent writes, as a ring of append log records
+ *
+ * The append log flusher appends every batch of records, and every
+ * sender reads from its own offset. Offsets count the bytes appended
+ * since the start; a sender whose offset fell out of the ring must
+ * start over with a full sync.
+ *
+ */
+class ReplicationBacklog
+{
+private:
+    char*                                   m_ring;
+    size_t                                  m_size;
+
+    /**
+     * @brief offset after the last byte appended
+     *
+     */
+    std::uint64_t                           m_end;
+
+    /**
+     * @brief guards the ring, used with m_cond, on the monotonic clock,
+     * to wait for new writes
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+    bool                                    m_is_stopping;
+
+public:
+    /**
+     * @brief create a backlog, init() allocates it
+     *
+     * @param size the size of the ring
+     */
+    explicit ReplicationBacklog(size_t size);
+
+    ~ReplicationBacklog();
+
+    /**
+     * @brief allocate the ring
+     *
+     * @return true on success
+     */
+    bool init();
+
+    /**
+     * @brief append records, and wake the senders up
+     *
+     * @param data whole records
+     */
+    void append(std::string_view data);
+
+    /**
+     * @brief copy bytes from an offset, waiting for them if there are
+     * none yet
+     *
+     * @param offset the offset of the first byte
+     * @param buffer where to copy them
+     * @param size the most bytes to copy
+     * @param timeout_ms the longest wait
+     * @return ssize_t the number of bytes copied, 0 if there are none
+     * yet or the backlog is stopping, -1 if the offset is not in the
+     * backlog anymore
+     */
+    ssize_t read(std::uint64_t offset, char* buffer, size_t size, int timeout_ms);
+
+    /**
+     * @brief wake the readers up, and stop them from waiting
+     *
+     */
+    void stop();
+
+    /**
+     * @brief offsets of the oldest byte kept, and after the last byte
+     *
+     */
+    std::uint64_t get_start_offset();
+    std::uint64_t get_end_offset();
+
+    size_t get_size() const { return m_size; }
+};
+
+/**
+ * @brief Serves the replicas of this server, on its own port
+ *
+ * Every replica gets its own sender thread. A replica that is not in
+ * sync gets a snapshot first, written with write_snapshot() into a
+ * memfd and sent with sendfile(), then the sender streams the
+ * backlog from the offset taken before the snapshot, in batches of
+ * up to REPLICATION_SEND_SIZE bytes. A replica that falls further
+ * behind than the backlog holds is disconnected, and syncs again when
+ * it comes back.
+ *
+ */
+class ReplicationPrimary
+{
+private:
+    /**
+     * @brief a connected replica, and its sender thread
+     *
+     */
+    struct Replica
+    {
+        ReplicationPrimary*                 m_primary;
+        int                                 m_fd;
+        std::string                         m_address;
+        pthread_t                           m_thread_id;
+
+        /**
+         * @brief offset of the next byte to send
+         *
+         */
+        std::atomic<std::uint64_t>          m_offset;
+        std::atomic<bool>                   m_is_done;
+    };
+
+    DataStoreInterface**                    m_datastores;
+    size_t                                  m_num_datastores;
+    ReplicationBacklog*                     m_backlog;
+    int                                     m_port;
+    int                                     m_listen_fd;
+
+    /**
+     * @brief random, tells a replica whether its offset is one of
+     * this run
+     *
+     */
+    std::uint64_t                           m_run_id;
+
+    std::mutex                              m_replicas_mutex;
+    std::list<Replica>                      m_replicas;
+
+    std::atomic<bool>                       m_is_stopping;
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief the loop of the accepting thread
+     *
+     */
+    void accept_loop();
+
+    static void* accept_start_routine(void* arg);
+
+    /**
+     * @brief sync a replica, then stream the backlog to it
+     *
+     */
+    void serve(Replica& replica);
+
+    static void* serve_start_routine(void* arg);
+
+    /**
+     * @brief send a snapshot of the data stores to a replica
+     *
+     * @param fd the socket of the replica
+     * @param offset the offset the writes go on from
+     * @return true on success
+     */
+    bool send_snapshot(int fd, std::uint64_t offset);
+
+    /**
+     * @brief join the sender threads that are done, with
+     * m_replicas_mutex held
+     *
+     */
+    void reap_unsafe();
+
+public:
+    /**
+     * @brief full syncs, and replicas that went on from their offset
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_full_syncs;
+    std::atomic<std::uint64_t>              m_num_partial_syncs;
+
+    /**
+     * @brief create a primary
+     *
+     * @param port the port replicas connect to
+     * @param datastores the data stores, must outlive the primary or
+     * stop()
+     * @param num_datastores the number of data stores
+     * @param backlog the backlog the append log fills
+     */
+    ReplicationPrimary(
+        int port,
+        DataStoreInterface** datastores,
+        size_t num_datastores,
+        ReplicationBacklog* backlog);
+
+    ~ReplicationPrimary()
+    {
+        stop();
+    }
+
+    /**
+     * @brief listen on the port, and start the accepting thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief disconnect the replicas, and stop all the threads
+     *
+     */
+    void stop();
+
+    /**
+     * @brief the address and the offset of every connected replica
+     *
+     */
+    std::vector<std::pair<std::string, std::uint64_t>> get_replicas();
+};
+
+/**
+ * @brief Keeps the data stores of this server in sync with a primary
+ *
+ * A thread connects to the primary, loads the snapshot it sends, and
+ * applies the stream of writes that follows. When the link breaks it
+ * connects again, every REPLICATION_RETRY_MS, and asks to go on from
+ * its offset so that a short break does not need a snapshot.
+ *
+ */
+class ReplicationReplica
+{
+private:
+    DataStoreInterface**                    m_datastores;
+    size_t                                  m_num_datastores;
+    std::string                             m_host;
+    int                                     m_port;
+
+    /**
+     * @brief the file the snapshot of a full sync is received into,
+     * empty for a file in memory
+     *
+     */
+    std::string                             m_sync_path;
+
+    /**
+     * @brief the run of the primary and the offset the data stores
+     * are in sync with, 0 if they are not
+     *
+     */
+    std::uint64_t                           m_run_id;
+
+    /**
+     * @brief the socket, shut down by stop() to end a blocking read
+     *
+     */
+    std::atomic<int>                        m_fd;
+
+    /**
+     * @brief used with m_cond, on the monotonic clock, to wait between
+     * two attempts, and to be woken up by stop()
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+    std::atomic<bool>                       m_is_stopping;
+
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief connect to the primary
+     *
+     * @return int the socket, -1 on failure
+     */
+    int connect_to_primary();
+
+    /**
+     * @brief sync with the primary, then apply its writes until the
+     * link breaks
+     *
+     * @param fd the socket
+     */
+    void sync(int fd);
+
+    /**
+     * @brief receive the snapshot of a full sync into a file, rather
+     * than into memory, so that it is mapped to be loaded
+     *
+     * @param fd the socket
+     * @param size the size of the snapshot
+     * @return int the file, -1 on failure
+     */
+    int receive_snapshot(int fd, std::uint64_t size);
+
+    /**
+     * @brief delete every key, before a full sync
+     *
+     */
+    void clear_datastores();
+
+    /**
+     * @brief the loop of the replica thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg);
+
+public:
+    /**
+     * @brief whether the link with the primary is up
+     *
+     */
+    std::atomic<bool>                       m_is_connected;
+
+    /**
+     * @brief offset of the next byte of the stream
+     *
+     */
+    std::atomic<std::uint64_t>              m_offset;
+
+    /**
+     * @brief full syncs, and writes applied
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_full_syncs;
+    std::atomic<std::uint64_t>              m_num_applied;
+
+    /**
+     * @brief create a replica
+     *
+     * @param host the host of the primary
+     * @param port its replication port
+     * @param datastores the data stores, must outlive the replica or
+     * stop()
+     * @param num_datastores the number of data stores, a power of two
+     * @param sync_path the file the snapshot of a full sync is
+     * received into, empty to keep it in a file in memory
+     */
+    ReplicationReplica(
+        const std::string& host,
+        int port,
+        DataStoreInterface** datastores,
+        size_t num_datastores,
+        const std::string& sync_path);
+
+    ~ReplicationReplica()
+    {
+        stop();
+        pthread_cond_destroy(&m_cond);
+    }
+
+    /**
+     * @brief start the replica thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop the replica thread, and wait for it
+     *
+     */
+    void stop();
+
+    const std::string& get_host() const { return m_host; }
+    int get_port() const { return m_port; }
+};
+
+#endif /* #ifndef REPLICATION_H_ */
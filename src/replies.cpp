@@ -0,0 +1,72 @@
+#include "replies.h"
+#include <charconv>
+
+/**
+ * @brief longest small integer reply, ":1023\r\n"
+ *
+ */
+#define SMALL_INTEGER_REPLY_SIZE 8
+
+/**
+ * @brief the preformatted small integer replies
+ *
+ */
+struct SmallIntegerReplies
+{
+    char                m_replies[REPLY_SMALL_INTEGERS][SMALL_INTEGER_REPLY_SIZE];
+    std::uint8_t        m_lengths[REPLY_SMALL_INTEGERS];
+
+    SmallIntegerReplies()
+    {
+        for (int i = 0; i < REPLY_SMALL_INTEGERS; i++)
+        {
+            char* p = m_replies[i];
+            *p++ = ':';
+            p = std::to_chars(p, m_replies[i] + SMALL_INTEGER_REPLY_SIZE, i).ptr;
+            *p++ = '\r';
+            *p++ = '\n';
+            m_lengths[i] = (std::uint8_t)(p - m_replies[i]);
+        }
+    }
+};
+
+static const SmallIntegerReplies g_small_integer_replies;
+
+/**
+ * @brief format a RESP line made of a type byte and an integer,
+ * without any allocation
+ *
+ */
+static bool append_prefixed_integer(IoBuffer& output, char prefix, long long n)
+{
+    // prefix + 20 digits with the sign + CRLF
+    char buffer[24];
+    char* p = buffer;
+    *p++ = prefix;
+    p = std::to_chars(p, buffer + sizeof(buffer), n).ptr;
+    *p++ = '\r';
+    *p++ = '\n';
+    return output.append(std::string_view(buffer, p - buffer));
+}
+
+bool append_integer_reply(IoBuffer& output, long long n)
+{
+    if (n >= 0 && n < REPLY_SMALL_INTEGERS)
+        return output.append(std::string_view(
+                    g_small_integer_replies.m_replies[n],
+                    g_small_integer_replies.m_lengths[n]));
+
+    return append_prefixed_integer(output, ':', n);
+}
+
+bool append_array_header(IoBuffer& output, long long n)
+{
+    return append_prefixed_integer(output, '*', n);
+}
+
+bool append_bulk_string(IoBuffer& output, std::string_view value)
+{
+    return append_prefixed_integer(output, '$', value.size()) && \
+        output.append(value) && \
+        output.append(std::string_view("\r\n", 2));
+}
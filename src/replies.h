@@ -0,0 +1,79 @@
+#ifndef REPLIES_H_
+#define REPLIES_H_
+
+#include "common_include.h"
+#include "io_buffer.h"
+
+/**
+ * @brief Replies that never change, kept as static byte strings so
+ * that sending them is a plain copy into the output buffer
+ *
+ */
+inline constexpr std::string_view REPLY_OK                  = "+OK\r\n";
+inline constexpr std::string_view REPLY_NIL                 = "$-1\r\n";
+inline constexpr std::string_view REPLY_ERROR               = "-ERROR\r\n";
+inline constexpr std::string_view REPLY_INVALID_COMMAND     = "-Invalid command\r\n";
+inline constexpr std::string_view REPLY_GENERIC_ERROR       = "-generic error\r\n";
+inline constexpr std::string_view REPLY_SET_FAILED          = "-Failed to set the value\r\n";
+inline constexpr std::string_view REPLY_NOT_AN_INTEGER      = "-Value is not an integer or out of range\r\n";
+inline constexpr std::string_view REPLY_INVALID_EXPIRE      = "-Invalid expire time\r\n";
+inline constexpr std::string_view REPLY_BGSAVE_STARTED      = "+Background saving started\r\n";
+inline constexpr std::string_view REPLY_BGSAVE_IN_PROGRESS  = "-Background save already in progress\r\n";
+inline constexpr std::string_view REPLY_SAVE_FAILED         = "-Failed to save the snapshot\r\n";
+inline constexpr std::string_view REPLY_NO_SNAPSHOT_FILE    = "-No snapshot file, see --snapshot-file\r\n";
+inline constexpr std::string_view REPLY_READONLY            = "-READONLY You can't write against a read only replica.\r\n";
+inline constexpr std::string_view REPLY_OOM                 = "-OOM command not allowed when used memory > 'maxmemory'\r\n";
+inline constexpr std::string_view REPLY_BUSY                = "-BUSY Server is overloaded, try again later\r\n";
+inline constexpr std::string_view REPLY_MISCONF             = "-MISCONF Errors writing to the append only file, see the server log\r\n";
+inline constexpr std::string_view REPLY_CROSSSLOT           = "-CROSSSLOT Keys in request don't hash to the same slot\r\n";
+inline constexpr std::string_view REPLY_TRYAGAIN            = "-TRYAGAIN Multiple keys request during rehashing of slot\r\n";
+inline constexpr std::string_view REPLY_CLUSTERDOWN         = "-CLUSTERDOWN Hash slot not served\r\n";
+inline constexpr std::string_view REPLY_CLUSTER_DISABLED    = "-ERR This instance has cluster support disabled\r\n";
+inline constexpr std::string_view REPLY_INVALID_SLOT        = "-ERR Invalid or out of range slot\r\n";
+inline constexpr std::string_view REPLY_UNKNOWN_NODE        = "-ERR Unknown node\r\n";
+inline constexpr std::string_view REPLY_SETSLOT_FAILED      = "-ERR The slot is not in a state that allows this\r\n";
+
+/**
+ * @brief integers in [0, REPLY_SMALL_INTEGERS) have a preformatted
+ * reply
+ *
+ */
+#define REPLY_SMALL_INTEGERS 1024
+
+/**
+ * @brief the reply for an integer, ":n\r\n"
+ *
+ * Small non-negative integers, the common case for counts, come from
+ * a table built once at startup. Others are formatted without any
+ * allocation.
+ *
+ * @param output the reply is appended here
+ * @param n the integer
+ * @return true on success
+ * @return false if out of memory
+ */
+bool append_integer_reply(IoBuffer& output, long long n);
+
+/**
+ * @brief the header of an array reply, "*n\r\n", to be followed by
+ * its n elements
+ *
+ * @param output the header is appended here
+ * @param n the number of elements
+ * @return true on success
+ * @return false if out of memory
+ */
+bool append_array_header(IoBuffer& output, long long n);
+
+/**
+ * @brief a bulk string reply, "$len\r\n" followed by the bytes and
+ * a CRLF
+ *
+ * @param output the reply is appended here
+ * @param value the bytes
+ * @return true on success
+ * @return false if out of memory
+ */
+bool append_bulk_string(IoBuffer& output, std::string_view value);
+
+#endif /* #ifndef REPLIES_H_ */
@@ -1,4 +1,6 @@
 #include "resp_parser.h"
+#include "resp_scan.h"
+#include "logger.h"
 
 std::tuple<resp_parse_error_t, int>
 RespParser::get_type()
@@ -40,20 +42,25 @@ RespParser::get_type()
 std::tuple<resp_parse_error_t, int>
 RespParser::get_length()
 {
-    char*           endptr          = nullptr;
-    long int        thenum          = 0;
+    const char*     endptr          = nullptr;
+    int             thenum          = 0;
 
     if (m_state.current >= m_state.end)
         return std::make_tuple(ERROR_CURRENT_BEYOND_END, 0);
-        
-    thenum = strtol(m_state.current, &endptr, 10);
 
-    if (thenum == 0 && (endptr == m_state.current || \
-            (*m_state.current && endptr && *endptr == 0)))
-        return std::make_tuple(ERROR_INVALID_NUMBER, 0);
+    switch (parse_bounded_int(m_state.current, m_state.end, thenum, endptr))
+    {
+        case INT_PARSE_SUCCESS:
+            break;
+        case INT_PARSE_INCOMPLETE:
+            // The number may continue in data that has not been received yet
+            return std::make_tuple(ERROR_CURRENT_BEYOND_END, 0);
+        default:
+            return std::make_tuple(ERROR_INVALID_NUMBER, 0);
+    }
 
-    m_state.current = endptr;
-    return std::make_tuple(ERROR_SUCCESS, (int)thenum);
+    m_state.current = const_cast<char*>(endptr);
+    return std::make_tuple(ERROR_SUCCESS, thenum);
 }
 
 resp_parse_error_t
@@ -77,57 +84,70 @@ RespParser::skip_crlf()
     return ERROR_SUCCESS;
 }
 
-std::tuple<resp_parse_error_t, std::string>
-RespParser::get_bulk_string_internal(int& stringlength)
+resp_parse_error_t
+RespParser::get_bulk_string_view(std::string_view& value, int& stringlength)
 {
-    std::string retval;
+    char* save_current = m_state.current;
 
     auto [err2, length] = get_length();
     if (ERROR_SUCCESS != err2)
-        return std::make_tuple(err2, retval);
-    
+        return err2;
+
     stringlength = length;
-    
+
     auto err = skip_crlf();
     if (ERROR_SUCCESS != err)
-    {
-        return std::make_tuple(err, retval);
-    }
+        return err;
 
     // "$-1\r\n" is interpreted as NULL string, we are just going
     // to treat it as an empty string for now
     if (length < 0)
-        return std::make_tuple(ERROR_SUCCESS, retval);
-
-    // "$0\r\n\r\n" is treated as an empty string
-    if (!length)
-        return std::make_tuple(skip_crlf(), retval);
+    {
+        value = std::string_view();
+        return ERROR_SUCCESS;
+    }
 
     char* current = m_state.current;
-    char* save_current = current;
 
-    for (int i = 0; i < length; i++, current++)
-    {
-        if (current >= m_state.end)
-            return std::make_tuple(ERROR_CURRENT_BEYOND_END, retval);
-        if ('\r' == *current || '\n' == *current)
-            return std::make_tuple(ERROR_STRING_CONTAINS_CRLF, retval);
-    }
+    // Only what has been received so far can be checked
+    size_t available = std::min((size_t)length, (size_t)(m_state.end - current));
+    if (find_crlf(current, current + available) != current + available)
+        return ERROR_STRING_CONTAINS_CRLF;
+    if (available < (size_t)length)
+        return ERROR_CURRENT_BEYOND_END;
 
-    m_state.current = current;
+    m_state.current = current + length;
     err = skip_crlf();
     if (ERROR_SUCCESS != err)
     {
         m_state.current = save_current;
-        return make_tuple(err, retval);
+        return err;
     }
 
-    // Overwrite the string temporarily here to
-    // optimize duplication
-    auto savechar = *current;
-    *current = 0;
-    retval = save_current;
-    *current = savechar;
+    value = std::string_view(current, length);
+    return ERROR_SUCCESS;
+}
+
+std::tuple<resp_parse_error_t, std::string>
+RespParser::get_bulk_string_internal(int& stringlength)
+{
+    std::string retval;
+    char* save_current = m_state.current;
+
+    std::string_view value;
+    auto err = get_bulk_string_view(value, stringlength);
+    if (ERROR_SUCCESS != err)
+        return std::make_tuple(err, retval);
+
+    try
+    {
+        retval.assign(value);
+    }
+    catch (...)
+    {
+        m_state.current = save_current;
+        return std::make_tuple(ERROR_NO_MEMORY, retval);
+    }
 
     return std::make_tuple(ERROR_SUCCESS, retval);
 }
@@ -167,7 +187,7 @@ RespParser::get_array_object()
     auto [err, length] = get_length();
     if (ERROR_SUCCESS != err)
         return std::make_tuple(
-            ERROR_INVALID_ARRAY_LENGTH,
+            ERROR_CURRENT_BEYOND_END == err ? err : ERROR_INVALID_ARRAY_LENGTH,
             std::shared_ptr<AbstractRespObject>(nullptr));
 
     auto arrp = new (std::nothrow) RespArray();
@@ -235,8 +255,7 @@ RespParser::get_array_object()
                 break;
             default:
                 {
-                    std::cerr << "Type " << type << " Not implemented. "\
-                            << std::endl;
+                    LOG_ERROR("Type " << type << " Not implemented.");
                     delete arrp;
                     return std::make_tuple(
                         ERROR_NOT_IMPLEMENTED,
@@ -273,8 +292,7 @@ RespParser::get_generic_object()
             break;
         default:
             {
-                std::cerr << "Type " << type << " Not implemented. "\
-                        << std::endl;
+                LOG_ERROR("Type " << type << " Not implemented.");
                 return std::make_tuple(
                     ERROR_NOT_IMPLEMENTED,
                     std::shared_ptr<AbstractRespObject>(nullptr)
@@ -282,3 +300,82 @@ RespParser::get_generic_object()
             }
     }
 }
+
+std::tuple<resp_parse_error_t, std::shared_ptr<AbstractRespObject> >
+RespParser::get_next_object()
+{
+    char* save_current = m_state.current;
+
+    auto [err, obj] = get_generic_object();
+    if (ERROR_CURRENT_BEYOND_END == err)
+    {
+        m_state.current = save_current;
+        return std::make_tuple(
+            ERROR_INCOMPLETE,
+            std::shared_ptr<AbstractRespObject>(nullptr));
+    }
+
+    return std::make_tuple(err, obj);
+}
+
+resp_parse_error_t RespParser::get_next_command(CommandView& command)
+{
+    char* save_current = m_state.current;
+    command.clear();
+
+    auto err = ERROR_SUCCESS;
+    auto [type_err, type] = get_type();
+    if (ERROR_SUCCESS != type_err)
+        err = type_err;
+    else if (RESP_ARRAY != type)
+        err = ERROR_NOT_IMPLEMENTED;
+
+    int length = 0;
+    if (ERROR_SUCCESS == err)
+    {
+        auto [length_err, array_length] = get_length();
+        length = array_length;
+        if (ERROR_SUCCESS != length_err)
+            err = ERROR_CURRENT_BEYOND_END == length_err ?
+                length_err : ERROR_INVALID_ARRAY_LENGTH;
+        else
+            err = skip_crlf();
+    }
+
+    for (int i = 0; i < length && ERROR_SUCCESS == err; i++)
+    {
+        char* wire_begin = m_state.current;
+
+        auto [elem_err, elem_type] = get_type();
+        if (ERROR_SUCCESS != elem_err)
+        {
+            err = elem_err;
+            break;
+        }
+
+        // Commands are flat, nested arrays are never valid here
+        if (RESP_BULK_STRING != elem_type)
+        {
+            err = ERROR_NOT_IMPLEMENTED;
+            break;
+        }
+
+        std::string_view value;
+        int value_length;
+        err = get_bulk_string_view(value, value_length);
+        if (ERROR_SUCCESS == err &&
+            !command.push_back(
+                value,
+                std::string_view(wire_begin, m_state.current - wire_begin)))
+            err = ERROR_NO_MEMORY;
+    }
+
+    if (ERROR_CURRENT_BEYOND_END == err)
+    {
+        m_state.current = save_current;
+        command.clear();
+        return ERROR_INCOMPLETE;
+    }
+
+    return err;
+}
@@ -31,6 +31,7 @@ typedef enum {
     ERROR_NO_MEMORY,
     ERROR_INVALID_ARRAY_LENGTH,
     ERROR_NOT_IMPLEMENTED,
+    ERROR_INCOMPLETE,
 } resp_parse_error_t;
 
 /**
@@ -98,6 +99,15 @@ public:
      */
     virtual std::string serialize() = 0;
 
+    /**
+     * @brief View the raw bytes of a string object without copying
+     * them. The view is only valid as long as the object is.
+     * 
+     * @return std::string_view the bytes of a simple or bulk string,
+     * empty for every other type
+     */
+    virtual std::string_view get_string_view() { return std::string_view(); }
+
     /**
      * @brief Get the type of the object
      * 
@@ -191,6 +201,16 @@ public:
         return m_value;
     }
 
+    /**
+     * @brief view the string without copying it
+     * 
+     * @return std::string_view the string
+     */
+    std::string_view get_string_view()
+    {
+        return m_value;
+    }
+
     /**
      * @brief serialize for storage
      * 
@@ -253,6 +273,16 @@ public:
         return m_isnull ? "nil": m_value;
     }
 
+    /**
+     * @brief view the bytes without copying them
+     * 
+     * @return std::string_view the bytes, empty for a null string
+     */
+    std::string_view get_string_view()
+    {
+        return m_isnull ? std::string_view() : std::string_view(m_value);
+    }
+
     /**
      * @brief Serialize for storage or transmission
      * 
@@ -355,10 +385,10 @@ public:
     /**
      * @brief Get the underlying vector of RESP objects
      * 
-     * @return std::vector<std::shared_ptr<AbstractRespObject> > 
+     * @return const std::vector<std::shared_ptr<AbstractRespObject> >&
      * The underlying vector of RESP objects
      */
-    std::vector<std::shared_ptr<AbstractRespObject> > get_array()
+    const std::vector<std::shared_ptr<AbstractRespObject> >& get_array()
     {
         return m_value;
     }
@@ -407,6 +437,134 @@ public:
     }
 };
 
+/**
+ * @brief number of command arguments a CommandView holds without
+ * allocating
+ * 
+ */
+#define COMMAND_VIEW_INLINE_ARGS 8
+
+/**
+ * @brief A command, as an array of bulk strings, with every argument
+ * pointing straight into the input buffer
+ * 
+ * This is what RespParser::get_next_command() produces. It lives on
+ * the stack of the caller and nothing is copied, so it is only valid
+ * as long as the parsed input is neither modified nor freed. Up to
+ * COMMAND_VIEW_INLINE_ARGS arguments are kept inline, longer commands
+ * spill into a vector.
+ * 
+ */
+class CommandView
+{
+public:
+    /**
+     * @brief number of arguments, including the command name
+     * 
+     */
+    int                                 m_argc;
+
+    /**
+     * @brief the first arguments
+     * 
+     */
+    std::string_view                    m_inline_argv[COMMAND_VIEW_INLINE_ARGS];
+
+    /**
+     * @brief the wire encoding of the first arguments, "$len\r\n...\r\n"
+     * 
+     */
+    std::string_view                    m_inline_wire[COMMAND_VIEW_INLINE_ARGS];
+
+    /**
+     * @brief the arguments beyond COMMAND_VIEW_INLINE_ARGS
+     * 
+     */
+    std::vector<std::string_view>       m_overflow_argv;
+
+    /**
+     * @brief the wire encoding of the arguments beyond
+     * COMMAND_VIEW_INLINE_ARGS
+     * 
+     */
+    std::vector<std::string_view>       m_overflow_wire;
+
+    CommandView():
+        m_argc(0)
+    {
+    }
+
+    /**
+     * @brief forget all arguments, keeping the overflow capacity
+     * 
+     */
+    void clear()
+    {
+        m_argc = 0;
+        m_overflow_argv.clear();
+        m_overflow_wire.clear();
+    }
+
+    /**
+     * @brief add an argument
+     * 
+     * @param value the bytes of the argument
+     * @param wire the wire encoding of the argument
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool push_back(std::string_view value, std::string_view wire)
+    {
+        if (m_argc < COMMAND_VIEW_INLINE_ARGS)
+        {
+            m_inline_argv[m_argc] = value;
+            m_inline_wire[m_argc] = wire;
+        }
+        else
+        {
+            try
+            {
+                m_overflow_argv.push_back(value);
+                m_overflow_wire.push_back(wire);
+            }
+            catch (...)
+            {
+                return false;
+            }
+        }
+
+        m_argc++;
+        return true;
+    }
+
+    /**
+     * @brief get an argument
+     * 
+     * @param i index of the argument, must be less than m_argc
+     * @return std::string_view the bytes of the argument
+     */
+    std::string_view argv(int i) const
+    {
+        if (i < COMMAND_VIEW_INLINE_ARGS)
+            return m_inline_argv[i];
+        return m_overflow_argv[i - COMMAND_VIEW_INLINE_ARGS];
+    }
+
+    /**
+     * @brief get the wire encoding of an argument, which is also the
+     * serialized form of it as a bulk string
+     * 
+     * @param i index of the argument, must be less than m_argc
+     * @return std::string_view the encoding of the argument
+     */
+    std::string_view wire(int i) const
+    {
+        if (i < COMMAND_VIEW_INLINE_ARGS)
+            return m_inline_wire[i];
+        return m_overflow_wire[i - COMMAND_VIEW_INLINE_ARGS];
+    }
+};
+
 /**
  * @brief Parser that parses a string and produces a RESP object
  * 
@@ -427,15 +585,32 @@ public:
      */
     std::string                     m_parse_string;
 
-    RespParser(std::string parsestring)
+    RespParser(std::string parsestring):
+        m_parse_string(std::move(parsestring))
     {
-        m_parse_string        = parsestring;
         m_state.begin         = const_cast<char*>(m_parse_string.c_str());
         m_state.end           = m_state.begin + m_parse_string.length();
         m_state.current       = m_state.begin;
         m_state.parse_error   = 0;
     }
 
+    /**
+     * @brief Parse a buffer in place, without copying it
+     * 
+     * The parser never writes to the input. The buffer must outlive
+     * the parser, and every CommandView it produces.
+     * 
+     * @param input the buffer
+     * @param length number of bytes in the buffer
+     */
+    RespParser(const char* input, size_t length)
+    {
+        m_state.begin         = const_cast<char*>(input);
+        m_state.end           = m_state.begin + length;
+        m_state.current       = m_state.begin;
+        m_state.parse_error   = 0;
+    }
+
     /**
      * @brief Get the length of the curren token
      * 
@@ -528,6 +703,72 @@ public:
     std::tuple<resp_parse_error_t, std::shared_ptr<AbstractRespObject> >
         get_generic_object();
 
+    /**
+     * @brief Streaming mode: parse the next complete object in the input
+     * 
+     * The input may hold several pipelined objects, and the last one may
+     * be truncated. If the input ends in the middle of an object,
+     * ERROR_INCOMPLETE is returned and the parse location is moved back
+     * to the beginning of that object, so that the truncated bytes can be
+     * parsed again once the rest of the object has been received.
+     * 
+     * @return std::tuple<resp_parse_error_t, std::shared_ptr<AbstractRespObject> > 
+     * A tuple containing
+     * 1. error, ERROR_INCOMPLETE, or success
+     * 2. The RESP object
+     */
+    std::tuple<resp_parse_error_t, std::shared_ptr<AbstractRespObject> >
+        get_next_object();
+
+    /**
+     * @brief Parse the next command, an array of bulk strings, into a
+     * view of the input
+     * 
+     * This is the allocation free counterpart of get_next_object(),
+     * used to serve clients. Nothing is copied, and no objects are
+     * created. Just like get_next_object(), ERROR_INCOMPLETE is
+     * returned if the input ends in the middle of the command, and the
+     * parse location is moved back to its start.
+     * 
+     * @param command filled in with the arguments of the command
+     * @return resp_parse_error_t error, ERROR_INCOMPLETE, or success
+     */
+    resp_parse_error_t get_next_command(CommandView& command);
+
+    /**
+     * @brief parse the current token as a bulk string, without copying
+     * it
+     * 
+     * @param value the bytes of the string
+     * @param stringlength the length of the string, -1 for a
+     * null string
+     * @return resp_parse_error_t error or success
+     */
+    resp_parse_error_t get_bulk_string_view(
+        std::string_view& value,
+        int& stringlength);
+
+    /**
+     * @brief number of bytes of the input that have been consumed
+     * by complete objects
+     * 
+     * @return size_t number of bytes consumed
+     */
+    size_t get_consumed_length() const
+    {
+        return m_state.current - m_state.begin;
+    }
+
+    /**
+     * @brief whether there is unparsed input left
+     * 
+     * @return true if there are more bytes to parse
+     * @return false if all input has been consumed
+     */
+    bool has_more() const
+    {
+        return m_state.current < m_state.end;
+    }
 };
 
 #endif /* #ifndef RESP_OBJECT_ */
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include "resp_parser.h"
+#include "resp_scan.h"
+
+/**
+ * @brief bytes processed by each measurement, large enough to average
+ * out the timer resolution
+ *
+ */
+#define BENCH_BYTES ((size_t)1 << 30)
+
+/**
+ * @brief print the throughput of a measurement
+ *
+ * @param name what was measured
+ * @param bytes number of bytes processed
+ * @param start when the measurement started
+ */
+static void report(
+    const std::string& name,
+    size_t bytes,
+    std::chrono::steady_clock::time_point start)
+{
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << bytes / elapsed.count() / 1e9 \
+        << " GB/s" << std::endl;
+}
+
+/**
+ * @brief keeps the compiler from optimizing the measured work away
+ *
+ */
+static volatile size_t g_sink;
+
+void bench_scanners(size_t size)
+{
+    std::string buffer(size, 'x');
+    std::vector<std::pair<const char*, crlf_scanner_t> > scanners = {
+        {"scalar", find_crlf_scalar}, {"sse2", find_crlf_sse2}};
+    if (cpu_has_avx2())
+        scanners.push_back({"avx2", find_crlf_avx2});
+
+    for (auto [name, scan]: scanners)
+    {
+        size_t iterations = BENCH_BYTES / size;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; i++)
+            g_sink = scan(buffer.data(), buffer.data() + size) - buffer.data();
+        report(std::string("scan ") + name + " " + std::to_string(size) + \
+            " bytes", iterations * size, start);
+    }
+}
+
+void bench_parse(size_t value_size)
+{
+    std::string value(value_size, 'v');
+    std::string command = "*3\r\n$3\r\nset\r\n$3\r\nkey\r\n$" + \
+        std::to_string(value_size) + "\r\n" + value + "\r\n";
+
+    // One buffer with many pipelined commands, as read from a socket
+    size_t count = std::max((size_t)1, (size_t)(64 << 20) / command.size());
+    std::string input;
+    for (size_t i = 0; i < count; i++)
+        input += command;
+
+    size_t rounds = std::max((size_t)1, BENCH_BYTES / input.size() / 4);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        RespParser parser(input);
+        while (parser.has_more())
+        {
+            auto [err, obj] = parser.get_next_object();
+            if (ERROR_SUCCESS != err)
+            {
+                std::cerr << "parse failed, err = " << err << std::endl;
+                exit(1);
+            }
+        }
+    }
+    report("parse SET with " + std::to_string(value_size) + " byte values", \
+        rounds * input.size(), start);
+}
+
+void bench_integers()
+{
+    std::string input;
+    for (int i = 0; i < 100000; i++)
+        input += std::to_string(i * 7919 % 65536) + "\r\n";
+
+    const char* end = input.data() + input.size();
+    size_t rounds = 200;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        char* p = const_cast<char*>(input.data());
+        while (p < end)
+        {
+            char* endptr;
+            g_sink = strtol(p, &endptr, 10);
+            p = endptr + 2;
+        }
+    }
+    report("strtol", rounds * input.size(), start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < rounds; r++)
+    {
+        const char* p = input.data();
+        while (p < end)
+        {
+            int value;
+            const char* endptr;
+            parse_bounded_int(p, end, value, endptr);
+            g_sink = value;
+            p = endptr + 2;
+        }
+    }
+    report("parse_bounded_int", rounds * input.size(), start);
+}
+
+int main(int argc, char** argv)
+{
+    std::cout << "CRLF scanner in use: " << g_find_crlf_name << std::endl;
+
+    bench_scanners(4096);
+    bench_scanners(65536);
+    bench_integers();
+    bench_parse(16);
+    bench_parse(4096);
+    bench_parse(65536);
+}
@@ -2,6 +2,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include "resp_parser.h"
+#include "resp_scan.h"
+#include "replies.h"
+#include "command_table.h"
 
 #define TEST(x, y) {\
     if (!(x))\
@@ -267,6 +270,287 @@ void test_array_serialization()
         TEST(ret->serialize() == s, "Serialization should yield the oriinal array back");
     }
 }
+void test_streaming()
+{
+    std::cout << std::endl << "Tests to validate streaming (pipelined) parsing" << std::endl;
+
+    {
+        std::string s1 = "*2\r\n$3\r\nget\r\n$1\r\nx\r\n";
+        std::string s2 = "*3\r\n$3\r\nset\r\n$1\r\nx\r\n$1\r\n1\r\n";
+        RespParser t1(s1 + s2);
+        auto [err, ret] = t1.get_next_object();
+        TEST(ERROR_SUCCESS == err, "First pipelined command should be parsed");
+        TEST(ret->to_string() == std::string("[get, x]"), "First command should be correct");
+        TEST(t1.get_consumed_length() == s1.length(), "Only the first command should be consumed");
+        TEST(t1.has_more(), "Second command should still be pending");
+        auto [err2, ret2] = t1.get_next_object();
+        TEST(ERROR_SUCCESS == err2, "Second pipelined command should be parsed");
+        TEST(ret2->to_string() == std::string("[set, x, 1]"), "Second command should be correct");
+        TEST(!t1.has_more(), "All input should be consumed");
+    }
+    {
+        std::string s1 = "*2\r\n$3\r\nget\r\n$1\r\nx\r\n";
+        std::string s2 = "*3\r\n$3\r\nset\r\n$1\r\nx\r\n$1\r\n1\r\n";
+        bool all_incomplete = true;
+        for (size_t i = 1; i < s2.length(); i++)
+        {
+            RespParser t1(s1 + s2.substr(0, i));
+            auto [err, ret] = t1.get_next_object();
+            auto [err2, ret2] = t1.get_next_object();
+            if (ERROR_SUCCESS != err || ERROR_INCOMPLETE != err2 ||
+                t1.get_consumed_length() != s1.length())
+                all_incomplete = false;
+        }
+        TEST(all_incomplete, "Every truncation of a command should be reported as incomplete");
+    }
+    {
+        RespParser t1("*2\r\n$3\r\nget\r\n$1\r\nx\r\n#");
+        auto [err, ret] = t1.get_next_object();
+        auto [err2, ret2] = t1.get_next_object();
+        TEST(ERROR_SUCCESS == err, "Valid command should be parsed");
+        TEST(ERROR_SUCCESS != err2 && ERROR_INCOMPLETE != err2, "Garbage should be reported as an error");
+    }
+}
+
+void test_scan()
+{
+    std::cout << std::endl << "Tests to validate the CRLF scanners, using " \
+        << g_find_crlf_name << std::endl;
+
+    std::vector<std::pair<const char*, crlf_scanner_t> > scanners = {
+        {"scalar", find_crlf_scalar}, {"sse2", find_crlf_sse2}};
+    if (cpu_has_avx2())
+        scanners.push_back({"avx2", find_crlf_avx2});
+
+    for (auto [name, scan]: scanners)
+    {
+        bool all_found = true;
+        bool none_found = true;
+
+        // Every length and position, around the vector widths
+        for (int length = 0; length <= 100; length++)
+        {
+            std::string s(length, 'x');
+            none_found = none_found && (scan(s.data(), s.data() + length) == s.data() + length);
+
+            for (int pos = 0; pos < length; pos++)
+            {
+                std::string t(s);
+                t[pos] = (pos % 2) ? '\r' : '\n';
+                if (pos + 1 < length)
+                    t[length - 1] = '\r';
+                all_found = all_found && (scan(t.data(), t.data() + length) == t.data() + pos);
+            }
+        }
+
+        TEST(none_found, std::string(name) + " should not find CRLF where there is none");
+        TEST(all_found, std::string(name) + " should find the first CR or LF");
+
+        std::string outside("ab\r\n");
+        TEST(scan(outside.data(), outside.data() + 2) == outside.data() + 2, \
+            std::string(name) + " should not look past the end");
+    }
+
+    {
+        int value = 0;
+        const char* endptr = nullptr;
+        std::string s("1234\r\n");
+        TEST(INT_PARSE_SUCCESS == parse_bounded_int(s.data(), s.data() + s.size(), value, endptr) &&
+            1234 == value && endptr == s.data() + 4, "Should parse a number followed by CRLF");
+        TEST(INT_PARSE_INCOMPLETE == parse_bounded_int(s.data(), s.data() + 4, value, endptr),
+            "A number cut by the end of the input should be incomplete");
+        s = "-2147483648\r";
+        TEST(INT_PARSE_SUCCESS == parse_bounded_int(s.data(), s.data() + s.size(), value, endptr) &&
+            INT32_MIN == value, "Should parse the smallest int");
+        s = "2147483648\r";
+        TEST(INT_PARSE_INVALID == parse_bounded_int(s.data(), s.data() + s.size(), value, endptr),
+            "Numbers that overflow an int should be invalid");
+        s = "99999999999999999999999\r";
+        TEST(INT_PARSE_INVALID == parse_bounded_int(s.data(), s.data() + s.size(), value, endptr),
+            "Very long numbers should be invalid");
+        s = " 12\r";
+        TEST(INT_PARSE_INVALID == parse_bounded_int(s.data(), s.data() + s.size(), value, endptr),
+            "Leading white space should be invalid");
+        s = "-";
+        TEST(INT_PARSE_INCOMPLETE == parse_bounded_int(s.data(), s.data() + s.size(), value, endptr),
+            "A lone minus sign should be incomplete");
+    }
+
+    {
+        std::string payload(5000, 'v');
+        RespParser t1("$5000\r\n" + payload + "\r\nM");
+        auto [err, obj] = t1.get_next_object();
+        TEST(ERROR_SUCCESS == err && obj->get_string_view() == payload, "Large bulk strings should be parsed");
+        payload[4321] = '\n';
+        RespParser t2("$5000\r\n" + payload + "\r\n");
+        auto [err2, obj2] = t2.get_next_object();
+        TEST(ERROR_STRING_CONTAINS_CRLF == err2, "LF deep inside a large bulk string should be found");
+    }
+}
+
+void test_command_view()
+{
+    std::cout << std::endl << "Tests to validate zero-copy command parsing" << std::endl;
+
+    {
+        std::string input("*3\r\n$3\r\nset\r\n$1\r\nx\r\n$5\r\nhello\r\n*2\r\n$3\r\nget\r\n$1\r\nx\r\n");
+        RespParser parser(input.data(), input.length());
+        CommandView command;
+
+        TEST(ERROR_SUCCESS == parser.get_next_command(command), "Valid command should be parsed");
+        TEST(3 == command.m_argc, "All arguments should be found");
+        TEST(command.argv(0) == "set" && command.argv(1) == "x" && command.argv(2) == "hello",
+            "Arguments should be the bulk string payloads");
+        TEST(command.argv(2).data() >= input.data() && command.argv(2).data() < input.data() + input.length(),
+            "Arguments should point into the input buffer");
+        TEST(command.wire(2) == "$5\r\nhello\r\n", "Wire encoding of an argument should be kept");
+
+        TEST(ERROR_SUCCESS == parser.get_next_command(command), "Pipelined command should be parsed");
+        TEST(2 == command.m_argc && command.argv(0) == "get", "Command view should be reused");
+        TEST(!parser.has_more(), "All input should be consumed");
+    }
+    {
+        std::string input("*12\r\n$3\r\ndel");
+        for (int i = 0; i < 11; i++)
+            input += "\r\n$2\r\nk" + std::to_string(i % 10);
+        input += "\r\n";
+
+        RespParser parser(input.data(), input.length());
+        CommandView command;
+        TEST(ERROR_SUCCESS == parser.get_next_command(command), "Long command should be parsed");
+        TEST(12 == command.m_argc && command.argv(11) == "k0" && command.argv(8) == "k7",
+            "Arguments beyond the inline ones should be found");
+    }
+    {
+        std::string input("*2\r\n$3\r\nget\r\n$5\r\nhel");
+        RespParser parser(input.data(), input.length());
+        CommandView command;
+        TEST(ERROR_INCOMPLETE == parser.get_next_command(command), "Partial command should be incomplete");
+        TEST(0 == parser.get_consumed_length() && 0 == command.m_argc, "Partial command should be rewound");
+    }
+    {
+        std::string input("*2\r\n$3\r\nget\r\n*1\r\n$1\r\nx\r\n");
+        RespParser parser(input.data(), input.length());
+        CommandView command;
+        TEST(ERROR_NOT_IMPLEMENTED == parser.get_next_command(command), "Nested arrays should be rejected");
+    }
+    {
+        std::string input("$3\r\nget\r\n");
+        RespParser parser(input.data(), input.length());
+        CommandView command;
+        TEST(ERROR_SUCCESS != parser.get_next_command(command), "Commands must be arrays");
+    }
+}
+
+void test_integer_replies()
+{
+    IoBuffer output;
+    for (int n: {0, 7, 1023, 1024, -5, INT32_MAX})
+    {
+        output.clear();
+        TEST(append_integer_reply(output, n), "Integer reply should be appended");
+        TEST(output.view() == RespInteger(n).serialize(),
+            "Integer reply should match the serialized integer " << n);
+    }
+
+    output.clear();
+    append_integer_reply(output, INT64_MIN);
+    TEST(output.view() == ":-9223372036854775808\r\n", "Integer reply should fit any 64 bit integer");
+}
+
+void test_io_buffer_release()
+{
+    IoBuffer input;
+    input.append("*1\r\n$4\r\nPI");
+    input.release();
+    TEST(input.view() == "*1\r\n$4\r\nPI", "A buffer that is not empty should keep its data");
+
+    const char* block = input.data();
+    input.consume(input.size());
+    input.release();
+
+    IoBuffer output;
+    TEST(output.append("+PONG\r\n") && output.data() == block,
+        "A released block should be reused by the next buffer");
+    TEST(input.append("*1\r\n") && input.view() == "*1\r\n", "A released buffer should be usable again");
+}
+
+void test_io_buffer()
+{
+    // The way read_from_socket() reads: the free space of the buffer,
+    // then the rest from a spill buffer appended after it
+    IoBuffer input;
+    std::string request(3 * IO_BUFFER_INITIAL_CAPACITY + 100, 'x');
+    for (size_t i = 0; i < request.size(); i++)
+        request[i] = 'a' + i % 26;
+    TEST(input.reserve(1024) && input.write_size() >= 1024, "Reserving should allocate the buffer");
+    size_t in_buffer = input.write_size();
+    memcpy(input.write_ptr(), request.data(), in_buffer);
+    input.commit(in_buffer);
+    TEST(input.append(std::string_view(request).substr(in_buffer)) && input.view() == request,
+        "A read split between the free space and the spill buffer should be kept in order");
+
+    // A partly parsed request stays, and the next read goes after it
+    input.consume(100);
+    TEST(input.view() == std::string_view(request).substr(100), "Consuming should drop bytes from the front");
+    TEST(input.reserve(input.write_size() + 1) && input.view() == std::string_view(request).substr(100),
+        "Making room should keep the bytes not consumed");
+    TEST(input.append("tail") && input.view() == request.substr(100) + "tail",
+        "Appending after a partial consume should add to the bytes not consumed");
+
+    // The way write_to_socket() consumes what a short send() took
+    size_t size = input.size();
+    while (input.size() > 1000)
+        input.consume(1000);
+    TEST(input.view() == (request.substr(100) + "tail").substr(size - input.size()),
+        "Consuming in steps should leave the end of the bytes");
+    input.consume(input.size());
+    TEST(input.empty() && input.write_size() >= 3 * IO_BUFFER_INITIAL_CAPACITY,
+        "Consuming everything should give all the room back");
+
+    input.append("+OK\r\n+OK\r\n");
+    input.truncate(5);
+    TEST(input.view() == "+OK\r\n", "Truncating should drop bytes from the end");
+    input.consume(input.size());
+    input.release();
+    TEST(input.empty() && 0 == input.write_size(), "Releasing an empty buffer should give its memory back");
+
+    // Never read, an append that does not fit only marks the buffer
+    IoBuffer output;
+    output.append("+PONG\r\n");
+    TEST(!output.append(std::string_view(request.data(), (size_t)IO_BUFFER_MAX_CAPACITY + 1)) && \
+        output.has_failed() && output.view() == "+PONG\r\n",
+        "An append that cannot be allocated should fail, and keep the buffer as it was");
+    output.clear();
+    TEST(!output.has_failed() && output.empty(), "Clearing should forget a failed append");
+}
+
+static constexpr CommandSpec g_test_commands[] =
+{
+    {"get",     COMMAND_GET,     nullptr, 2,  2, 1, COMMAND_FLAG_READ,  1,  1, 1},
+    {"set",     COMMAND_SET,     nullptr, 3,  5, 2, COMMAND_FLAG_WRITE, 1,  1, 1},
+    {"mset",    COMMAND_MSET,    nullptr, 3, -1, 2, COMMAND_FLAG_WRITE, 1, -1, 2},
+    {"pexpire", COMMAND_PEXPIRE, nullptr, 3,  3, 1, COMMAND_FLAG_WRITE, 1,  1, 1},
+};
+
+void test_command_table()
+{
+    static constexpr CommandTable table(g_test_commands);
+    TEST(table.is_perfect(), "The command names should have a perfect hash");
+    TEST(table.find("GeT") == &g_test_commands[0], "Command names should not be case sensitive");
+    TEST(table.find("pexpire") == &g_test_commands[3], "Every command should be found");
+    TEST(!table.find("gets") && !table.find("ge") && !table.find(""), "Unknown commands should not be found");
+
+    const CommandSpec* set = table.find("SET");
+    TEST(set->accepts_argc(3) && !set->accepts_argc(4) && set->accepts_argc(5) && !set->accepts_argc(7),
+        "SET should take 3 or 5 arguments");
+    const CommandSpec* mset = table.find("mset");
+    std::string keys;
+    for (int i = mset->m_first_key; i <= mset->get_last_key(7); i += mset->m_key_step)
+        keys += std::to_string(i);
+    TEST(keys == "135", "The keys of MSET should be every other argument");
+}
+
 int main(int argc, char** argv)
 {
     basic_tests();
@@ -280,6 +564,13 @@ int main(int argc, char** argv)
     test_bulk_string_serialization();
     test_error();
     test_array_serialization();
+    test_streaming();
+    test_scan();
+    test_command_view();
+    test_integer_replies();
+    test_io_buffer_release();
+    test_io_buffer();
+    test_command_table();
 
     std::cout << std::endl << "All tests passed" << std::endl;
 }
\ No newline at end of file
@@ -0,0 +1,143 @@
+#include "resp_scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESP_SCAN_X86
+#include <immintrin.h>
+#endif
+
+const char* find_crlf_scalar(const char* begin, const char* end)
+{
+    for (const char* p = begin; p < end; p++)
+    {
+        if ('\r' == *p || '\n' == *p)
+            return p;
+    }
+    return end;
+}
+
+#ifdef RESP_SCAN_X86
+
+const char* find_crlf_sse2(const char* begin, const char* end)
+{
+    const __m128i   cr  = _mm_set1_epi8('\r');
+    const __m128i   lf  = _mm_set1_epi8('\n');
+    const char*     p   = begin;
+
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        int mask = _mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    return find_crlf_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+const char* find_crlf_avx2(const char* begin, const char* end)
+{
+    const __m256i   cr  = _mm256_set1_epi8('\r');
+    const __m256i   lf  = _mm256_set1_epi8('\n');
+    const char*     p   = begin;
+
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(
+                    _mm256_or_si256(
+                        _mm256_cmpeq_epi8(v, cr),
+                        _mm256_cmpeq_epi8(v, lf)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+
+    // Less than a full vector is left
+    return find_crlf_sse2(p, end);
+}
+
+bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#else
+
+const char* find_crlf_sse2(const char* begin, const char* end)
+{
+    return find_crlf_scalar(begin, end);
+}
+
+const char* find_crlf_avx2(const char* begin, const char* end)
+{
+    return find_crlf_scalar(begin, end);
+}
+
+bool cpu_has_avx2()
+{
+    return false;
+}
+
+#endif /* #ifdef RESP_SCAN_X86 */
+
+/**
+ * @brief pick the fastest scanner the CPU supports
+ *
+ * @return crlf_scanner_t the scanner
+ */
+static crlf_scanner_t pick_crlf_scanner()
+{
+    if (cpu_has_avx2())
+        return find_crlf_avx2;
+#ifdef RESP_SCAN_X86
+    return find_crlf_sse2;
+#else
+    return find_crlf_scalar;
+#endif
+}
+
+crlf_scanner_t  g_find_crlf         = pick_crlf_scanner();
+
+const char*     g_find_crlf_name    =
+    find_crlf_avx2 == g_find_crlf ? "avx2" :
+    find_crlf_sse2 == g_find_crlf ? "sse2" : "scalar";
+
+int_parse_result_t parse_bounded_int(
+    const char* begin,
+    const char* end,
+    int& value,
+    const char*& endptr)
+{
+    const char*     p           = begin;
+    bool            negative    = false;
+    std::int64_t    thenum      = 0;
+
+    if (p < end && '-' == *p)
+    {
+        negative = true;
+        p++;
+    }
+
+    const char* digits = p;
+    std::int64_t limit = negative ? -(std::int64_t)INT32_MIN : INT32_MAX;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        thenum = thenum * 10 + (*p - '0');
+        if (thenum > limit)
+            return INT_PARSE_INVALID;
+    }
+
+    // The number may continue in data that has not been received yet
+    if (p >= end)
+        return INT_PARSE_INCOMPLETE;
+
+    if (p == digits)
+        return INT_PARSE_INVALID;
+
+    value = (int)(negative ? -thenum : thenum);
+    endptr = p;
+    return INT_PARSE_SUCCESS;
+}
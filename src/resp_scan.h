@@ -0,0 +1,119 @@
+#ifndef RESP_SCAN_H_
+#define RESP_SCAN_H_
+
+#include "common_include.h"
+
+/**
+ * @brief signature of the functions that look for the first CR or LF
+ *
+ * @param begin first byte to look at
+ * @param end one past the last byte to look at
+ * @return const char* the first CR or LF, or end if there is none
+ */
+typedef const char* (*crlf_scanner_t)(const char* begin, const char* end);
+
+/**
+ * @brief look for the first CR or LF, one byte at a time
+ *
+ * @param begin first byte to look at
+ * @param end one past the last byte to look at
+ * @return const char* the first CR or LF, or end if there is none
+ */
+const char* find_crlf_scalar(const char* begin, const char* end);
+
+/**
+ * @brief look for the first CR or LF, 16 bytes at a time with SSE2.
+ * Falls back to find_crlf_scalar() on other architectures.
+ *
+ * @param begin first byte to look at
+ * @param end one past the last byte to look at
+ * @return const char* the first CR or LF, or end if there is none
+ */
+const char* find_crlf_sse2(const char* begin, const char* end);
+
+/**
+ * @brief look for the first CR or LF, 32 bytes at a time with AVX2.
+ * Must only be called if cpu_has_avx2() is true.
+ *
+ * @param begin first byte to look at
+ * @param end one past the last byte to look at
+ * @return const char* the first CR or LF, or end if there is none
+ */
+const char* find_crlf_avx2(const char* begin, const char* end);
+
+/**
+ * @brief whether the CPU we run on supports AVX2
+ *
+ * @return true if find_crlf_avx2() can be used
+ */
+bool cpu_has_avx2();
+
+/**
+ * @brief the fastest scanner supported by the CPU, picked once at
+ * startup
+ *
+ */
+extern crlf_scanner_t g_find_crlf;
+
+/**
+ * @brief name of the scanner in g_find_crlf, for diagnostics
+ *
+ */
+extern const char* g_find_crlf_name;
+
+/**
+ * @brief look for the first CR or LF with the fastest scanner
+ *
+ * @param begin first byte to look at
+ * @param end one past the last byte to look at
+ * @return const char* the first CR or LF, or end if there is none
+ */
+inline const char* find_crlf(const char* begin, const char* end)
+{
+    return g_find_crlf(begin, end);
+}
+
+/**
+ * @brief outcome of parse_bounded_int()
+ *
+ */
+typedef enum
+{
+    /**
+     * @brief a number was parsed
+     *
+     */
+    INT_PARSE_SUCCESS,
+    /**
+     * @brief the input ended before the number did, more data is needed
+     *
+     */
+    INT_PARSE_INCOMPLETE,
+    /**
+     * @brief there is no number, or it does not fit in an int
+     *
+     */
+    INT_PARSE_INVALID
+} int_parse_result_t;
+
+/**
+ * @brief parse an optionally negative decimal integer
+ *
+ * Unlike strtol(), this never reads at or past end, so the input
+ * does not have to be NUL terminated, and a number that is cut off by
+ * the end of the input is reported as such. No leading white space or
+ * '+' sign is accepted, as the RESP protocol has none.
+ *
+ * @param begin first byte of the number
+ * @param end one past the last byte that may be read
+ * @param value the parsed value, on success
+ * @param endptr the first byte after the number, on success
+ * @return int_parse_result_t whether the parse worked
+ */
+int_parse_result_t parse_bounded_int(
+    const char* begin,
+    const char* end,
+    int& value,
+    const char*& endptr);
+
+#endif /* #ifndef RESP_SCAN_H_ */
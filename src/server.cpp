@@ -3,12 +3,21 @@
 
 int main(int argc, char** argv)
 {
+    ServerConfig config;
+    if (!config.parse_args(argc, argv))
+    {
+        ServerConfig::usage(argv[0]);
+        exit(1);
+    }
+
+    log_set_level(config.m_log_level);
+
     std::cout << "Starting server ..." << std::endl;
 
-    Orchestrator orchestrator;
+    Orchestrator orchestrator(config);
     if (orchestrator.run_server())
     {
-        std::cerr << "could not start server " << std::endl;
+        LOG_ERROR("could not start server");
         exit(1);
     }
     while (true)
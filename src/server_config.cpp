@@ -0,0 +1,425 @@
+#include "server_config.h"
+#include "io_uring_loop.h"
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+
+/**
+ * @brief parse a positive integer argument
+ * 
+ * @param s the string to parse
+ * @param value where the parsed value is stored
+ * @return true if the string is a positive integer
+ * @return false otherwise
+ */
+static bool parse_positive_int(const char* s, int& value)
+{
+    char*       endptr  = nullptr;
+    long int    thenum  = strtol(s, &endptr, 10);
+
+    if (endptr == s || *endptr || thenum <= 0 || thenum > INT32_MAX)
+        return false;
+
+    value = (int)thenum;
+    return true;
+}
+
+/**
+ * @brief parse a size in bytes, with an optional k, m or g suffix
+ * 
+ * @param s the string to parse
+ * @param value where the parsed value is stored
+ * @return true if the string is a size
+ * @return false otherwise
+ */
+static bool parse_size(const char* s, size_t& value)
+{
+    char*               endptr  = nullptr;
+    unsigned long long  thenum  = strtoull(s, &endptr, 10);
+
+    if (endptr == s || '-' == *s)
+        return false;
+
+    unsigned long long multiplier = 1;
+    switch (tolower(*endptr))
+    {
+        case '\0':                             break;
+        case 'k': multiplier = 1ULL << 10;     endptr++; break;
+        case 'm': multiplier = 1ULL << 20;     endptr++; break;
+        case 'g': multiplier = 1ULL << 30;     endptr++; break;
+        default: return false;
+    }
+
+    if (*endptr || thenum > SIZE_MAX / multiplier)
+        return false;
+
+    value = (size_t)(thenum * multiplier);
+    return true;
+}
+
+/**
+ * @brief parse a list of CPUs the process may run on
+ * 
+ * @param s the list, as taken by parse_cpu_list()
+ * @param cpus where the CPUs are stored
+ * @return true if the list is valid, and has no CPU the process may
+ * not run on
+ */
+static bool parse_allowed_cpus(const char* s, cpu_set_t& cpus)
+{
+    if (!parse_cpu_list(s, cpus))
+        return false;
+
+    cpu_set_t allowed;
+    CPU_AND(&allowed, &cpus, &CpuTopology::get().get_allowed_cpus());
+    return CPU_EQUAL(&allowed, &cpus);
+}
+
+void ServerConfig::get_cpu_placement(CpuPlacement& placement) const
+{
+    const CpuTopology& topology = CpuTopology::get();
+    bool is_pipeline = SERVER_MODE_PIPELINE == m_mode;
+
+    cpu_set_t default_cpus;
+    CPU_ZERO(&default_cpus);
+    if (CPU_AFFINITY_NUMA == m_cpu_affinity && is_pipeline)
+        default_cpus = topology.get_node_cpus(0);
+
+    auto pick = [&default_cpus](const cpu_set_t& cpus) {
+        return is_cpu_set_empty(cpus) ? default_cpus : cpus;
+    };
+    placement.m_io_cpus = pick(m_io_cpus);
+    placement.m_read_cpus = pick(m_read_cpus);
+    placement.m_parse_cpus = pick(m_parse_cpus);
+    placement.m_write_cpus = pick(m_write_cpus);
+
+    placement.m_loop_cpus.clear();
+    placement.m_cpu_loops.clear();
+    if (!is_pipeline)
+    {
+        std::vector<int> loop_cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &m_loop_cpus))
+                loop_cpus.push_back(cpu);
+        }
+
+        int num_loops = get_num_event_loops();
+        for (int i = 0; i < num_loops; i++)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            if (!loop_cpus.empty())
+                CPU_SET(loop_cpus[i % loop_cpus.size()], &cpus);
+            else if (CPU_AFFINITY_NUMA == m_cpu_affinity)
+                cpus = topology.get_node_cpus(i % topology.get_num_nodes());
+            placement.m_loop_cpus.push_back(cpus);
+        }
+
+        // A CPU goes to one of the loops that run on it, or else on its
+        // node, so that the loops of a node share its CPUs
+        if (!loop_cpus.empty() || CPU_AFFINITY_NUMA == m_cpu_affinity)
+        {
+            placement.m_cpu_loops.assign(CPU_SETSIZE, -1);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                int node = topology.get_node_of_cpu(cpu);
+                if (node < 0)
+                    continue;
+
+                std::vector<int> same_cpu;
+                std::vector<int> same_node;
+                for (int i = 0; i < num_loops; i++)
+                {
+                    std::vector<int> nodes;
+                    topology.get_nodes_of(placement.m_loop_cpus[i], nodes);
+                    if (CPU_ISSET(cpu, &placement.m_loop_cpus[i]))
+                        same_cpu.push_back(i);
+                    else if (std::find(nodes.begin(), nodes.end(), node) != nodes.end())
+                        same_node.push_back(i);
+                }
+
+                auto& loops = same_cpu.empty() ? same_node : same_cpu;
+                if (!loops.empty())
+                    placement.m_cpu_loops[cpu] = loops[cpu % loops.size()];
+            }
+        }
+    }
+
+    // Any thread that runs commands may serve any shard, so the shards
+    // are spread over all the nodes those threads run on. That at
+    // least keeps them off the node of the thread that loads them.
+    std::vector<int> nodes;
+    if (is_pipeline)
+        topology.get_nodes_of(placement.m_parse_cpus, nodes);
+    else
+    {
+        for (auto& cpus: placement.m_loop_cpus)
+            topology.get_nodes_of(cpus, nodes);
+        std::sort(nodes.begin(), nodes.end());
+        nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+    }
+
+    if (topology.get_num_nodes() < 2)
+        nodes.clear();
+    placement.m_shard_nodes.clear();
+    for (size_t i = 0; i < get_num_datastores(); i++)
+        placement.m_shard_nodes.push_back(nodes.empty() ? -1 : nodes[i % nodes.size()]);
+}
+
+bool ServerConfig::parse_args(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char* option = argv[i];
+
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Missing value for " << option << std::endl;
+            return false;
+        }
+
+        const char* value = argv[++i];
+        bool        valid = false;
+
+        if (0 == strcmp(option, "--port"))
+            valid = parse_positive_int(value, m_port);
+        else if (0 == strcmp(option, "--epoll-batch-size"))
+            valid = parse_positive_int(value, m_epoll_batch_size);
+        else if (0 == strcmp(option, "--event-loops"))
+            valid = parse_positive_int(value, m_num_event_loops);
+        else if (0 == strcmp(option, "--datastores"))
+            valid = parse_positive_int(value, m_num_datastores);
+        else if (0 == strcmp(option, "--pool-min-threads"))
+            valid = parse_positive_int(value, m_pool_min_threads);
+        else if (0 == strcmp(option, "--pool-max-threads"))
+            valid = parse_positive_int(value, m_pool_max_threads);
+        else if (0 == strcmp(option, "--pool-target-wait-us"))
+            valid = parse_positive_int(value, m_pool_target_wait_us);
+        else if (0 == strcmp(option, "--pool-queue-limit"))
+            valid = parse_size(value, m_pool_queue_limit);
+        else if (0 == strcmp(option, "--overload-policy"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "defer"))
+                m_overload_policy = OVERLOAD_DEFER;
+            else if (0 == strcmp(value, "busy"))
+                m_overload_policy = OVERLOAD_BUSY;
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--client-output-limit"))
+            valid = parse_size(value, m_client_output_limit);
+        else if (0 == strcmp(option, "--log-level"))
+            valid = log_parse_level(value, m_log_level);
+        else if (0 == strcmp(option, "--snapshot-file"))
+        {
+            m_snapshot_file = value;
+            valid = !m_snapshot_file.empty();
+        }
+        else if (0 == strcmp(option, "--snapshot-interval"))
+            valid = parse_positive_int(value, m_snapshot_interval_s);
+        else if (0 == strcmp(option, "--aof-file"))
+        {
+            m_aof_file = value;
+            valid = !m_aof_file.empty();
+        }
+        else if (0 == strcmp(option, "--appendfsync"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "always"))
+                m_appendfsync = APPENDFSYNC_ALWAYS;
+            else if (0 == strcmp(value, "everysec"))
+                m_appendfsync = APPENDFSYNC_EVERYSEC;
+            else if (0 == strcmp(value, "no"))
+                m_appendfsync = APPENDFSYNC_NO;
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--replication-port"))
+            valid = parse_positive_int(value, m_replication_port);
+        else if (0 == strcmp(option, "--repl-backlog-size"))
+            valid = parse_size(value, m_repl_backlog_size) && m_repl_backlog_size;
+        else if (0 == strcmp(option, "--replicaof"))
+        {
+            // HOST:PORT, the port is the replication port of the primary
+            const char* colon = strrchr(value, ':');
+            valid = colon && colon != value && parse_positive_int(colon + 1, m_replicaof_port);
+            if (valid)
+                m_replicaof_host.assign(value, colon - value);
+        }
+        else if (0 == strcmp(option, "--cluster-nodes"))
+            valid = parse_cluster_nodes(value, m_cluster_slots) && !m_cluster_slots.empty();
+        else if (0 == strcmp(option, "--cluster-announce"))
+            valid = parse_cluster_address(value, m_cluster_announce_host, m_cluster_announce_port);
+        else if (0 == strcmp(option, "--maxmemory"))
+            valid = parse_size(value, m_max_memory);
+        else if (0 == strcmp(option, "--maxmemory-policy"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "noeviction"))
+                m_maxmemory_policy = EVICTION_NOEVICTION;
+            else if (0 == strcmp(value, "lru"))
+                m_maxmemory_policy = EVICTION_LRU;
+            else if (0 == strcmp(value, "lfu"))
+                m_maxmemory_policy = EVICTION_LFU;
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--mode"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "pipeline"))
+                m_mode = SERVER_MODE_PIPELINE;
+            else if (0 == strcmp(value, "event-loop"))
+                m_mode = SERVER_MODE_EVENT_LOOP;
+#ifdef HAVE_IO_URING
+            else if (0 == strcmp(value, "io-uring"))
+                m_mode = SERVER_MODE_IO_URING;
+#endif
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--datastore"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "locked"))
+                m_datastore_type = DATASTORE_LOCKED;
+            else if (0 == strcmp(value, "read-optimized"))
+                m_datastore_type = DATASTORE_READ_OPTIMIZED;
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--cpu-affinity"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "none"))
+                m_cpu_affinity = CPU_AFFINITY_NONE;
+            else if (0 == strcmp(value, "numa"))
+                m_cpu_affinity = CPU_AFFINITY_NUMA;
+            else
+                valid = false;
+        }
+        else if (0 == strcmp(option, "--io-cpus"))
+            valid = parse_allowed_cpus(value, m_io_cpus);
+        else if (0 == strcmp(option, "--read-cpus"))
+            valid = parse_allowed_cpus(value, m_read_cpus);
+        else if (0 == strcmp(option, "--parse-cpus"))
+            valid = parse_allowed_cpus(value, m_parse_cpus);
+        else if (0 == strcmp(option, "--write-cpus"))
+            valid = parse_allowed_cpus(value, m_write_cpus);
+        else if (0 == strcmp(option, "--loop-cpus"))
+            valid = parse_allowed_cpus(value, m_loop_cpus);
+        else if (0 == strcmp(option, "--scheduler"))
+        {
+            valid = true;
+            if (0 == strcmp(value, "single-queue"))
+                m_scheduler = SCHEDULER_SINGLE_QUEUE;
+            else if (0 == strcmp(value, "work-stealing"))
+                m_scheduler = SCHEDULER_WORK_STEALING;
+            else
+                valid = false;
+        }
+        else
+        {
+            std::cerr << "Unknown option " << option << std::endl;
+            return false;
+        }
+
+        if (!valid)
+        {
+            std::cerr << "Invalid value '" << value << "' for " \
+                << option << std::endl;
+            return false;
+        }
+    }
+
+    // The writes a replica gets from its primary are not logged
+    if (!m_replicaof_host.empty() && (!m_aof_file.empty() || m_replication_port))
+    {
+        std::cerr << "A replica cannot have an append log, or replicas " \
+            "of its own" << std::endl;
+        return false;
+    }
+
+    if (!m_cluster_announce_host.empty() && m_cluster_slots.empty())
+    {
+        std::cerr << "--cluster-announce needs --cluster-nodes" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+void ServerConfig::usage(const char* progname)
+{
+    std::cerr << "Usage: " << progname << " [options]" << std::endl;
+    std::cerr << "  --port N                port to listen on (default " \
+        << PORTNUM << ")" << std::endl;
+    std::cerr << "  --epoll-batch-size N    events drained per epoll_wait " \
+        "(default " << DEFAULT_EPOLL_BATCH_SIZE << ")" << std::endl;
+#ifdef HAVE_IO_URING
+    std::cerr << "  --mode MODE             pipeline (default), event-loop or " \
+        "io-uring" << std::endl;
+#else
+    std::cerr << "  --mode MODE             pipeline (default) or event-loop" \
+        << std::endl;
+#endif
+    std::cerr << "  --event-loops N         loop threads in event-loop and " \
+        "io-uring modes (default one per core)" << std::endl;
+    std::cerr << "  --datastores N          data store shards, rounded up to a " \
+        "power of two (default four per core)" << std::endl;
+    std::cerr << "  --datastore TYPE        locked (default) or read-optimized" \
+        << std::endl;
+    std::cerr << "  --scheduler TYPE        thread pool scheduler in pipeline " \
+        "mode, single-queue (default) or work-stealing" << std::endl;
+    std::cerr << "  --pool-min-threads N    fewest threads of each pipeline " \
+        "pool (default " << PoolSizingConfig().m_min_threads << ")" << std::endl;
+    std::cerr << "  --pool-max-threads N    most threads of each pipeline " \
+        "pool (default " << PoolSizingConfig().m_max_threads << ")" << std::endl;
+    std::cerr << "  --pool-target-wait-us N grow a pool when its jobs wait " \
+        "longer on average (default " << PoolSizingConfig().m_target_wait_us \
+        << ")" << std::endl;
+    std::cerr << "  --pool-queue-limit N    stop reading sockets while a " \
+        "pipeline pool has N jobs queued (default no limit)" << std::endl;
+    std::cerr << "  --overload-policy P     defer (default) the sockets read " \
+        "while a pool is full, or answer them with -BUSY" << std::endl;
+    std::cerr << "  --client-output-limit B hold back the commands of a client " \
+        "with B bytes of responses unsent (default no limit)" << std::endl;
+    std::cerr << "  --cpu-affinity A        numa to keep every loop, or the " \
+        "pipeline, on one NUMA node, or none (default)" << std::endl;
+    std::cerr << "  --io-cpus LIST          CPUs of the accepting and epoll " \
+        "threads, e.g. 0-3,8 (default any)" << std::endl;
+    std::cerr << "  --read-cpus LIST        CPUs of the read pool in pipeline " \
+        "mode (default any)" << std::endl;
+    std::cerr << "  --parse-cpus LIST       CPUs of the parse pool in pipeline " \
+        "mode (default any)" << std::endl;
+    std::cerr << "  --write-cpus LIST       CPUs of the write pool in pipeline " \
+        "mode (default any)" << std::endl;
+    std::cerr << "  --loop-cpus LIST        one CPU per loop, in turn, in " \
+        "event-loop and io-uring modes (default any)" << std::endl;
+    std::cerr << "  --log-level LEVEL       trace, debug, info, warn, error or " \
+        "none (default info)" << std::endl;
+    std::cerr << "  --maxmemory BYTES       most memory for keys and values, " \
+        "with an optional k, m or g suffix (default no limit)" << std::endl;
+    std::cerr << "  --maxmemory-policy P    noeviction, lru (default) or lfu" \
+        << std::endl;
+    std::cerr << "  --snapshot-file PATH    load the keys from PATH at startup, " \
+        "and save them there (default none)" << std::endl;
+    std::cerr << "  --snapshot-interval N   seconds between two snapshots " \
+        "(default " << DEFAULT_SNAPSHOT_INTERVAL_S << ")" << std::endl;
+    std::cerr << "  --aof-file PATH         log the writes to PATH.1, PATH.2, ..., " \
+        "and replay them at startup (default none)" << std::endl;
+    std::cerr << "  --appendfsync P         always, everysec (default) or no" \
+        << std::endl;
+    std::cerr << "  --replication-port N    serve replicas on port N " \
+        "(default none)" << std::endl;
+    std::cerr << "  --repl-backlog-size B   writes kept for the replicas that " \
+        "reconnect (default " << DEFAULT_REPL_BACKLOG_SIZE / (1024 * 1024) << "m)" << std::endl;
+    std::cerr << "  --replicaof HOST:PORT   be a read only replica of the " \
+        "primary with that replication port" << std::endl;
+    std::cerr << "  --cluster-nodes LIST    run in a cluster, LIST is comma " \
+        "separated HOST:PORT@FIRST-LAST slot ranges (default none)" << std::endl;
+    std::cerr << "  --cluster-announce A    HOST:PORT of this node in the " \
+        "cluster (default 127.0.0.1 and --port)" << std::endl;
+}
@@ -0,0 +1,496 @@
+#ifndef SERVER_CONFIG_H_
+#define SERVER_CONFIG_H_
+
+#include "common_include.h"
+#include "thread_pool.h"
+#include "pool_controller.h"
+#include "logger.h"
+#include "data_store.h"
+#include "append_log.h"
+#include "replication.h"
+#include "cluster.h"
+#include "cpu_topology.h"
+
+#define PORTNUM 6379
+
+/**
+ * @brief default number of events drained by one epoll_wait
+ * 
+ */
+#define DEFAULT_EPOLL_BATCH_SIZE 4096
+
+/**
+ * @brief threads each pipeline pool starts with, within the bounds
+ * of its size controller
+ * 
+ */
+#define DEFAULT_POOL_THREADS 8
+
+/**
+ * @brief default seconds between two snapshots
+ * 
+ */
+#define DEFAULT_SNAPSHOT_INTERVAL_S 300
+
+/**
+ * @brief The engine used to serve the connections
+ * 
+ */
+typedef enum
+{
+    /**
+     * @brief Staged pipeline: an epoll thread hands ready sockets to
+     * the read, parse and write thread pools in turn
+     * 
+     */
+    SERVER_MODE_PIPELINE,
+    /**
+     * @brief Run to completion: every event loop thread owns its own
+     * epoll instance and connections, and reads, parses, runs and
+     * writes inline
+     * 
+     */
+    SERVER_MODE_EVENT_LOOP,
+    /**
+     * @brief Run to completion on io_uring: every loop thread owns
+     * its own ring and connections, and the kernel accepts, receives
+     * and sends for it, see IoUringLoop
+     * 
+     */
+    SERVER_MODE_IO_URING
+} server_mode_t;
+
+/**
+ * @brief The data store variant used for every shard
+ * 
+ */
+typedef enum
+{
+    /**
+     * @brief DataStore: a hash map behind a reader-writer lock
+     * 
+     */
+    DATASTORE_LOCKED,
+    /**
+     * @brief ReadOptimizedDataStore: lock-free readers, for
+     * read-mostly workloads
+     * 
+     */
+    DATASTORE_READ_OPTIMIZED
+} datastore_type_t;
+
+/**
+ * @brief What the pipeline does with a socket that becomes readable
+ * while one of its pools is full
+ * 
+ */
+typedef enum
+{
+    /**
+     * @brief leave it unread, and disabled in epoll, until the pools
+     * catch up
+     * 
+     */
+    OVERLOAD_DEFER,
+    /**
+     * @brief read its commands at once, on the epoll thread, and
+     * answer every one with -BUSY without running it
+     * 
+     */
+    OVERLOAD_BUSY
+} overload_policy_t;
+
+/**
+ * @brief Where the threads run when they are not given CPUs
+ * 
+ */
+typedef enum
+{
+    /**
+     * @brief anywhere
+     * 
+     */
+    CPU_AFFINITY_NONE,
+    /**
+     * @brief each on one NUMA node: the loops are spread over the
+     * nodes, and the pipeline is kept on the first one, so that a
+     * request never crosses nodes from one stage to the next
+     * 
+     */
+    CPU_AFFINITY_NUMA
+} cpu_affinity_t;
+
+/**
+ * @brief Where every thread runs, and where every shard takes its
+ * memory from, as worked out by ServerConfig::get_cpu_placement()
+ * 
+ * An empty set of CPUs lets a thread run anywhere, and a node of -1
+ * lets a shard take its memory anywhere.
+ * 
+ */
+struct CpuPlacement
+{
+    /**
+     * @brief the accepting and the epoll threads
+     * 
+     */
+    cpu_set_t                               m_io_cpus;
+
+    /**
+     * @brief the pools of SERVER_MODE_PIPELINE
+     * 
+     */
+    cpu_set_t                               m_read_cpus;
+    cpu_set_t                               m_parse_cpus;
+    cpu_set_t                               m_write_cpus;
+
+    /**
+     * @brief every loop of SERVER_MODE_EVENT_LOOP and
+     * SERVER_MODE_IO_URING
+     * 
+     */
+    std::vector<cpu_set_t>                  m_loop_cpus;
+
+    /**
+     * @brief for every CPU, the loop that gets the connections whose
+     * packets that CPU receives, -1 to spread them round-robin. Empty
+     * if the loops are not pinned.
+     * 
+     */
+    std::vector<int>                        m_cpu_loops;
+
+    /**
+     * @brief the node of every shard
+     * 
+     */
+    std::vector<int>                        m_shard_nodes;
+};
+
+/**
+ * @brief Startup configuration of the server
+ * 
+ * All tunables are collected here so that they can be passed
+ * to the orchestrator in one go. Every member has a sensible
+ * default, and can be overridden from the command line.
+ * 
+ */
+struct ServerConfig
+{
+    /**
+     * @brief port on which the server listens
+     * 
+     */
+    int                                     m_port;
+
+    /**
+     * @brief maximum number of ready sockets returned by a single
+     * call to epoll_wait
+     * 
+     */
+    int                                     m_epoll_batch_size;
+
+    /**
+     * @brief the engine used to serve connections
+     * 
+     */
+    server_mode_t                           m_mode;
+
+    /**
+     * @brief number of loop threads in SERVER_MODE_EVENT_LOOP and
+     * SERVER_MODE_IO_URING, 0 means one per core
+     * 
+     */
+    int                                     m_num_event_loops;
+
+    /**
+     * @brief number of DataStore shards, rounded up to a power of two,
+     * 0 means it is sized from the number of cores
+     * 
+     */
+    int                                     m_num_datastores;
+
+    /**
+     * @brief the data store variant used for every shard
+     * 
+     */
+    datastore_type_t                        m_datastore_type;
+
+    /**
+     * @brief how the thread pools of SERVER_MODE_PIPELINE hand jobs
+     * to their threads
+     * 
+     */
+    scheduler_type_t                        m_scheduler;
+
+    /**
+     * @brief fewest and most threads of each pool of
+     * SERVER_MODE_PIPELINE, see PoolSizeController
+     * 
+     */
+    int                                     m_pool_min_threads;
+    int                                     m_pool_max_threads;
+
+    /**
+     * @brief a pool grows when its jobs wait longer than this on
+     * average, in microseconds
+     * 
+     */
+    int                                     m_pool_target_wait_us;
+
+    /**
+     * @brief jobs each pool of SERVER_MODE_PIPELINE may have queued
+     * before no more sockets are read, 0 for no limit
+     * 
+     */
+    size_t                                  m_pool_queue_limit;
+
+    /**
+     * @brief what is done with the sockets that become readable while
+     * a pool is full
+     * 
+     */
+    overload_policy_t                       m_overload_policy;
+
+    /**
+     * @brief bytes of responses a client may have waiting to be sent,
+     * beyond which the rest of its commands wait for them to be sent,
+     * 0 for no limit
+     * 
+     */
+    size_t                                  m_client_output_limit;
+
+    /**
+     * @brief lowest level logged, one of LOG_LEVEL_*. Levels below the
+     * one compiled in stay off.
+     * 
+     */
+    int                                     m_log_level;
+
+    /**
+     * @brief the most bytes used by keys and values, across all the
+     * shards, 0 for no limit
+     * 
+     */
+    size_t                                  m_max_memory;
+
+    /**
+     * @brief what the shards do once they reach their share of
+     * m_max_memory
+     * 
+     */
+    eviction_policy_t                       m_maxmemory_policy;
+
+    /**
+     * @brief the snapshot file, loaded at startup and written in the
+     * background, empty to keep everything in memory only
+     * 
+     */
+    std::string                             m_snapshot_file;
+
+    /**
+     * @brief seconds between two snapshots
+     * 
+     */
+    int                                     m_snapshot_interval_s;
+
+    /**
+     * @brief the prefix of the append log segments, replayed at
+     * startup after the snapshot, empty to not log the writes
+     * 
+     */
+    std::string                             m_aof_file;
+
+    /**
+     * @brief when the append log is synced
+     * 
+     */
+    appendfsync_t                           m_appendfsync;
+
+    /**
+     * @brief the port replicas connect to, 0 to have no replicas
+     * 
+     */
+    int                                     m_replication_port;
+
+    /**
+     * @brief size of the backlog of writes kept for the replicas
+     * 
+     */
+    size_t                                  m_repl_backlog_size;
+
+    /**
+     * @brief the primary this server is a read only replica of, an
+     * empty host if it is not a replica
+     * 
+     */
+    std::string                             m_replicaof_host;
+    int                                     m_replicaof_port;
+
+    /**
+     * @brief the slots of every node of the cluster, empty if this
+     * server is not in a cluster
+     * 
+     */
+    std::vector<ClusterSlotRange>           m_cluster_slots;
+
+    /**
+     * @brief the address of this node, as the clients and the other
+     * nodes reach it, an empty host for 127.0.0.1 and m_port
+     * 
+     */
+    std::string                             m_cluster_announce_host;
+    int                                     m_cluster_announce_port;
+
+    /**
+     * @brief where the threads run when they are not given CPUs below
+     * 
+     */
+    cpu_affinity_t                          m_cpu_affinity;
+
+    /**
+     * @brief the CPUs of the accepting and the epoll threads, of each
+     * pool of SERVER_MODE_PIPELINE, and of the loops, empty if not
+     * given. A loop gets one CPU of m_loop_cpus, in turn.
+     * 
+     */
+    cpu_set_t                               m_io_cpus;
+    cpu_set_t                               m_read_cpus;
+    cpu_set_t                               m_parse_cpus;
+    cpu_set_t                               m_write_cpus;
+    cpu_set_t                               m_loop_cpus;
+
+    ServerConfig():
+        m_port(PORTNUM),
+        m_epoll_batch_size(DEFAULT_EPOLL_BATCH_SIZE),
+        m_mode(SERVER_MODE_PIPELINE),
+        m_num_event_loops(0),
+        m_num_datastores(0),
+        m_datastore_type(DATASTORE_LOCKED),
+        m_scheduler(SCHEDULER_SINGLE_QUEUE),
+        m_pool_min_threads(PoolSizingConfig().m_min_threads),
+        m_pool_max_threads(PoolSizingConfig().m_max_threads),
+        m_pool_target_wait_us(PoolSizingConfig().m_target_wait_us),
+        m_pool_queue_limit(0),
+        m_overload_policy(OVERLOAD_DEFER),
+        m_client_output_limit(0),
+        m_log_level(LOG_LEVEL_INFO),
+        m_max_memory(0),
+        m_maxmemory_policy(EVICTION_LRU),
+        m_snapshot_interval_s(DEFAULT_SNAPSHOT_INTERVAL_S),
+        m_appendfsync(APPENDFSYNC_EVERYSEC),
+        m_replication_port(0),
+        m_repl_backlog_size(DEFAULT_REPL_BACKLOG_SIZE),
+        m_replicaof_port(0),
+        m_cluster_announce_port(0),
+        m_cpu_affinity(CPU_AFFINITY_NONE)
+    {
+        CPU_ZERO(&m_io_cpus);
+        CPU_ZERO(&m_read_cpus);
+        CPU_ZERO(&m_parse_cpus);
+        CPU_ZERO(&m_write_cpus);
+        CPU_ZERO(&m_loop_cpus);
+    }
+
+    /**
+     * @brief the bounds and thresholds of the pool size controller
+     * 
+     * @return PoolSizingConfig the configuration, with the maximum
+     * raised to the minimum if needed
+     */
+    PoolSizingConfig get_pool_sizing() const
+    {
+        PoolSizingConfig sizing;
+        sizing.m_min_threads = m_pool_min_threads;
+        sizing.m_max_threads = std::min(THREAD_POOL_MAX_THREADS,
+            std::max(m_pool_min_threads, m_pool_max_threads));
+        sizing.m_min_threads = std::min(sizing.m_min_threads, sizing.m_max_threads);
+        sizing.m_target_wait_us = m_pool_target_wait_us;
+        return sizing;
+    }
+
+    /**
+     * @brief number of DataStore shards to actually create
+     * 
+     * Unless configured, there are four shards per core, so that two
+     * hot keys rarely end up behind the same lock.
+     * 
+     * @return size_t the number of shards, always a power of two, and
+     * at most one per hash slot
+     */
+    size_t get_num_datastores() const
+    {
+        size_t wanted = m_num_datastores;
+        if (0 == wanted)
+            wanted = 4 * std::max(1u, std::thread::hardware_concurrency());
+        wanted = std::min(wanted, (size_t)CLUSTER_SLOTS);
+
+        size_t num = 1;
+        while (num < wanted)
+            num <<= 1;
+        return num;
+    }
+
+    /**
+     * @brief the memory limit of every shard
+     * 
+     * Keys are spread evenly over the shards, so each one gets an
+     * equal share of m_max_memory.
+     * 
+     * @return size_t the limit, 0 for no limit
+     */
+    size_t get_datastore_max_memory() const
+    {
+        if (!m_max_memory)
+            return 0;
+        return std::max((size_t)1, m_max_memory / get_num_datastores());
+    }
+
+    /**
+     * @brief number of event loop threads to actually start
+     * 
+     * @return int m_num_event_loops, or the number of cores if
+     * that is not set
+     */
+    int get_num_event_loops() const
+    {
+        if (m_num_event_loops > 0)
+            return m_num_event_loops;
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    /**
+     * @brief work out where every thread runs, and where every shard
+     * takes its memory from
+     * 
+     * The CPUs given win over m_cpu_affinity. The shards are spread
+     * over the nodes of the threads that run the commands, the parse
+     * pool or the loops, and are left alone if those threads are not
+     * pinned, or on a machine with a single node.
+     * 
+     * @param placement the placement
+     */
+    void get_cpu_placement(CpuPlacement& placement) const;
+
+    /**
+     * @brief Parse the command line arguments and override the
+     * defaults.
+     * 
+     * Arguments are of the form "--option value".
+     * 
+     * @param argc number of arguments
+     * @param argv the arguments
+     * @return true if all arguments were valid
+     * @return false on an unknown or invalid argument, or options
+     * that do not go together
+     */
+    bool parse_args(int argc, char** argv);
+
+    /**
+     * @brief print the supported command line arguments
+     * 
+     * @param progname name of the executable
+     */
+    static void usage(const char* progname);
+};
+
+#endif /* #ifndef SERVER_CONFIG_H_ */
@@ -0,0 +1,147 @@
+#include "server_stats.h"
+
+/**
+ * @brief Hands the ThreadStats of a thread back when it exits
+ *
+ */
+struct ThreadStatsHandle
+{
+    ThreadStats*        m_stats;
+
+    ThreadStatsHandle(): m_stats(nullptr) {}
+
+    ~ThreadStatsHandle()
+    {
+        if (m_stats)
+            ServerStats::get()->release(m_stats);
+    }
+};
+
+static thread_local ThreadStatsHandle t_stats;
+
+ServerStats* ServerStats::get()
+{
+    static ServerStats* stats = new ServerStats;
+    return stats;
+}
+
+ThreadStats* ServerStats::acquire()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto stats: m_threads)
+    {
+        if (!stats->m_is_in_use)
+        {
+            stats->m_is_in_use = true;
+            return stats;
+        }
+    }
+
+    ThreadStats* stats = new (std::nothrow) ThreadStats;
+    if (!stats)
+        return nullptr;
+
+    size_t num_shards = m_num_shards.load();
+    if (num_shards)
+    {
+        stats->m_shards = new (std::nothrow) ShardCounters[num_shards];
+        if (stats->m_shards)
+            stats->m_num_shards = num_shards;
+    }
+
+    try
+    {
+        m_threads.push_back(stats);
+    }
+    catch (...)
+    {
+        delete[] stats->m_shards;
+        delete stats;
+        return nullptr;
+    }
+
+    stats->m_is_in_use = true;
+    return stats;
+}
+
+ThreadStats* ServerStats::get_thread_stats()
+{
+    ThreadStatsHandle& handle = t_stats;
+    if (!handle.m_stats)
+        handle.m_stats = acquire();
+    return handle.m_stats;
+}
+
+void ServerStats::release(ThreadStats* stats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    stats->m_is_in_use = false;
+}
+
+void ServerStats::record_request(const State& state)
+{
+    ThreadStats* stats = get_thread_stats();
+    if (!stats)
+        return;
+
+    std::int64_t now = now_ns();
+    std::int64_t first = 0;
+    int previous = -1;
+
+    // A state lasts until the next timed state that was entered
+    for (int i = STATE_FIRST_TIMED; i <= STATE_LAST_TIMED; i++)
+    {
+        std::int64_t time = state.m_stage_time[i];
+        if (!time)
+            continue;
+
+        if (previous < 0)
+            first = time;
+        else
+            stats->m_stage_histograms[previous].record(
+                time - state.m_stage_time[previous]);
+        previous = i;
+    }
+
+    if (previous < 0)
+        return;
+
+    stats->m_stage_histograms[previous].record(
+        now - state.m_stage_time[previous]);
+    stats->m_request_histogram.record(now - first);
+}
+
+void ServerStats::get_latency(LatencySnapshot* stages, LatencySnapshot& request)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (auto stats: m_threads)
+    {
+        for (int i = 0; i < STATE_NUM_STATES; i++)
+            stages[i].add(stats->m_stage_histograms[i]);
+        request.add(stats->m_request_histogram);
+    }
+}
+
+std::vector<ShardTotals> ServerStats::get_shard_totals()
+{
+    std::vector<ShardTotals> totals(m_num_shards.load());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto stats: m_threads)
+    {
+        size_t n = std::min(stats->m_num_shards, totals.size());
+        for (size_t i = 0; i < n; i++)
+        {
+            const ShardCounters& counters = stats->m_shards[i];
+            totals[i].m_gets += counters.m_gets.load(std::memory_order_relaxed);
+            totals[i].m_hits += counters.m_hits.load(std::memory_order_relaxed);
+            totals[i].m_misses += counters.m_misses.load(std::memory_order_relaxed);
+            totals[i].m_sets += counters.m_sets.load(std::memory_order_relaxed);
+            totals[i].m_dels += counters.m_dels.load(std::memory_order_relaxed);
+        }
+    }
+
+    return totals;
+}
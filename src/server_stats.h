@@ -0,0 +1,222 @@
+#ifndef SERVER_STATS_H_
+#define SERVER_STATS_H_
+
+#include "common_include.h"
+#include "latency_histogram.h"
+#include "state.h"
+
+/**
+ * @brief Operations one thread ran against one data store shard
+ *
+ * Like the histograms, the counters are only written by their thread.
+ *
+ */
+struct ShardCounters
+{
+    std::atomic<std::uint64_t>      m_gets;
+    std::atomic<std::uint64_t>      m_hits;
+    std::atomic<std::uint64_t>      m_misses;
+    std::atomic<std::uint64_t>      m_sets;
+    std::atomic<std::uint64_t>      m_dels;
+
+    ShardCounters(): m_gets(0), m_hits(0), m_misses(0), m_sets(0), m_dels(0) {}
+
+    static void increment(std::atomic<std::uint64_t>& counter, std::uint64_t n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+
+    void count_get(bool is_hit)
+    {
+        increment(m_gets);
+        increment(is_hit ? m_hits : m_misses);
+    }
+
+    void count_set() { increment(m_sets); }
+
+    void count_del(bool is_hit)
+    {
+        increment(m_dels);
+        increment(is_hit ? m_hits : m_misses);
+    }
+
+    /**
+     * @brief count the keys of a batch that went to this shard
+     *
+     */
+    void count_gets(std::uint64_t n, std::uint64_t hits)
+    {
+        increment(m_gets, n);
+        increment(m_hits, hits);
+        increment(m_misses, n - hits);
+    }
+
+    void count_sets(std::uint64_t n) { increment(m_sets, n); }
+
+    void count_dels(std::uint64_t n, std::uint64_t hits)
+    {
+        increment(m_dels, n);
+        increment(m_hits, hits);
+        increment(m_misses, n - hits);
+    }
+};
+
+/**
+ * @brief The sum of the ShardCounters of all threads for one shard
+ *
+ */
+struct ShardTotals
+{
+    std::uint64_t                   m_gets;
+    std::uint64_t                   m_hits;
+    std::uint64_t                   m_misses;
+    std::uint64_t                   m_sets;
+    std::uint64_t                   m_dels;
+
+    ShardTotals(): m_gets(0), m_hits(0), m_misses(0), m_sets(0), m_dels(0) {}
+
+    std::uint64_t get_ops() const { return m_gets + m_sets + m_dels; }
+};
+
+/**
+ * @brief The statistics kept by one thread
+ *
+ */
+struct ThreadStats
+{
+    /**
+     * @brief time a request spent in each state, indexed by StateState
+     *
+     */
+    LatencyHistogram                m_stage_histograms[STATE_NUM_STATES];
+
+    /**
+     * @brief time from the first timed state to the response being
+     * written
+     *
+     */
+    LatencyHistogram                m_request_histogram;
+
+    /**
+     * @brief one entry per shard
+     *
+     */
+    ShardCounters*                  m_shards;
+    size_t                          m_num_shards;
+
+    /**
+     * @brief set while a thread owns this, protected by the mutex of
+     * ServerStats
+     *
+     */
+    bool                            m_is_in_use;
+
+    ThreadStats(): m_shards(nullptr), m_num_shards(0), m_is_in_use(false) {}
+};
+
+/**
+ * @brief Request latencies and data store counters of the server
+ *
+ * Every thread records into its own ThreadStats, so that recording
+ * never contends with other threads. The ThreadStats of a thread that
+ * exits is handed to the next new thread, its counts carry on adding
+ * up. INFO sums up all of them.
+ *
+ * There is one instance, which lives as long as the process, so that
+ * threads exiting late never use a dead object.
+ *
+ */
+class ServerStats
+{
+private:
+    /**
+     * @brief protects m_threads and ThreadStats::m_is_in_use
+     *
+     */
+    std::mutex                      m_mutex;
+    std::vector<ThreadStats*>       m_threads;
+
+    std::atomic<size_t>             m_num_shards;
+
+    ServerStats(): m_num_shards(0) {}
+
+    /**
+     * @brief find or create a ThreadStats for the calling thread
+     *
+     * @return ThreadStats* the statistics, or nullptr if out of memory
+     */
+    ThreadStats* acquire();
+
+public:
+    /**
+     * @brief the instance
+     *
+     * @return ServerStats* the instance
+     */
+    static ServerStats* get();
+
+    /**
+     * @brief set the number of data store shards, before any
+     * operation on them is counted
+     *
+     * @param num_shards the number of shards
+     */
+    void set_num_shards(size_t num_shards)
+    {
+        m_num_shards.store(num_shards);
+    }
+
+    /**
+     * @brief the statistics of the calling thread
+     *
+     * @return ThreadStats* the statistics, or nullptr if out of memory
+     */
+    ThreadStats* get_thread_stats();
+
+    /**
+     * @brief hand back the statistics of an exiting thread
+     *
+     * @param stats the statistics
+     */
+    void release(ThreadStats* stats);
+
+    /**
+     * @brief the counters of the calling thread for a shard
+     *
+     * @param shard the index of the shard
+     * @return ShardCounters* the counters, or nullptr
+     */
+    ShardCounters* get_shard_counters(size_t shard)
+    {
+        ThreadStats* stats = get_thread_stats();
+        if (!stats || shard >= stats->m_num_shards)
+            return nullptr;
+        return &stats->m_shards[shard];
+    }
+
+    /**
+     * @brief record the states a request went through, once its
+     * response has been written
+     *
+     * @param state the state of the connection
+     */
+    void record_request(const State& state);
+
+    /**
+     * @brief add up the latencies of all threads
+     *
+     * @param stages the time spent in each state, indexed by StateState
+     * @param request the time of whole requests
+     */
+    void get_latency(LatencySnapshot* stages, LatencySnapshot& request);
+
+    /**
+     * @brief add up the counters of all threads
+     *
+     * @return std::vector<ShardTotals> one entry per shard
+     */
+    std::vector<ShardTotals> get_shard_totals();
+};
+
+#endif /* #ifndef SERVER_STATS_H_ */
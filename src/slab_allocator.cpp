@@ -0,0 +1,148 @@
+#include "slab_allocator.h"
+#include "cpu_topology.h"
+
+/**
+ * @brief the chunk size of every class
+ *
+ */
+static const std::uint32_t g_chunk_sizes[SLAB_NUM_CLASSES] = {
+    16, 24, 32, 40, 48, 56, 64,
+    80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048
+};
+
+/**
+ * @brief the class of every size, in steps of 8 bytes
+ *
+ */
+struct ClassTable
+{
+    std::uint8_t        m_classes[SLAB_MAX_CHUNK_SIZE / 8 + 1];
+
+    ClassTable()
+    {
+        int c = 0;
+        for (int i = 0; i <= SLAB_MAX_CHUNK_SIZE / 8; i++)
+        {
+            while (g_chunk_sizes[c] < (std::uint32_t)i * 8)
+                c++;
+            m_classes[i] = (std::uint8_t)c;
+        }
+    }
+};
+
+static const ClassTable g_class_table;
+
+int SlabAllocator::get_class(size_t size)
+{
+    return g_class_table.m_classes[(size + 7) / 8];
+}
+
+size_t SlabAllocator::get_chunk_size(size_t size)
+{
+    if (size > SLAB_MAX_CHUNK_SIZE)
+        return size;
+    return g_chunk_sizes[get_class(size)];
+}
+
+SlabAllocator::SlabAllocator():
+    m_used(0),
+    m_numa_node(-1)
+{
+    for (auto& size_class: m_classes)
+    {
+        size_class.m_free = nullptr;
+        size_class.m_next = nullptr;
+        size_class.m_end = nullptr;
+    }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    for (void* slab: m_slabs)
+        free_slab(slab);
+}
+
+void SlabAllocator::free_slab(void* slab)
+{
+    if (m_numa_node >= 0)
+        ::operator delete(slab, std::align_val_t(SLAB_NUMA_ALIGNMENT));
+    else
+        ::operator delete(slab);
+}
+
+void* SlabAllocator::allocate(size_t size)
+{
+    if (size > SLAB_MAX_CHUNK_SIZE)
+    {
+        void* p = ::operator new(size, std::nothrow);
+        if (p)
+            m_used += size;
+        return p;
+    }
+
+    int c = get_class(size);
+    SizeClass& size_class = m_classes[c];
+    size_t chunk_size = g_chunk_sizes[c];
+
+    if (size_class.m_free)
+    {
+        FreeChunk* chunk = size_class.m_free;
+        size_class.m_free = chunk->m_next;
+        m_used += chunk_size;
+        return chunk;
+    }
+
+    if ((size_t)(size_class.m_end - size_class.m_next) < chunk_size)
+    {
+        void* slab;
+        if (m_numa_node >= 0)
+        {
+            // Bound before the chunks are first written to
+            slab = ::operator new(SLAB_SIZE, std::align_val_t(SLAB_NUMA_ALIGNMENT), std::nothrow);
+            if (slab)
+                bind_memory_to_node(slab, SLAB_SIZE, m_numa_node);
+        }
+        else
+            slab = ::operator new(SLAB_SIZE, std::nothrow);
+        if (!slab)
+            return nullptr;
+
+        try
+        {
+            m_slabs.push_back(slab);
+        }
+        catch (...)
+        {
+            free_slab(slab);
+            return nullptr;
+        }
+
+        size_class.m_next = static_cast<char*>(slab);
+        size_class.m_end = size_class.m_next + SLAB_SIZE;
+    }
+
+    void* p = size_class.m_next;
+    size_class.m_next += chunk_size;
+    m_used += chunk_size;
+    return p;
+}
+
+void SlabAllocator::free(void* p, size_t size)
+{
+    if (size > SLAB_MAX_CHUNK_SIZE)
+    {
+        ::operator delete(p);
+        m_used -= size;
+        return;
+    }
+
+    int c = get_class(size);
+    FreeChunk* chunk = static_cast<FreeChunk*>(p);
+    chunk->m_next = m_classes[c].m_free;
+    m_classes[c].m_free = chunk;
+    m_used -= g_chunk_sizes[c];
+}
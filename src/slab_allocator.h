@@ -0,0 +1,164 @@
+#ifndef SLAB_ALLOCATOR_H_
+#define SLAB_ALLOCATOR_H_
+
+#include "common_include.h"
+#include <cstdint>
+
+/**
+ * @brief size of the slabs that chunks are carved from
+ *
+ */
+#define SLAB_SIZE (64 * 1024)
+
+/**
+ * @brief largest chunk served from slabs, larger allocations go to the
+ * general purpose allocator
+ *
+ */
+#define SLAB_MAX_CHUNK_SIZE 2048
+
+/**
+ * @brief number of chunk sizes
+ *
+ */
+#define SLAB_NUM_CLASSES 27
+
+/**
+ * @brief alignment of the slabs bound to a NUMA node, so that a slab
+ * is made of whole pages
+ *
+ */
+#define SLAB_NUMA_ALIGNMENT 4096
+
+/**
+ * @brief Allocates small objects of many sizes, with little overhead
+ *
+ * Memory comes in SLAB_SIZE slabs, and every slab is cut into chunks
+ * of a single size. Chunk sizes grow by about 25% from one class to
+ * the next, so at most a fifth of a chunk is wasted, and there are no
+ * per allocation headers. Freed chunks go to a free list of their
+ * class, and slabs are only given back when the allocator is
+ * destroyed.
+ *
+ * The slabs can be bound to a NUMA node, see set_numa_node(). Large
+ * allocations are not, they come from wherever the general purpose
+ * allocator takes them.
+ *
+ * The caller passes the size of an allocation back when freeing it.
+ * The allocator is not thread safe, the owner serializes the calls.
+ *
+ */
+class SlabAllocator
+{
+private:
+    struct FreeChunk
+    {
+        FreeChunk*          m_next;
+    };
+
+    struct SizeClass
+    {
+        /**
+         * @brief freed chunks of this class
+         *
+         */
+        FreeChunk*          m_free;
+
+        /**
+         * @brief the part of the last slab of this class that was
+         * never handed out
+         *
+         */
+        char*               m_next;
+        char*               m_end;
+    };
+
+    SizeClass                       m_classes[SLAB_NUM_CLASSES];
+
+    /**
+     * @brief all the slabs, freed with the allocator
+     *
+     */
+    std::vector<void*>              m_slabs;
+
+    /**
+     * @brief bytes handed out and not freed, counting whole chunks
+     *
+     */
+    size_t                          m_used;
+
+    /**
+     * @brief the node the slabs come from, -1 for any
+     *
+     */
+    int                             m_numa_node;
+
+    /**
+     * @brief the class of a size
+     *
+     * @param size the size, at most SLAB_MAX_CHUNK_SIZE
+     * @return int the index of the smallest class that fits it
+     */
+    static int get_class(size_t size);
+
+    /**
+     * @brief give a slab back to the general purpose allocator
+     *
+     */
+    void free_slab(void* slab);
+
+public:
+    SlabAllocator();
+
+    ~SlabAllocator();
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    /**
+     * @brief allocate memory, aligned to 8 bytes
+     *
+     * @param size the size
+     * @return void* the memory, or nullptr if out of memory
+     */
+    void* allocate(size_t size);
+
+    /**
+     * @brief free memory
+     *
+     * @param p memory returned by allocate()
+     * @param size the size it was allocated with
+     */
+    void free(void* p, size_t size);
+
+    /**
+     * @brief the size that an allocation really takes
+     *
+     * @param size the size asked for
+     * @return size_t the size of its chunk
+     */
+    static size_t get_chunk_size(size_t size);
+
+    /**
+     * @brief get the slabs from a NUMA node
+     *
+     * Must be called before the first allocation.
+     *
+     * @param node the node id, -1 for any
+     */
+    void set_numa_node(int node) { m_numa_node = node; }
+
+    /**
+     * @brief bytes in use, by whole chunks and large allocations
+     *
+     */
+    size_t get_used() const { return m_used; }
+
+    /**
+     * @brief bytes held in slabs, used or not
+     *
+     */
+    size_t get_reserved() const { return m_slabs.size() * SLAB_SIZE; }
+};
+
+#endif /* #ifndef SLAB_ALLOCATOR_H_ */
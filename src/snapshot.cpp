@@ -0,0 +1,630 @@
+#include "snapshot.h"
+#include "append_log.h"
+#include "logger.h"
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief the snapshot being written, and the records not written yet
+ *
+ */
+struct SnapshotOutput
+{
+    int                 m_fd;
+    std::string         m_buffer;
+
+    /**
+     * @brief bytes already written to the file
+     *
+     */
+    std::uint64_t       m_written;
+
+    std::uint64_t       m_num_keys;
+
+    /**
+     * @brief set when a record could not be buffered
+     *
+     */
+    bool                m_is_failed;
+
+    explicit SnapshotOutput(int fd):
+        m_fd(fd),
+        m_written(0),
+        m_num_keys(0),
+        m_is_failed(false)
+    {
+    }
+
+    /**
+     * @brief offset in the file of the next byte appended
+     *
+     */
+    std::uint64_t get_offset() const
+    {
+        return m_written + m_buffer.size();
+    }
+
+    /**
+     * @brief append bytes to the buffer
+     *
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool append(const void* data, size_t size)
+    {
+        try
+        {
+            m_buffer.append(static_cast<const char*>(data), size);
+        }
+        catch (...)
+        {
+            LOG_ERROR("Out of memory");
+            m_is_failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief write the buffer to the file
+     *
+     * @return true on success
+     * @return false on a write error
+     */
+    bool flush()
+    {
+        size_t done = 0;
+        while (done < m_buffer.size())
+        {
+            ssize_t n = ::write(m_fd, m_buffer.data() + done, m_buffer.size() - done);
+            if (n < 0)
+            {
+                if (EINTR == errno)
+                    continue;
+                LOG_ERROR("Snapshot write failed, errno = " << errno);
+                return false;
+            }
+            done += n;
+        }
+
+        m_written += m_buffer.size();
+        m_buffer.clear();
+        return true;
+    }
+};
+
+/**
+ * @brief append an unsigned integer as a varint
+ *
+ * @param output the snapshot
+ * @param v the integer
+ * @return true on success
+ */
+static bool append_varint(SnapshotOutput& output, std::uint64_t v)
+{
+    std::uint8_t bytes[10];
+    return output.append(bytes, encode_varint(v, bytes));
+}
+
+/**
+ * @brief the entry_visitor_t that appends a record
+ *
+ */
+static void append_record(
+    std::string_view key,
+    std::string_view value,
+    std::int64_t expire_at,
+    void* context)
+{
+    SnapshotOutput& output = *static_cast<SnapshotOutput*>(context);
+    std::uint8_t flags = EXPIRE_NEVER != expire_at ? SNAPSHOT_RECORD_EXPIRES : 0;
+
+    bool is_ok = output.append(&flags, 1) && \
+        append_varint(output, key.size()) && \
+        append_varint(output, value.size()) && \
+        (!flags || output.append(&expire_at, sizeof(expire_at))) && \
+        output.append(key.data(), key.size()) && \
+        output.append(value.data(), value.size());
+    if (is_ok)
+        output.m_num_keys++;
+}
+
+bool write_snapshot(
+    int fd,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    std::int64_t created_at,
+    std::uint64_t& num_keys,
+    std::uint64_t& num_bytes)
+{
+    SnapshotOutput output(fd);
+    std::vector<SnapshotSection> sections;
+    bool is_ok = true;
+    try
+    {
+        output.m_buffer.reserve(2 * SNAPSHOT_WRITE_SIZE);
+        sections.resize(num_datastores);
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        is_ok = false;
+    }
+
+    SnapshotHeader header;
+    memcpy(header.m_magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    header.m_version = SNAPSHOT_VERSION;
+    header.m_num_sections = (std::uint32_t)num_datastores;
+    header.m_created_at = created_at;
+    is_ok = is_ok && output.append(&header, sizeof(header));
+
+    for (size_t i = 0; is_ok && i < num_datastores; i++)
+    {
+        SnapshotSection& section = sections[i];
+        section.m_offset = output.get_offset();
+        std::uint64_t num_keys = output.m_num_keys;
+
+        // Records are only buffered with the data store locked, the
+        // writes happen in between
+        size_t cursor = 0;
+        do
+        {
+            cursor = datastores[i]->scan(cursor, SNAPSHOT_SCAN_BUCKETS, append_record, &output);
+            if (output.m_is_failed)
+                is_ok = false;
+            else if (output.m_buffer.size() >= SNAPSHOT_WRITE_SIZE)
+                is_ok = output.flush();
+        } while (is_ok && cursor);
+
+        section.m_length = output.get_offset() - section.m_offset;
+        section.m_num_keys = output.m_num_keys - num_keys;
+    }
+
+    SnapshotTrailer trailer;
+    trailer.m_sections_offset = output.get_offset();
+    memcpy(trailer.m_magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    is_ok = is_ok && \
+        output.append(sections.data(), sections.size() * sizeof(SnapshotSection)) && \
+        output.append(&trailer, sizeof(trailer)) && \
+        output.flush();
+
+    num_keys = output.m_num_keys;
+    num_bytes = output.m_written;
+    return is_ok;
+}
+
+SnapshotWriter::SnapshotWriter(
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    const std::string& path,
+    int interval_s,
+    AppendLog* append_log):
+    m_datastores(datastores),
+    m_num_datastores(num_datastores),
+    m_path(path),
+    m_append_log(append_log),
+    m_interval_s(interval_s),
+    m_mutex(PTHREAD_MUTEX_INITIALIZER),
+    m_is_requested(false),
+    m_is_stopping(false),
+    m_is_running(false),
+    m_thread_id(),
+    m_is_saving(false),
+    m_num_saved(0),
+    m_num_failed(0),
+    m_last_save_time(0),
+    m_last_save_keys(0),
+    m_last_save_bytes(0)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+bool SnapshotWriter::write()
+{
+    std::unique_lock lock(m_write_mutex);
+    m_is_saving = true;
+
+    // The writes logged before the walk are all in the snapshot, the
+    // segments that hold them can go once it is complete
+    std::uint64_t segment = 0;
+    if (m_append_log && m_append_log->is_persistent() && \
+        !m_append_log->start_segment(segment))
+        LOG_WARN("Cannot start a new append log segment, the log is not trimmed");
+
+    std::int64_t start = unix_time_ms();
+    std::string tmp_path = m_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        LOG_ERROR("Cannot create " << tmp_path << ", errno = " << errno);
+        m_num_failed++;
+        m_is_saving = false;
+        return false;
+    }
+
+    std::uint64_t num_keys = 0;
+    std::uint64_t num_bytes = 0;
+    bool is_ok = write_snapshot(fd, m_datastores, m_num_datastores, start, num_keys, num_bytes);
+
+    if (is_ok && fsync(fd))
+    {
+        LOG_ERROR("Snapshot fsync failed, errno = " << errno);
+        is_ok = false;
+    }
+    close(fd);
+
+    if (is_ok && rename(tmp_path.c_str(), m_path.c_str()))
+    {
+        LOG_ERROR("Cannot rename " << tmp_path << " to " << m_path << ", errno = " << errno);
+        is_ok = false;
+    }
+
+    if (!is_ok)
+    {
+        unlink(tmp_path.c_str());
+        m_num_failed++;
+        m_is_saving = false;
+        return false;
+    }
+
+    // The rename only survives a crash once the directory is synced
+    size_t slash = m_path.rfind('/');
+    std::string directory = std::string::npos == slash ? "." : m_path.substr(0, slash + 1);
+    int dir_fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0)
+    {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    if (segment)
+        m_append_log->remove_segments_before(segment);
+
+    m_last_save_time = start;
+    m_last_save_keys = num_keys;
+    m_last_save_bytes = num_bytes;
+    m_num_saved++;
+    m_is_saving = false;
+    LOG_INFO("Saved " << num_keys << " keys to " << m_path << " in " \
+        << unix_time_ms() - start << "ms");
+    return true;
+}
+
+void SnapshotWriter::loop()
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    pthread_mutex_lock(&m_mutex);
+    while (!m_is_stopping)
+    {
+        deadline.tv_sec += m_interval_s;
+        while (!m_is_stopping && !m_is_requested)
+        {
+            if (!m_interval_s)
+                pthread_cond_wait(&m_cond, &m_mutex);
+            else if (ETIMEDOUT == pthread_cond_timedwait(&m_cond, &m_mutex, &deadline))
+                break;
+        }
+
+        if (m_is_stopping)
+            break;
+
+        m_is_requested = false;
+        pthread_mutex_unlock(&m_mutex);
+        write();
+        pthread_mutex_lock(&m_mutex);
+
+        // The next snapshot is an interval after this one ended
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void* SnapshotWriter::thread_start_routine(void* arg)
+{
+    static_cast<SnapshotWriter*>(arg)->loop();
+    return nullptr;
+}
+
+bool SnapshotWriter::start()
+{
+    int retval;
+
+    if (m_is_running)
+        return true;
+
+    m_is_stopping = false;
+    if (0 != (retval = pthread_create(
+                        &m_thread_id,
+                        NULL,
+                        SnapshotWriter::thread_start_routine,
+                        this)))
+    {
+        LOG_ERROR("pthread_create failed with rc = " << retval);
+        return false;
+    }
+
+    m_is_running = true;
+    return true;
+}
+
+void SnapshotWriter::stop()
+{
+    if (!m_is_running)
+        return;
+
+    pthread_mutex_lock(&m_mutex);
+    m_is_stopping = true;
+    pthread_cond_broadcast(&m_cond);
+    pthread_mutex_unlock(&m_mutex);
+
+    pthread_join(m_thread_id, nullptr);
+    m_is_running = false;
+}
+
+bool SnapshotWriter::request()
+{
+    pthread_mutex_lock(&m_mutex);
+    bool is_busy = m_is_saving;
+    if (!is_busy)
+    {
+        m_is_requested = true;
+        pthread_cond_broadcast(&m_cond);
+    }
+    pthread_mutex_unlock(&m_mutex);
+    return !is_busy;
+}
+
+/**
+ * @brief a section of a snapshot, loaded by its own thread
+ *
+ */
+struct SnapshotLoadJob
+{
+    const char*                 m_begin;
+    const char*                 m_end;
+    DataStoreInterface**        m_datastores;
+    size_t                      m_num_datastores;
+    std::int64_t                m_now;
+
+    size_t                      m_num_loaded;
+
+    /**
+     * @brief keys the data stores refused, because of their memory
+     * limit
+     *
+     */
+    size_t                      m_num_dropped;
+    bool                        m_is_ok;
+};
+
+static void* load_section(void* arg)
+{
+    SnapshotLoadJob& job = *static_cast<SnapshotLoadJob*>(arg);
+    const char* p = job.m_begin;
+    const char* end = job.m_end;
+
+    while (p < end)
+    {
+        std::uint8_t flags = *p++;
+        std::uint64_t key_length;
+        std::uint64_t value_length;
+        if (!decode_varint(p, end, key_length) || !decode_varint(p, end, value_length))
+            return nullptr;
+
+        std::int64_t expire_at = EXPIRE_NEVER;
+        if (flags & SNAPSHOT_RECORD_EXPIRES)
+        {
+            if (end - p < (ptrdiff_t)sizeof(expire_at))
+                return nullptr;
+            memcpy(&expire_at, p, sizeof(expire_at));
+            p += sizeof(expire_at);
+        }
+
+        if ((std::uint64_t)(end - p) < key_length || \
+            (std::uint64_t)(end - p) - key_length < value_length)
+            return nullptr;
+
+        std::string_view key(p, key_length);
+        std::string_view value(p + key_length, value_length);
+        p += key_length + value_length;
+
+        if (EXPIRE_NEVER != expire_at && expire_at <= job.m_now)
+            continue;
+
+        HashedKey hashed_key(key);
+        if (job.m_datastores[get_partition(hashed_key, job.m_num_datastores)]->set(
+                hashed_key, value, expire_at))
+            job.m_num_loaded++;
+        else
+            job.m_num_dropped++;
+    }
+
+    job.m_is_ok = true;
+    return nullptr;
+}
+
+/**
+ * @brief check the structure of a mapped snapshot
+ *
+ * @param data the snapshot
+ * @param size its size
+ * @param sections set to the table of sections
+ * @return true if the snapshot is well formed
+ * @return false otherwise
+ */
+static bool read_sections(
+    const char* data,
+    size_t size,
+    std::vector<SnapshotSection>& sections)
+{
+    SnapshotHeader header;
+    SnapshotTrailer trailer;
+    if (size < sizeof(header) + sizeof(trailer))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+    if (memcmp(header.m_magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) || \
+        memcmp(trailer.m_magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) || \
+        SNAPSHOT_VERSION != header.m_version)
+        return false;
+
+    std::uint64_t table_size = (std::uint64_t)header.m_num_sections * sizeof(SnapshotSection);
+    if (trailer.m_sections_offset < sizeof(header) || \
+        trailer.m_sections_offset + table_size + sizeof(trailer) != size)
+        return false;
+
+    sections.resize(header.m_num_sections);
+    memcpy(sections.data(), data + trailer.m_sections_offset, table_size);
+    for (auto& section: sections)
+    {
+        if (section.m_offset < sizeof(header) || \
+            section.m_offset > trailer.m_sections_offset || \
+            section.m_length > trailer.m_sections_offset - section.m_offset)
+            return false;
+    }
+    return true;
+}
+
+bool load_snapshot_data(
+    const char* data,
+    size_t size,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_loaded)
+{
+    num_loaded = 0;
+
+    std::int64_t start = unix_time_ms();
+    std::vector<SnapshotSection> sections;
+    std::vector<SnapshotLoadJob> jobs;
+    std::vector<pthread_t> threads;
+    bool is_ok = true;
+    try
+    {
+        is_ok = read_sections(data, size, sections);
+        jobs.resize(sections.size());
+        threads.resize(sections.size());
+    }
+    catch (...)
+    {
+        is_ok = false;
+    }
+
+    if (!is_ok)
+        return false;
+
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        const char* begin = data + sections[i].m_offset;
+        jobs[i] = SnapshotLoadJob{
+            begin, begin + sections[i].m_length,
+            datastores, num_datastores, start, 0, 0, false};
+    }
+
+    std::vector<bool> is_started(sections.size(), false);
+    for (size_t i = 0; i < sections.size(); i++)
+        is_started[i] = 0 == pthread_create(&threads[i], NULL, load_section, &jobs[i]);
+
+    size_t num_dropped = 0;
+    for (size_t i = 0; i < sections.size(); i++)
+    {
+        if (is_started[i])
+            pthread_join(threads[i], nullptr);
+        else
+            load_section(&jobs[i]);
+
+        is_ok = is_ok && jobs[i].m_is_ok;
+        num_loaded += jobs[i].m_num_loaded;
+        num_dropped += jobs[i].m_num_dropped;
+    }
+
+    if (num_dropped)
+        LOG_WARN("Dropped " << num_dropped << " keys of the snapshot, over the memory limit");
+    return is_ok;
+}
+
+bool load_snapshot_fd(
+    int fd,
+    const std::string& name,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_loaded)
+{
+    num_loaded = 0;
+
+    struct stat st;
+    if (fstat(fd, &st))
+    {
+        LOG_ERROR("Cannot stat " << name << ", errno = " << errno);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    if (size < sizeof(SnapshotHeader) + sizeof(SnapshotTrailer))
+    {
+        LOG_ERROR("Snapshot " << name << " is corrupt");
+        return false;
+    }
+
+    void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED == map)
+    {
+        LOG_ERROR("Cannot map " << name << ", errno = " << errno);
+        return false;
+    }
+
+    // Every section is read once from start to end
+    madvise(map, size, MADV_SEQUENTIAL);
+    madvise(map, size, MADV_WILLNEED);
+
+    std::int64_t start = unix_time_ms();
+    bool is_ok = load_snapshot_data(
+                    static_cast<const char*>(map), size,
+                    datastores, num_datastores, num_loaded);
+    munmap(map, size);
+
+    if (!is_ok)
+    {
+        LOG_ERROR("Snapshot " << name << " is corrupt");
+        return false;
+    }
+
+    LOG_INFO("Loaded " << num_loaded << " keys from " << name << " in " \
+        << unix_time_ms() - start << "ms");
+    return true;
+}
+
+bool load_snapshot(
+    const std::string& path,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_loaded)
+{
+    num_loaded = 0;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (ENOENT == errno)
+        {
+            LOG_INFO("No snapshot at " << path << ", starting empty");
+            return true;
+        }
+        LOG_ERROR("Cannot open " << path << ", errno = " << errno);
+        return false;
+    }
+
+    bool is_ok = load_snapshot_fd(fd, path, datastores, num_datastores, num_loaded);
+    close(fd);
+    return is_ok;
+}
@@ -0,0 +1,366 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include "common_include.h"
+#include "data_store.h"
+#include <pthread.h>
+#include <ctime>
+
+class AppendLog;
+
+/**
+ * @brief identifies a snapshot file, at its start and at its end
+ *
+ */
+#define SNAPSHOT_MAGIC "KVSNAP01"
+#define SNAPSHOT_MAGIC_SIZE 8
+
+#define SNAPSHOT_VERSION 1
+
+/**
+ * @brief buckets visited per lock of a data store while writing a
+ * snapshot
+ *
+ */
+#define SNAPSHOT_SCAN_BUCKETS 256
+
+/**
+ * @brief records are gathered into writes of at least this size
+ *
+ */
+#define SNAPSHOT_WRITE_SIZE (1024 * 1024)
+
+/**
+ * @brief flags of a snapshot record
+ *
+ */
+#define SNAPSHOT_RECORD_EXPIRES 0x1
+
+/**
+ * @brief encode an unsigned integer as a LEB128 varint, the length
+ * encoding of snapshots and of the append log
+ *
+ * @param v the integer
+ * @param bytes room for the varint, at least 10 bytes
+ * @return size_t the length of the varint
+ */
+inline size_t encode_varint(std::uint64_t v, std::uint8_t* bytes)
+{
+    size_t n = 0;
+    do
+    {
+        bytes[n] = v & 0x7f;
+        v >>= 7;
+        if (v)
+            bytes[n] |= 0x80;
+        n++;
+    } while (v);
+    return n;
+}
+
+/**
+ * @brief decode a LEB128 varint
+ *
+ * @param p the varint, moved past it
+ * @param end the end of the data
+ * @param v set to the integer
+ * @return true on success
+ * @return false if the data ends too early
+ */
+inline bool decode_varint(const char*& p, const char* end, std::uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        if (p == end)
+            return false;
+        std::uint8_t byte = *p++;
+        v |= (std::uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * @brief The start of a snapshot file
+ *
+ * A snapshot is a header, one section of records per data store, the
+ * table of the sections, and a trailer that points to the table.
+ * Sections are loaded in parallel, and the number of data stores may
+ * change between the writing and the loading of a snapshot. Integers
+ * are in the byte order of the machine.
+ *
+ * A record is a flags byte, the lengths of the key and of the value
+ * as LEB128 varints, the expiry time as a 64 bit integer if the
+ * SNAPSHOT_RECORD_EXPIRES flag is set, then the key and the value.
+ *
+ */
+struct SnapshotHeader
+{
+    char                    m_magic[SNAPSHOT_MAGIC_SIZE];
+    std::uint32_t           m_version;
+    std::uint32_t           m_num_sections;
+
+    /**
+     * @brief unix time in ms at which the snapshot started
+     *
+     */
+    std::int64_t            m_created_at;
+};
+
+/**
+ * @brief An entry of the table of sections
+ *
+ */
+struct SnapshotSection
+{
+    std::uint64_t           m_offset;
+    std::uint64_t           m_length;
+    std::uint64_t           m_num_keys;
+};
+
+/**
+ * @brief The end of a snapshot file
+ *
+ */
+struct SnapshotTrailer
+{
+    /**
+     * @brief offset of the table of sections
+     *
+     */
+    std::uint64_t           m_sections_offset;
+    char                    m_magic[SNAPSHOT_MAGIC_SIZE];
+};
+
+/**
+ * @brief Writes snapshots of the data stores, in the background
+ *
+ * There is no fork: the writer walks every data store with scan(), a
+ * few buckets per lock, so that requests go on while it writes. The
+ * snapshot is therefore not a single point in time, a key written
+ * during the walk may be in either state. Records are gathered into
+ * large sequential writes to a temporary file, which replaces the
+ * snapshot once it is complete and synced.
+ *
+ * A snapshot is written every interval, and when requested. With an
+ * append log, a snapshot starts a new segment of the log before its
+ * walk, and deletes the older segments once it is complete.
+ *
+ */
+class SnapshotWriter
+{
+private:
+    DataStoreInterface**                    m_datastores;
+    size_t                                  m_num_datastores;
+    std::string                             m_path;
+
+    /**
+     * @brief the append log trimmed by the snapshots, nullptr if
+     * there is none
+     *
+     */
+    AppendLog*                              m_append_log;
+
+    /**
+     * @brief seconds between two snapshots, 0 to only write the
+     * requested ones
+     *
+     */
+    int                                     m_interval_s;
+
+    /**
+     * @brief serializes the snapshots, between SAVE and the thread
+     *
+     */
+    std::mutex                              m_write_mutex;
+
+    /**
+     * @brief used with m_cond, on the monotonic clock, to wait for the
+     * next snapshot, and to be woken up by request() and stop()
+     *
+     */
+    pthread_mutex_t                         m_mutex;
+    pthread_cond_t                          m_cond;
+    bool                                    m_is_requested;
+    bool                                    m_is_stopping;
+
+    bool                                    m_is_running;
+    pthread_t                               m_thread_id;
+
+    /**
+     * @brief the loop of the writer thread
+     *
+     */
+    void loop();
+
+    static void* thread_start_routine(void* arg);
+
+public:
+    /**
+     * @brief whether a snapshot is being written
+     *
+     */
+    std::atomic<bool>                       m_is_saving;
+
+    /**
+     * @brief snapshots written, and snapshots that failed
+     *
+     */
+    std::atomic<std::uint64_t>              m_num_saved;
+    std::atomic<std::uint64_t>              m_num_failed;
+
+    /**
+     * @brief unix time in ms at which the last good snapshot started,
+     * 0 if there is none
+     *
+     */
+    std::atomic<std::int64_t>               m_last_save_time;
+
+    /**
+     * @brief keys and bytes of the last good snapshot
+     *
+     */
+    std::atomic<std::uint64_t>              m_last_save_keys;
+    std::atomic<std::uint64_t>              m_last_save_bytes;
+
+    /**
+     * @brief create a writer
+     *
+     * @param datastores the data stores, must outlive the writer or
+     * stop()
+     * @param num_datastores the number of data stores
+     * @param path the snapshot file
+     * @param interval_s seconds between two snapshots, 0 to only write
+     * the requested ones
+     * @param append_log the append log of the writes done to the data
+     * stores, must outlive the writer or stop(), nullptr if there is
+     * none
+     */
+    SnapshotWriter(
+        DataStoreInterface** datastores,
+        size_t num_datastores,
+        const std::string& path,
+        int interval_s,
+        AppendLog* append_log = nullptr);
+
+    ~SnapshotWriter()
+    {
+        stop();
+        pthread_cond_destroy(&m_cond);
+    }
+
+    /**
+     * @brief start the writer thread
+     *
+     * @return true on success
+     */
+    bool start();
+
+    /**
+     * @brief stop the writer thread, and wait for it, and for the
+     * snapshot it is writing
+     *
+     */
+    void stop();
+
+    /**
+     * @brief ask the writer thread for a snapshot
+     *
+     * @return true if one will be written
+     * @return false if one is being written already
+     */
+    bool request();
+
+    /**
+     * @brief write a snapshot now, in the calling thread
+     *
+     * @return true on success
+     * @return false on failure, the previous snapshot is then kept
+     */
+    bool write();
+};
+
+/**
+ * @brief write a snapshot of the data stores to a file descriptor,
+ * with large sequential writes
+ *
+ * @param fd where to write, a file, a memfd or a socket
+ * @param datastores the data stores
+ * @param num_datastores the number of data stores
+ * @param created_at the unix time in ms put in the header
+ * @param num_keys set to the number of keys written
+ * @param num_bytes set to the number of bytes written
+ * @return true on success
+ * @return false on a write error, or if out of memory
+ */
+bool write_snapshot(
+    int fd,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    std::int64_t created_at,
+    std::uint64_t& num_keys,
+    std::uint64_t& num_bytes);
+
+/**
+ * @brief load a snapshot held in memory into the data stores, one
+ * thread per section
+ *
+ * @param data the snapshot
+ * @param size its size
+ * @param datastores the data stores
+ * @param num_datastores the number of data stores, a power of two
+ * @param num_loaded set to the number of keys loaded
+ * @return true on success
+ * @return false if the snapshot is corrupt
+ */
+bool load_snapshot_data(
+    const char* data,
+    size_t size,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_loaded);
+
+/**
+ * @brief load a snapshot from an open file into the data stores
+ *
+ * The file is mapped, and loaded like load_snapshot() does.
+ *
+ * @param fd the file, left open
+ * @param name the name of the file, for the logs
+ * @param datastores the data stores, empty
+ * @param num_datastores the number of data stores, a power of two
+ * @param num_loaded set to the number of keys loaded
+ * @return true on success
+ * @return false if it cannot be mapped, or is corrupt
+ */
+bool load_snapshot_fd(
+    int fd,
+    const std::string& name,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_loaded);
+
+/**
+ * @brief load a snapshot into the data stores
+ *
+ * The file is mapped rather than read, and every section is loaded by
+ * its own thread. Keys go to the data store get_partition() picks, so
+ * the number of data stores can differ from the one of the snapshot.
+ * Keys that expired since the snapshot are skipped.
+ *
+ * @param path the snapshot file
+ * @param datastores the data stores, empty
+ * @param num_datastores the number of data stores, a power of two
+ * @param num_loaded set to the number of keys loaded
+ * @return true if the snapshot was loaded, or there is none
+ * @return false if it cannot be read, or is corrupt
+ */
+bool load_snapshot(
+    const std::string& path,
+    DataStoreInterface** datastores,
+    size_t num_datastores,
+    size_t& num_loaded);
+
+#endif /* #ifndef SNAPSHOT_H_ */
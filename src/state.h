@@ -3,7 +3,10 @@
 
 #include "common_include.h"
 #include "resp_parser.h"
+#include "io_buffer.h"
+#include "latency_histogram.h"
 #include <cstring>
+#include <thread>
 
 typedef enum
 {
@@ -14,10 +17,55 @@ typedef enum
     STATE_IN_READ_LOOP,
     STATE_WAITING_FOR_PARSING,
     STATE_PARSING,
+    STATE_WAITING_FOR_WRITE,
     STATE_IN_WRITE_LOOP,
+    STATE_WAITING_FOR_WRITABLE,
     STATE_CLOSING
 } StateState;
 
+#define STATE_NUM_STATES (STATE_CLOSING + 1)
+
+/**
+ * @brief the states timed for the latency of a request, in the order
+ * a request goes through them
+ * 
+ */
+#define STATE_FIRST_TIMED STATE_WAITING_FOR_READ_JOB
+#define STATE_LAST_TIMED STATE_WAITING_FOR_WRITABLE
+
+/**
+ * @brief The lock of a State, a byte that is spun on
+ * 
+ * A connection is locked when epoll hands it to a job, and unlocked
+ * by whichever worker finishes with it, which std::mutex does not
+ * allow. It is rarely waited for, so a waiter just yields.
+ * 
+ */
+class StateLock
+{
+private:
+    std::atomic<bool>                       m_is_locked;
+
+public:
+    StateLock(): m_is_locked(false)
+    {
+    }
+
+    void lock()
+    {
+        while (m_is_locked.exchange(true, std::memory_order_acquire))
+        {
+            while (m_is_locked.load(std::memory_order_relaxed))
+                std::this_thread::yield();
+        }
+    }
+
+    void unlock()
+    {
+        m_is_locked.store(false, std::memory_order_release);
+    }
+};
+
 /**
  * @brief This class stores the state associated with
  * each socket. As a socket is accepted, becomes
@@ -26,9 +74,12 @@ typedef enum
  * worker queues. There must be a way to pass the state
  * through all the queues, and this class helps with that
  * 
- * An object of this class is also present in a map that
- * is available in the orchestrator object, and given an fd
- * it is always possible to lookup this structure.
+ * An object of this class is also present in the connection
+ * table of the orchestrator, and given an fd it is always possible
+ * to lookup this structure.
+ * 
+ * There is one per connection, so it is kept small: the buffers hold
+ * no memory while the connection waits for a request.
  * 
  */
 struct State
@@ -38,79 +89,116 @@ struct State
      * 
      */
     StateState                              m_state;
+    int                                     m_socket;
+
+    /**
+     * @brief when each state was last entered through set_state(),
+     * steady clock nanoseconds, 0 if it was not entered since the
+     * last response was written
+     * 
+     */
+    std::int64_t                            m_stage_time[STATE_NUM_STATES];
 
     /**
      * @brief The data that was read from the socket
      * 
+     * Clients may pipeline several commands, and the last one
+     * may be only partially received. Complete commands are
+     * consumed once they have been run, and an incomplete
+     * trailing command is kept here until the rest is read.
+     * 
      */
-    std::string                             m_read_data;
+    IoBuffer                                m_input;
 
     /**
-     * @brief parsed object from the data read from the
-     * socket. This is the command (and not the response).
+     * @brief The serialized responses to all the commands that
+     * were run from m_input, sent back with as few writes as
+     * possible. Whatever a short write left over stays here until
+     * the socket becomes writable again.
      * 
      */
-    std::shared_ptr<AbstractRespObject>     m_object;
+    IoBuffer                                m_output;
 
     /**
-     * @brief 
+     * @brief In case there is some unrecoverable error,
+     * this will be used to communicate the error to the client.
+     * This is really a backup mechanism. It points to what is
+     * left to write of a static string, nullptr if there is none.
      * 
      */
-    std::shared_ptr<AbstractRespObject>     m_response;
-    int                                     m_socket;
-    mutable std::mutex                      m_mutex;
+    const char*                             m_special_error;
+
+    mutable StateLock                       m_mutex;
 
     // If this is set, then the socket must be closed
     // after writing
     bool                                    m_is_error;
 
     /**
-     * @brief In case there is some unrecoverable error,
-     * this will be used to communicate the error to the client.
-     * This is really a backup mechanism.
+     * @brief set by ASKING, for the command that follows it, which may
+     * come with a later read
+     * 
+     */
+    bool                                    m_is_asking;
+
+    /**
+     * @brief set when commands were left in m_input because m_output
+     * reached the output limit of a client, they are run once it has
+     * been sent
      * 
      */
-    char m_special_error[64];
+    bool                                    m_is_output_limited;
 
     State(int fd)
     {
-        m_object = std::shared_ptr<AbstractRespObject>(nullptr);
-        m_response = std::shared_ptr<AbstractRespObject>(nullptr);
         m_state = STATE_INVALID;
+        memset(m_stage_time, 0, sizeof(m_stage_time));
         m_socket = fd;
-        m_special_error[0] = 0;
+        m_special_error = nullptr;
         m_is_error = false;
+        m_is_asking = false;
+        m_is_output_limited = false;
+    }
+
+    /**
+     * @brief move to a state, and remember when
+     * 
+     * @param state the new state
+     */
+    void set_state(StateState state)
+    {
+        m_state = state;
+        m_stage_time[state] = now_ns();
     }
 
     /**
      * @brief Once a write has been completed, a new set of data
      * must be read.
-     * This resets the state so that it can start again from a clean
-     * slate.
+     * This clears the state so that it can start again from a clean
+     * slate. Any partially received command in m_input is kept, and
+     * so is m_output, which is empty once it has all been written.
+     * The buffers that are empty give their memory back.
      * 
      */
-    void reset()
+    void clear()
     {
         m_state = STATE_INVALID;
-        m_read_data = std::string("");
-        m_object = std::shared_ptr<AbstractRespObject>(nullptr);
-        m_response = std::shared_ptr<AbstractRespObject>(nullptr);
+        memset(m_stage_time, 0, sizeof(m_stage_time));
         m_is_error = false;
-        m_special_error[0] = 0;
-        m_mutex.unlock();
+        m_special_error = nullptr;
+        m_input.release();
+        m_output.release();
     }
 
     /**
-     * @brief Create a state object
+     * @brief Clear the state, and release the mutex that was taken
+     * when the socket was picked up from epoll.
      * 
-     * @param fd the file descriptor for which to create a state
-     * @return std::shared_ptr<State> the state
      */
-    static std::shared_ptr<State>
-    create_state(int fd)
+    void reset()
     {
-        auto p = new (std::nothrow) State(fd);
-        return std::shared_ptr<State>(p);
+        clear();
+        m_mutex.unlock();
     }
 
     /**
@@ -118,11 +206,12 @@ struct State
      * This indicates that the error is unrecoverable and the
      * connection must be closed
      * 
-     * @param err the string containing the error
+     * @param err the string containing the error, a literal as it
+     * is not copied
      */
     void set_special_error(const char* err)
     {
-        strncpy(m_special_error, err, 63);
+        m_special_error = err;
         m_is_error = true;
     }
 
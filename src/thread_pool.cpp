@@ -1,64 +1,482 @@
 #include "thread_pool.h"
+#include "work_stealing_deque.h"
+#include "logger.h"
 #include <unistd.h>
+#include <sched.h>
 #include <cassert>
 #include <cstdlib>
 
+/**
+ * @brief bounds of the number of rounds an idle worker spins, looking
+ * for work, before it goes to sleep
+ * 
+ */
+#define THREAD_POOL_MIN_SPIN_ROUNDS 16
+#define THREAD_POOL_MAX_SPIN_ROUNDS 4096
+
+/**
+ * @brief How long an idle worker spins before it sleeps
+ * 
+ * Sleeping and being woken up costs two system calls and a context
+ * switch, which is wasted when the next job arrives a few
+ * microseconds later. Spinning is wasted when it does not. The limit
+ * doubles whenever spinning found a job, and halves whenever the
+ * worker had to sleep anyway, so it follows the arrival rate.
+ * 
+ */
+struct AdaptiveSpin
+{
+    int                 m_limit;
+
+    AdaptiveSpin(): m_limit(THREAD_POOL_MIN_SPIN_ROUNDS) {}
+
+    void found_work()
+    {
+        m_limit = std::min(m_limit * 2, THREAD_POOL_MAX_SPIN_ROUNDS);
+    }
+
+    void went_to_sleep()
+    {
+        m_limit = std::max(m_limit / 2, THREAD_POOL_MIN_SPIN_ROUNDS);
+    }
+
+    /**
+     * @brief wait a little, one round of the spin
+     * 
+     * @param round the number of rounds spun so far
+     */
+    static void relax(int round)
+    {
+        // Give up the CPU now and then, in case another thread on it
+        // is the one that will add the job
+        if (15 == (round & 15))
+        {
+            sched_yield();
+            return;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+};
+
+/**
+ * @brief A queued job of a work-stealing pool
+ * 
+ * The deques hold raw pointers, so that stealers never copy a
+ * shared_ptr that the owner may be overwriting. The node keeps the
+ * job alive until it has run.
+ * 
+ */
+struct WorkStealingNode
+{
+    std::shared_ptr<JobInterface>       m_job;
+
+    /**
+     * @brief when the job was added, steady clock nanoseconds
+     * 
+     */
+    std::int64_t                        m_enqueue_time;
+
+    /**
+     * @brief next node in an inbox
+     * 
+     */
+    WorkStealingNode*                   m_next;
+};
+
+/**
+ * @brief A worker thread of a work-stealing pool
+ * 
+ */
+struct WorkStealingWorker
+{
+    /**
+     * @brief the pool the worker belongs to
+     * 
+     */
+    ThreadPool*                         m_pool;
+
+    /**
+     * @brief jobs added by this worker, and jobs moved over from
+     * inboxes
+     * 
+     */
+    WorkStealingDeque<WorkStealingNode> m_deque;
+
+    /**
+     * @brief jobs added from outside the pool, a lock-free stack that
+     * any thread can push to and any thread can empty in one go
+     * 
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<WorkStealingNode*> m_inbox;
+
+    /**
+     * @brief number of jobs ever pushed to, and taken from, the inbox
+     * 
+     */
+    std::atomic<std::uint64_t>          m_inbox_added;
+    std::atomic<std::uint64_t>          m_inbox_taken;
+
+    /**
+     * @brief set to ask the worker to exit
+     * 
+     */
+    std::atomic<bool>                   m_retire;
+
+    /**
+     * @brief set while the worker is sleeping or about to, and
+     * cleared by the thread that wakes it up, so that two threads
+     * never wake up the same worker
+     * 
+     */
+    std::atomic<bool>                   m_sleeping;
+
+    /**
+     * @brief set under m_mutex to wake up the worker
+     * 
+     */
+    bool                                m_wakeup;
+
+    pthread_mutex_t                     m_mutex;
+    pthread_cond_t                      m_cond;
+
+    /**
+     * @brief state of the random number generator that picks victims
+     * 
+     */
+    std::uint32_t                       m_random;
+
+    WorkStealingWorker(ThreadPool* pool, std::uint32_t seed):
+        m_pool(pool),
+        m_inbox(nullptr),
+        m_inbox_added(0),
+        m_inbox_taken(0),
+        m_retire(false),
+        m_sleeping(false),
+        m_wakeup(false),
+        m_mutex(PTHREAD_MUTEX_INITIALIZER),
+        m_cond(PTHREAD_COND_INITIALIZER),
+        m_random(seed | 1)
+    {
+    }
+
+    /**
+     * @brief next pseudo random number, xorshift32
+     * 
+     * @return std::uint32_t the number
+     */
+    std::uint32_t next_random()
+    {
+        m_random ^= m_random << 13;
+        m_random ^= m_random >> 17;
+        m_random ^= m_random << 5;
+        return m_random;
+    }
+
+    /**
+     * @brief number of jobs queued for this worker, may be stale
+     * 
+     * @return size_t the number of jobs
+     */
+    size_t get_queue_depth() const
+    {
+        std::uint64_t taken = m_inbox_taken.load(std::memory_order_relaxed);
+        std::uint64_t added = m_inbox_added.load(std::memory_order_relaxed);
+        return m_deque.size() + (added > taken ? added - taken : 0);
+    }
+};
+
+/**
+ * @brief the work-stealing worker running on this thread, if any
+ * 
+ */
+static thread_local WorkStealingWorker*     t_current_worker    = nullptr;
+
+/**
+ * @brief the inbox the next job added by this thread goes to
+ * 
+ */
+static thread_local unsigned                t_next_worker       = \
+    (unsigned)std::hash<std::thread::id>()(std::this_thread::get_id());
+
+
+/**
+ * @brief wake up a worker, whether it sleeps or not
+ * 
+ */
+static void wake_worker(WorkStealingWorker* worker)
+{
+    pthread_mutex_lock(&worker->m_mutex);
+    worker->m_wakeup = true;
+    pthread_cond_signal(&worker->m_cond);
+    pthread_mutex_unlock(&worker->m_mutex);
+}
+
+/**
+ * @brief claim a sleeping worker, so that the thread that does is
+ * the only one to wake it up
+ * 
+ */
+static bool claim_worker(WorkStealingWorker* worker)
+{
+    return worker->m_sleeping.load() && worker->m_sleeping.exchange(false);
+}
+
+void ThreadPool::reap_slot(ThreadSlot* slot)
+{
+    if (THREAD_SLOT_FREE != slot->m_state.load())
+    {
+        pthread_join(slot->m_tid, nullptr);
+        slot->m_state.store(THREAD_SLOT_FREE);
+    }
+}
 
 int ThreadPool::add_thread()
 {
-    pthread_t       tid;
-    int             retval;
+    int                 retval;
+    ThreadSlot*         slot        = nullptr;
+    WorkStealingWorker* worker      = nullptr;
+    bool                is_new_worker = false;
 
-    retval = pthread_create(
-                &tid,
-                NULL,
+    if (SCHEDULER_WORK_STEALING == m_scheduler)
+    {
+        // Workers are kept dense, the next one may be a retired one
+        int index = m_num_workers.load();
+        if (index >= THREAD_POOL_MAX_THREADS)
+        {
+            LOG_ERROR("Too many threads, at most " << THREAD_POOL_MAX_THREADS);
+            return EAGAIN;
+        }
+
+        slot = &m_slots[index];
+        reap_slot(slot);
+
+        worker = m_workers[index].load();
+        if (!worker)
+        {
+            try
+            {
+                worker = new WorkStealingWorker(this, (index + 1) * 2654435761u);
+            }
+            catch (...)
+            {
+                LOG_ERROR("Failed to create worker, OOM");
+                return ENOMEM;
+            }
+            is_new_worker = true;
+
+            // Beyond m_max_workers, so nobody else looks at it yet
+            m_workers[index].store(worker);
+        }
+        worker->m_retire.store(false);
+    }
+    else
+    {
+        for (int i = 0; i < THREAD_POOL_MAX_THREADS && !slot; i++)
+        {
+            if (THREAD_SLOT_RUNNING != m_slots[i].m_state.load())
+                slot = &m_slots[i];
+        }
+
+        if (!slot)
+        {
+            LOG_ERROR("Too many threads, at most " << THREAD_POOL_MAX_THREADS);
+            return EAGAIN;
+        }
+
+        reap_slot(slot);
+    }
+
+    // Counted before the thread starts, so that it can never go below 0
+    m_num_threads++;
+    slot->m_state.store(THREAD_SLOT_RUNNING);
+
+    retval = create_pinned_thread(
+                &slot->m_tid,
+                m_cpus,
                 ThreadPool::thread_start_routine,
-                this);
-    
-    if (0 == retval)
+                slot);
+
+    if (0 != retval)
+    {
+        m_num_threads--;
+        slot->m_state.store(THREAD_SLOT_FREE);
+        if (is_new_worker)
+        {
+            m_workers[slot->m_index].store(nullptr);
+            delete worker;
+        }
+        LOG_ERROR("Failed to create thread, err = " << retval << " errno = " \
+            << errno);
+        return retval;
+    }
+
+    if (worker)
+    {
+        // Published only now, so jobs never go to a worker without a thread
+        int index = slot->m_index;
+        m_num_workers.store(index + 1);
+        if (m_max_workers.load() < index + 1)
+            m_max_workers.store(index + 1);
+    }
+
+    return 0;
+}
+
+int ThreadPool::remove_thread()
+{
+    if (SCHEDULER_WORK_STEALING == m_scheduler)
     {
-        m_num_threads++;
-        m_threads.push_back(tid);
+        int num_workers = m_num_workers.load();
+        if (num_workers <= 1)
+            return EBUSY;
+
+        // No new jobs go to the last worker from now on
+        WorkStealingWorker* worker = m_workers[num_workers - 1].load();
+        m_num_workers.store(num_workers - 1);
+        worker->m_retire.store(true);
+        unpark(worker);
+        return 0;
     }
+
+    int retval = 0;
+
+    pthread_mutex_lock(&m_job_queue_mutex);
+    if (m_num_threads - m_num_to_retire <= 1)
+        retval = EBUSY;
     else
     {
-        std::cerr << "Failed to create thread, err = ";
-        std::cerr << retval << " errno = " << errno << std::endl;
+        // Whichever thread looks at the queue next will exit
+        m_num_to_retire++;
+        if (m_num_waiting)
+            pthread_cond_signal(&m_job_queue_cond);
     }
+    pthread_mutex_unlock(&m_job_queue_mutex);
+
     return retval;
 }
 
+int ThreadPool::set_cpus(const cpu_set_t& cpus)
+{
+    m_cpus = cpus;
+
+    // An empty set lets the threads go back to all the CPUs allowed
+    cpu_set_t target = cpus;
+    if (is_cpu_set_empty(target))
+        target = CpuTopology::get().get_allowed_cpus();
+
+    for (int i = 0; i < THREAD_POOL_MAX_THREADS; i++)
+    {
+        if (THREAD_SLOT_RUNNING != m_slots[i].m_state.load())
+            continue;
+
+        // A thread that has just retired is gone already
+        int retval = pthread_setaffinity_np(m_slots[i].m_tid, sizeof(target), &target);
+        if (0 != retval && ESRCH != retval)
+        {
+            LOG_ERROR("Failed to set the CPUs of a thread, err = " << retval);
+            return retval;
+        }
+    }
+    return 0;
+}
+
+void ThreadPool::get_stats(ThreadPoolStats& stats)
+{
+    stats.m_jobs_run = 0;
+    stats.m_wait_ns = 0;
+    for (int i = 0; i < THREAD_POOL_MAX_THREADS; i++)
+    {
+        stats.m_jobs_run += m_slots[i].m_jobs_run.load(std::memory_order_relaxed);
+        stats.m_wait_ns += m_slots[i].m_wait_ns.load(std::memory_order_relaxed);
+    }
+
+    if (SCHEDULER_WORK_STEALING == m_scheduler)
+    {
+        stats.m_num_threads = m_num_workers.load();
+        stats.m_num_idle = m_num_sleeping.load();
+        stats.m_queue_depth = 0;
+        for (int i = 0; i < m_max_workers.load(); i++)
+            stats.m_queue_depth += m_workers[i].load()->get_queue_depth();
+        return;
+    }
+
+    pthread_mutex_lock(&m_job_queue_mutex);
+    stats.m_num_threads = m_num_threads - m_num_to_retire;
+    stats.m_num_idle = m_num_waiting;
+    stats.m_queue_depth = m_job_queue.size();
+    pthread_mutex_unlock(&m_job_queue_mutex);
+}
+
+size_t ThreadPool::get_queue_length() const
+{
+    if (SCHEDULER_SINGLE_QUEUE == m_scheduler)
+        return m_job_queue_length.load(std::memory_order_relaxed);
+
+    size_t length = 0;
+    for (int i = 0; i < m_max_workers.load(std::memory_order_relaxed); i++)
+        length += m_workers[i].load(std::memory_order_relaxed)->get_queue_depth();
+    return length;
+}
+
+void ThreadPool::get_latency(LatencySnapshot& wait, LatencySnapshot& service)
+{
+    for (int i = 0; i < THREAD_POOL_MAX_THREADS; i++)
+    {
+        // Slots that never ran a job have nothing to add
+        if (!m_slots[i].m_jobs_run.load(std::memory_order_relaxed))
+            continue;
+        wait.add(m_slots[i].m_wait_histogram);
+        service.add(m_slots[i].m_service_histogram);
+    }
+}
+
 void* ThreadPool::thread_start_routine(void* arg)
 {
-    static_cast<ThreadPool*>(arg)->loop();
+    auto slot = static_cast<ThreadSlot*>(arg);
+    auto pool = slot->m_pool;
+
+    if (SCHEDULER_WORK_STEALING == pool->m_scheduler)
+        pool->loop_work_stealing(pool->m_workers[slot->m_index].load(), slot);
+    else
+        pool->loop(slot);
+
+    pool->m_num_threads--;
+    slot->m_state.store(THREAD_SLOT_EXITED);
     return nullptr;
 }
-
-void ThreadPool::process_job_unsafe(bool& lock_held)
+void ThreadPool::process_job_unsafe(bool& lock_held, ThreadSlot* slot)
 {
     assert(lock_held);
 
     if (!lock_held)
     {
-        std::cerr << "lock not held " << std::endl;
+        LOG_ERROR("lock not held");
         return;
     }
 
     if (m_job_queue.size())
     {
-        auto p_job = m_job_queue.front();
+        auto p_job = std::move(m_job_queue.front().m_job);
+        auto enqueue_time = m_job_queue.front().m_enqueue_time;
         m_job_queue.pop_front();
+        m_job_queue_length.store(m_job_queue.size(), std::memory_order_relaxed);
         pthread_mutex_unlock(&m_job_queue_mutex);
         lock_held = false;
 
+        auto start_time = now_ns();
+        slot->job_started(start_time - enqueue_time);
+
         if (m_is_debug)
         {
-            std::cerr << __FILE__ << ":" << __LINE__;
-            std::cerr << " Running job " << p_job->get_job_id() << ": ";
-            std::cerr << p_job->get_job_description() << std::endl;
+            LOG_DEBUG(__FILE__ << ":" << __LINE__ << " Running job " \
+                << p_job->get_job_id() << ": " \
+                << p_job->get_job_description());
         }
 
         p_job->run();
+        slot->job_finished(now_ns() - start_time);
     }
 
     if (lock_held)
@@ -68,78 +486,89 @@ void ThreadPool::process_job_unsafe(bool& lock_held)
     }
 }
 
-void ThreadPool::loop()
+void ThreadPool::loop(ThreadSlot* slot)
 {
-    bool        lock_held       = false;
-    int         err             = 0;
+    bool            lock_held       = false;
+    int             err             = 0;
+    AdaptiveSpin    spin;
 
     if (m_is_debug)
-        std::cerr << "Thread " << pthread_self() << " waiting for work." << std::endl;
+        LOG_DEBUG("Thread " << pthread_self() << " waiting for work.");
 
-    while(true)
+    while (!m_is_destroying)
     {
         if (m_is_debug_verbose)
-            std::cerr << "looping " << pthread_self() << std::endl;
+            LOG_DEBUG("looping " << pthread_self());
 
-        if (m_is_destroying)
-        {
-            m_num_threads--;
-            return;
-        }
+        // Watch the queue without taking the lock for a while first
+        int round = 0;
+        for (; round < spin.m_limit && !m_is_destroying && \
+                !m_job_queue_length.load(std::memory_order_relaxed); round++)
+            AdaptiveSpin::relax(round);
 
-        if (!lock_held && (0 != (err = pthread_mutex_lock(&m_job_queue_mutex))))
+        if (0 != (err = pthread_mutex_lock(&m_job_queue_mutex)))
         {
-            std::cerr << __FILE__ << ":" << __LINE__ << " : ";
-            std::cerr << "pthread_mutex_lock failed, err = " << err;
-            std::cerr << " errno = " << errno << ". Exiting." << std::endl;
-            m_num_threads--;
-            return;
+            LOG_ERROR(__FILE__ << ":" << __LINE__ << " : " \
+                << "pthread_mutex_lock failed, err = " << err << " errno = " \
+                << errno << ". Exiting.");
+            break;
         }
 
         lock_held = true;
 
+        if (m_num_to_retire)
+        {
+            m_num_to_retire--;
+            break;
+        }
+
         if (m_job_queue.size())
         {
-            /* This function will release the lock */
-            process_job_unsafe(lock_held);
+            if (round)
+                spin.found_work();
         }
         else
         {
-            // wait 100 milliseconds
-            struct timespec timout = {0, 100000000};
+            spin.went_to_sleep();
 
-            int rc = pthread_cond_timedwait(
-                &m_job_queue_cond,
-                &m_job_queue_mutex,
-                &timout
-            );
-
-            if (0 == rc || ETIMEDOUT == rc || ETIMEDOUT == errno)
+            // Every add_job signals under the lock while someone is
+            // waiting, so there is no need to wake up periodically
+            m_num_waiting++;
+            while (!m_job_queue.size() && !m_is_destroying && !m_num_to_retire)
             {
-                if (rc == 0 && m_is_debug)
+                if (0 != (err = pthread_cond_wait(&m_job_queue_cond, &m_job_queue_mutex)))
                 {
-                    std::cerr << "pthread_cond_wait returned, rc = " << rc << " thread = " \
-                        << pthread_self() << " q length " << m_job_queue.size() << std::endl;
+                    assert(0);
+                    LOG_ERROR("Fatal error in pthread_cond_wait, rc = " \
+                        << err << " errno = " << errno << ". Terminating");
+                    exit(0);
                 }
-                if (m_job_queue.size())
-                    process_job_unsafe(lock_held); // this will release the lock
-                else
+
+                if (m_is_debug)
                 {
-                    pthread_mutex_unlock(&m_job_queue_mutex);
-                    lock_held = false;
+                    LOG_DEBUG("pthread_cond_wait returned, thread = " \
+                        << pthread_self() << " q length " \
+                        << m_job_queue.size());
                 }
             }
-            else
-            {
-                assert(0);
-                std::cerr << "Fatal error in pthread_cond_timedwait, rc = " << rc;
-                std::cerr << " errno = " << errno << ". Terminating" << std::endl;
-                exit(0);
-            }
+            m_num_waiting--;
+        }
+
+        if (m_is_destroying)
+            break;
+
+        // Woken up to retire
+        if (!m_job_queue.size())
+        {
+            pthread_mutex_unlock(&m_job_queue_mutex);
+            lock_held = false;
+            continue;
         }
 
+        /* This function will release the lock */
+        process_job_unsafe(lock_held, slot);
     }
-out:
+
     if (lock_held)
     {
         pthread_mutex_unlock(&m_job_queue_mutex);
@@ -156,11 +585,14 @@ int ThreadPool::add_job(std::shared_ptr<JobInterface> p_job)
     if (!p_job)
         return 0;
 
+    if (SCHEDULER_WORK_STEALING == m_scheduler)
+        return add_job_work_stealing(p_job);
+
     if (0 != pthread_mutex_lock(&m_job_queue_mutex))
     {
-        std::cerr << __FILE__ << ":" << __LINE__ << ": ";
-        std::cerr << "Fatal error, could not acquire lock, rc = " << rc;
-        std::cerr << " errno = " << errno << std::endl;
+        LOG_ERROR(__FILE__ << ":" << __LINE__ << ": " \
+            << "Fatal error, could not acquire lock, rc = " << rc \
+            << " errno = " << errno);
         assert(0);
         exit(1);
     }
@@ -169,15 +601,17 @@ int ThreadPool::add_job(std::shared_ptr<JobInterface> p_job)
 
     try
     {
-        m_job_queue.push_back(p_job);
+        m_job_queue.push_back({p_job, now_ns()});
+        m_job_queue_length.store(m_job_queue.size(), std::memory_order_relaxed);
     }
     catch(...)
     {
-        std::cerr << "Failed to push job to queue, OOM" << std::endl;
+        LOG_ERROR("Failed to push job to queue, OOM");
         retval = 1;
     }
 
-    if (0 == retval)
+    // Spinning threads see the new length without being signalled
+    if (0 == retval && m_num_waiting)
     {
         pthread_cond_signal(&m_job_queue_cond);
     }
@@ -187,37 +621,364 @@ int ThreadPool::add_job(std::shared_ptr<JobInterface> p_job)
     return retval;
 }
 
+int ThreadPool::add_jobs(
+        const std::vector<std::shared_ptr<JobInterface> >& jobs)
+{
+    int     rc          = 0;
+    int     retval      = 0;
+
+    if (jobs.empty())
+        return 0;
+
+    if (SCHEDULER_WORK_STEALING == m_scheduler)
+    {
+        for (auto& p_job: jobs)
+            if (0 != add_job(p_job))
+                retval = 1;
+        return retval;
+    }
+
+    if (0 != (rc = pthread_mutex_lock(&m_job_queue_mutex)))
+    {
+        LOG_ERROR(__FILE__ << ":" << __LINE__ << ": " \
+            << "Fatal error, could not acquire lock, rc = " << rc \
+            << " errno = " << errno);
+        assert(0);
+        exit(1);
+    }
+
+    try
+    {
+        auto enqueue_time = now_ns();
+        for (auto& p_job: jobs)
+            if (p_job)
+                m_job_queue.push_back({p_job, enqueue_time});
+    }
+    catch(...)
+    {
+        LOG_ERROR("Failed to push job to queue, OOM");
+        retval = 1;
+    }
+    m_job_queue_length.store(m_job_queue.size(), std::memory_order_relaxed);
+
+    if (m_num_waiting && jobs.size() > 1)
+        pthread_cond_broadcast(&m_job_queue_cond);
+    else if (m_num_waiting)
+        pthread_cond_signal(&m_job_queue_cond);
+
+    pthread_mutex_unlock(&m_job_queue_mutex);
+
+    return retval;
+}
+
 void ThreadPool::destroy()
 {
     m_is_destroying = true;
 
+    // Wake up every sleeping thread, taking each lock so that a thread
+    // about to sleep either sees the flag or gets the wakeup
+    pthread_mutex_lock(&m_job_queue_mutex);
+    pthread_cond_broadcast(&m_job_queue_cond);
+    pthread_mutex_unlock(&m_job_queue_mutex);
+
+    for (int i = 0; i < m_max_workers.load(); i++)
+        wake_worker(m_workers[i].load());
+
+    if (m_is_debug)
+        LOG_DEBUG("Waiting for threads to destroy");
+
+    // A thread finishes the job it is running, and then exits
+    for (int i = 0; i < THREAD_POOL_MAX_THREADS; i++)
+        reap_slot(&m_slots[i]);
+
     if (m_is_debug)
-        std::cerr << "Waiting for threads to destroy " << std::endl;
+        LOG_DEBUG("OK.");
 
-    while (m_num_threads)
+    free_workers();
+}
+
+int ThreadPool::add_job_work_stealing(std::shared_ptr<JobInterface> p_job)
+{
+    WorkStealingNode* node = new (std::nothrow) WorkStealingNode;
+    if (!node)
     {
-        if (m_is_debug)
-            std::cerr << "Threads remaining: " << m_num_threads << std::endl;
-        /*
-         * TODO: Improve
-         *
-         * This is a sub-optimal implementation, and an ideal implemenatation
-         * will use conditional signals, but for current purposes
-         * this will work.
-         */
-        usleep(100);
+        LOG_ERROR("Failed to push job to queue, OOM");
+        return 1;
+    }
+    node->m_job = std::move(p_job);
+    node->m_enqueue_time = now_ns();
+    node->m_next = nullptr;
+
+    // A worker keeps the jobs it creates, others steal them if idle
+    if (t_current_worker && this == t_current_worker->m_pool)
+    {
+        if (!t_current_worker->m_deque.push(node))
+        {
+            delete node;
+            LOG_ERROR("Failed to push job to queue, OOM");
+            return 1;
+        }
+
+        // Pairs with the fence in park(), either the sleeper sees the
+        // job or we see the sleeper
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_num_sleeping.load())
+            unpark(nullptr);
+        return 0;
+    }
+
+    int num_workers = m_num_workers.load();
+    if (0 == num_workers)
+    {
+        delete node;
+        LOG_ERROR("No threads to run the job");
+        return 1;
+    }
+
+    WorkStealingWorker* worker = m_workers[t_next_worker++ % num_workers].load();
+
+    WorkStealingNode* head = worker->m_inbox.load(std::memory_order_relaxed);
+    do
+    {
+        node->m_next = head;
+    } while (!worker->m_inbox.compare_exchange_weak(head, node));
+    worker->m_inbox_added.fetch_add(1, std::memory_order_relaxed);
+
+    // The jobs already in the inbox were pushed with the same checks,
+    // whoever takes them takes this one too, in the same drain
+    if (head)
+        return 0;
+
+    if (!unpark(worker) && (m_num_sleeping.load() || worker->m_retire.load()))
+    {
+        // The worker is busy or gone, let a sleeping one steal the job
+        unpark(nullptr);
+    }
+
+    return 0;
+}
+
+WorkStealingNode* ThreadPool::drain_inbox(
+                        WorkStealingWorker* worker,
+                        WorkStealingWorker* victim)
+{
+    // The inbox is newest first. Pushing in that order leaves the
+    // oldest job at the bottom, where the owner takes next.
+    WorkStealingNode* node = victim->m_inbox.exchange(nullptr);
+    if (!node)
+        return nullptr;
+
+    std::uint64_t taken = 1;
+    for (; node->m_next; taken++)
+    {
+        WorkStealingNode* next = node->m_next;
+        if (!worker->m_deque.push(node))
+        {
+            // Out of memory growing the deque, hand the rest back
+            WorkStealingNode* tail = node;
+            while (tail->m_next)
+                tail = tail->m_next;
+            WorkStealingNode* head = victim->m_inbox.load();
+            do
+            {
+                tail->m_next = head;
+            } while (!victim->m_inbox.compare_exchange_weak(head, node));
+            victim->m_inbox_taken.fetch_add(taken - 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        node = next;
+    }
+    victim->m_inbox_taken.fetch_add(taken, std::memory_order_relaxed);
+
+    // The oldest job of the inbox is run right away
+    return node;
+}
+
+WorkStealingNode* ThreadPool::find_work(WorkStealingWorker* worker)
+{
+    WorkStealingNode* node = worker->m_deque.take();
+    if (node)
+        return node;
+
+    if (worker->m_inbox.load(std::memory_order_relaxed) && \
+        (node = drain_inbox(worker, worker)))
+        return node;
+
+    // Retired workers are included, they may have been given a job
+    // just before they retired
+    int num_workers = m_max_workers.load();
+    if (num_workers < 2)
+        return nullptr;
+
+    int start = worker->next_random() % num_workers;
+    for (int i = 0; i < num_workers; i++)
+    {
+        WorkStealingWorker* victim = m_workers[(start + i) % num_workers].load();
+        if (victim == worker)
+            continue;
+
+        if ((node = victim->m_deque.steal()))
+            return node;
+
+        if (victim->m_inbox.load(std::memory_order_relaxed) && \
+            (node = drain_inbox(worker, victim)))
+            return node;
+    }
+
+    return nullptr;
+}
+
+WorkStealingNode* ThreadPool::park(WorkStealingWorker* worker)
+{
+    // Counted first, the thread that wakes the worker up uncounts it
+    m_num_sleeping++;
+    worker->m_sleeping.store(true);
+
+    // Look once more, a job added before the flags were visible would
+    // otherwise not wake anyone up
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    WorkStealingNode* node = find_work(worker);
+
+    if (!node && !m_is_destroying)
+    {
+        pthread_mutex_lock(&worker->m_mutex);
+        while (!worker->m_wakeup && !m_is_destroying && !worker->m_retire.load())
+            pthread_cond_wait(&worker->m_cond, &worker->m_mutex);
+        worker->m_wakeup = false;
+        pthread_mutex_unlock(&worker->m_mutex);
+    }
+
+    // Unless a waker claimed the worker, and uncounted it already
+    if (worker->m_sleeping.exchange(false))
+        m_num_sleeping--;
+    return node;
+}
+
+bool ThreadPool::unpark(WorkStealingWorker* preferred)
+{
+    WorkStealingWorker* worker = nullptr;
+
+    if (preferred)
+    {
+        if (claim_worker(preferred))
+            worker = preferred;
     }
+    else
+    {
+        int num_workers = m_num_workers.load();
+        int start = num_workers ? t_next_worker % num_workers : 0;
+        for (int i = 0; i < num_workers && !worker; i++)
+        {
+            WorkStealingWorker* candidate = \
+                m_workers[(start + i) % num_workers].load();
+            if (claim_worker(candidate))
+                worker = candidate;
+        }
+    }
+
+    if (!worker)
+        return false;
+
+    m_num_sleeping--;
+    wake_worker(worker);
+    return true;
+}
+
+void ThreadPool::run_node(WorkStealingNode* node, ThreadSlot* slot)
+{
+    auto start_time = now_ns();
+    slot->job_started(start_time - node->m_enqueue_time);
 
     if (m_is_debug)
-        std::cerr << "OK." << std::endl;
+    {
+        LOG_DEBUG(__FILE__ << ":" << __LINE__ << " Running job " \
+            << node->m_job->get_job_id() << ": " \
+            << node->m_job->get_job_description());
+    }
+
+    node->m_job->run();
+    slot->job_finished(now_ns() - start_time);
+    delete node;
+}
+
+void ThreadPool::loop_work_stealing(WorkStealingWorker* worker, ThreadSlot* slot)
+{
+    int             spins   = 0;
+    AdaptiveSpin    spin;
+
+    t_current_worker = worker;
+
+    if (m_is_debug)
+        LOG_DEBUG("Thread " << pthread_self() << " waiting for work.");
+
+    while (!m_is_destroying && !worker->m_retire.load(std::memory_order_relaxed))
+    {
+        WorkStealingNode* node = find_work(worker);
+
+        if (!node)
+        {
+            if (spins < spin.m_limit)
+            {
+                AdaptiveSpin::relax(spins++);
+                continue;
+            }
+
+            spins = 0;
+            spin.went_to_sleep();
+            if (!(node = park(worker)))
+                continue;
+        }
+        else if (spins)
+            spin.found_work();
+
+        spins = 0;
+        run_node(node, slot);
+    }
+
+    // A retiring worker runs what was queued for it, adders that
+    // pick it after this see m_retire and wake up someone else
+    while (!m_is_destroying)
+    {
+        WorkStealingNode* node = worker->m_deque.take();
+        if (!node && !(node = drain_inbox(worker, worker)))
+            break;
+        run_node(node, slot);
+    }
+
+    t_current_worker = nullptr;
+}
+
+void ThreadPool::free_workers()
+{
+    int num_workers = m_max_workers.exchange(0);
+    m_num_workers.store(0);
+
+    for (int i = 0; i < num_workers; i++)
+    {
+        WorkStealingWorker* worker = m_workers[i].exchange(nullptr);
+
+        while (WorkStealingNode* node = worker->m_deque.take())
+            delete node;
+
+        WorkStealingNode* node = worker->m_inbox.exchange(nullptr);
+        while (node)
+        {
+            WorkStealingNode* next = node->m_next;
+            delete node;
+            node = next;
+        }
+
+        delete worker;
+    }
 }
 
 
 ThreadPool* ThreadPoolFactory::create_thread_pool(
                 int num_threads,
-                bool is_debug = false)
+                bool is_debug,
+                scheduler_type_t scheduler)
 {
-    ThreadPool* pool = new ThreadPool();
+    ThreadPool* pool = new (std::nothrow) ThreadPool(scheduler);
 
     if (!pool)
         return nullptr;
@@ -229,7 +990,7 @@ ThreadPool* ThreadPoolFactory::create_thread_pool(
         if (0 != pool->add_thread())
         {
             delete pool;
-            std::cerr << "Failed to add thread, errno = " << errno << std::endl;
+            LOG_ERROR("Failed to add thread, errno = " << errno);
             return nullptr;
         }
     }
@@ -2,8 +2,35 @@
 #define THREAD_POOL_
 
 #include "common_include.h"
+#include "latency_histogram.h"
+#include "cpu_topology.h"
 #include <pthread.h>
 
+/**
+ * @brief maximum number of worker threads of a pool
+ * 
+ */
+#define THREAD_POOL_MAX_THREADS 256
+
+/**
+ * @brief How jobs are handed to the worker threads of a pool
+ * 
+ */
+typedef enum
+{
+    /**
+     * @brief One FIFO queue behind one mutex, shared by all workers
+     * 
+     */
+    SCHEDULER_SINGLE_QUEUE,
+    /**
+     * @brief Every worker has its own deque and inbox, and idle
+     * workers steal from randomly chosen others
+     * 
+     */
+    SCHEDULER_WORK_STEALING
+} scheduler_type_t;
+
 /**
  * @brief Jobs posted to the thread pool must
  * derive from this class
@@ -64,9 +91,161 @@ public:
     virtual ~JobInterface() {}
 };
 
+struct WorkStealingWorker;
+struct WorkStealingNode;
+class ThreadPool;
+
+/**
+ * @brief The life cycle of a ThreadSlot
+ * 
+ */
+typedef enum
+{
+    THREAD_SLOT_FREE,
+    THREAD_SLOT_RUNNING,
+    /**
+     * @brief the thread has exited, and still has to be joined
+     * 
+     */
+    THREAD_SLOT_EXITED
+} thread_slot_state_t;
+
+/**
+ * @brief Book-keeping of one worker thread of a pool
+ * 
+ * The counters are only written by the thread itself, on its own
+ * cache line, and only add up, so that they can be summed up by
+ * anyone at any time without stalling the workers.
+ * 
+ */
+struct alignas(CACHE_LINE_SIZE) ThreadSlot
+{
+    /**
+     * @brief number of jobs run by threads in this slot
+     * 
+     */
+    std::atomic<std::uint64_t>      m_jobs_run;
+
+    /**
+     * @brief total time these jobs have spent queued, in nanoseconds
+     * 
+     */
+    std::atomic<std::uint64_t>      m_wait_ns;
+
+    /**
+     * @brief a thread_slot_state_t
+     * 
+     */
+    std::atomic<int>                m_state;
+
+    pthread_t                       m_tid;
+    ThreadPool*                     m_pool;
+    int                             m_index;
+
+    /**
+     * @brief how long jobs were queued, and how long they ran
+     * 
+     */
+    LatencyHistogram                m_wait_histogram;
+    LatencyHistogram                m_service_histogram;
+
+    ThreadSlot():
+        m_jobs_run(0),
+        m_wait_ns(0),
+        m_state(THREAD_SLOT_FREE),
+        m_tid(),
+        m_pool(nullptr),
+        m_index(0)
+    {
+    }
+
+    /**
+     * @brief account for a job about to be run
+     * 
+     * @param wait_ns how long the job was queued
+     */
+    void job_started(std::int64_t wait_ns)
+    {
+        m_jobs_run.store(m_jobs_run.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+        m_wait_ns.store(m_wait_ns.load(std::memory_order_relaxed) + \
+            std::max(wait_ns, (std::int64_t)0), std::memory_order_relaxed);
+        m_wait_histogram.record(wait_ns);
+    }
+
+    /**
+     * @brief account for a job that has returned
+     * 
+     * @param service_ns how long the job ran
+     */
+    void job_finished(std::int64_t service_ns)
+    {
+        m_service_histogram.record(service_ns);
+    }
+};
+
+/**
+ * @brief A snapshot of the load of a pool
+ * 
+ */
+struct ThreadPoolStats
+{
+    /**
+     * @brief threads running, not counting those asked to retire
+     * 
+     */
+    int                             m_num_threads;
+
+    /**
+     * @brief threads sleeping for lack of work
+     * 
+     */
+    int                             m_num_idle;
+
+    /**
+     * @brief jobs waiting to be run
+     * 
+     */
+    size_t                          m_queue_depth;
+
+    /**
+     * @brief jobs started since the pool was created
+     * 
+     */
+    std::uint64_t                   m_jobs_run;
+
+    /**
+     * @brief total time these jobs spent queued, in nanoseconds
+     * 
+     */
+    std::uint64_t                   m_wait_ns;
+};
+
+/**
+ * @brief A job waiting in the queue of a single-queue pool
+ * 
+ */
+struct QueuedJob
+{
+    std::shared_ptr<JobInterface>   m_job;
+
+    /**
+     * @brief when the job was added, steady clock nanoseconds
+     * 
+     */
+    std::int64_t                    m_enqueue_time;
+};
+
 /**
  * @brief A thread pool that runs jobs. The thread-pool can have
- * multiple worker threads, and there is one job queue.
+ * multiple worker threads.
+ * 
+ * With SCHEDULER_SINGLE_QUEUE there is one job queue. With
+ * SCHEDULER_WORK_STEALING, jobs added from outside the pool go to the
+ * inbox of one worker, picked round robin by the adding thread, and
+ * jobs added by a worker go to its own deque. A worker runs its own
+ * jobs first, then steals from the deques and inboxes of the others,
+ * spins for a while, and finally sleeps until a job is added.
  * 
  * Priorities are not supported at the moment.
  * 
@@ -74,13 +253,93 @@ public:
 class ThreadPool
 {
 private:
+    /**
+     * @brief add a job to a work-stealing pool
+     * 
+     * @param p_job the job
+     * @return int 0 on success
+     */
+    int add_job_work_stealing(std::shared_ptr<JobInterface> p_job);
+
+    /**
+     * @brief find the next job for a worker of a work-stealing pool
+     * 
+     * @param worker the worker looking for work
+     * @return WorkStealingNode* the job, or nullptr if there is none
+     */
+    WorkStealingNode* find_work(WorkStealingWorker* worker);
+
+    /**
+     * @brief move the jobs of an inbox to the deque of a worker
+     * 
+     * @param worker the worker whose deque receives the jobs
+     * @param victim the worker whose inbox is emptied
+     * @return WorkStealingNode* one of the jobs to run right away, or
+     * nullptr if the inbox was empty
+     */
+    WorkStealingNode* drain_inbox(
+                        WorkStealingWorker* worker,
+                        WorkStealingWorker* victim);
+
+    /**
+     * @brief sleep until woken up, giving up if work shows up
+     * meanwhile
+     * 
+     * @param worker the worker going to sleep
+     * @return WorkStealingNode* a job found before falling asleep,
+     * or nullptr
+     */
+    WorkStealingNode* park(WorkStealingWorker* worker);
+
+    /**
+     * @brief wake up a sleeping worker, one that no other thread is
+     * waking up already
+     * 
+     * @param preferred the worker to wake if it is sleeping, or
+     * nullptr for any sleeping worker
+     * @return true if a worker was woken up
+     */
+    bool unpark(WorkStealingWorker* preferred);
+
+    /**
+     * @brief The loop of a worker thread of a work-stealing pool
+     * 
+     * @param worker the worker
+     * @param slot the slot of the thread
+     */
+    void loop_work_stealing(WorkStealingWorker* worker, ThreadSlot* slot);
+
+    /**
+     * @brief run a job of a work-stealing pool, and free its node
+     * 
+     * @param node the job
+     * @param slot the slot of the calling thread
+     */
+    void run_node(WorkStealingNode* node, ThreadSlot* slot);
+
+    /**
+     * @brief free the workers and the jobs they did not run, once
+     * their threads are gone
+     * 
+     */
+    void free_workers();
+
     /**
      * @brief pick up a job from the queue and process it
      * lock must be taken by the caller
      * 
      * @param lock_held 
+     * @param slot the slot of the calling thread
      */
-    void process_job_unsafe(bool& lock_held);
+    void process_job_unsafe(bool& lock_held, ThreadSlot* slot);
+
+    /**
+     * @brief make a slot ready for a new thread, joining the thread
+     * that used it before
+     * 
+     * @param slot the slot
+     */
+    void reap_slot(ThreadSlot* slot);
 
 public:
     /**
@@ -90,16 +349,17 @@ public:
     std::atomic<int>                                m_num_threads;
 
     /**
-     * @brief A vector containing all threads
+     * @brief All threads, by slot. In a work-stealing pool, slot i
+     * belongs to m_workers[i].
      * 
      */
-    std::vector<pthread_t>                          m_threads;
+    ThreadSlot                                      m_slots[THREAD_POOL_MAX_THREADS];
 
     /**
      * @brief the queue of new jobs
      * 
      */
-    std::deque<std::shared_ptr<JobInterface> >      m_job_queue;
+    std::deque<QueuedJob>                           m_job_queue;
 
     /**
      * @brief Mutex for the job queue
@@ -114,12 +374,69 @@ public:
      */
     pthread_cond_t                                  m_job_queue_cond;
 
+    /**
+     * @brief m_job_queue.size(), readable without the mutex by
+     * threads spinning for work
+     * 
+     */
+    std::atomic<size_t>                             m_job_queue_length;
+
+    /**
+     * @brief number of threads waiting on m_job_queue_cond, changed
+     * under m_job_queue_mutex
+     * 
+     */
+    std::atomic<int>                                m_num_waiting;
+
+    /**
+     * @brief number of threads of a single-queue pool asked to exit,
+     * protected by m_job_queue_mutex
+     * 
+     */
+    int                                             m_num_to_retire;
+
     /**
      * @brief Signal to the theads that this pool is being destroyed
      * and they have to terminate
      * 
      */
-    bool                                            m_is_destroying;
+    std::atomic<bool>                               m_is_destroying;
+
+    /**
+     * @brief how jobs are handed to the workers
+     * 
+     */
+    scheduler_type_t                                m_scheduler;
+
+    /**
+     * @brief the workers of a work-stealing pool. The first
+     * m_num_workers have a thread, the ones after that up to
+     * m_max_workers have retired.
+     * 
+     */
+    std::atomic<WorkStealingWorker*>                m_workers[THREAD_POOL_MAX_THREADS];
+
+    /**
+     * @brief number of workers of a work-stealing pool that have a
+     * thread, and get new jobs
+     * 
+     */
+    std::atomic<int>                                m_num_workers;
+
+    /**
+     * @brief number of entries of m_workers ever used. Retired
+     * workers may still get a job from an adder that picked them just
+     * before they retired, so they are stolen from like the others.
+     * 
+     */
+    std::atomic<int>                                m_max_workers;
+
+    /**
+     * @brief number of workers of a work-stealing pool that are
+     * sleeping or about to
+     * 
+     */
+    std::atomic<int>                                m_num_sleeping;
 
     /**
      * @brief auto-incrementin job id
@@ -127,6 +444,21 @@ public:
      */
     std::atomic<std::uint64_t>                      m_job_sequence_number;
 
+    /**
+     * @brief jobs the pool may have queued before is_full(), 0 for
+     * no limit. Jobs are never refused, whoever adds them is expected
+     * to stop adding new work while the pool is full.
+     * 
+     */
+    std::atomic<size_t>                             m_queue_limit;
+
+    /**
+     * @brief the CPUs the threads run on, empty to let them run
+     * anywhere. Changed with set_cpus().
+     * 
+     */
+    cpu_set_t                                       m_cpus;
+
     /**
      * @brief print additional debug logs if this is true
      * 
@@ -140,32 +472,107 @@ public:
     bool                                            m_is_debug_verbose;
 
     /* Constructor */
-    ThreadPool() :
+    ThreadPool(scheduler_type_t scheduler = SCHEDULER_SINGLE_QUEUE) :
         m_num_threads(0),
         m_job_queue_mutex(PTHREAD_MUTEX_INITIALIZER),
         m_job_queue_cond(PTHREAD_COND_INITIALIZER),
+        m_job_queue_length(0),
+        m_num_waiting(0),
+        m_num_to_retire(0),
         m_is_destroying(false),
+        m_scheduler(scheduler),
+        m_workers(),
+        m_num_workers(0),
+        m_max_workers(0),
+        m_num_sleeping(0),
         m_job_sequence_number(0),
+        m_queue_limit(0),
         m_is_debug(false),
         m_is_debug_verbose(false)
     {
-        m_threads.reserve(8);
+        CPU_ZERO(&m_cpus);
+        for (int i = 0; i < THREAD_POOL_MAX_THREADS; i++)
+        {
+            m_slots[i].m_pool = this;
+            m_slots[i].m_index = i;
+        }
     }
 
 
     /**
      * @brief Add another worker thread
      * 
+     * Must not be called by several threads at once.
+     * 
      * @return int 0 on success
      */
     int add_thread();
 
+    /**
+     * @brief Ask one worker thread to exit
+     * 
+     * The thread finishes its current job first. In a work-stealing
+     * pool it also runs the jobs still queued for it. At least one
+     * thread is always kept. Must not be called by several threads at
+     * once, or at the same time as add_thread().
+     * 
+     * @return int 0 on success
+     */
+    int remove_thread();
+
+    /**
+     * @brief run the threads of the pool on a set of CPUs
+     * 
+     * The threads already running are moved there, and the ones added
+     * later start there. Must not be called by several threads at
+     * once, or at the same time as add_thread().
+     * 
+     * @param cpus the CPUs, an empty set to let the threads run
+     * anywhere
+     * @return int 0 on success
+     */
+    int set_cpus(const cpu_set_t& cpus);
+
+    /**
+     * @brief take a snapshot of the load of the pool
+     * 
+     * @param stats the snapshot
+     */
+    void get_stats(ThreadPoolStats& stats);
+
+    /**
+     * @brief number of jobs waiting to be run, read without locks, so
+     * it may be a little stale
+     * 
+     * @return size_t the number of jobs
+     */
+    size_t get_queue_length() const;
+
+    /**
+     * @brief whether the pool has m_queue_limit jobs or more queued
+     * 
+     */
+    bool is_full() const
+    {
+        size_t limit = m_queue_limit.load(std::memory_order_relaxed);
+        return limit && get_queue_length() >= limit;
+    }
+
+    /**
+     * @brief add up the latency histograms of all threads of the pool,
+     * past and present
+     * 
+     * @param wait how long jobs were queued
+     * @param service how long jobs ran
+     */
+    void get_latency(LatencySnapshot& wait, LatencySnapshot& service);
+
     /**
      * @brief whenever a new pthread is created, it will call
      * this function. 
      * a static glue is required for the pthread interface
      * 
-     * @param arg the pointer to this thread pool
+     * @param arg the ThreadSlot of the thread
      * @return void* nullptr
      */
     static void* thread_start_routine(void* arg);
@@ -173,14 +580,20 @@ public:
     /**
      * @brief The loop of the worker thread runs
      * In this loop, it monitors the queue for work, and when
-     * one is available it performs the job
+     * one is available it performs the job. An idle thread spins
+     * briefly and then sleeps until a job is added.
      * 
+     * @param slot the slot of the thread
      */
-    void loop();
+    void loop(ThreadSlot* slot);
 
     /**
      * @brief Destroy the pool, and ask all threads to stop processing
      * 
+     * Sleeping threads are woken up, and busy ones finish their
+     * current job. Returns once all threads have exited. Jobs that
+     * were not started are not run.
+     * 
      */
     void destroy();
 
@@ -193,6 +606,18 @@ public:
      */
     int add_job(std::shared_ptr<JobInterface> p_job);
 
+    /**
+     * @brief add a batch of jobs for processing
+     * 
+     * The queue lock is taken once for the whole batch, and all
+     * waiting threads are woken up together.
+     * 
+     * @param jobs the jobs for processing, must derive from
+     * JobInterface
+     * @return int 0 on success
+     */
+    int add_jobs(const std::vector<std::shared_ptr<JobInterface> >& jobs);
+
     /* Detructor */
     ~ThreadPool()
     {
@@ -213,9 +638,13 @@ public:
      * 
      * @param num_threads number of threads
      * @param is_debug turn on verbose debug messages
+     * @param scheduler how jobs are handed to the threads
      * @return ThreadPool* a thread pool
      */
-    ThreadPool* create_thread_pool(int num_threads, bool is_debug);
+    ThreadPool* create_thread_pool(
+                    int num_threads,
+                    bool is_debug,
+                    scheduler_type_t scheduler = SCHEDULER_SINGLE_QUEUE);
 };
 
 #endif /* #ifndef THREAD_POOL_ */
\ No newline at end of file
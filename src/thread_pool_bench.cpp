@@ -0,0 +1,89 @@
+#include <chrono>
+#include <cstdlib>
+#include <unistd.h>
+#include "thread_pool.h"
+
+/**
+ * @brief jobs added by each producer in a measurement
+ *
+ */
+#define BENCH_JOBS_PER_PRODUCER 200000
+
+class EmptyJob: public JobInterface
+{
+public:
+    std::atomic<int>*   p_run_count;
+
+    int run()
+    {
+        p_run_count->fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    EmptyJob(std::atomic<int>* prun_count): p_run_count(prun_count) {}
+};
+
+/**
+ * @brief measure how long add_job takes, and how many jobs per second
+ * a pool gets through, with several threads adding at once
+ *
+ * @param scheduler the scheduler to measure
+ * @param name the name to report
+ * @param num_threads threads of the pool
+ * @param num_producers threads adding jobs
+ */
+void bench_add_job(
+    scheduler_type_t scheduler,
+    const char* name,
+    int num_threads,
+    int num_producers)
+{
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(num_threads, false, scheduler);
+    std::atomic<int> job_run_count = 0;
+
+    std::vector<LatencyHistogram> add_latency(num_producers);
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < num_producers; p++)
+        producers.emplace_back([&, p]() {
+            for (int i = 0; i < BENCH_JOBS_PER_PRODUCER; i++)
+            {
+                auto job = std::make_shared<EmptyJob>(&job_run_count);
+                std::int64_t before = now_ns();
+                tp->add_job(std::move(job));
+                add_latency[p].record(now_ns() - before);
+            }
+        });
+    for (auto& producer: producers)
+        producer.join();
+
+    const int NUM_JOBS = num_producers * BENCH_JOBS_PER_PRODUCER;
+    while (job_run_count < NUM_JOBS)
+        usleep(100);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    LatencySnapshot latency;
+    for (auto& histogram: add_latency)
+        latency.add(histogram);
+
+    std::cout << name << ", " << num_producers << " producers, " << num_threads \
+        << " threads: " << (int)(NUM_JOBS / elapsed.count()) << " jobs/s, add_job " \
+        << latency.to_string() << " us" << std::endl;
+
+    delete tp;
+}
+
+int main(int argc, char** argv)
+{
+    for (auto [scheduler, name]: {
+            std::make_pair(SCHEDULER_SINGLE_QUEUE, "single queue"),
+            std::make_pair(SCHEDULER_WORK_STEALING, "work stealing")})
+    {
+        bench_add_job(scheduler, name, 1, 1);
+        bench_add_job(scheduler, name, 8, 1);
+        bench_add_job(scheduler, name, 8, 4);
+    }
+}
@@ -1,7 +1,13 @@
 #include "thread_pool.h"
+#include "pool_controller.h"
+#include "logger.h"
+#include <chrono>
+#include <ctime>
 #include <cstdlib>
+#include <fstream>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/stat.h>
 
 #define TEST(x, y) {\
     if (!(x))\
@@ -125,8 +131,527 @@ void test_jobs2()
     }
 }
 
+class CountingJob: public JobInterface
+{
+public:
+    std::atomic<int>*   p_run_count;
+
+    int run()
+    {
+        ++(*p_run_count);
+        return 0;
+    }
+
+    CountingJob(std::atomic<int>* prun_count): p_run_count(prun_count) {}
+};
+
+/**
+ * @brief a job that adds more jobs to its own pool when run, which
+ * exercises the per-worker deques of the work-stealing scheduler
+ * 
+ */
+class SpawningJob: public JobInterface
+{
+public:
+    ThreadPool*         m_pool;
+    std::atomic<int>*   p_run_count;
+    int                 m_children;
+
+    int run()
+    {
+        ++(*p_run_count);
+        for (int i = 0; i < m_children; i++)
+            m_pool->add_job(std::make_shared<CountingJob>(p_run_count));
+        return 0;
+    }
+
+    SpawningJob(ThreadPool* pool, std::atomic<int>* prun_count, int children):
+        m_pool(pool),
+        p_run_count(prun_count),
+        m_children(children)
+    {
+    }
+};
+
+void test_work_stealing()
+{
+    auto tpf = ThreadPoolFactory();
+
+    std::cout << std::endl << __FILE__ << ":" << __LINE__ << " Executing work-stealing tests" << std::endl;
+
+    {
+        auto tp = tpf.create_thread_pool(4, false, SCHEDULER_WORK_STEALING);
+        TEST(tp, "Work-stealing pool must be created.");
+
+        std::atomic<int>        job_constructor_count   = 0;
+        std::atomic<int>        job_destructor_count    = 0;
+        std::atomic<int>        job_run_count           = 0;
+
+        const int NUM_JOBS = 8;
+        for (int i = 0; i < NUM_JOBS; i++)
+        {
+            auto bt = new BasicTest(&job_constructor_count, &job_destructor_count, &job_run_count);
+            bt->m_is_debug = false;
+            tp->add_job(std::shared_ptr<JobInterface>(bt));
+        }
+
+        sleep(3);
+
+        TEST(job_run_count == NUM_JOBS, "Work-stealing pool must run all jobs.");
+        TEST(job_destructor_count == NUM_JOBS, "Work-stealing pool must release all jobs.");
+        delete tp;
+    }
+
+    {
+        auto tp = tpf.create_thread_pool(4, false, SCHEDULER_WORK_STEALING);
+        std::atomic<int>        job_run_count           = 0;
+
+        const int NUM_PARENTS = 10, NUM_CHILDREN = 1000;
+        for (int i = 0; i < NUM_PARENTS; i++)
+            tp->add_job(std::make_shared<SpawningJob>(tp, &job_run_count, NUM_CHILDREN));
+
+        for (int i = 0; i < 300 && job_run_count < NUM_PARENTS * (NUM_CHILDREN + 1); i++)
+            usleep(10000);
+
+        TEST(job_run_count == NUM_PARENTS * (NUM_CHILDREN + 1), "Jobs added by workers must all run.");
+        delete tp;
+    }
+
+    {
+        auto tp = tpf.create_thread_pool(2, false, SCHEDULER_WORK_STEALING);
+        std::atomic<int>        job_constructor_count   = 0;
+        std::atomic<int>        job_destructor_count    = 0;
+        std::atomic<int>        job_run_count           = 0;
+
+        const int NUM_JOBS = 20;
+        for (int i = 0; i < NUM_JOBS; i++)
+        {
+            auto bt = new BasicTest(&job_constructor_count, &job_destructor_count, &job_run_count);
+            bt->m_is_debug = false;
+            tp->add_job(std::shared_ptr<JobInterface>(bt));
+        }
+
+        sleep(1);
+        delete tp;
+
+        TEST(job_destructor_count == NUM_JOBS, "Jobs left in a work-stealing pool must be released.");
+        TEST(job_run_count && job_run_count != NUM_JOBS, "All jobs cannot run within the time frame.");
+    }
+}
+
+/**
+ * @brief a job that records when it ran
+ * 
+ */
+class TimestampJob: public JobInterface
+{
+public:
+    std::atomic<std::int64_t>*  p_run_time;
+
+    int run()
+    {
+        p_run_time->store(std::chrono::steady_clock::now().time_since_epoch().count());
+        return 0;
+    }
+
+    TimestampJob(std::atomic<std::int64_t>* prun_time): p_run_time(prun_time) {}
+};
+
+/**
+ * @brief CPU time used by the whole process so far
+ * 
+ * @return double the CPU time in seconds
+ */
+static double process_cpu_seconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void test_idle(scheduler_type_t scheduler, const char* name)
+{
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(32, false, scheduler);
+
+    std::cout << std::endl << __FILE__ << ":" << __LINE__ << " Executing idle test, " << name << std::endl;
+
+    // Let the threads run out of spinning
+    usleep(100000);
+
+    double cpu = process_cpu_seconds();
+    sleep(1);
+    cpu = process_cpu_seconds() - cpu;
+    std::cout << "CPU used by 32 idle threads in 1s: " << cpu * 1000 << "ms" << std::endl;
+    TEST(cpu < 0.05, "Idle threads must not use the CPU.");
+
+    // Jobs arriving one at a time must still be picked up promptly
+    const int NUM_JOBS = 200;
+    std::atomic<std::int64_t> run_time = 0;
+    std::chrono::steady_clock::duration total(0), worst(0);
+    for (int i = 0; i < NUM_JOBS; i++)
+    {
+        run_time = 0;
+        auto added = std::chrono::steady_clock::now();
+        tp->add_job(std::make_shared<TimestampJob>(&run_time));
+        while (!run_time)
+            sched_yield();
+
+        auto latency = std::chrono::steady_clock::duration(run_time) - added.time_since_epoch();
+        total += latency;
+        worst = std::max(worst, latency);
+        usleep(1000);
+    }
+    std::cout << "Wakeup latency, average " \
+        << std::chrono::duration_cast<std::chrono::microseconds>(total).count() / NUM_JOBS \
+        << "us, worst " << std::chrono::duration_cast<std::chrono::microseconds>(worst).count() \
+        << "us" << std::endl;
+    TEST(worst < std::chrono::milliseconds(100), "Sleeping threads must be woken up by new jobs.");
+
+    auto start = std::chrono::steady_clock::now();
+    delete tp;
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    TEST(elapsed < std::chrono::milliseconds(100), "Idle pool must shut down without waiting on timeouts.");
+}
+
+class SleepJob: public JobInterface
+{
+public:
+    std::atomic<int>*   p_run_count;
+
+    int run()
+    {
+        usleep(20000);
+        ++(*p_run_count);
+        return 0;
+    }
+
+    SleepJob(std::atomic<int>* prun_count): p_run_count(prun_count) {}
+};
+
+void test_pool_controller(scheduler_type_t scheduler, const char* name)
+{
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(1, false, scheduler);
+
+    std::cout << std::endl << __FILE__ << ":" << __LINE__ << " Executing pool controller test, " << name << std::endl;
+
+    PoolSizingConfig sizing;
+    sizing.m_min_threads = 1;
+    sizing.m_max_threads = 8;
+    sizing.m_quiet_samples = 3;
+    PoolSizeController controller(sizing);
+    TEST(controller.add_pool("test", tp), "Pool must be put under control.");
+
+    // A burst queues far more jobs than there are threads
+    const int NUM_JOBS = 100;
+    std::atomic<int> job_run_count = 0;
+    for (int i = 0; i < NUM_JOBS; i++)
+        tp->add_job(std::make_shared<SleepJob>(&job_run_count));
+
+    ThreadPoolStats stats;
+    for (int i = 0; i < 10; i++)
+    {
+        controller.sample();
+        usleep(10000);
+    }
+    tp->get_stats(stats);
+    TEST(8 == stats.m_num_threads, "Pool must grow up to its maximum under a burst.");
+    TEST(controller.m_num_grown && controller.get_recent_decisions().size(), "Growing must be recorded.");
+
+    for (int i = 0; i < 200 && job_run_count < NUM_JOBS; i++)
+        usleep(10000);
+    TEST(job_run_count == NUM_JOBS, "All jobs must run while the pool is resized.");
+
+    // Quiet now, the pool goes back to its minimum, one thread per sample
+    for (int i = 0; i < 20; i++)
+    {
+        usleep(5000);
+        controller.sample();
+    }
+    usleep(10000);
+    tp->get_stats(stats);
+    TEST(1 == stats.m_num_threads, "Pool must shrink back to its minimum when quiet.");
+    TEST(controller.m_num_shrunk == 7, "Every retired thread must be recorded.");
+
+    job_run_count = 0;
+    for (int i = 0; i < 10; i++)
+        tp->add_job(std::make_shared<CountingJob>(&job_run_count));
+    for (int i = 0; i < 100 && job_run_count < 10; i++)
+        usleep(10000);
+    TEST(job_run_count == 10, "Shrunk pool must still run jobs.");
+
+    delete tp;
+}
+
+void test_queue_limit(scheduler_type_t scheduler, const char* name)
+{
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(1, false, scheduler);
+
+    std::cout << std::endl << __FILE__ << ":" << __LINE__ << " Executing queue limit test, " << name << std::endl;
+
+    tp->m_queue_limit = 5;
+    TEST(!tp->is_full(), "An empty pool must not be full.");
+
+    const int NUM_JOBS = 10;
+    std::atomic<int> job_run_count = 0;
+    for (int i = 0; i < NUM_JOBS; i++)
+        tp->add_job(std::make_shared<SleepJob>(&job_run_count));
+    TEST(tp->get_queue_length() >= 5 && tp->is_full(), "A pool with more jobs queued than its limit must be full.");
+
+    for (int i = 0; i < 200 && job_run_count < NUM_JOBS; i++)
+        usleep(10000);
+    TEST(job_run_count == NUM_JOBS, "A full pool must still run its jobs.");
+    TEST(0 == tp->get_queue_length() && !tp->is_full(), "A drained pool must not be full.");
+
+    delete tp;
+}
+
+/**
+ * @brief records the CPUs the thread that runs it may run on
+ * 
+ */
+class AffinityJob: public JobInterface
+{
+public:
+    cpu_set_t*          m_pcpus;
+    std::atomic<int>*   m_prun_count;
+
+    AffinityJob(cpu_set_t* pcpus, std::atomic<int>* prun_count):
+        m_pcpus(pcpus),
+        m_prun_count(prun_count)
+    {
+    }
+
+    int run()
+    {
+        pthread_getaffinity_np(pthread_self(), sizeof(*m_pcpus), m_pcpus);
+        ++(*m_prun_count);
+        return 0;
+    }
+};
+
+void test_cpu_affinity(scheduler_type_t scheduler, const char* name)
+{
+    std::cout << std::endl << __FILE__ << ":" << __LINE__ << " Executing CPU affinity test, " << name << std::endl;
+
+    cpu_set_t cpus;
+    TEST(parse_cpu_list("0-2,5\n", cpus) && 4 == CPU_COUNT(&cpus) && \
+        CPU_ISSET(2, &cpus) && !CPU_ISSET(3, &cpus), "A CPU list must have its CPUs and ranges.");
+    TEST("0-2,5" == format_cpu_list(cpus), "A CPU list must be formatted with ranges.");
+    TEST(!parse_cpu_list("", cpus) && !parse_cpu_list("3-1", cpus) && \
+        !parse_cpu_list("1,,2", cpus) && !parse_cpu_list("x", cpus), "An invalid CPU list must be rejected.");
+
+    // Node 1 has memory only, and the CPU of node 2 is not one the
+    // process may run on
+    const cpu_set_t& allowed = CpuTopology::get().get_allowed_cpus();
+    int cpu = 0;
+    while (!CPU_ISSET(cpu, &allowed))
+        cpu++;
+    char dir[] = "/tmp/cpu_topology_XXXXXX";
+    TEST(mkdtemp(dir), "A fake node directory must be created.");
+    const char* cpulists[] = {nullptr, "\n", "1023\n"};
+    std::string first = std::to_string(cpu) + "\n";
+    cpulists[0] = first.c_str();
+    for (int node = 0; node < 3; node++)
+    {
+        std::string path = std::string(dir) + "/node" + std::to_string(node);
+        mkdir(path.c_str(), 0700);
+        std::ofstream(path + "/cpulist") << cpulists[node];
+    }
+    CpuTopology topology(dir);
+    TEST(CPU_ISSET(1023, &allowed) || (1 == topology.get_num_nodes() && \
+        0 == topology.get_node_id(0) && 0 == topology.get_node_of_cpu(cpu)),
+        "Only the nodes with CPUs the process may run on must be kept.");
+    for (int node = 0; node < 3; node++)
+    {
+        std::string path = std::string(dir) + "/node" + std::to_string(node);
+        unlink((path + "/cpulist").c_str());
+        rmdir(path.c_str());
+    }
+    rmdir(dir);
+
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(2, false, scheduler);
+
+    cpu_set_t pinned;
+    CPU_ZERO(&pinned);
+    CPU_SET(cpu, &pinned);
+    TEST(0 == tp->set_cpus(pinned), "The CPUs of a pool must be set.");
+    TEST(0 == tp->add_thread(), "A thread must be added to a pinned pool.");
+
+    const int NUM_JOBS = 16;
+    cpu_set_t seen[NUM_JOBS];
+    std::atomic<int> job_run_count = 0;
+    for (int i = 0; i < NUM_JOBS; i++)
+        tp->add_job(std::make_shared<AffinityJob>(&seen[i], &job_run_count));
+    for (int i = 0; i < 200 && job_run_count < NUM_JOBS; i++)
+        usleep(10000);
+
+    bool is_pinned = job_run_count == NUM_JOBS;
+    for (int i = 0; i < NUM_JOBS && is_pinned; i++)
+        is_pinned = CPU_EQUAL(&seen[i], &pinned);
+    TEST(is_pinned, "The threads of a pool, old and new, must run on its CPUs.");
+
+    delete tp;
+}
+
+void test_latency(scheduler_type_t scheduler, const char* name)
+{
+    std::cout << std::endl << __FILE__ << ":" << __LINE__ << " Executing latency test, " << name << std::endl;
+
+    bool is_bounded = true;
+    int previous = -1;
+    for (std::int64_t ns = 0; ns < (1LL << 36); ns = ns * 5 / 4 + 1)
+    {
+        int bucket = LatencyHistogram::get_bucket(ns);
+        std::int64_t limit = LatencyHistogram::get_bucket_limit(bucket);
+        if (bucket < previous || (ns < (1LL << LATENCY_MAX_BITS) && \
+                (limit < ns || limit > ns + ns / LATENCY_SUB_BUCKETS)))
+            is_bounded = false;
+        previous = bucket;
+    }
+    TEST(is_bounded, "Buckets must be in order, and within an eighth of their values.");
+
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(1, false, scheduler);
+
+    const int NUM_JOBS = 10;
+    std::atomic<int> job_run_count = 0;
+    for (int i = 0; i < NUM_JOBS; i++)
+        tp->add_job(std::make_shared<SleepJob>(&job_run_count));
+    for (int i = 0; i < 100 && job_run_count < NUM_JOBS; i++)
+        usleep(10000);
+    usleep(10000);
+
+    LatencySnapshot wait;
+    LatencySnapshot service;
+    tp->get_latency(wait, service);
+    TEST(NUM_JOBS == wait.m_total && NUM_JOBS == service.m_total, "Every job must be timed.");
+    TEST(service.get_percentile(50) >= 20000000, "Service time must cover the whole job.");
+    TEST(wait.get_percentile(100) >= (NUM_JOBS - 1) * 20000000LL, "Wait time must cover the jobs ahead in the queue.");
+
+    delete tp;
+}
+
+/**
+ * @brief measure how fast a pool runs tiny jobs added by several
+ * threads at once, where the cost is dominated by the queues
+ * 
+ * @param scheduler the scheduler to measure
+ * @param name the name to report
+ */
+void bench_contention(scheduler_type_t scheduler, const char* name)
+{
+    const int NUM_THREADS = 8, NUM_PRODUCERS = 4, JOBS_PER_PRODUCER = 50000;
+    const int NUM_JOBS = NUM_PRODUCERS * JOBS_PER_PRODUCER;
+
+    auto tpf = ThreadPoolFactory();
+    auto tp = tpf.create_thread_pool(NUM_THREADS, false, scheduler);
+    std::atomic<int> job_run_count = 0;
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> producers;
+    for (int p = 0; p < NUM_PRODUCERS; p++)
+        producers.emplace_back([&]() {
+            for (int i = 0; i < JOBS_PER_PRODUCER; i++)
+                tp->add_job(std::make_shared<CountingJob>(&job_run_count));
+        });
+    for (auto& producer: producers)
+        producer.join();
+
+    while (job_run_count < NUM_JOBS)
+        usleep(100);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "Contention benchmark, " << name << ": " \
+        << (int)(NUM_JOBS / elapsed.count()) << " jobs/s with " \
+        << NUM_PRODUCERS << " producers and " << NUM_THREADS << " threads" << std::endl;
+
+    delete tp;
+}
+
+static void* log_and_exit(void* arg)
+{
+    LOG_INFO("line of thread " << *static_cast<int*>(arg));
+    return nullptr;
+}
+
+void test_logger()
+{
+    std::cout << "Running logger tests" << std::endl;
+
+    // The flusher writes to stderr, a file stands in for it
+    char path[] = "/tmp/logger_test_XXXXXX";
+    int fd = mkstemp(path);
+    TEST(fd >= 0, "A log file must be created.");
+    log_flush();
+    int saved_stderr = dup(STDERR_FILENO);
+    dup2(fd, STDERR_FILENO);
+
+    log_set_level(LOG_LEVEL_INFO);
+    for (int i = 0; i < 100; i++)
+        LOG_INFO("line " << i);
+    LOG_DEBUG("debug line");
+    log_flush();
+
+    // Every thread has a ring, left to the flusher once it exits
+    size_t num_rings = log_get_num_rings();
+    int ids[16];
+    pthread_t threads[16];
+    for (int i = 0; i < 16; i++)
+    {
+        ids[i] = i;
+        pthread_create(&threads[i], nullptr, log_and_exit, &ids[i]);
+    }
+    for (int i = 0; i < 16; i++)
+        pthread_join(threads[i], nullptr);
+    log_flush();
+    log_flush();
+
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stderr);
+
+    std::ifstream file(path);
+    std::vector<std::string> lines;
+    std::string line;
+    while (std::getline(file, line))
+        lines.push_back(line);
+    close(fd);
+    unlink(path);
+
+    bool is_ordered = lines.size() >= 100;
+    for (int i = 0; is_ordered && i < 100; i++)
+        is_ordered = lines[i] == "line " + std::to_string(i);
+    TEST(is_ordered, "The lines of a thread must be flushed in order.");
+    TEST(std::find(lines.begin(), lines.end(), "debug line") == lines.end(),
+        "Lines below the level must not be written.");
+    bool has_all = true;
+    for (int i = 0; i < 16; i++)
+        has_all = has_all && std::find(lines.begin(), lines.end(),
+                                "line of thread " + std::to_string(i)) != lines.end();
+    TEST(has_all, "The last lines of a thread that exited must be flushed.");
+    TEST(log_get_num_rings() == num_rings, "The ring of a thread that exited must be freed once drained.");
+}
+
 int main(int argc, char** argv)
 {
+    test_logger();
     test_jobs();
     test_jobs2();
+    test_work_stealing();
+    test_idle(SCHEDULER_SINGLE_QUEUE, "single queue");
+    test_idle(SCHEDULER_WORK_STEALING, "work stealing");
+    test_pool_controller(SCHEDULER_SINGLE_QUEUE, "single queue");
+    test_pool_controller(SCHEDULER_WORK_STEALING, "work stealing");
+    test_queue_limit(SCHEDULER_SINGLE_QUEUE, "single queue");
+    test_queue_limit(SCHEDULER_WORK_STEALING, "work stealing");
+    test_cpu_affinity(SCHEDULER_SINGLE_QUEUE, "single queue");
+    test_cpu_affinity(SCHEDULER_WORK_STEALING, "work stealing");
+    test_latency(SCHEDULER_SINGLE_QUEUE, "single queue");
+    test_latency(SCHEDULER_WORK_STEALING, "work stealing");
+    bench_contention(SCHEDULER_SINGLE_QUEUE, "single queue");
+    bench_contention(SCHEDULER_WORK_STEALING, "work stealing");
 }
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include "timer_wheel.h"
+#include "logger.h"
+
+bool TimerWheel::place(TimerEntry&& entry)
+{
+    // Late timers fire with the current tick
+    std::int64_t time = std::max(entry.m_time, m_current);
+
+    try
+    {
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            int shift = (level + 1) * TIMER_WHEEL_SLOT_BITS;
+            if ((time >> shift) == (m_current >> shift))
+            {
+                slot(level, time).push_back(std::move(entry));
+                return true;
+            }
+        }
+        overflow().push_back(std::move(entry));
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory, dropping the timer of a key");
+        return false;
+    }
+    return true;
+}
+
+void TimerWheel::next_tick()
+{
+    m_current++;
+
+    // The levels whose slots start at this tick, the wheel wraps at
+    // the top level and then looks at the overflow list
+    m_cascade_level = 0;
+    while (m_cascade_level < TIMER_WHEEL_LEVELS)
+    {
+        std::int64_t mask = ((std::int64_t)1 << ((m_cascade_level + 1) * TIMER_WHEEL_SLOT_BITS)) - 1;
+        if (m_current & mask)
+            break;
+        m_cascade_level++;
+    }
+}
+
+size_t TimerWheel::cascade(size_t budget)
+{
+    size_t work = 0;
+
+    // From the top, so that timers cascaded from a level land in the
+    // slot of the level below that is cascaded next
+    while (m_cascade_level > 0)
+    {
+        if (TIMER_WHEEL_LEVELS == m_cascade_level)
+        {
+            // Timers that stay far away go back to the overflow list,
+            // so it is swapped out first. This happens every few hours.
+            std::vector<TimerEntry> far;
+            far.swap(overflow());
+            for (auto& entry: far)
+            {
+                if (!place(std::move(entry)))
+                    m_size--;
+            }
+            work += far.size();
+            m_cascade_level--;
+            continue;
+        }
+
+        std::vector<TimerEntry>& source = slot(m_cascade_level, m_current);
+        while (!source.empty())
+        {
+            if (work >= budget)
+                return work;
+
+            TimerEntry entry = std::move(source.back());
+            source.pop_back();
+            if (!place(std::move(entry)))
+                m_size--;
+            work++;
+        }
+        m_cascade_level--;
+    }
+    return work;
+}
+
+bool TimerWheel::add(std::string_view key, std::int64_t time, std::int64_t now)
+{
+    if (!m_slots)
+    {
+        m_slots = new (std::nothrow) std::vector<TimerEntry>[
+                    TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS + 1];
+        if (!m_slots)
+        {
+            LOG_ERROR("Out of memory");
+            return false;
+        }
+    }
+
+    // An empty wheel can start from any tick
+    if (!m_size)
+    {
+        m_current = now;
+        m_cascade_level = 0;
+    }
+
+    try
+    {
+        if (!place(TimerEntry{std::string(key), time}))
+            return false;
+    }
+    catch (...)
+    {
+        LOG_ERROR("Out of memory");
+        return false;
+    }
+
+    m_size++;
+    return true;
+}
@@ -0,0 +1,221 @@
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+#include "common_include.h"
+#include <cstdint>
+#include <time.h>
+
+/**
+ * @brief bits of the time that pick the slot in each level of a
+ * TimerWheel
+ *
+ */
+#define TIMER_WHEEL_SLOT_BITS 6
+
+/**
+ * @brief slots in each level of a TimerWheel
+ *
+ */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/**
+ * @brief levels of a TimerWheel. With 1ms ticks, they cover about
+ * 4.6 hours, later timers wait in an overflow list
+ *
+ */
+#define TIMER_WHEEL_LEVELS 4
+
+/**
+ * @brief the wall clock, in milliseconds since the epoch, which is
+ * what key expiry times are given in
+ *
+ * @return std::int64_t the time
+ */
+inline std::int64_t unix_time_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (std::int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @brief A key to look at once its time has come
+ *
+ */
+struct TimerEntry
+{
+    std::string             m_key;
+
+    /**
+     * @brief the time the timer was added for, in ms
+     *
+     */
+    std::int64_t            m_time;
+};
+
+/**
+ * @brief A hierarchical timer wheel with 1ms ticks
+ *
+ * Level 0 has one slot per tick, and every higher level has one
+ * slot per TIMER_WHEEL_SLOTS slots of the level below. A timer is
+ * put in the lowest level that covers its time, and is moved down a
+ * level, cascaded, when the wheel reaches the start of its slot, so
+ * adding a timer and handing it out are both O(1).
+ *
+ * Timers cannot be removed. They only name a key, and the owner
+ * checks, when a timer fires, whether it still applies.
+ *
+ * The wheel is not thread safe, the owner serializes the calls.
+ *
+ */
+class TimerWheel
+{
+private:
+    /**
+     * @brief TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots,
+     * followed by the overflow list. Allocated with the first timer,
+     * so that a wheel that is never used costs a pointer.
+     *
+     */
+    std::vector<TimerEntry>*        m_slots;
+
+    /**
+     * @brief the next tick to run, all the timers of earlier ticks
+     * have been handed out
+     *
+     */
+    std::int64_t                    m_current;
+
+    /**
+     * @brief the highest level whose slot for m_current still has to
+     * be cascaded before the tick can run, 0 if none
+     *
+     */
+    int                             m_cascade_level;
+
+    /**
+     * @brief number of timers in the wheel
+     *
+     */
+    size_t                          m_size;
+
+    std::vector<TimerEntry>& slot(int level, std::int64_t time)
+    {
+        size_t index = (time >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+        return m_slots[level * TIMER_WHEEL_SLOTS + index];
+    }
+
+    std::vector<TimerEntry>& overflow()
+    {
+        return m_slots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];
+    }
+
+    /**
+     * @brief put a timer in the level that covers its time
+     *
+     * @param entry the timer
+     * @return true on success
+     * @return false if out of memory, the timer is then lost
+     */
+    bool place(TimerEntry&& entry);
+
+    /**
+     * @brief move the timer of m_current one tick forward
+     *
+     */
+    void next_tick();
+
+    /**
+     * @brief cascade the slots that start at m_current
+     *
+     * @param budget the most timers to move
+     * @return size_t the number of timers moved
+     */
+    size_t cascade(size_t budget);
+
+public:
+    TimerWheel():
+        m_slots(nullptr),
+        m_current(0),
+        m_cascade_level(0),
+        m_size(0)
+    {
+    }
+
+    ~TimerWheel()
+    {
+        delete[] m_slots;
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    /**
+     * @brief add a timer
+     *
+     * @param key the key to hand out when the timer fires
+     * @param time when the timer fires, in ms
+     * @param now the current time, in ms
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool add(std::string_view key, std::int64_t time, std::int64_t now);
+
+    /**
+     * @brief number of timers in the wheel
+     *
+     */
+    size_t size() const { return m_size; }
+
+    /**
+     * @brief hand out the timers whose time is at most now
+     *
+     * The work is bounded: every timer handed out or cascaded, and
+     * every tick the wheel moves, uses one unit of the budget. Once it
+     * is used up, the wheel stops where it is, and the next call goes
+     * on from there.
+     *
+     * @param now the current time, in ms
+     * @param budget the most work to do
+     * @param fn called with the key and the time of every timer that
+     * fires, it may add timers for later times
+     * @return size_t the work done, budget if there may be more
+     */
+    template <typename Fn>
+    size_t expire(std::int64_t now, size_t budget, Fn fn)
+    {
+        size_t work = 0;
+        while (m_current <= now && work < budget)
+        {
+            if (!m_size)
+            {
+                // Nothing to wait for, catch up at once
+                m_current = now + 1;
+                m_cascade_level = 0;
+                break;
+            }
+
+            work += cascade(budget - work);
+            if (m_cascade_level)
+                break;
+
+            std::vector<TimerEntry>& due = slot(0, m_current);
+            while (!due.empty() && work < budget)
+            {
+                TimerEntry entry = std::move(due.back());
+                due.pop_back();
+                m_size--;
+                work++;
+                fn(entry.m_key, entry.m_time);
+            }
+            if (!due.empty())
+                break;
+
+            next_tick();
+            work++;
+        }
+        return std::min(work, budget);
+    }
+};
+
+#endif /* #ifndef TIMER_WHEEL_H_ */
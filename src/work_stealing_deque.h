@@ -0,0 +1,234 @@
+#ifndef WORK_STEALING_DEQUE_H_
+#define WORK_STEALING_DEQUE_H_
+
+#include "common_include.h"
+#include <cstdint>
+
+/**
+ * @brief initial number of slots of a WorkStealingDeque, must be a
+ * power of two
+ *
+ */
+#define WORK_STEALING_DEQUE_INITIAL_SIZE 256
+
+/**
+ * @brief A Chase-Lev work-stealing deque of pointers
+ *
+ * One thread, the owner, pushes and takes at the bottom. Any other
+ * thread may steal from the top. Owner operations only touch shared
+ * state when the deque is nearly empty, so a worker that keeps
+ * producing and consuming its own work does not contend with anyone.
+ *
+ * Follows "Correct and Efficient Work-Stealing for Weak Memory Models"
+ * (Le, Pop, Cohen, Zappa Nardelli, PPoPP 2013). When the slots run
+ * out, they are copied to an array twice the size. A stealer may still
+ * be reading the old array, so old arrays are only freed with the
+ * deque.
+ *
+ * @tparam T the pointed to type, the deque never owns the items
+ */
+template <typename T>
+class WorkStealingDeque
+{
+private:
+    /**
+     * @brief the slots, indexed by position & m_mask
+     *
+     */
+    struct Array
+    {
+        std::int64_t            m_mask;
+        std::atomic<T*>*        m_slots;
+        Array*                  m_previous;
+
+        T* get(std::int64_t i) const
+        {
+            return m_slots[i & m_mask].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t i, T* item)
+        {
+            m_slots[i & m_mask].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * @brief position of the oldest item, advanced by take and steal
+     *
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t>      m_top;
+
+    /**
+     * @brief position one past the newest item, only written by the
+     * owner
+     *
+     */
+    alignas(CACHE_LINE_SIZE) std::atomic<std::int64_t>      m_bottom;
+
+    /**
+     * @brief the current slots
+     *
+     */
+    std::atomic<Array*>                                     m_array;
+
+    /**
+     * @brief allocate an array
+     *
+     * @param size number of slots, a power of two
+     * @param previous the array this one replaces
+     * @return Array* the array, or nullptr if out of memory
+     */
+    static Array* create_array(std::int64_t size, Array* previous)
+    {
+        Array* array = new (std::nothrow) Array;
+        if (!array)
+            return nullptr;
+
+        array->m_slots = new (std::nothrow) std::atomic<T*>[size];
+        if (!array->m_slots)
+        {
+            delete array;
+            return nullptr;
+        }
+
+        array->m_mask = size - 1;
+        array->m_previous = previous;
+        return array;
+    }
+
+public:
+    WorkStealingDeque():
+        m_top(0),
+        m_bottom(0),
+        m_array(create_array(WORK_STEALING_DEQUE_INITIAL_SIZE, nullptr))
+    {
+        if (!m_array.load(std::memory_order_relaxed))
+            throw std::bad_alloc();
+    }
+
+    ~WorkStealingDeque()
+    {
+        Array* array = m_array.load(std::memory_order_relaxed);
+        while (array)
+        {
+            Array* previous = array->m_previous;
+            delete[] array->m_slots;
+            delete array;
+            array = previous;
+        }
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+    WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+    /**
+     * @brief add an item at the bottom, only called by the owner
+     *
+     * @param item the item
+     * @return true on success
+     * @return false if out of memory
+     */
+    bool push(T* item)
+    {
+        std::int64_t b = m_bottom.load(std::memory_order_relaxed);
+        std::int64_t t = m_top.load(std::memory_order_acquire);
+        Array* array = m_array.load(std::memory_order_relaxed);
+
+        if (b - t > array->m_mask)
+        {
+            Array* bigger = create_array((array->m_mask + 1) * 2, array);
+            if (!bigger)
+                return false;
+
+            for (std::int64_t i = t; i < b; i++)
+                bigger->put(i, array->get(i));
+            m_array.store(bigger, std::memory_order_release);
+            array = bigger;
+        }
+
+        array->put(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * @brief remove the newest item, only called by the owner
+     *
+     * @return T* the item, or nullptr if the deque is empty
+     */
+    T* take()
+    {
+        std::int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Array* array = m_array.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = m_top.load(std::memory_order_relaxed);
+
+        if (t > b)
+        {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T* item = array->get(b);
+        if (t == b)
+        {
+            // The last item, a stealer may be racing for it
+            if (!m_top.compare_exchange_strong(t, t + 1,
+                    std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = nullptr;
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    /**
+     * @brief remove the oldest item, called by any thread
+     *
+     * @return T* the item, or nullptr if the deque is empty or another
+     * thread got the item first
+     */
+    T* steal()
+    {
+        std::int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t b = m_bottom.load(std::memory_order_acquire);
+
+        if (t >= b)
+            return nullptr;
+
+        Array* array = m_array.load(std::memory_order_acquire);
+        T* item = array->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1,
+                std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return item;
+    }
+
+    /**
+     * @brief number of items, may be stale by the time it returns
+     *
+     * @return size_t the number of items
+     */
+    size_t size() const
+    {
+        std::int64_t t = m_top.load(std::memory_order_acquire);
+        std::int64_t b = m_bottom.load(std::memory_order_acquire);
+        return b > t ? (size_t)(b - t) : 0;
+    }
+
+    /**
+     * @brief whether the deque looks empty, may be stale by the time it
+     * returns
+     *
+     * @return true if there was nothing to take or steal
+     */
+    bool empty() const
+    {
+        return m_top.load(std::memory_order_acquire) >= \
+            m_bottom.load(std::memory_order_acquire);
+    }
+};
+
+#endif /* #ifndef WORK_STEALING_DEQUE_H_ */